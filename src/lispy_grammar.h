@@ -0,0 +1,11 @@
+/*
+** Generated by mpcgen -t. Do not edit.
+*/
+
+#define LISPY_GRAMMAR \
+  "number : /-?[0-9]+/ ;\n" \
+  "symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;\n" \
+  "sexpr  : '(' <expr>* ')' ;\n" \
+  "qexpr  : '{' <expr>* '}' ;\n" \
+  "expr   : <number> | <symbol> | <sexpr> | <qexpr> ;\n" \
+  "lispy  : /^/ <expr>* /$/ ;\n"
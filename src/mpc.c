@@ -1,5 +1,24 @@
 #include "mpc.h"
 
+#include <time.h>
+
+/*
+** `mpc_parse_many` and `mpc_parse_chunked` use POSIX
+** threads, so programs must be linked with -lpthread.
+** Defining `MPC_NO_THREADS` does the work in turn on
+** the calling thread instead. This is the default on
+** Windows unless `MPC_THREADS` is defined, such as
+** when building against a pthreads port.
+*/
+
+#if defined(_WIN32) && !defined(MPC_THREADS) && !defined(MPC_NO_THREADS)
+#define MPC_NO_THREADS
+#endif
+
+#ifndef MPC_NO_THREADS
+#include <pthread.h>
+#endif
+
 /*
 ** State Type
 */
@@ -37,19 +56,27 @@ static mpc_state_t mpc_state_new(void) {
 **
 ** The second is a File which is also somewhat
 ** easy. The contents are never loaded into
-** memory but backtracking can still be achieved
-** by seeking in the file at different positions.
+** memory all at once. Instead they are read
+** through a fixed size window buffer. Peeking,
+** failing and backtracking just move the cursor
+** around inside this window and the file is
+** only touched (seeked and read) once the cursor
+** leaves the window. Positions count from where
+** the file was when parsing began, so input can
+** follow anything already read from it.
 **
 ** The final mode is Pipe. This is the difficult
-** one. As we assume pipes cannot be seeked - and
-** only support a single character lookahead at
-** any point, when the input is marked for a
-** potential backtracking we start buffering any
-** input.
+** one. As we assume pipes cannot be seeked every
+** character read from the pipe is appended to a
+** length tracked buffer and all reads go through
+** this buffer.
 **
 ** This means that if we are requested to seek
 ** back we can simply start reading from the
-** buffer instead of the input.
+** buffer instead of the input. Once no marks
+** remain the consumed prefix of the buffer is
+** trimmed so it only grows while backtracking
+** is possible.
 **
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
@@ -67,14 +94,57 @@ enum {
   MPC_INPUT_MARKS_MIN = 32
 };
 
+/*
+** Small allocations during a parse come from an
+** arena inside the input. Blocks of 16, 32 or 64
+** bytes are bumped off the end of the arena and
+** kept on a free list per size once freed, so both
+** are constant time. Anything larger, or anything
+** that does not fit once the arena is used up, is
+** left to `malloc`.
+*/
+
+enum {
+  MPC_INPUT_MEM_NUM = 2048,
+  MPC_INPUT_MEM_CLASSES = 3
+};
+
 enum {
-  MPC_INPUT_MEM_NUM = 512
+  MPC_INPUT_WINDOW_SIZE = 65536
 };
 
-typedef struct {
-  char mem[64];
+typedef union mpc_mem_t {
+  char mem[16];
+  union mpc_mem_t *next;
+  double align;
 } mpc_mem_t;
 
+enum {
+  MPC_INPUT_MEMO_COLUMNS = 4096,
+  MPC_INPUT_MEMO_ENTRIES = 32,
+  MPC_INPUT_MEMO_MAX = 1048576
+};
+
+typedef struct {
+  mpc_parser_t *p;
+  char last;
+  char mode;
+  char success;
+  char state_last;
+  mpc_state_t state;
+  mpc_result_t result;
+  mpc_err_t *merged;
+  long gen;
+} mpc_memo_t;
+
+typedef struct {
+  long pos;
+  int memos_num;
+  int memos_slots;
+  int memos_next;
+  mpc_memo_t *memos;
+} mpc_memo_column_t;
+
 typedef struct {
 
   int type;
@@ -83,8 +153,16 @@ typedef struct {
 
   char *string;
   char *buffer;
+  long buffer_pos;
+  long buffer_len;
+  long buffer_slots;
   FILE *file;
 
+  char *window;
+  long window_pos;
+  long window_len;
+  long file_start;
+
   int suppress;
   int backtrack;
   int marks_slots;
@@ -94,8 +172,21 @@ typedef struct {
   char *lasts;
   char last;
 
+  mpc_memo_column_t *memo;
+  int memo_columns;
+  int memo_entries;
+  struct mpc_ast_arena_t *ast;
+  long ast_gen;
+
+  long rewinds;
+  clock_t profile_time;
+  long profile_rewinds;
+
   size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
+  long mem_hits;
+  long mem_fallbacks;
+  mpc_mem_t *mem_free[MPC_INPUT_MEM_CLASSES];
+  unsigned char mem_class[MPC_INPUT_MEM_NUM];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
 
 } mpc_input_t;
@@ -113,8 +204,16 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->string = malloc(strlen(string) + 1);
   strcpy(i->string, string);
   i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_slots = 0;
   i->file = NULL;
 
+  i->window = NULL;
+  i->window_pos = 0;
+  i->window_len = 0;
+  i->file_start = 0;
+
   i->suppress = 0;
   i->backtrack = 1;
   i->marks_num = 0;
@@ -123,8 +222,19 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
+  i->memo = NULL;
+  i->memo_columns = MPC_INPUT_MEMO_COLUMNS;
+  i->memo_entries = MPC_INPUT_MEMO_ENTRIES;
+  i->ast = NULL;
+  i->ast_gen = 1;
+
   i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->mem_hits = 0;
+  i->mem_fallbacks = 0;
+  i->rewinds = 0;
+  i->profile_time = 0;
+  i->profile_rewinds = 0;
+  memset(i->mem_free, 0, sizeof(i->mem_free));
 
   return i;
 }
@@ -143,8 +253,16 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   strncpy(i->string, string, length);
   i->string[length] = '\0';
   i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_slots = 0;
   i->file = NULL;
 
+  i->window = NULL;
+  i->window_pos = 0;
+  i->window_len = 0;
+  i->file_start = 0;
+
   i->suppress = 0;
   i->backtrack = 1;
   i->marks_num = 0;
@@ -153,8 +271,19 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
+  i->memo = NULL;
+  i->memo_columns = MPC_INPUT_MEMO_COLUMNS;
+  i->memo_entries = MPC_INPUT_MEMO_ENTRIES;
+  i->ast = NULL;
+  i->ast_gen = 1;
+
   i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->mem_hits = 0;
+  i->mem_fallbacks = 0;
+  i->rewinds = 0;
+  i->profile_time = 0;
+  i->profile_rewinds = 0;
+  memset(i->mem_free, 0, sizeof(i->mem_free));
 
   return i;
 
@@ -172,8 +301,16 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 
   i->string = NULL;
   i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_slots = 0;
   i->file = pipe;
 
+  i->window = NULL;
+  i->window_pos = 0;
+  i->window_len = 0;
+  i->file_start = 0;
+
   i->suppress = 0;
   i->backtrack = 1;
   i->marks_num = 0;
@@ -182,8 +319,19 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
+  i->memo = NULL;
+  i->memo_columns = MPC_INPUT_MEMO_COLUMNS;
+  i->memo_entries = MPC_INPUT_MEMO_ENTRIES;
+  i->ast = NULL;
+  i->ast_gen = 1;
+
   i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->mem_hits = 0;
+  i->mem_fallbacks = 0;
+  i->rewinds = 0;
+  i->profile_time = 0;
+  i->profile_rewinds = 0;
+  memset(i->mem_free, 0, sizeof(i->mem_free));
 
   return i;
 
@@ -200,8 +348,17 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
 
   i->string = NULL;
   i->buffer = NULL;
+  i->buffer_pos = 0;
+  i->buffer_len = 0;
+  i->buffer_slots = 0;
   i->file = file;
 
+  i->window = malloc(MPC_INPUT_WINDOW_SIZE);
+  i->window_pos = 0;
+  i->window_len = 0;
+  i->file_start = ftell(file);
+  if (i->file_start < 0) { i->file_start = 0; }
+
   i->suppress = 0;
   i->backtrack = 1;
   i->marks_num = 0;
@@ -210,18 +367,47 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
+  i->memo = NULL;
+  i->memo_columns = MPC_INPUT_MEMO_COLUMNS;
+  i->memo_entries = MPC_INPUT_MEMO_ENTRIES;
+  i->ast = NULL;
+  i->ast_gen = 1;
+
   i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->mem_hits = 0;
+  i->mem_fallbacks = 0;
+  i->rewinds = 0;
+  i->profile_time = 0;
+  i->profile_rewinds = 0;
+  memset(i->mem_free, 0, sizeof(i->mem_free));
 
   return i;
 }
 
+static void mpc_input_memo_delete(mpc_input_t *i);
+
 static void mpc_input_delete(mpc_input_t *i) {
 
+  long j;
+
+  mpc_input_memo_delete(i);
+
   free(i->filename);
 
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+  /* Return any unconsumed lookahead to the pipe */
+  if (i->type == MPC_INPUT_PIPE) {
+    for (j = i->buffer_pos + i->buffer_len - 1; j >= i->state.pos; j--) {
+      ungetc(i->buffer[j - i->buffer_pos], i->file);
+    }
+    free(i->buffer);
+  }
+
+  /* Leave the file positioned just after the consumed input */
+  if (i->type == MPC_INPUT_FILE) {
+    fseek(i->file, i->file_start + i->state.pos, SEEK_SET);
+    free(i->window);
+  }
 
   free(i->marks);
   free(i->lasts);
@@ -234,24 +420,35 @@ static int mpc_mem_ptr(mpc_input_t *i, void *p) {
     (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t));
 }
 
+static size_t mpc_mem_size(int k) {
+  return sizeof(mpc_mem_t) << k;
+}
+
+static int mpc_mem_class(mpc_input_t *i, void *p) {
+  return i->mem_class[(mpc_mem_t*)p - i->mem];
+}
+
 static void *mpc_malloc(mpc_input_t *i, size_t n) {
-  size_t j;
-  char *p;
+  int k = 0;
+  mpc_mem_t *p;
 
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
+  while (k < MPC_INPUT_MEM_CLASSES && n > mpc_mem_size(k)) { k++; }
+  if (k == MPC_INPUT_MEM_CLASSES) { i->mem_fallbacks++; return malloc(n); }
 
-  j = i->mem_index;
-  do {
-    if (!i->mem_full[i->mem_index]) {
-      p = (void*)(i->mem + i->mem_index);
-      i->mem_full[i->mem_index] = 1;
-      i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-      return p;
-    }
-    i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-  } while (j != i->mem_index);
+  if (i->mem_free[k]) {
+    p = i->mem_free[k];
+    i->mem_free[k] = p->next;
+    i->mem_hits++;
+    return p;
+  }
+
+  if (i->mem_index + (1 << k) > MPC_INPUT_MEM_NUM) { i->mem_fallbacks++; return malloc(n); }
 
-  return malloc(n);
+  p = i->mem + i->mem_index;
+  i->mem_class[i->mem_index] = (unsigned char)k;
+  i->mem_index += 1 << k;
+  i->mem_hits++;
+  return p;
 }
 
 static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
@@ -261,33 +458,36 @@ static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
 }
 
 static void mpc_free(mpc_input_t *i, void *p) {
-  size_t j;
+  int k;
   if (!mpc_mem_ptr(i, p)) { free(p); return; }
-  j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
-  i->mem_full[j] = 0;
+  k = mpc_mem_class(i, p);
+  ((mpc_mem_t*)p)->next = i->mem_free[k];
+  i->mem_free[k] = p;
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
 
   char *q = NULL;
+  size_t m;
 
   if (!mpc_mem_ptr(i, p)) { return realloc(p, n); }
 
-  if (n > sizeof(mpc_mem_t)) {
-    q = malloc(n);
-    memcpy(q, p, sizeof(mpc_mem_t));
-    mpc_free(i, p);
-    return q;
-  }
+  m = mpc_mem_size(mpc_mem_class(i, p));
+  if (n <= m) { return p; }
 
-  return p;
+  q = mpc_malloc(i, n);
+  memcpy(q, p, m);
+  mpc_free(i, p);
+  return q;
 }
 
 static void *mpc_export(mpc_input_t *i, void *p) {
   char *q = NULL;
+  size_t m;
   if (!mpc_mem_ptr(i, p)) { return p; }
-  q = malloc(sizeof(mpc_mem_t));
-  memcpy(q, p, sizeof(mpc_mem_t));
+  m = mpc_mem_size(mpc_mem_class(i, p));
+  q = malloc(m);
+  memcpy(q, p, m);
   mpc_free(i, p);
   return q;
 }
@@ -313,14 +513,9 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
-  }
-
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
-  int j;
 
   if (i->backtrack < 1) { return; }
 
@@ -335,36 +530,83 @@ static void mpc_input_unmark(mpc_input_t *i) {
     i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
   }
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    for (j = strlen(i->buffer) - 1; j >= 0; j--)
-      ungetc(i->buffer[j], i->file);
-
-    free(i->buffer);
-    i->buffer = NULL;
-  }
-
 }
 
 static void mpc_input_rewind(mpc_input_t *i) {
 
   if (i->backtrack < 1) { return; }
 
+  i->rewinds++;
   i->state = i->marks[i->marks_num-1];
   i->last  = i->lasts[i->marks_num-1];
 
-  if (i->type == MPC_INPUT_FILE) {
-    fseek(i->file, i->state.pos, SEEK_SET);
-  }
-
   mpc_input_unmark(i);
 }
 
-static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+static void mpc_input_buffer_trim(mpc_input_t *i) {
+
+  long keep = i->state.pos;
+  long used;
+
+  /* Nothing before the oldest mark can be rewound to */
+  if (i->marks_num > 0 && i->marks[0].pos < keep) { keep = i->marks[0].pos; }
+  used = keep - i->buffer_pos;
+
+  /* Only compact once the dead prefix outweighs what is kept */
+  if (used <= 0 || used < i->buffer_len - used) { return; }
+
+  memmove(i->buffer, i->buffer + used, i->buffer_len - used);
+  i->buffer_pos += used;
+  i->buffer_len -= used;
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+
+  int c;
+  long j = i->state.pos - i->buffer_pos;
+
+  if (j < i->buffer_len) { return i->buffer[j]; }
+
+  c = getc(i->file);
+  if (c == EOF) { return '\0'; }
+
+  if (i->buffer_len == i->buffer_slots) {
+    i->buffer_slots = i->buffer_slots ? i->buffer_slots * 2 : MPC_INPUT_MARKS_MIN;
+    i->buffer = realloc(i->buffer, i->buffer_slots);
+  }
+
+  i->buffer[i->buffer_len++] = (char)c;
+  return (char)c;
+}
+
+static int mpc_input_window_in_range(mpc_input_t *i) {
+  return i->state.pos >= i->window_pos
+      && i->state.pos <  i->window_pos + i->window_len;
+}
+
+static char mpc_input_window_get(mpc_input_t *i) {
+
+  long end = i->window_pos + i->window_len;
+
+  if (mpc_input_window_in_range(i)) {
+    return i->window[i->state.pos - i->window_pos];
+  }
+
+  /* A short read at the end of the window means end of file */
+  if (i->state.pos == end && i->window_len < MPC_INPUT_WINDOW_SIZE && i->window_len > 0) {
+    return '\0';
+  }
+
+  /* Only seek when not continuing on from the previous window */
+  if (i->state.pos != end || i->window_len == 0) {
+    fseek(i->file, i->file_start + i->state.pos, SEEK_SET);
+  }
+
+  i->window_pos = i->state.pos;
+  i->window_len = (long)fread(i->window, 1, MPC_INPUT_WINDOW_SIZE, i->file);
+
+  if (i->window_len == 0) { return '\0'; }
+  return i->window[0];
 }
 
 static char mpc_input_getc(mpc_input_t *i) {
@@ -374,19 +616,8 @@ static char mpc_input_getc(mpc_input_t *i) {
   switch (i->type) {
 
     case MPC_INPUT_STRING: return i->string[i->state.pos];
-    case MPC_INPUT_FILE: c = fgetc(i->file); return c;
-    case MPC_INPUT_PIPE:
-
-      if (!i->buffer) { c = getc(i->file); return c; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        c = mpc_input_buffer_get(i);
-        return c;
-      } else {
-        c = getc(i->file);
-        return c;
-      }
-
+    case MPC_INPUT_FILE: return mpc_input_window_get(i);
+    case MPC_INPUT_PIPE: return mpc_input_buffer_get(i);
     default: return c;
   }
 }
@@ -397,32 +628,8 @@ static char mpc_input_peekc(mpc_input_t *i) {
 
   switch (i->type) {
     case MPC_INPUT_STRING: return i->string[i->state.pos];
-    case MPC_INPUT_FILE:
-
-      c = fgetc(i->file);
-      if (feof(i->file)) { return '\0'; }
-
-      fseek(i->file, -1, SEEK_CUR);
-      return c;
-
-    case MPC_INPUT_PIPE:
-
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        return mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-
+    case MPC_INPUT_FILE: return mpc_input_window_get(i);
+    case MPC_INPUT_PIPE: return mpc_input_buffer_get(i);
     default: return c;
   }
 
@@ -433,38 +640,18 @@ static int mpc_input_terminated(mpc_input_t *i) {
 }
 
 static int mpc_input_failure(mpc_input_t *i, char c) {
-
-  switch (i->type) {
-    case MPC_INPUT_STRING: { break; }
-    case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
-    case MPC_INPUT_PIPE: {
-
-      if (!i->buffer) { ungetc(c, i->file); break; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file);
-      }
-    }
-    default: { break; }
-  }
+  (void)i; (void)c;
   return 0;
 }
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
 
-  if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
-  }
-
   i->last = c;
   i->state.pos++;
   i->state.col++;
 
+  if (i->type == MPC_INPUT_PIPE) { mpc_input_buffer_trim(i); }
+
   if (c == '\n') {
     i->state.col = 0;
     i->state.row++;
@@ -479,6 +666,25 @@ static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   return 1;
 }
 
+/*
+** Character classes and FIRST sets are stored as
+** 256 bit maps with one bit for each character.
+*/
+
+enum {
+  MPC_FIRST_BYTES = 32
+};
+
+static int mpc_first_has(const unsigned char *first, char c) {
+  unsigned char x = (unsigned char)c;
+  return first[x >> 3] & (1 << (x & 7));
+}
+
+static void mpc_first_add(unsigned char *first, char c) {
+  unsigned char x = (unsigned char)c;
+  first[x >> 3] |= (unsigned char)(1 << (x & 7));
+}
+
 static int mpc_input_any(mpc_input_t *i, char **o) {
   char x;
   if (mpc_input_terminated(i)) { return 0; }
@@ -500,18 +706,53 @@ static int mpc_input_range(mpc_input_t *i, char c, char d, char **o) {
   return x >= c && x <= d ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
 }
 
-static int mpc_input_oneof(mpc_input_t *i, const char *c, char **o) {
+static int mpc_input_class(mpc_input_t *i, const unsigned char *set, char **o) {
   char x;
   if (mpc_input_terminated(i)) { return 0; }
   x = mpc_input_getc(i);
-  return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+  return mpc_first_has(set, x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
 }
 
-static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
-  char x;
-  if (mpc_input_terminated(i)) { return 0; }
-  x = mpc_input_getc(i);
-  return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+/*
+** Matches the longest run of characters from a
+** class as one string. String input is scanned in
+** place, other inputs a character at a time.
+*/
+
+static long mpc_input_span(mpc_input_t *i, const unsigned char *set, char **o) {
+
+  long j = 0, slots = MPC_FIRST_BYTES;
+  const char *s;
+  char c;
+
+  if (i->type == MPC_INPUT_STRING) {
+    s = i->string + i->state.pos;
+    while (s[j] != '\0' && mpc_first_has(set, s[j])) {
+      if (s[j] == '\n') { i->state.col = 0; i->state.row++; }
+      else { i->state.col++; }
+      j++;
+    }
+    if (j > 0) { i->last = s[j-1]; }
+    i->state.pos += j;
+    (*o) = mpc_malloc(i, j + 1);
+    memcpy(*o, s, j);
+    (*o)[j] = '\0';
+    return j;
+  }
+
+  (*o) = mpc_malloc(i, slots);
+  while (1) {
+    c = mpc_input_getc(i);
+    if (c == '\0' || !mpc_first_has(set, c)) { break; }
+    mpc_input_success(i, c, NULL);
+    if (j + 1 == slots) {
+      slots *= 2;
+      (*o) = mpc_realloc(i, *o, slots);
+    }
+    (*o)[j++] = c;
+  }
+  (*o)[j] = '\0';
+  return j;
 }
 
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
@@ -521,9 +762,80 @@ static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
   return cond(x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
 }
 
+/*
+** Returns where the next `n` characters are held
+** in memory, if they all are. That is always so for
+** a string input, and for the others when they are
+** all in the window or buffer already read.
+*/
+
+static const char *mpc_input_contiguous(mpc_input_t *i, size_t n) {
+
+  switch (i->type) {
+    case MPC_INPUT_STRING:
+      return i->string + i->state.pos;
+    case MPC_INPUT_FILE:
+      if (i->state.pos < i->window_pos
+      ||  i->state.pos + (long)n > i->window_pos + i->window_len) { return NULL; }
+      return i->window + (i->state.pos - i->window_pos);
+    case MPC_INPUT_PIPE:
+      if (i->state.pos < i->buffer_pos
+      ||  i->state.pos + (long)n > i->buffer_pos + i->buffer_len) { return NULL; }
+      return i->buffer + (i->state.pos - i->buffer_pos);
+    default: return NULL;
+  }
+}
+
+/* Moves over `n` characters at `s` known to be there */
+static void mpc_input_advance(mpc_input_t *i, const char *s, size_t n) {
+
+  size_t j;
+
+  for (j = 0; j < n; j++) {
+    if (s[j] == '\n') { i->state.col = 0; i->state.row++; }
+    else { i->state.col++; }
+  }
+
+  if (n > 0) { i->last = s[n-1]; }
+  i->state.pos += (long)n;
+
+  if (i->type == MPC_INPUT_PIPE) { mpc_input_buffer_trim(i); }
+}
+
+/*
+** Literals are compared with the input in one go
+** where it is in memory. String input ends at the
+** first null, which never matches a literal, so it
+** can be compared up to there. Without backtracking
+** the characters that did match are consumed even
+** on failure, as they are when compared one by one.
+*/
+
 static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
 
-  const char *x = c;
+  const char *x = c, *s;
+  size_t n = strlen(c), m = 0;
+
+  s = mpc_input_contiguous(i, n);
+
+  if (s) {
+
+    if (n > 0 && *s != *c) { return 0; }
+
+    if (i->type == MPC_INPUT_STRING ? strncmp(s, c, n) == 0 : memcmp(s, c, n) == 0) {
+      mpc_input_advance(i, s, n);
+      *o = mpc_malloc(i, n + 1);
+      memcpy(*o, c, n + 1);
+      return 1;
+    }
+
+    if (i->backtrack < 1) {
+      while (s[m] == c[m]) { m++; }
+      mpc_input_advance(i, s, m);
+    }
+
+    return 0;
+  }
 
   mpc_input_mark(i);
   while (*x) {
@@ -535,8 +847,8 @@ static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   }
   mpc_input_unmark(i);
 
-  *o = mpc_malloc(i, strlen(c) + 1);
-  strcpy(*o, c);
+  *o = mpc_malloc(i, n + 1);
+  memcpy(*o, c, n + 1);
   return 1;
 }
 
@@ -601,14 +913,12 @@ static void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt
   va_end(va);
 }
 
-static char char_unescape_buffer[4];
+static const char *mpc_err_char_unescape(char c, char *buffer) {
 
-static const char *mpc_err_char_unescape(char c) {
-
-  char_unescape_buffer[0] = '\'';
-  char_unescape_buffer[1] = ' ';
-  char_unescape_buffer[2] = '\'';
-  char_unescape_buffer[3] = '\0';
+  buffer[0] = '\'';
+  buffer[1] = ' ';
+  buffer[2] = '\'';
+  buffer[3] = '\0';
 
   switch (c) {
     case '\a': return "bell";
@@ -621,8 +931,8 @@ static const char *mpc_err_char_unescape(char c) {
     case '\t': return "tab";
     case ' ' : return "space";
     default:
-      char_unescape_buffer[1] = c;
-      return char_unescape_buffer;
+      buffer[1] = c;
+      return buffer;
   }
 
 }
@@ -633,6 +943,7 @@ char *mpc_err_string(mpc_err_t *x) {
   int pos = 0;
   int max = 1023;
   char *buffer = calloc(1, 1024);
+  char received[4];
 
   if (x->failure) {
     mpc_err_string_cat(buffer, &pos, &max,
@@ -657,7 +968,7 @@ char *mpc_err_string(mpc_err_t *x) {
   }
 
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->received));
+  mpc_err_string_cat(buffer, &pos, &max, "%s", mpc_err_char_unescape(x->received, received));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
 
   return realloc(buffer, strlen(buffer) + 1);
@@ -914,9 +1225,18 @@ enum {
   MPC_TYPE_CHECK_WITH = 26,
 
   MPC_TYPE_SOI        = 27,
-  MPC_TYPE_EOI        = 28
+  MPC_TYPE_EOI        = 28,
+
+  MPC_TYPE_MEMO       = 29,
+  MPC_TYPE_DFA        = 30,
+  MPC_TYPE_CLASS      = 31,
+  MPC_TYPE_SPAN       = 32,
+  MPC_TYPE_FASTFAIL   = 33,
+  MPC_TYPE_ARENA      = 34
 };
 
+typedef struct mpc_dfa_t mpc_dfa_t;
+
 typedef struct { char *m; } mpc_pdata_fail_t;
 typedef struct { mpc_ctor_t lf; void *x; } mpc_pdata_lift_t;
 typedef struct { mpc_parser_t *x; char *m; } mpc_pdata_expect_t;
@@ -924,7 +1244,7 @@ typedef struct { int(*f)(char,char); } mpc_pdata_anchor_t;
 typedef struct { char x; } mpc_pdata_single_t;
 typedef struct { char x; char y; } mpc_pdata_range_t;
 typedef struct { int(*f)(char); } mpc_pdata_satisfy_t;
-typedef struct { char *x; } mpc_pdata_string_t;
+typedef struct { char *x; unsigned char *set; } mpc_pdata_string_t;
 typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
 typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_to_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_t f; char *e; } mpc_pdata_check_t;
@@ -932,8 +1252,12 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_with_t f; void *d; ch
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; unsigned char *first; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_parser_t *x; mpc_apply_t cp; mpc_dtor_t dx; } mpc_pdata_memo_t;
+typedef struct { mpc_parser_t *x; mpc_dfa_t *dfa; } mpc_pdata_dfa_t;
+typedef struct { unsigned char *set; int n; char **ms; } mpc_pdata_class_t;
+typedef struct { int n; mpc_parser_t *x; unsigned char *set; } mpc_pdata_span_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -953,2975 +1277,7975 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_memo_t memo;
+  mpc_pdata_dfa_t dfa;
+  mpc_pdata_class_t cls;
+  mpc_pdata_span_t span;
 } mpc_pdata_t;
 
+typedef struct {
+  long calls;
+  long successes;
+  long failures;
+  long backtracks;
+  long bytes;
+  clock_t time;
+} mpc_profile_t;
+
 struct mpc_parser_t {
   char *name;
   mpc_pdata_t data;
+  mpc_profile_t *profile;
   char type;
   char retained;
 };
 
-static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
-  int j;
-  for (j = 0; j < n; j++) { if (j != x) { mpc_free(i, xs[j]); } }
-  return xs[x];
-}
+/*
+** AST Arena
+*/
 
-static mpc_val_t *mpcf_input_fst_free(mpc_input_t *i, int n, mpc_val_t **xs) { return mpcf_input_nth_free(i, n, xs, 0); }
-static mpc_val_t *mpcf_input_snd_free(mpc_input_t *i, int n, mpc_val_t **xs) { return mpcf_input_nth_free(i, n, xs, 1); }
-static mpc_val_t *mpcf_input_trd_free(mpc_input_t *i, int n, mpc_val_t **xs) { return mpcf_input_nth_free(i, n, xs, 2); }
+/*
+** Parsers wrapped with `mpca_arena` build their
+** AST inside a single arena which is handed to
+** the root node, so the whole tree is freed at
+** once when the root is deleted. Deleting any
+** other node of an arena does nothing, so nodes
+** dropped on backtracking are just left behind
+** until the arena goes.
+**
+** Memory is taken from blocks that double in size
+** so even very large trees only need a handful of
+** them. Tags are interned so every node with the
+** same tag shares one string. Child arrays are
+** always sized to a power of two which leaves
+** room to add children without copying each time.
+**
+** Nodes made outside the arena can still be
+** added as children. The arena then notes that
+** it is mixed and deleting a node walks its
+** children to delete the ones it does not own.
+**
+** When parsing with `mpc_parse_slices` the arena
+** also remembers the string given by the caller.
+** Leaves made by `mpcf_str_ast` then point their
+** contents straight into that string instead of
+** copying it. Such contents are not terminated,
+** so `contents_len` must be used to read them, or
+** `mpc_ast_materialise` called to copy them out.
+*/
 
-static mpc_val_t *mpcf_input_strfold(mpc_input_t *i, int n, mpc_val_t **xs) {
-  int j;
-  size_t l = 0;
-  if (n == 0) { return mpc_calloc(i, 1, 1); }
-  for (j = 0; j < n; j++) { l += strlen(xs[j]); }
-  xs[0] = mpc_realloc(i, xs[0], l + 1);
-  for (j = 1; j < n; j++) { strcat(xs[0], xs[j]); mpc_free(i, xs[j]); }
-  return xs[0];
-}
+enum {
+  MPC_AST_ARENA_ALIGN = 8,
+  MPC_AST_ARENA_BLOCK = 4096,
+  MPC_AST_ARENA_TAGS  = 64
+};
 
-static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
-  mpc_state_t *s = ((mpc_state_t**)xs)[0];
-  mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
-  a = mpc_ast_state(a, *s);
-  mpc_free(i, s);
-  (void) n;
-  return a;
+typedef struct mpc_ast_arena_t {
+  char *block;
+  size_t used;
+  size_t size;
+  char **tags;
+  int tags_num;
+  int tags_slots;
+  int mixed;
+  mpc_ast_t *root;
+  const char *input;
+  size_t input_len;
+} mpc_ast_arena_t;
+
+static mpc_ast_arena_t *mpc_ast_arena_new(void) {
+  mpc_ast_arena_t *m = malloc(sizeof(mpc_ast_arena_t));
+  m->block = NULL;
+  m->used = 0;
+  m->size = 0;
+  m->tags = NULL;
+  m->tags_num = 0;
+  m->tags_slots = 0;
+  m->mixed = 0;
+  m->root = NULL;
+  m->input = NULL;
+  m->input_len = 0;
+  return m;
+}
+
+static void mpc_ast_arena_delete(mpc_ast_arena_t *m) {
+  char *b;
+  /* Each block starts with a link to the one before */
+  while (m->block) {
+    b = *(char**)m->block;
+    free(m->block);
+    m->block = b;
+  }
+  free(m->tags);
+  free(m);
 }
 
-static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t **xs) {
-  int j;
-  if (f == mpcf_null)      { return mpcf_null(n, xs); }
-  if (f == mpcf_fst)       { return mpcf_fst(n, xs); }
-  if (f == mpcf_snd)       { return mpcf_snd(n, xs); }
-  if (f == mpcf_trd)       { return mpcf_trd(n, xs); }
-  if (f == mpcf_fst_free)  { return mpcf_input_fst_free(i, n, xs); }
-  if (f == mpcf_snd_free)  { return mpcf_input_snd_free(i, n, xs); }
-  if (f == mpcf_trd_free)  { return mpcf_input_trd_free(i, n, xs); }
-  if (f == mpcf_strfold)   { return mpcf_input_strfold(i, n, xs); }
-  if (f == mpcf_state_ast) { return mpcf_input_state_ast(i, n, xs); }
-  for (j = 0; j < n; j++) { xs[j] = mpc_export(i, xs[j]); }
-  return f(j, xs);
-}
+static void *mpc_ast_arena_alloc(mpc_ast_arena_t *m, size_t n) {
 
-static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
-  mpc_free(i, x);
-  return NULL;
-}
+  char *b;
+  size_t size;
 
-static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
-  mpc_free(i, c);
-  return a;
-}
+  n = (n + MPC_AST_ARENA_ALIGN - 1) & ~(size_t)(MPC_AST_ARENA_ALIGN - 1);
 
-static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
-  if (f == mpcf_free)     { return mpcf_input_free(i, x); }
-  if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x); }
-  return f(mpc_export(i, x));
-}
+  if (m->used + n > m->size) {
+    size = m->size ? m->size * 2 : MPC_AST_ARENA_BLOCK;
+    while (size < n + MPC_AST_ARENA_ALIGN) { size *= 2; }
+    b = malloc(size);
+    *(char**)b = m->block;
+    m->block = b;
+    m->used = MPC_AST_ARENA_ALIGN;
+    m->size = size;
+  }
 
-static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
-  return f(mpc_export(i, x), d);
+  b = m->block + m->used;
+  m->used += n;
+  return b;
 }
 
-static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
-  if (d == free) { mpc_free(i, x); return; }
-  d(mpc_export(i, x));
+static unsigned long mpc_ast_arena_hash(const char *s) {
+  unsigned long h = 5381;
+  while (*s) { h = h * 33 + (unsigned char)*s++; }
+  return h;
 }
 
-enum {
-  MPC_PARSE_STACK_MIN = 4
-};
+/*
+** Interns the string just allocated at the top of
+** the arena. If it is already known the space is
+** given back and the existing copy returned.
+*/
 
-#define MPC_SUCCESS(x) r->output = x; return 1
-#define MPC_FAILURE(x) r->error = x; return 0
-#define MPC_PRIMITIVE(x) \
-  if (x) { MPC_SUCCESS(r->output); } \
-  else { MPC_FAILURE(NULL); }
-
-#define MPC_MAX_RECURSION_DEPTH 1000
+static char *mpc_ast_arena_intern_top(mpc_ast_arena_t *m, char *s) {
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+  int j, k, slots;
+  char **tags;
 
-  int j = 0, k = 0;
-  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
-  mpc_result_t *results;
-  int results_slots = MPC_PARSE_STACK_MIN;
+  if (m->tags_num * 2 >= m->tags_slots) {
+    slots = m->tags_slots ? m->tags_slots * 2 : MPC_AST_ARENA_TAGS;
+    tags = calloc(slots, sizeof(char*));
+    for (j = 0; j < m->tags_slots; j++) {
+      if (m->tags[j] == NULL) { continue; }
+      k = (int)(mpc_ast_arena_hash(m->tags[j]) & (slots-1));
+      while (tags[k]) { k = (k+1) & (slots-1); }
+      tags[k] = m->tags[j];
+    }
+    free(m->tags);
+    m->tags = tags;
+    m->tags_slots = slots;
+  }
 
-  if (depth == MPC_MAX_RECURSION_DEPTH)
-  {
-    MPC_FAILURE(mpc_err_fail(i, "Maximum recursion depth exceeded!"));
+  k = (int)(mpc_ast_arena_hash(s) & (m->tags_slots-1));
+  while (m->tags[k]) {
+    if (strcmp(m->tags[k], s) == 0) {
+      m->used = (size_t)(s - m->block);
+      return m->tags[k];
+    }
+    k = (k+1) & (m->tags_slots-1);
   }
 
-  switch (p->type) {
+  m->tags[k] = s;
+  m->tags_num++;
+  return s;
+}
 
-    /* Basic Parsers */
+static char *mpc_ast_arena_intern(mpc_ast_arena_t *m, const char *t) {
+  char *s = mpc_ast_arena_alloc(m, strlen(t) + 1);
+  strcpy(s, t);
+  return mpc_ast_arena_intern_top(m, s);
+}
 
-    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
-    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
-    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
-    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
-    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
-    case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
-    case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
+static mpc_ast_t *mpc_ast_arena_slice(mpc_ast_arena_t *m, const char *tag, const char *contents, size_t length) {
+  mpc_ast_t *a = mpc_ast_arena_alloc(m, sizeof(mpc_ast_t));
+  a->tag = mpc_ast_arena_intern(m, tag);
+  a->contents = (char*)contents;
+  a->contents_len = (int)length;
+  a->state = mpc_state_new();
+  a->children_num = 0;
+  a->children = NULL;
+  a->arena = m;
+  return a;
+}
 
-    /* Other parsers */
+static mpc_ast_t *mpc_ast_arena_node(mpc_ast_arena_t *m, const char *tag, const char *contents, size_t length) {
+  mpc_ast_t *a = mpc_ast_arena_slice(m, tag, NULL, length);
+  a->contents = mpc_ast_arena_alloc(m, length + 1);
+  memcpy(a->contents, contents, length);
+  a->contents[length] = '\0';
+  return a;
+}
 
-    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
-    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
-    case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
-    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
-    case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
+static int mpc_ast_arena_sliced(mpc_ast_arena_t *m, const char *s) {
+  return m->input && s >= m->input && s < m->input + m->input_len;
+}
 
-    /* Application Parsers */
+/*
+** Only slices need their length. Other contents are
+** terminated, and may have been set by code which
+** does not know about `contents_len`.
+*/
 
-    case MPC_TYPE_APPLY:
-      if (mpc_parse_run(i, p->data.apply.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
-      } else {
-        MPC_FAILURE(r->output);
-      }
+static int mpc_ast_contents_len(mpc_ast_t *a) {
+  if (a->arena && mpc_ast_arena_sliced(a->arena, a->contents)) { return a->contents_len; }
+  return (int)strlen(a->contents);
+}
 
-    case MPC_TYPE_APPLY_TO:
-      if (mpc_parse_run(i, p->data.apply_to.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
-      } else {
-        MPC_FAILURE(r->error);
-      }
+static mpc_ast_t **mpc_ast_arena_children(mpc_ast_arena_t *m, int n) {
+  int slots = 1;
+  while (slots < n) { slots *= 2; }
+  return mpc_ast_arena_alloc(m, sizeof(mpc_ast_t*) * slots);
+}
 
-    case MPC_TYPE_CHECK:
-      if (mpc_parse_run(i, p->data.check.x, r, e, depth+1)) {
-        if (p->data.check.f(&r->output)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check.e));
-        }
-      } else {
-        MPC_FAILURE(r->error);
-      }
+static void mpc_ast_arena_add_child(mpc_ast_t *r, mpc_ast_t *a) {
 
-    case MPC_TYPE_CHECK_WITH:
-      if (mpc_parse_run(i, p->data.check_with.x, r, e, depth+1)) {
-        if (p->data.check_with.f(&r->output, p->data.check_with.d)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check_with.e));
-        }
-      } else {
-        MPC_FAILURE(r->error);
-      }
+  int n = r->children_num;
+  mpc_ast_t **children;
 
-    case MPC_TYPE_EXPECT:
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.expect.x, r, e, depth+1)) {
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_suppress_disable(i);
-        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
-      }
+  /* Only full when the count is a power of two */
+  if ((n & (n-1)) == 0) {
+    children = mpc_ast_arena_children(r->arena, n+1);
+    if (n) { memcpy(children, r->children, sizeof(mpc_ast_t*) * n); }
+    r->children = children;
+  }
 
-    case MPC_TYPE_PREDICT:
-      mpc_input_backtrack_disable(i);
-      if (mpc_parse_run(i, p->data.predict.x, r, e, depth+1)) {
-        mpc_input_backtrack_enable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_backtrack_enable(i);
-        MPC_FAILURE(r->error);
-      }
+  r->children[n] = a;
+  r->children_num++;
+  if (a && a->arena != r->arena) { r->arena->mixed = 1; }
+}
 
-    /* Optional Parsers */
+/* Prefixes the tag with `tl` characters of `t` and optionally a bar */
+static void mpc_ast_arena_prefix(mpc_ast_t *a, const char *t, size_t tl, int bar) {
+  size_t ul = strlen(a->tag);
+  char *s = mpc_ast_arena_alloc(a->arena, tl + bar + ul + 1);
+  memcpy(s, t, tl);
+  if (bar) { s[tl] = '|'; }
+  memcpy(s + tl + bar, a->tag, ul + 1);
+  a->tag = mpc_ast_arena_intern_top(a->arena, s);
+}
 
-    /* TODO: Update Not Error Message */
+static mpc_ast_t *mpc_ast_arena_copy(mpc_ast_arena_t *m, mpc_ast_t *a) {
 
-    case MPC_TYPE_NOT:
-      mpc_input_mark(i);
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        mpc_input_rewind(i);
-        mpc_input_suppress_disable(i);
-        mpc_parse_dtor(i, p->data.not.dx, r->output);
-        MPC_FAILURE(mpc_err_new(i, "opposite"));
-      } else {
-        mpc_input_unmark(i);
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+  int j;
+  mpc_ast_t *r;
 
-    case MPC_TYPE_MAYBE:
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        MPC_SUCCESS(r->output);
-      } else {
-        *e = mpc_err_merge(i, *e, r->error);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+  if (a == NULL) { return a; }
 
-    /* Repeat Parsers */
+  /* Tags and contents are never changed in place so can be shared */
+  if (a->arena == m) {
+    r = mpc_ast_arena_slice(m, "", a->contents, mpc_ast_contents_len(a));
+    r->tag = a->tag;
+  } else {
+    r = mpc_ast_arena_node(m, a->tag, a->contents, mpc_ast_contents_len(a));
+  }
+  r->state = a->state;
+  r->children_num = a->children_num;
+  r->children = a->children_num ? mpc_ast_arena_children(m, a->children_num) : NULL;
 
-    case MPC_TYPE_MANY:
+  for (j = 0; j < a->children_num; j++) {
+    r->children[j] = mpc_ast_arena_copy(m, a->children[j]);
+  }
 
-      results = results_stk;
+  return r;
+}
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
-      }
+static void mpc_ast_delete_no_children(mpc_ast_t *a);
 
-      *e = mpc_err_merge(i, *e, results[j].error);
+static void mpc_ast_arena_release(mpc_ast_t *a) {
 
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+  int j;
+  mpc_ast_arena_t *m = a->arena;
 
-    case MPC_TYPE_MANY1:
+  if (m->mixed) {
+    for (j = 0; j < a->children_num; j++) {
+      if (a->children[j] == NULL) { continue; }
+      if (a->children[j]->arena == m) {
+        mpc_ast_arena_release(a->children[j]);
+      } else {
+        mpc_ast_delete(a->children[j]);
+      }
+    }
+  }
 
-      results = results_stk;
+  if (m->root == a) { mpc_ast_arena_delete(m); }
+}
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
-      }
+static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
+  int j;
+  for (j = 0; j < n; j++) { if (j != x) { mpc_free(i, xs[j]); } }
+  return xs[x];
+}
 
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
+static mpc_val_t *mpcf_input_fst_free(mpc_input_t *i, int n, mpc_val_t **xs) { return mpcf_input_nth_free(i, n, xs, 0); }
+static mpc_val_t *mpcf_input_snd_free(mpc_input_t *i, int n, mpc_val_t **xs) { return mpcf_input_nth_free(i, n, xs, 1); }
+static mpc_val_t *mpcf_input_trd_free(mpc_input_t *i, int n, mpc_val_t **xs) { return mpcf_input_nth_free(i, n, xs, 2); }
 
-        *e = mpc_err_merge(i, *e, results[j].error);
+static mpc_val_t *mpcf_input_strfold(mpc_input_t *i, int n, mpc_val_t **xs) {
+  int j;
+  size_t l = 0, k, m;
+  if (n == 0) { return mpc_calloc(i, 1, 1); }
+  for (j = 0; j < n; j++) { l += strlen(xs[j]); }
+  m = strlen(xs[0]);
+  xs[0] = mpc_realloc(i, xs[0], l + 1);
+  for (j = 1; j < n; j++) {
+    k = strlen(xs[j]);
+    memcpy((char*)xs[0] + m, xs[j], k);
+    m += k;
+    mpc_free(i, xs[j]);
+  }
+  ((char*)xs[0])[m] = '\0';
+  return xs[0];
+}
 
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
+  mpc_state_t *s = ((mpc_state_t**)xs)[0];
+  mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
+  a = mpc_ast_state(a, *s);
+  mpc_free(i, s);
+  (void) n;
+  return a;
+}
 
-    case MPC_TYPE_COUNT:
+/*
+** Folds the children straight into one array as
+** the count is known up front, rather than adding
+** them one by one as `mpcf_fold_ast` does.
+*/
 
-      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-        : results_stk;
+static mpc_val_t *mpcf_input_fold_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == p->data.repeat.n) { break; }
-      }
+  int j, k, m = 0;
+  mpc_ast_t** as = (mpc_ast_t**)xs;
+  mpc_ast_t *r;
 
-      if (j == p->data.repeat.n) {
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        for (k = 0; k < j; k++) {
-          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
-        }
-        MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+  if (n == 0) { return NULL; }
+  if (n == 1) { return xs[0]; }
+  if (n == 2 && xs[1] == NULL) { return xs[0]; }
+  if (n == 2 && xs[0] == NULL) { return xs[1]; }
 
-    /* Combinatory Parsers */
+  for (j = 0; j < n; j++) {
+    if (as[j] == NULL) { continue; }
+    m += as[j]->children_num >= 2 ? as[j]->children_num : 1;
+  }
 
-    case MPC_TYPE_OR:
+  r = mpc_ast_arena_node(i->ast, ">", "", 0);
+  r->children = m ? mpc_ast_arena_children(i->ast, m) : NULL;
 
-      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+  for (j = 0; j < n; j++) {
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+    if (as[j] == NULL) { continue; }
 
-      for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e, depth+1)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
-        }
+    if (as[j]->children_num == 0) {
+      r->children[r->children_num++] = as[j];
+    } else if (as[j]->children_num == 1) {
+      r->children[r->children_num++] = mpc_ast_add_root_tag(as[j]->children[0], as[j]->tag);
+      mpc_ast_delete_no_children(as[j]);
+    } else {
+      for (k = 0; k < as[j]->children_num; k++) {
+        r->children[r->children_num++] = as[j]->children[k];
       }
+      mpc_ast_delete_no_children(as[j]);
+    }
 
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+  }
 
-    case MPC_TYPE_AND:
+  for (j = 0; j < r->children_num; j++) {
+    if (r->children[j]->arena != i->ast) { i->ast->mixed = 1; }
+  }
 
-      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
-
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+  if (r->children_num) {
+    r->state = r->children[0]->state;
+  }
 
-      mpc_input_mark(i);
-      for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e, depth+1)) {
-          mpc_input_rewind(i);
-          for (k = 0; k < j; k++) {
-            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
-          }
-          MPC_FAILURE(results[j].error;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        }
-      }
-      mpc_input_unmark(i);
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+  return r;
+}
 
-    /* End */
+/*
+** A tuple carries the values of a sequence whole
+** to a fold further out, which treats them as if
+** they had been parsed by its own sequence.
+*/
 
-    default:
+typedef struct {
+  int n;
+  mpc_val_t **xs;
+} mpc_tuple_t;
 
-      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
-  }
+enum {
+  MPC_TUPLE_STACK = 16
+};
 
-  return 0;
+/* Replaces the tuple at the end of `xs` with its values */
+static mpc_val_t **mpc_tuple_splice(int n, mpc_val_t **xs, mpc_val_t **stk, int *m) {
 
-}
+  mpc_tuple_t *t = xs[n-1];
+  mpc_val_t **ys;
 
-#undef MPC_SUCCESS
-#undef MPC_FAILURE
-#undef MPC_PRIMITIVE
+  *m = n - 1 + (t ? t->n : 0);
+  ys = *m > MPC_TUPLE_STACK ? malloc(sizeof(mpc_val_t*) * *m) : stk;
 
-int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
-  e->state = mpc_state_invalid();
-  x = mpc_parse_run(i, p, r, &e, 0);
-  if (x) {
-    mpc_err_delete_internal(i, e);
-    r->output = mpc_export(i, r->output);
-  } else {
-    r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
+  memcpy(ys, xs, sizeof(mpc_val_t*) * (n-1));
+  if (t) {
+    memcpy(ys + n - 1, t->xs, sizeof(mpc_val_t*) * t->n);
+    free(t);
   }
-  return x;
-}
-
-int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_string(filename, string);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
-}
 
-int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
+  return ys;
 }
 
-int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_file(filename, file);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
+static mpc_val_t *mpcf_input_fold_ast_tuple(mpc_input_t *i, int n, mpc_val_t **xs) {
+  int m;
+  mpc_val_t *stk[MPC_TUPLE_STACK], *r;
+  mpc_val_t **ys = mpc_tuple_splice(n, xs, stk, &m);
+  r = mpcf_input_fold_ast(i, m, ys);
+  if (ys != stk) { free(ys); }
+  return r;
 }
 
-int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
+static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t **xs) {
+  int j;
+  if (f == mpcf_null)      { return mpcf_null(n, xs); }
+  if (f == mpcf_fst)       { return mpcf_fst(n, xs); }
+  if (f == mpcf_snd)       { return mpcf_snd(n, xs); }
+  if (f == mpcf_trd)       { return mpcf_trd(n, xs); }
+  if (f == mpcf_fst_free)  { return mpcf_input_fst_free(i, n, xs); }
+  if (f == mpcf_snd_free)  { return mpcf_input_snd_free(i, n, xs); }
+  if (f == mpcf_trd_free)  { return mpcf_input_trd_free(i, n, xs); }
+  if (f == mpcf_strfold)   { return mpcf_input_strfold(i, n, xs); }
+  if (f == mpcf_state_ast) { return mpcf_input_state_ast(i, n, xs); }
+  if (f == mpcf_fold_ast && i->ast) { return mpcf_input_fold_ast(i, n, xs); }
+  if (f == mpcf_fold_ast_tuple && i->ast) { return mpcf_input_fold_ast_tuple(i, n, xs); }
+  for (j = 0; j < n; j++) { xs[j] = mpc_export(i, xs[j]); }
+  return f(j, xs);
 }
 
-int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
-
-  FILE *f = fopen(filename, "rb");
-  int res;
-
-  if (f == NULL) {
-    r->output = NULL;
-    r->error = mpc_err_file(filename, "Unable to open file!");
-    return 0;
-  }
-
-  res = mpc_parse_file(filename, f, p, r);
-  fclose(f);
-  return res;
+static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
+  mpc_free(i, x);
+  return NULL;
 }
 
 /*
-** Building a Parser
+** When slicing, a leaf whose text is exactly what
+** was consumed from `pos` points into the string
+** given by the caller. Anything else is copied.
 */
 
-static void mpc_undefine_unretained(mpc_parser_t *p, int force);
+static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c, long pos) {
 
-static void mpc_undefine_or(mpc_parser_t *p) {
+  mpc_ast_arena_t *m = i->ast;
+  mpc_ast_t *a;
+  size_t n;
 
-  int i;
-  for (i = 0; i < p->data.or.n; i++) {
-    mpc_undefine_unretained(p->data.or.xs[i], 0);
+  if (m == NULL) {
+    a = mpc_ast_new("", c);
+  } else {
+    n = strlen(c);
+    if (m->input && n > 0 && i->type == MPC_INPUT_STRING
+    &&  (long)n <= i->state.pos - pos
+    &&  memcmp(i->string + pos, c, n) == 0) {
+      a = mpc_ast_arena_slice(m, "", m->input + pos, n);
+    } else {
+      a = mpc_ast_arena_node(m, "", c, n);
+    }
   }
-  free(p->data.or.xs);
 
+  mpc_free(i, c);
+  return a;
 }
 
-static void mpc_undefine_and(mpc_parser_t *p) {
+static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x, long pos) {
+  if (f == mpcf_free)     { return mpcf_input_free(i, x); }
+  if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x, pos); }
+  if (f == (mpc_apply_t)mpc_ast_copy && i->ast) { return mpc_ast_arena_copy(i->ast, x); }
+  return f(mpc_export(i, x));
+}
 
-  int i;
-  for (i = 0; i < p->data.and.n; i++) {
-    mpc_undefine_unretained(p->data.and.xs[i], 0);
-  }
-  free(p->data.and.xs);
-  free(p->data.and.dxs);
+static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
+  return f(mpc_export(i, x), d);
+}
 
+static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
+  if (d == free) { mpc_free(i, x); return; }
+  d(mpc_export(i, x));
 }
 
-static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
+enum {
+  MPC_PARSE_STACK_MIN = 4
+};
 
-  if (p->retained && !force) { return; }
+#define MPC_SUCCESS(x) r->output = x; return 1
+#define MPC_FAILURE(x) r->error = x; return 0
+#define MPC_PRIMITIVE(x) \
+  if (x) { MPC_SUCCESS(r->output); } \
+  else { MPC_FAILURE(NULL); }
 
-  switch (p->type) {
+#define MPC_MAX_RECURSION_DEPTH 1000
 
-    case MPC_TYPE_FAIL: free(p->data.fail.m); break;
+/*
+** Packrat Memoisation
+*/
 
-    case MPC_TYPE_ONEOF:
-    case MPC_TYPE_NONEOF:
-    case MPC_TYPE_STRING:
-      free(p->data.string.x);
-      break;
+/*
+** Parsers wrapped with `mpc_memo` remember their
+** result at each input position so that after
+** backtracking they are not run again. Entries
+** are kept in a ring of columns indexed by input
+** position. Only the most recent columns are kept
+** and a column is evicted as soon as its slot is
+** needed for a later position. Each column holds
+** a bounded number of entries, replacing the
+** oldest once full. Both limits can be set on a
+** `mpc_context_t`.
+**
+** The memo table owns a copy of every stored
+** output made with the parser's copy function,
+** and every hit hands out a fresh copy, so the
+** usual fold and destructor ownership rules are
+** unchanged. Stored errors are packed into one
+** block outside of the input memory pool, as they
+** live much longer than most allocations made
+** during a parse and are only ever copied out.
+**
+** ASTs stored while building an arena are copied
+** into the arena instead. These copies share the
+** tags and contents of the original and are never
+** freed on their own, which makes storing and
+** hitting them cheap. They are only valid while
+** the arena is being built, so each entry notes
+** the arena generation of the input and is ignored
+** once that arena has been handed to its root.
+*/
 
-    case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
-    case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
-    case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth);
 
-    case MPC_TYPE_MAYBE:
-    case MPC_TYPE_NOT:
-      mpc_undefine_unretained(p->data.not.x, 0);
-      break;
+static mpc_err_t *mpc_err_copy(mpc_input_t *i, mpc_err_t *x) {
+  int j;
+  mpc_err_t *y;
+  if (x == NULL) { return NULL; }
+  y = mpc_malloc(i, sizeof(mpc_err_t));
+  y->state = x->state;
+  y->received = x->received;
+  y->filename = mpc_malloc(i, strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = mpc_malloc(i, strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  y->expected_num = x->expected_num;
+  y->expected = NULL;
+  if (x->expected_num) {
+    y->expected = mpc_malloc(i, sizeof(char*) * x->expected_num);
+    for (j = 0; j < x->expected_num; j++) {
+      y->expected[j] = mpc_malloc(i, strlen(x->expected[j]) + 1);
+      strcpy(y->expected[j], x->expected[j]);
+    }
+  }
+  return y;
+}
 
-    case MPC_TYPE_EXPECT:
-      mpc_undefine_unretained(p->data.expect.x, 0);
-      free(p->data.expect.m);
-      break;
+static mpc_err_t *mpc_err_pack(mpc_err_t *x) {
 
-    case MPC_TYPE_MANY:
-    case MPC_TYPE_MANY1:
-    case MPC_TYPE_COUNT:
-      mpc_undefine_unretained(p->data.repeat.x, 0);
-      break;
+  int j;
+  size_t n;
+  char *b;
+  mpc_err_t *y;
 
-    case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
-    case MPC_TYPE_AND: mpc_undefine_and(p); break;
+  if (x == NULL) { return NULL; }
 
-    case MPC_TYPE_CHECK:
-      mpc_undefine_unretained(p->data.check.x, 0);
-      free(p->data.check.e);
-      break;
+  n = sizeof(mpc_err_t) + sizeof(char*) * x->expected_num + strlen(x->filename) + 1;
+  if (x->failure) { n += strlen(x->failure) + 1; }
+  for (j = 0; j < x->expected_num; j++) { n += strlen(x->expected[j]) + 1; }
 
-    case MPC_TYPE_CHECK_WITH:
-      mpc_undefine_unretained(p->data.check_with.x, 0);
-      free(p->data.check_with.e);
-      break;
+  y = malloc(n);
+  *y = *x;
+  y->expected = x->expected_num ? (char**)(y + 1) : NULL;
+  b = (char*)(y + 1) + sizeof(char*) * x->expected_num;
 
-    default: break;
+  y->filename = b;
+  strcpy(b, x->filename);
+  b += strlen(b) + 1;
+
+  if (x->failure) {
+    y->failure = b;
+    strcpy(b, x->failure);
+    b += strlen(b) + 1;
   }
 
-  if (!force) {
-    free(p->name);
-    free(p);
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = b;
+    strcpy(b, x->expected[j]);
+    b += strlen(b) + 1;
   }
 
+  return y;
 }
 
-void mpc_delete(mpc_parser_t *p) {
-  if (p->retained) {
-
-    if (p->type != MPC_TYPE_UNDEFINED) {
-      mpc_undefine_unretained(p, 0);
-    }
-
-    free(p->name);
-    free(p);
+static int mpc_input_memo_mode(mpc_input_t *i) {
+  return (i->suppress ? 1 : 0) | (i->backtrack > 0 ? 2 : 0) | (i->state.term ? 4 : 0);
+}
 
-  } else {
-    mpc_undefine_unretained(p, 0);
+static void mpc_input_memo_clear_entry(mpc_input_t *i, mpc_memo_t *m) {
+  if (m->success && m->result.output && m->gen == 0) {
+    mpc_parse_dtor(i, m->p->data.memo.dx, m->result.output);
+  } else if (!m->success) {
+    free(m->result.error);
   }
+  free(m->merged);
 }
 
-static void mpc_soft_delete(mpc_val_t *x) {
-  mpc_undefine_unretained(x, 0);
+static void mpc_input_memo_clear(mpc_input_t *i, mpc_memo_column_t *c) {
+  int j;
+  for (j = 0; j < c->memos_num; j++) {
+    mpc_input_memo_clear_entry(i, &c->memos[j]);
+  }
+  c->memos_num = 0;
+  c->memos_next = 0;
 }
 
-static mpc_parser_t *mpc_undefined(void) {
-  mpc_parser_t *p = calloc(1, sizeof(mpc_parser_t));
-  p->retained = 0;
-  p->type = MPC_TYPE_UNDEFINED;
-  p->name = NULL;
-  return p;
+static void mpc_input_memo_delete(mpc_input_t *i) {
+  int j;
+  if (i->memo == NULL) { return; }
+  for (j = 0; j < i->memo_columns; j++) {
+    mpc_input_memo_clear(i, &i->memo[j]);
+    free(i->memo[j].memos);
+  }
+  free(i->memo);
+  i->memo = NULL;
 }
 
-mpc_parser_t *mpc_new(const char *name) {
-  mpc_parser_t *p = mpc_undefined();
-  p->retained = 1;
-  p->name = realloc(p->name, strlen(name) + 1);
-  strcpy(p->name, name);
-  return p;
+static mpc_memo_t *mpc_input_memo_find(mpc_input_t *i, mpc_parser_t *p, int mode) {
+  int j;
+  mpc_memo_column_t *c;
+  mpc_memo_t *m;
+  if (i->memo == NULL) { return NULL; }
+  c = &i->memo[i->state.pos % i->memo_columns];
+  if (c->pos != i->state.pos) { return NULL; }
+  for (j = 0; j < c->memos_num; j++) {
+    m = &c->memos[j];
+    if (m->p == p && m->mode == mode && m->last == i->last
+    &&  (m->gen == 0 || (m->gen == i->ast_gen && i->ast))) { return m; }
+  }
+  return NULL;
 }
 
-mpc_parser_t *mpc_copy(mpc_parser_t *a) {
-  int i = 0;
-  mpc_parser_t *p;
+static mpc_memo_t *mpc_input_memo_add(mpc_input_t *i, long pos) {
 
-  if (a->retained) { return a; }
+  int j;
+  mpc_memo_column_t *c;
+  mpc_memo_t *m;
+
+  if (i->memo == NULL) {
+    i->memo = malloc(sizeof(mpc_memo_column_t) * i->memo_columns);
+    for (j = 0; j < i->memo_columns; j++) {
+      i->memo[j].pos = -1;
+      i->memo[j].memos_num = 0;
+      i->memo[j].memos_slots = 0;
+      i->memo[j].memos_next = 0;
+      i->memo[j].memos = NULL;
+    }
+  }
 
-  p = mpc_undefined();
-  p->retained = a->retained;
-  p->type = a->type;
-  p->data = a->data;
+  c = &i->memo[pos % i->memo_columns];
 
-  if (a->name) {
-    p->name = malloc(strlen(a->name)+1);
-    strcpy(p->name, a->name);
+  /* Evict the older position sharing this column */
+  if (c->pos != pos) {
+    mpc_input_memo_clear(i, c);
+    c->pos = pos;
   }
 
-  switch (a->type) {
+  /* Once the column is full replace its oldest entry */
+  if (c->memos_num == i->memo_entries) {
+    m = &c->memos[c->memos_next];
+    c->memos_next = (c->memos_next + 1) % i->memo_entries;
+    mpc_input_memo_clear_entry(i, m);
+    return m;
+  }
 
-    case MPC_TYPE_FAIL:
-      p->data.fail.m = malloc(strlen(a->data.fail.m)+1);
-      strcpy(p->data.fail.m, a->data.fail.m);
-    break;
+  if (c->memos_num == c->memos_slots) {
+    c->memos_slots = c->memos_slots ? c->memos_slots * 2 : 4;
+    if (c->memos_slots > i->memo_entries) { c->memos_slots = i->memo_entries; }
+    c->memos = realloc(c->memos, sizeof(mpc_memo_t) * c->memos_slots);
+  }
 
-    case MPC_TYPE_ONEOF:
-    case MPC_TYPE_NONEOF:
-    case MPC_TYPE_STRING:
-      p->data.string.x = malloc(strlen(a->data.string.x)+1);
-      strcpy(p->data.string.x, a->data.string.x);
-      break;
-
-    case MPC_TYPE_APPLY:    p->data.apply.x    = mpc_copy(a->data.apply.x);    break;
-    case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_copy(a->data.apply_to.x); break;
-    case MPC_TYPE_PREDICT:  p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
-
-    case MPC_TYPE_MAYBE:
-    case MPC_TYPE_NOT:
-      p->data.not.x = mpc_copy(a->data.not.x);
-      break;
-
-    case MPC_TYPE_EXPECT:
-      p->data.expect.x = mpc_copy(a->data.expect.x);
-      p->data.expect.m = malloc(strlen(a->data.expect.m)+1);
-      strcpy(p->data.expect.m, a->data.expect.m);
-      break;
-
-    case MPC_TYPE_MANY:
-    case MPC_TYPE_MANY1:
-    case MPC_TYPE_COUNT:
-      p->data.repeat.x = mpc_copy(a->data.repeat.x);
-      break;
-
-    case MPC_TYPE_OR:
-      p->data.or.xs = malloc(a->data.or.n * sizeof(mpc_parser_t*));
-      for (i = 0; i < a->data.or.n; i++) {
-        p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
-      }
-    break;
-    case MPC_TYPE_AND:
-      p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
-      for (i = 0; i < a->data.and.n; i++) {
-        p->data.and.xs[i] = mpc_copy(a->data.and.xs[i]);
-      }
-      p->data.and.dxs = malloc((a->data.and.n-1) * sizeof(mpc_dtor_t));
-      for (i = 0; i < a->data.and.n-1; i++) {
-        p->data.and.dxs[i] = a->data.and.dxs[i];
-      }
-    break;
+  return &c->memos[c->memos_num++];
+}
 
-    case MPC_TYPE_CHECK:
-      p->data.check.x      = mpc_copy(a->data.check.x);
-      p->data.check.e      = malloc(strlen(a->data.check.e)+1);
-      strcpy(p->data.check.e, a->data.check.e);
-      break;
-    case MPC_TYPE_CHECK_WITH:
-      p->data.check_with.x = mpc_copy(a->data.check_with.x);
-      p->data.check_with.e = malloc(strlen(a->data.check_with.e)+1);
-      strcpy(p->data.check_with.e, a->data.check_with.e);
-      break;
+static int mpc_parse_memo(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
 
-    default: break;
+  int x;
+  int mode = mpc_input_memo_mode(i);
+  long pos = i->state.pos;
+  char last = i->last;
+  mpc_err_t *me = NULL;
+  mpc_memo_t *m = mpc_input_memo_find(i, p, mode);
+
+  if (m) {
+    i->state = m->state;
+    i->last = m->state_last;
+    if (m->merged) { *e = mpc_err_merge(i, *e, mpc_err_copy(i, m->merged)); }
+    if (m->success) {
+      r->output = m->result.output ? mpc_parse_apply(i, p->data.memo.cp, m->result.output, pos) : NULL;
+    } else {
+      r->error = mpc_err_copy(i, m->result.error);
+    }
+    return m->success;
   }
 
+  x = mpc_parse_run(i, p->data.memo.x, r, &me, depth+1);
+
+  if (x) { r->output = mpc_export(i, r->output); }
+
+  m = mpc_input_memo_add(i, pos);
+  m->p = p;
+  m->last = last;
+  m->mode = mode;
+  m->success = x;
+  m->state = i->state;
+  m->state_last = i->last;
+  m->merged = mpc_err_pack(me);
+  m->gen = 0;
+  if (x && r->output && i->ast && p->data.memo.cp == (mpc_apply_t)mpc_ast_copy) {
+    m->result.output = mpc_ast_arena_copy(i->ast, r->output);
+    m->gen = i->ast_gen;
+  } else if (x) {
+    m->result.output = r->output ? p->data.memo.cp(r->output) : NULL;
+  } else {
+    m->result.error = mpc_err_pack(r->error);
+  }
 
-  return p;
+  if (me) { *e = mpc_err_merge(i, *e, me); }
+  return x;
 }
 
-mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
-  mpc_undefine_unretained(p, 1);
-  p->type = MPC_TYPE_UNDEFINED;
-  return p;
-}
+/*
+** A character class stands in for an `or` of the
+** single character parsers merged into it. None
+** of those can fail after another succeeds, so on
+** failure it reports what each of them expected
+** in turn, as the `or` would have done.
+*/
 
-mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
+static int mpc_parse_class(mpc_input_t *i, mpc_pdata_class_t *d, mpc_result_t *r, mpc_err_t **e) {
 
-  if (p->retained) {
-    p->type = a->type;
-    p->data = a->data;
-  } else {
-    mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
-    p->type = a2->type;
-    p->data = a2->data;
-    free(a2);
+  int j;
+
+  if (mpc_input_class(i, d->set, (char**)&r->output)) { return 1; }
+
+  for (j = 0; !i->suppress && j < d->n; j++) {
+    *e = mpc_err_merge(i, *e, mpc_err_new(i, d->ms[j]));
   }
 
-  free(a);
-  return p;
+  r->error = NULL;
+  return 0;
 }
 
-void mpc_cleanup(int n, ...) {
-  int i;
-  mpc_parser_t **list = malloc(sizeof(mpc_parser_t*) * n);
+/*
+** A span stands in for `many` or `many1` of a
+** character class folded into a string. It scans
+** the whole run at once, then runs the class where
+** the run stopped for the error it reports.
+*/
 
-  va_list va;
-  va_start(va, n);
-  for (i = 0; i < n; i++) { list[i] = va_arg(va, mpc_parser_t*); }
-  for (i = 0; i < n; i++) { mpc_undefine(list[i]); }
-  for (i = 0; i < n; i++) { mpc_delete(list[i]); }
-  va_end(va);
+static int mpc_parse_span(mpc_input_t *i, mpc_pdata_span_t *d, mpc_result_t *r, mpc_err_t **e, int depth) {
 
-  free(list);
-}
+  mpc_result_t x;
 
-mpc_parser_t *mpc_pass(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_PASS;
-  return p;
-}
+  if (mpc_input_span(i, d->set, (char**)&r->output) >= d->n) {
+    if (!mpc_parse_run(i, d->x, &x, e, depth+1)) {
+      *e = mpc_err_merge(i, *e, x.error);
+    }
+    return 1;
+  }
 
-mpc_parser_t *mpc_fail(const char *m) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_FAIL;
-  p->data.fail.m = malloc(strlen(m) + 1);
-  strcpy(p->data.fail.m, m);
-  return p;
+  mpc_free(i, r->output);
+  mpc_parse_run(i, d->x, &x, e, depth+1);
+  r->error = mpc_err_many1(i, x.error);
+  return 0;
 }
 
 /*
-** As `snprintf` is not ANSI standard this
-** function `mpc_failf` should be considered
-** unsafe.
-**
-** You have a few options if this is going to be
-** trouble.
-**
-** - Ensure the format string does not exceed
-**   the buffer length using precision specifiers
-**   such as `%.512s`.
-**
-** - Patch this function in your code base to
-**   use `snprintf` or whatever variant your
-**   system supports.
-**
-** - Avoid it altogether.
-**
+** Parsers wrapped with `mpc_fastfail` are first
+** run with errors suppressed so that a successful
+** parse never builds the expected lists of the
+** alternatives it tried. Only on failure is the
+** input rewound and the parser run again to work
+** out the full error. This is only exact for the
+** root parser as errors left over from a nested
+** success are dropped, and actions are run twice
+** on failure. Without backtracking the input can
+** not be rewound so the parser is just run once.
 */
 
-mpc_parser_t *mpc_failf(const char *fmt, ...) {
+static int mpc_parse_fastfail(mpc_input_t *i, mpc_parser_t *a, mpc_result_t *r, mpc_err_t **e, int depth) {
 
-  va_list va;
-  char *buffer;
+  int x;
 
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_FAIL;
+  if (i->suppress || i->backtrack < 1) {
+    return mpc_parse_run(i, a, r, e, depth+1);
+  }
 
-  va_start(va, fmt);
-  buffer = malloc(2048);
-  vsprintf(buffer, fmt, va);
-  va_end(va);
+  mpc_input_mark(i);
+  mpc_input_suppress_enable(i);
+  x = mpc_parse_run(i, a, r, e, depth+1);
+  mpc_input_suppress_disable(i);
 
-  buffer = realloc(buffer, strlen(buffer) + 1);
-  p->data.fail.m = buffer;
-  return p;
+  if (x) {
+    mpc_input_unmark(i);
+    return 1;
+  }
 
+  mpc_err_delete_internal(i, r->error);
+  mpc_input_rewind(i);
+  return mpc_parse_run(i, a, r, e, depth+1);
 }
 
-mpc_parser_t *mpc_lift_val(mpc_val_t *x) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_LIFT_VAL;
-  p->data.lift.x = x;
-  return p;
-}
+/*
+** Hands the arena over to the root of the AST. A
+** root made outside of the arena is moved into it
+** first so that deleting the root frees it all.
+*/
 
-mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_LIFT;
-  p->data.lift.lf = lf;
-  return p;
-}
+static void mpc_parse_arena_done(mpc_input_t *i, int x, mpc_result_t *r) {
 
-mpc_parser_t *mpc_anchor(int(*f)(char,char)) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_ANCHOR;
-  p->data.anchor.f = f;
-  return mpc_expect(p, "anchor");
-}
+  mpc_ast_arena_t *m = i->ast;
+  mpc_ast_t *a, *b;
 
-mpc_parser_t *mpc_state(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_STATE;
-  return p;
+  /* Memoised copies in the arena can no longer be used */
+  i->ast = NULL;
+  i->ast_gen++;
+
+  if (!x || r->output == NULL) {
+    mpc_ast_arena_delete(m);
+    return;
+  }
+
+  a = r->output;
+
+  if (a->arena != m) {
+    b = mpc_ast_arena_node(m, a->tag, a->contents, mpc_ast_contents_len(a));
+    b->state = a->state;
+    b->children_num = a->children_num;
+    b->children = a->children_num ? mpc_ast_arena_children(m, a->children_num) : NULL;
+    if (a->children_num) {
+      memcpy(b->children, a->children, sizeof(mpc_ast_t*) * a->children_num);
+      m->mixed = 1;
+    }
+    mpc_ast_delete_no_children(a);
+    r->output = a = b;
+  }
+
+  m->root = a;
 }
 
-mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_EXPECT;
-  p->data.expect.x = a;
-  p->data.expect.m = malloc(strlen(expected) + 1);
-  strcpy(p->data.expect.m, expected);
-  return p;
+static int mpc_parse_arena(mpc_input_t *i, mpc_parser_t *a, mpc_result_t *r, mpc_err_t **e, int depth) {
+  int x;
+  if (i->ast) { return mpc_parse_run(i, a, r, e, depth+1); }
+  i->ast = mpc_ast_arena_new();
+  x = mpc_parse_run(i, a, r, e, depth+1);
+  mpc_parse_arena_done(i, x, r);
+  return x;
 }
 
 /*
-** As `snprintf` is not ANSI standard this
-** function `mpc_expectf` should be considered
-** unsafe.
-**
-** You have a few options if this is going to be
-** trouble.
-**
-** - Ensure the format string does not exceed
-**   the buffer length using precision specifiers
-**   such as `%.512s`.
-**
-** - Patch this function in your code base to
-**   use `snprintf` or whatever variant your
-**   system supports.
-**
-** - Avoid it altogether.
+** An `or` with a FIRST set lookahead only tries
+** the alternatives that can start with the next
+** character. If all of those fail the skipped
+** alternatives are run anyway, so that the error
+** reports everything that was expected. Each
+** alternative collects its errors separately so
+** they can be merged in the original order.
 **
+** Returns the index of the successful alternative
+** or -1 on failure.
 */
 
-mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
-  va_list va;
-  char *buffer;
+static int mpc_parse_or_first(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *results, mpc_err_t **e, int depth) {
 
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_EXPECT;
+  int j, k, x = -1, skipped = 0;
+  int stop = p->data.or.n;
+  long pos = i->state.pos;
+  char c = mpc_input_peekc(i);
+  mpc_err_t *le = NULL, *se;
 
-  va_start(va, fmt);
-  buffer = malloc(2048);
-  vsprintf(buffer, fmt, va);
-  va_end(va);
+  for (j = 0; j < p->data.or.n; j++) { results[j].error = NULL; }
 
-  buffer = realloc(buffer, strlen(buffer) + 1);
-  p->data.expect.x = a;
-  p->data.expect.m = buffer;
-  return p;
+  for (j = 0; j < p->data.or.n; j++) {
+    if (j < stop && !mpc_first_has(p->data.or.first + j * MPC_FIRST_BYTES, c)) {
+      skipped = 1;
+      continue;
+    }
+    le = NULL;
+    if (mpc_parse_run(i, p->data.or.xs[j], &results[j], &le, depth+1)) { x = j; break; }
+    results[j].error = mpc_err_merge(i, le, results[j].error);
+    le = NULL;
+    /* Without backtracking a failure may have moved the input */
+    if (i->state.pos != pos) { stop = j+1; }
+  }
+
+  /*
+  ** Skipped alternatives can only be run from where
+  ** they were skipped. Their errors are also needed
+  ** when the match is empty, as they are then at the
+  ** same position as anything that follows.
+  */
+  if (skipped && i->state.pos == pos && (x == -1 || !i->suppress)) {
+    k = x == -1 ? p->data.or.n : x;
+    for (j = 0; j < k; j++) {
+      if (mpc_first_has(p->data.or.first + j * MPC_FIRST_BYTES, c)) { continue; }
+      se = NULL;
+      if (mpc_parse_run(i, p->data.or.xs[j], &results[j], &se, depth+1)) { x = j; le = se; break; }
+      results[j].error = mpc_err_merge(i, se, results[j].error);
+    }
+  }
+
+  for (j = 0; j < p->data.or.n; j++) {
+    if (j == x || results[j].error == NULL) { continue; }
+    if (x == -1 || j < x) {
+      *e = mpc_err_merge(i, *e, results[j].error);
+    } else {
+      mpc_err_delete_internal(i, results[j].error);
+    }
+  }
+
+  if (le) { *e = mpc_err_merge(i, *e, le); }
+
+  return x;
 }
 
+static int mpc_parse_dfa(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e);
+static mpc_dfa_t *mpc_dfa_new(mpc_parser_t *p);
+static void mpc_dfa_delete(mpc_dfa_t *d);
+
+static int mpc_parse_node(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth);
+
 /*
-** Basic Parsers
+** Parsers with profiling turned on by `mpc_profile`
+** go through here and count what happens to them.
+** Time and backtracks only count what the parser
+** does itself. Anything done inside another rule
+** being profiled is charged to that rule, so that
+** recursive rules are not counted many times over.
 */
 
-mpc_parser_t *mpc_any(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_ANY;
-  return mpc_expect(p, "any character");
-}
+static int mpc_parse_profile(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
 
-mpc_parser_t *mpc_char(char c) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_SINGLE;
-  p->data.single.x = c;
-  return mpc_expectf(p, "'%c'", c);
-}
+  int x;
+  long pos = i->state.pos;
+  long rewinds = i->rewinds;
+  clock_t start = clock();
+  clock_t time;
 
-mpc_parser_t *mpc_range(char s, char e) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_RANGE;
-  p->data.range.x = s;
-  p->data.range.y = e;
-  return mpc_expectf(p, "character between '%c' and '%c'", s, e);
-}
+  /* Totals from nested profiled rules are kept on the input */
+  clock_t inner_time = i->profile_time;
+  long inner_rewinds = i->profile_rewinds;
+  i->profile_time = 0;
+  i->profile_rewinds = 0;
 
-mpc_parser_t *mpc_oneof(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_ONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "one of '%s'", s);
-}
-
-mpc_parser_t *mpc_noneof(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_NONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "none of '%s'", s);
+  x = mpc_parse_node(i, p, r, e, depth);
 
-}
+  time = clock() - start;
+  rewinds = i->rewinds - rewinds;
 
-mpc_parser_t *mpc_satisfy(int(*f)(char)) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_SATISFY;
-  p->data.satisfy.f = f;
-  return mpc_expectf(p, "character satisfying function %p", f);
-}
+  p->profile->time += time - i->profile_time;
+  p->profile->calls++;
+  p->profile->backtracks += rewinds - i->profile_rewinds;
 
-mpc_parser_t *mpc_string(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_STRING;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "\"%s\"", s);
-}
+  i->profile_time = inner_time + time;
+  i->profile_rewinds = inner_rewinds + rewinds;
 
-/*
-** Core Parsers
-*/
+  if (x) {
+    p->profile->successes++;
+    p->profile->bytes += i->state.pos - pos;
+  } else {
+    p->profile->failures++;
+  }
 
-mpc_parser_t *mpc_apply(mpc_parser_t *a, mpc_apply_t f) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_APPLY;
-  p->data.apply.x = a;
-  p->data.apply.f = f;
-  return p;
+  return x;
 }
 
-mpc_parser_t *mpc_apply_to(mpc_parser_t *a, mpc_apply_to_t f, void *x) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_APPLY_TO;
-  p->data.apply_to.x = a;
-  p->data.apply_to.f = f;
-  p->data.apply_to.d = x;
-  return p;
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+  if (p->profile) { return mpc_parse_profile(i, p, r, e, depth); }
+  return mpc_parse_node(i, p, r, e, depth);
 }
 
-mpc_parser_t *mpc_check(mpc_parser_t *a, mpc_dtor_t da, mpc_check_t f, const char *e) {
-  mpc_parser_t  *p = mpc_undefined();
-  p->type = MPC_TYPE_CHECK;
-  p->data.check.x = a;
-  p->data.check.dx = da;
-  p->data.check.f = f;
-  p->data.check.e = malloc(strlen(e) + 1);
-  strcpy(p->data.check.e, e);
-  return p;
-}
+static int mpc_parse_node(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
 
-mpc_parser_t *mpc_check_with(mpc_parser_t *a, mpc_dtor_t da, mpc_check_with_t f, void *x, const char *e) {
-  mpc_parser_t  *p = mpc_undefined();
-  p->type = MPC_TYPE_CHECK_WITH;
-  p->data.check_with.x = a;
-  p->data.check_with.dx = da;
-  p->data.check_with.f = f;
-  p->data.check_with.d = x;
-  p->data.check_with.e = malloc(strlen(e) + 1);
-  strcpy(p->data.check_with.e, e);
-  return p;
-}
+  int j = 0, k = 0, unmarked;
+  long pos;
+  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
+  mpc_result_t *results;
+  int results_slots = MPC_PARSE_STACK_MIN;
 
-mpc_parser_t *mpc_checkf(mpc_parser_t *a, mpc_dtor_t da, mpc_check_t f, const char *fmt, ...) {
-  va_list va;
-  char *buffer;
-  mpc_parser_t *p;
+  if (depth == MPC_MAX_RECURSION_DEPTH)
+  {
+    MPC_FAILURE(mpc_err_fail(i, "Maximum recursion depth exceeded!"));
+  }
 
-  va_start(va, fmt);
-  buffer = malloc(2048);
-  vsprintf(buffer, fmt, va);
-  va_end(va);
+  switch (p->type) {
 
-  p = mpc_check(a, da, f, buffer);
-  free(buffer);
+    /* Basic Parsers */
 
-  return p;
-}
+    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
+    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
+    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
+    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_class(i, p->data.string.set, (char**)&r->output));
+    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_class(i, p->data.string.set, (char**)&r->output));
+    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
+    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
+    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
+    case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
+    case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
 
-mpc_parser_t *mpc_check_withf(mpc_parser_t *a, mpc_dtor_t da, mpc_check_with_t f, void *x, const char *fmt, ...) {
-  va_list va;
-  char *buffer;
-  mpc_parser_t *p;
+    /* Other parsers */
 
-  va_start(va, fmt);
-  buffer = malloc(2048);
-  vsprintf(buffer, fmt, va);
-  va_end(va);
+    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
+    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
+    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
+    case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
+    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
+    case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
 
-  p = mpc_check_with(a, da, f, x, buffer);
-  free(buffer);
+    /* Application Parsers */
 
-  return p;
-}
+    case MPC_TYPE_APPLY:
+      pos = i->state.pos;
+      if (mpc_parse_run(i, p->data.apply.x, r, e, depth+1)) {
+        MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output, pos));
+      } else {
+        MPC_FAILURE(r->output);
+      }
 
-mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_PREDICT;
-  p->data.predict.x = a;
-  return p;
-}
+    case MPC_TYPE_APPLY_TO:
+      if (mpc_parse_run(i, p->data.apply_to.x, r, e, depth+1)) {
+        MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
+      } else {
+        MPC_FAILURE(r->error);
+      }
 
-mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_NOT;
-  p->data.not.x = a;
-  p->data.not.dx = da;
-  p->data.not.lf = lf;
-  return p;
-}
+    case MPC_TYPE_CHECK:
+      if (mpc_parse_run(i, p->data.check.x, r, e, depth+1)) {
+        if (p->data.check.f(&r->output)) {
+          MPC_SUCCESS(r->output);
+        } else {
+          mpc_parse_dtor(i, p->data.check.dx, r->output);
+          MPC_FAILURE(mpc_err_fail(i, p->data.check.e));
+        }
+      } else {
+        MPC_FAILURE(r->error);
+      }
 
-mpc_parser_t *mpc_not(mpc_parser_t *a, mpc_dtor_t da) {
-  return mpc_not_lift(a, da, mpcf_ctor_null);
-}
+    case MPC_TYPE_CHECK_WITH:
+      if (mpc_parse_run(i, p->data.check_with.x, r, e, depth+1)) {
+        if (p->data.check_with.f(&r->output, p->data.check_with.d)) {
+          MPC_SUCCESS(r->output);
+        } else {
+          mpc_parse_dtor(i, p->data.check.dx, r->output);
+          MPC_FAILURE(mpc_err_fail(i, p->data.check_with.e));
+        }
+      } else {
+        MPC_FAILURE(r->error);
+      }
 
-mpc_parser_t *mpc_maybe_lift(mpc_parser_t *a, mpc_ctor_t lf) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_MAYBE;
-  p->data.not.x = a;
-  p->data.not.lf = lf;
-  return p;
-}
+    case MPC_TYPE_EXPECT:
+      mpc_input_suppress_enable(i);
+      if (mpc_parse_run(i, p->data.expect.x, r, e, depth+1)) {
+        mpc_input_suppress_disable(i);
+        MPC_SUCCESS(r->output);
+      } else {
+        mpc_input_suppress_disable(i);
+        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
+      }
 
-mpc_parser_t *mpc_maybe(mpc_parser_t *a) {
-  return mpc_maybe_lift(a, mpcf_ctor_null);
-}
+    case MPC_TYPE_MEMO:
+      return mpc_parse_memo(i, p, r, e, depth);
 
-mpc_parser_t *mpc_many(mpc_fold_t f, mpc_parser_t *a) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_MANY;
-  p->data.repeat.x = a;
-  p->data.repeat.f = f;
-  return p;
-}
+    case MPC_TYPE_DFA:
+      return mpc_parse_dfa(i, p, r, e);
 
-mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_MANY1;
-  p->data.repeat.x = a;
-  p->data.repeat.f = f;
-  return p;
-}
+    case MPC_TYPE_CLASS:
+      return mpc_parse_class(i, &p->data.cls, r, e);
 
-mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_COUNT;
-  p->data.repeat.n = n;
-  p->data.repeat.f = f;
-  p->data.repeat.x = a;
-  p->data.repeat.dx = da;
-  return p;
-}
+    case MPC_TYPE_SPAN:
+      return mpc_parse_span(i, &p->data.span, r, e, depth);
 
-mpc_parser_t *mpc_or(int n, ...) {
+    case MPC_TYPE_PREDICT:
+      mpc_input_backtrack_disable(i);
+      if (mpc_parse_run(i, p->data.predict.x, r, e, depth+1)) {
+        mpc_input_backtrack_enable(i);
+        MPC_SUCCESS(r->output);
+      } else {
+        mpc_input_backtrack_enable(i);
+        MPC_FAILURE(r->error);
+      }
 
-  int i;
-  va_list va;
+    case MPC_TYPE_FASTFAIL:
+      return mpc_parse_fastfail(i, p->data.predict.x, r, e, depth);
 
-  mpc_parser_t *p = mpc_undefined();
+    case MPC_TYPE_ARENA:
+      return mpc_parse_arena(i, p->data.predict.x, r, e, depth);
 
-  p->type = MPC_TYPE_OR;
-  p->data.or.n = n;
-  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+    /* Optional Parsers */
 
-  va_start(va, n);
-  for (i = 0; i < n; i++) {
-    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
-  }
-  va_end(va);
+    /* TODO: Update Not Error Message */
 
-  return p;
-}
+    case MPC_TYPE_NOT:
+      mpc_input_mark(i);
+      mpc_input_suppress_enable(i);
+      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
+        mpc_input_rewind(i);
+        mpc_input_suppress_disable(i);
+        mpc_parse_dtor(i, p->data.not.dx, r->output);
+        MPC_FAILURE(mpc_err_new(i, "opposite"));
+      } else {
+        mpc_input_unmark(i);
+        mpc_input_suppress_disable(i);
+        MPC_SUCCESS(p->data.not.lf());
+      }
 
-mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
+    case MPC_TYPE_MAYBE:
+      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
+        MPC_SUCCESS(r->output);
+      } else {
+        *e = mpc_err_merge(i, *e, r->error);
+        MPC_SUCCESS(p->data.not.lf());
+      }
 
-  int i;
-  va_list va;
+    /* Repeat Parsers */
 
-  mpc_parser_t *p = mpc_undefined();
+    case MPC_TYPE_MANY:
 
-  p->type = MPC_TYPE_AND;
-  p->data.and.n = n;
-  p->data.and.f = f;
-  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
-  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+      results = results_stk;
 
-  va_start(va, f);
-  for (i = 0; i < n; i++) {
-    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
-  }
-  for (i = 0; i < (n-1); i++) {
-    p->data.and.dxs[i] = va_arg(va, mpc_dtor_t);
-  }
-  va_end(va);
+      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
+        j++;
+        if (j == MPC_PARSE_STACK_MIN) {
+          results_slots = j + j / 2;
+          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
+          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
+        } else if (j >= results_slots) {
+          results_slots = j + j / 2;
+          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
+        }
+      }
 
-  return p;
-}
+      *e = mpc_err_merge(i, *e, results[j].error);
 
-/*
-** Common Parsers
-*/
+      MPC_SUCCESS(
+        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
+        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
 
-mpc_parser_t *mpc_soi(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_SOI;
-  return mpc_expect(p, "start of input");
-}
+    case MPC_TYPE_MANY1:
 
-mpc_parser_t *mpc_eoi(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_EOI;
-  return mpc_expect(p, "end of input");
-}
+      results = results_stk;
 
-static int mpc_boundary_anchor(char prev, char next) {
-  const char* word = "abcdefghijklmnopqrstuvwxyz"
-                     "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-                     "0123456789_";
-  if ( strchr(word, next) &&  prev == '\0') { return 1; }
-  if ( strchr(word, prev) &&  next == '\0') { return 1; }
-  if ( strchr(word, next) && !strchr(word, prev)) { return 1; }
-  if (!strchr(word, next) &&  strchr(word, prev)) { return 1; }
-  return 0;
-}
+      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
+        j++;
+        if (j == MPC_PARSE_STACK_MIN) {
+          results_slots = j + j / 2;
+          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
+          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
+        } else if (j >= results_slots) {
+          results_slots = j + j / 2;
+          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
+        }
+      }
 
-static int mpc_boundary_newline_anchor(char prev, char next) {
-  (void)next;
-  return prev == '\n';
-}
+      if (j == 0) {
+        MPC_FAILURE(
+          mpc_err_many1(i, results[j].error);
+          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      } else {
 
-mpc_parser_t *mpc_boundary(void) { return mpc_expect(mpc_anchor(mpc_boundary_anchor), "word boundary"); }
-mpc_parser_t *mpc_boundary_newline(void) { return mpc_expect(mpc_anchor(mpc_boundary_newline_anchor), "start of newline"); }
+        *e = mpc_err_merge(i, *e, results[j].error);
 
-mpc_parser_t *mpc_whitespace(void) { return mpc_expect(mpc_oneof(" \f\n\r\t\v"), "whitespace"); }
-mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_many(mpcf_strfold, mpc_whitespace()), "spaces"); }
-mpc_parser_t *mpc_blank(void) { return mpc_expect(mpc_apply(mpc_whitespaces(), mpcf_free), "whitespace"); }
+        MPC_SUCCESS(
+          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
+          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      }
 
-mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline"); }
-mpc_parser_t *mpc_tab(void) { return mpc_expect(mpc_char('\t'), "tab"); }
-mpc_parser_t *mpc_escape(void) { return mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), free); }
+    case MPC_TYPE_COUNT:
 
-mpc_parser_t *mpc_digit(void) { return mpc_expect(mpc_oneof("0123456789"), "digit"); }
-mpc_parser_t *mpc_hexdigit(void) { return mpc_expect(mpc_oneof("0123456789ABCDEFabcdef"), "hex digit"); }
-mpc_parser_t *mpc_octdigit(void) { return mpc_expect(mpc_oneof("01234567"), "oct digit"); }
-mpc_parser_t *mpc_digits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_digit()), "digits"); }
-mpc_parser_t *mpc_hexdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_hexdigit()), "hex digits"); }
-mpc_parser_t *mpc_octdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_octdigit()), "oct digits"); }
+      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
+        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
+        : results_stk;
 
-mpc_parser_t *mpc_lower(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyz"), "lowercase letter"); }
-mpc_parser_t *mpc_upper(void) { return mpc_expect(mpc_oneof("ABCDEFGHIJKLMNOPQRSTUVWXYZ"), "uppercase letter"); }
-mpc_parser_t *mpc_alpha(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"), "letter"); }
-mpc_parser_t *mpc_underscore(void) { return mpc_expect(mpc_char('_'), "underscore"); }
-mpc_parser_t *mpc_alphanum(void) { return mpc_expect(mpc_or(3, mpc_alpha(), mpc_digit(), mpc_underscore()), "alphanumeric"); }
+      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
+        j++;
+        if (j == p->data.repeat.n) { break; }
+      }
 
-mpc_parser_t *mpc_int(void) { return mpc_expect(mpc_apply(mpc_digits(), mpcf_int), "integer"); }
-mpc_parser_t *mpc_hex(void) { return mpc_expect(mpc_apply(mpc_hexdigits(), mpcf_hex), "hexadecimal"); }
-mpc_parser_t *mpc_oct(void) { return mpc_expect(mpc_apply(mpc_octdigits(), mpcf_oct), "octadecimal"); }
-mpc_parser_t *mpc_number(void) { return mpc_expect(mpc_or(3, mpc_int(), mpc_hex(), mpc_oct()), "number"); }
+      if (j == p->data.repeat.n) {
+        MPC_SUCCESS(
+          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
+          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      } else {
+        for (k = 0; k < j; k++) {
+          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
+        }
+        MPC_FAILURE(
+          mpc_err_count(i, results[j].error, p->data.repeat.n);
+          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      }
 
-mpc_parser_t *mpc_real(void) {
+    /* Combinatory Parsers */
 
-  /* [+-]?\d+(\.\d+)?([eE][+-]?[0-9]+)? */
+    case MPC_TYPE_OR:
 
-  mpc_parser_t *p0, *p1, *p2, *p30, *p31, *p32, *p3;
+      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
 
-  p0 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
-  p1 = mpc_digits();
-  p2 = mpc_maybe_lift(mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_digits(), free), mpcf_ctor_str);
-  p30 = mpc_oneof("eE");
-  p31 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
-  p32 = mpc_digits();
-  p3 = mpc_maybe_lift(mpc_and(3, mpcf_strfold, p30, p31, p32, free, free), mpcf_ctor_str);
+      results = p->data.or.n > MPC_PARSE_STACK_MIN
+        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
+        : results_stk;
 
-  return mpc_expect(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, free, free, free), "real");
+      if (p->data.or.first) {
+        j = mpc_parse_or_first(i, p, results, e, depth);
+        if (j >= 0) {
+          MPC_SUCCESS(results[j].output;
+            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        }
+        MPC_FAILURE(NULL;
+          if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      }
 
-}
+      for (j = 0; j < p->data.or.n; j++) {
+        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e, depth+1)) {
+          MPC_SUCCESS(results[j].output;
+            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        } else {
+          *e = mpc_err_merge(i, *e, results[j].error);
+        }
+      }
 
-mpc_parser_t *mpc_float(void) {
-  return mpc_expect(mpc_apply(mpc_real(), mpcf_float), "float");
-}
+      MPC_FAILURE(NULL;
+        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
 
-mpc_parser_t *mpc_char_lit(void) {
-  return mpc_expect(mpc_between(mpc_or(2, mpc_escape(), mpc_any()), free, "'", "'"), "char");
-}
+    case MPC_TYPE_AND:
 
-mpc_parser_t *mpc_string_lit(void) {
-  mpc_parser_t *strchar = mpc_or(2, mpc_escape(), mpc_noneof("\""));
-  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, strchar), free, "\"", "\""), "string");
-}
+      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
 
-mpc_parser_t *mpc_regex_lit(void) {
-  mpc_parser_t *regexchar = mpc_or(2, mpc_escape(), mpc_noneof("/"));
-  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, regexchar), free, "/", "/"), "regex");
-}
+      results = p->data.or.n > MPC_PARSE_STACK_MIN
+        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
+        : results_stk;
+
+      /*
+      ** Nothing reads a pipe once the whole parse has
+      ** failed, so a sequence at the top need not hold
+      ** a mark. Otherwise it would keep all the input
+      ** buffered from the start.
+      */
+      unmarked = depth == 0 && i->type == MPC_INPUT_PIPE;
+
+      if (!unmarked) { mpc_input_mark(i); }
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e, depth+1)) {
+          if (!unmarked) { mpc_input_rewind(i); }
+          for (k = 0; k < j; k++) {
+            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
+          }
+          MPC_FAILURE(results[j].error;
+            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        }
+      }
+      if (!unmarked) { mpc_input_unmark(i); }
+      MPC_SUCCESS(
+        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
+        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+
+    /* End */
+
+    default:
+
+      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+  }
+
+  return 0;
 
-mpc_parser_t *mpc_ident(void) {
-  mpc_parser_t *p0, *p1;
-  p0 = mpc_or(2, mpc_alpha(), mpc_underscore());
-  p1 = mpc_many(mpcf_strfold, mpc_alphanum());
-  return mpc_and(2, mpcf_strfold, p0, p1, free);
 }
 
+#undef MPC_SUCCESS
+#undef MPC_FAILURE
+#undef MPC_PRIMITIVE
+
 /*
-** Useful Parsers
+** Parser Graphs
 */
 
-mpc_parser_t *mpc_startwith(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_soi(), a, mpcf_dtor_null); }
-mpc_parser_t *mpc_endwith(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(2, mpcf_fst, a, mpc_eoi(), da); }
-mpc_parser_t *mpc_whole(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(3, mpcf_snd, mpc_soi(), a, mpc_eoi(), mpcf_dtor_null, da); }
+/*
+** A parser graph is walked by numbering the parsers
+** in the order they are first reached from the root,
+** using a hash table from parser to index so that
+** shared and recursive parsers are only visited once.
+*/
 
-mpc_parser_t *mpc_stripl(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_blank(), a, mpcf_dtor_null); }
-mpc_parser_t *mpc_stripr(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
-mpc_parser_t *mpc_strip(mpc_parser_t *a) { return mpc_and(3, mpcf_snd, mpc_blank(), a, mpc_blank(), mpcf_dtor_null, mpcf_dtor_null); }
-mpc_parser_t *mpc_tok(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
-mpc_parser_t *mpc_sym(const char *s) { return mpc_tok(mpc_string(s)); }
+enum { MPC_LOWER_SLOTS_MIN = 64 };
 
-mpc_parser_t *mpc_total(mpc_parser_t *a, mpc_dtor_t da) { return mpc_whole(mpc_strip(a), da); }
+typedef struct {
+  int nodes_num;
+  int nodes_slots;
+  mpc_parser_t **nodes;
+  int keys_slots;
+  mpc_parser_t **keys;
+  int *vals;
+} mpc_lower_t;
 
-mpc_parser_t *mpc_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
-  return mpc_and(3, mpcf_snd_free,
-    mpc_string(o), a, mpc_string(c),
-    free, ad);
+static unsigned long mpc_lower_hash(mpc_parser_t *p) {
+  unsigned long h = (unsigned long)p;
+  return (h >> 4) * 2654435761UL;
 }
 
-mpc_parser_t *mpc_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "(", ")"); }
-mpc_parser_t *mpc_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "<", ">"); }
-mpc_parser_t *mpc_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_between(a, ad, "{", "}"); }
-mpc_parser_t *mpc_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_between(a, ad, "[", "]"); }
+static void mpc_lower_insert(mpc_lower_t *l, mpc_parser_t *p, int v) {
+  unsigned long h = mpc_lower_hash(p) & (l->keys_slots-1);
+  while (l->keys[h]) { h = (h+1) & (l->keys_slots-1); }
+  l->keys[h] = p;
+  l->vals[h] = v;
+}
 
-mpc_parser_t *mpc_tok_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
-  return mpc_and(3, mpcf_snd_free,
-    mpc_sym(o), mpc_tok(a), mpc_sym(c),
-    free, ad);
+/* Gives the index of a parser, adding it if it is new */
+static int mpc_lower_add(mpc_lower_t *l, mpc_parser_t *p) {
+
+  int k;
+  unsigned long h;
+
+  h = mpc_lower_hash(p) & (l->keys_slots-1);
+  while (l->keys[h]) {
+    if (l->keys[h] == p) { return l->vals[h]; }
+    h = (h+1) & (l->keys_slots-1);
+  }
+
+  if (l->nodes_num == l->nodes_slots) {
+    l->nodes_slots *= 2;
+    l->nodes = realloc(l->nodes, sizeof(mpc_parser_t*) * l->nodes_slots);
+  }
+  l->nodes[l->nodes_num++] = p;
+
+  /* Keep the table at most half full */
+  if (l->nodes_num * 2 > l->keys_slots) {
+    free(l->keys);
+    free(l->vals);
+    l->keys_slots *= 2;
+    l->keys = calloc(l->keys_slots, sizeof(mpc_parser_t*));
+    l->vals = calloc(l->keys_slots, sizeof(int));
+    for (k = 0; k < l->nodes_num; k++) { mpc_lower_insert(l, l->nodes[k], k); }
+  } else {
+    mpc_lower_insert(l, p, l->nodes_num-1);
+  }
+
+  return l->nodes_num-1;
 }
 
-mpc_parser_t *mpc_tok_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "(", ")"); }
-mpc_parser_t *mpc_tok_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "<", ">"); }
-mpc_parser_t *mpc_tok_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_tok_between(a, ad, "{", "}"); }
-mpc_parser_t *mpc_tok_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_tok_between(a, ad, "[", "]"); }
+static void mpc_lower_init(mpc_lower_t *l) {
+  l->nodes_num = 0;
+  l->nodes_slots = MPC_LOWER_SLOTS_MIN;
+  l->nodes = malloc(sizeof(mpc_parser_t*) * l->nodes_slots);
+  l->keys_slots = MPC_LOWER_SLOTS_MIN * 2;
+  l->keys = calloc(l->keys_slots, sizeof(mpc_parser_t*));
+  l->vals = calloc(l->keys_slots, sizeof(int));
+}
 
-/*
-** Regular Expression Parsers
-*/
+static void mpc_lower_free(mpc_lower_t *l) {
+  free(l->nodes);
+  free(l->keys);
+  free(l->vals);
+}
 
-/*
-** So here is a cute bootstrapping.
-**
-** I'm using the previously defined
-** mpc constructs and functions to
-** parse the user regex string and
-** construct a parser from it.
-**
-** As it turns out lots of the standard
-** mpc functions look a lot like `fold`
-** functions and so can be used indirectly
-** by many of the parsing functions to build
-** a parser directly - as we are parsing.
-**
-** This is certainly something that
-** would be less elegant/interesting
-** in a two-phase parser which first
-** builds an AST and then traverses it
-** to generate the object.
-**
-** This whole thing acts as a great
-** case study for how trivial it can be
-** to write a great parser in a few
-** lines of code using mpc.
+/* Numbers every parser reachable from `p` into `l->nodes` */
+static void mpc_lower_reach(mpc_lower_t *l, mpc_parser_t *p) {
+
+  int j, k, n;
+  mpc_parser_t *a, **as;
+
+  mpc_lower_add(l, p);
+
+  for (k = 0; k < l->nodes_num; k++) {
+
+    a = l->nodes[k];
+
+    switch (a->type) {
+      case MPC_TYPE_EXPECT:     mpc_lower_add(l, a->data.expect.x);     break;
+      case MPC_TYPE_APPLY:      mpc_lower_add(l, a->data.apply.x);      break;
+      case MPC_TYPE_APPLY_TO:   mpc_lower_add(l, a->data.apply_to.x);   break;
+      case MPC_TYPE_CHECK:      mpc_lower_add(l, a->data.check.x);      break;
+      case MPC_TYPE_CHECK_WITH: mpc_lower_add(l, a->data.check_with.x); break;
+      case MPC_TYPE_PREDICT:    mpc_lower_add(l, a->data.predict.x);    break;
+      case MPC_TYPE_FASTFAIL:   mpc_lower_add(l, a->data.predict.x);    break;
+      case MPC_TYPE_ARENA:      mpc_lower_add(l, a->data.predict.x);    break;
+      case MPC_TYPE_MEMO:       mpc_lower_add(l, a->data.memo.x);       break;
+
+      case MPC_TYPE_NOT:
+      case MPC_TYPE_MAYBE:
+        mpc_lower_add(l, a->data.not.x);
+        break;
+
+      case MPC_TYPE_MANY:
+      case MPC_TYPE_MANY1:
+      case MPC_TYPE_COUNT:
+        mpc_lower_add(l, a->data.repeat.x);
+        break;
+
+      case MPC_TYPE_OR:
+      case MPC_TYPE_AND:
+        n = a->type == MPC_TYPE_OR ? a->data.or.n : a->data.and.n;
+        as = a->type == MPC_TYPE_OR ? a->data.or.xs : a->data.and.xs;
+        for (j = 0; j < n; j++) { mpc_lower_add(l, as[j]); }
+        break;
+
+      default: break;
+    }
+  }
+}
+
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_err_t *e = NULL, *u;
+  x = mpc_parse_run(i, p, r, &e, 0);
+  if (x) {
+    mpc_err_delete_internal(i, e);
+    r->output = mpc_export(i, r->output);
+  } else {
+    u = mpc_err_fail(i, "Unknown Error");
+    u->state = mpc_state_invalid();
+    e = mpc_err_merge(i, u, e);
+    r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
+  }
+  return x;
+}
+
+int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+/*
+** Parses into an arena like `mpca_arena`, but the
+** contents of the leaves point into `string` when
+** they can rather than being copied. The string
+** must therefore outlive the AST, and `p` must
+** build an `mpc_ast_t`.
 */
 
+int mpc_nparse_slices(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
+  i->ast = mpc_ast_arena_new();
+  i->ast->input = string;
+  i->ast->input_len = length;
+  x = mpc_parse_input(i, p, r);
+  mpc_parse_arena_done(i, x, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_slices(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_nparse_slices(filename, string, strlen(string), p, r);
+}
+
+int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_file(filename, file);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
 /*
+** A context keeps one input around for repeated
+** parses of strings. Its marks, memo table and
+** arena are reset rather than reallocated, and the
+** filename and string are borrowed from the caller
+** for the duration of the parse instead of copied.
+*/
+
+struct mpc_context_t {
+  mpc_input_t *input;
+  char *string;
+  size_t string_slots;
+};
+
+mpc_context_t *mpc_context_new(void) {
+  mpc_context_t *c = malloc(sizeof(mpc_context_t));
+  c->input = mpc_input_new_string("", "");
+  free(c->input->filename);
+  free(c->input->string);
+  c->input->filename = NULL;
+  c->input->string = NULL;
+  c->string = NULL;
+  c->string_slots = 0;
+  return c;
+}
+
+void mpc_context_delete(mpc_context_t *c) {
+  c->input->filename = NULL;
+  c->input->string = NULL;
+  mpc_input_delete(c->input);
+  free(c->string);
+  free(c);
+}
+
+/*
+** Sets how many input positions the packrat memo
+** table keeps and how many entries each of them
+** holds. Values are clamped to a sane range.
+*/
+
+void mpc_context_memo(mpc_context_t *c, int columns, int entries) {
+  mpc_input_memo_delete(c->input);
+  if (columns < 1) { columns = 1; }
+  if (entries < 1) { entries = 1; }
+  if (columns > MPC_INPUT_MEMO_MAX) { columns = MPC_INPUT_MEMO_MAX; }
+  if (entries > MPC_INPUT_MEMO_MAX) { entries = MPC_INPUT_MEMO_MAX; }
+  c->input->memo_columns = columns;
+  c->input->memo_entries = entries;
+}
+
+/*
+** Prints how the last parse through the context
+** used the input's small allocation pool, and how
+** often it had to backtrack.
+*/
+
+void mpc_context_stats(mpc_context_t *c, FILE *f) {
+  fprintf(f, "Pool Hits: %li\n", c->input->mem_hits);
+  fprintf(f, "Pool Fallbacks: %li\n", c->input->mem_fallbacks);
+  fprintf(f, "Backtracks: %li\n", c->input->rewinds);
+}
+
+static void mpc_input_reset(mpc_input_t *i, const char *filename, const char *string) {
+
+  mpc_input_memo_delete(i);
+
+  i->filename = (char*)filename;
+  i->state = mpc_state_new();
+  i->string = (char*)string;
+
+  i->suppress = 0;
+  i->backtrack = 1;
+  i->marks_num = 0;
+  i->last = '\0';
+
+  i->mem_index = 0;
+  i->mem_hits = 0;
+  i->mem_fallbacks = 0;
+  i->rewinds = 0;
+  i->profile_time = 0;
+  i->profile_rewinds = 0;
+  memset(i->mem_free, 0, sizeof(i->mem_free));
+}
+
+int mpc_context_parse(mpc_context_t *c, const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_reset(c->input, filename, string);
+  x = mpc_parse_input(c->input, p, r);
+  c->input->filename = NULL;
+  c->input->string = NULL;
+  return x;
+}
+
+int mpc_context_nparse(mpc_context_t *c, const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+
+  /* The input must be null terminated so is copied, but into a reused buffer */
+  if (length + 1 > c->string_slots) {
+    c->string_slots = length + 1;
+    c->string = realloc(c->string, c->string_slots);
+  }
+
+  memcpy(c->string, string, length);
+  c->string[length] = '\0';
+
+  return mpc_context_parse(c, filename, c->string, p, r);
+}
+
+/*
+** Incremental Reparsing
+*/
+
+/*
+** After an edit only the smallest node built by
+** one of the given rules which strictly contains
+** the edit is parsed again, starting from where
+** it started before. This is only accepted if it
+** ends exactly where the following node now has
+** to start, otherwise the next enclosing rule is
+** tried, and failing all of them the whole input
+** is parsed again. Nodes after the edit are kept
+** and their positions shifted.
 **
-**  ### Regular Expression Grammar
-**
-**      <regex> : <term> | (<term> "|" <regex>)
-**
-**      <term> : <factor>*
-**
-**      <factor> : <base>
-**               | <base> "*"
-**               | <base> "+"
-**               | <base> "?"
-**               | <base> "{" <digits> "}"
-**
-**      <base> : <char>
-**             | "\" <char>
-**             | "(" <regex> ")"
-**             | "[" <range> "]"
+** This gives the same tree as a full parse when
+** the rules are bracketed, such as lists, so that
+** what they match can not depend on the input
+** around them.
 */
 
-static mpc_val_t *mpcf_re_or(int n, mpc_val_t **xs) {
-  (void) n;
-  if (xs[1] == NULL) { return xs[0]; }
-  else { return mpc_or(2, xs[0], xs[1]); }
+typedef struct {
+  const char *filename;
+  const char *string;
+  long length;
+  long pos;
+  long removed;
+  long delta;
+  int rules_num;
+  mpc_parser_t **rules;
+  mpc_context_t *ctx;
+  mpc_ast_t *root;
+} mpc_reparse_t;
+
+/* Returns the rule tagging `t` and the end of its name in the tag */
+static mpc_parser_t *mpc_reparse_rule(mpc_reparse_t *x, mpc_ast_t *t, size_t *offset) {
+
+  int k;
+  size_t l;
+  const char *s, *e;
+
+  for (s = t->tag; ; s = e + 1) {
+    e = strchr(s, '|');
+    l = e ? (size_t)(e - s) : strlen(s);
+    for (k = 0; k < x->rules_num; k++) {
+      if (x->rules[k]->name == NULL) { continue; }
+      if (strlen(x->rules[k]->name) == l && strncmp(x->rules[k]->name, s, l) == 0) {
+        *offset = (size_t)(s - t->tag) + l;
+        return x->rules[k];
+      }
+    }
+    if (e == NULL) { return NULL; }
+  }
 }
 
-static mpc_val_t *mpcf_re_and(int n, mpc_val_t **xs) {
-  int i;
-  mpc_parser_t *p = mpc_lift(mpcf_ctor_str);
-  for (i = 0; i < n; i++) {
-    p = mpc_and(2, mpcf_strfold, p, xs[i], free);
+static void mpc_reparse_shift(mpc_ast_t *t, mpc_ast_t *skip, mpc_state_t q, long delta, long rows, long cols) {
+
+  int j;
+
+  if (t == skip) { return; }
+
+  if (t->state.pos >= q.pos) {
+    if (t->state.row == q.row) { t->state.col += cols; }
+    t->state.row += rows;
+    t->state.pos += delta;
+  }
+
+  for (j = 0; j < t->children_num; j++) {
+    /* Children ending before the edit are left alone */
+    if (j+1 < t->children_num && t->children[j+1]->state.pos <= q.pos) { continue; }
+    mpc_reparse_shift(t->children[j], skip, q, delta, rows, cols);
   }
-  return p;
 }
 
-static mpc_val_t *mpcf_re_repeat(int n, mpc_val_t **xs) {
-  int num;
-  (void) n;
-  if (xs[1] == NULL) { return xs[0]; }
-  switch(((char*)xs[1])[0])
-  {
-    case '*': { free(xs[1]); return mpc_many(mpcf_strfold, xs[0]); }; break;
-    case '+': { free(xs[1]); return mpc_many1(mpcf_strfold, xs[0]); }; break;
-    case '?': { free(xs[1]); return mpc_maybe_lift(xs[0], mpcf_ctor_str); }; break;
-    default:
-      num = *(int*)xs[1];
-      free(xs[1]);
+static int mpc_reparse_try(mpc_reparse_t *x, mpc_ast_t *parent, int index, mpc_ast_t *t, mpc_state_t *next) {
+
+  size_t offset, l;
+  long end = (next ? next->pos : x->length - x->delta);
+  char *prefix;
+  mpc_ast_t *b;
+  mpc_state_t q;
+  mpc_result_t r;
+  mpc_input_t *i = x->ctx->input;
+  mpc_parser_t *p = mpc_reparse_rule(x, t, &offset);
+
+  if (p == NULL || t->state.pos >= x->pos || x->pos + x->removed >= end) { return 0; }
+
+  mpc_input_reset(i, x->filename, x->string);
+  i->state = t->state;
+  i->last = t->state.pos > 0 ? x->string[t->state.pos-1] : '\0';
+
+  if (!mpc_parse_input(i, p, &r)) {
+    mpc_err_delete(r.error);
+    return 0;
   }
 
-  return mpc_count(num, mpcf_strfold, xs[0], free);
+  if (i->state.pos != end + x->delta) {
+    mpc_ast_delete(r.output);
+    return 0;
+  }
+
+  /* Restore the tags added above the rule, and its name if it was added where used */
+  b = r.output;
+  l = strlen(p->name);
+  if (strncmp(b->tag, p->name, l) == 0 && (b->tag[l] == '|' || b->tag[l] == '\0')) {
+    offset = offset > l ? offset - l - 1 : 0;
+  }
+
+  if (offset > 0) {
+    prefix = malloc(offset + 1);
+    memcpy(prefix, t->tag, offset);
+    prefix[offset] = '\0';
+    mpc_ast_add_tag(b, prefix);
+    free(prefix);
+  }
+
+  if (next) {
+    q = *next;
+    mpc_reparse_shift(x->root, t, q, x->delta, i->state.row - q.row, i->state.col - q.col);
+  }
+
+  if (parent) {
+    parent->children[index] = b;
+    if (parent->arena && b->arena != parent->arena) { parent->arena->mixed = 1; }
+  } else {
+    x->root = b;
+  }
+
+  mpc_ast_delete(t);
+  return 1;
 }
 
-static mpc_parser_t *mpc_re_escape_char(char c) {
-  switch (c) {
-    case 'a': return mpc_char('\a');
-    case 'f': return mpc_char('\f');
-    case 'n': return mpc_char('\n');
-    case 'r': return mpc_char('\r');
-    case 't': return mpc_char('\t');
-    case 'v': return mpc_char('\v');
-    case 'b': return mpc_and(2, mpcf_snd, mpc_boundary(), mpc_lift(mpcf_ctor_str), free);
-    case 'B': return mpc_not_lift(mpc_boundary(), free, mpcf_ctor_str);
-    case 'A': return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
-    case 'Z': return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free);
-    case 'd': return mpc_digit();
-    case 'D': return mpc_not_lift(mpc_digit(), free, mpcf_ctor_str);
-    case 's': return mpc_whitespace();
-    case 'S': return mpc_not_lift(mpc_whitespace(), free, mpcf_ctor_str);
-    case 'w': return mpc_alphanum();
-    case 'W': return mpc_not_lift(mpc_alphanum(), free, mpcf_ctor_str);
-    default: return NULL;
+static int mpc_reparse_node(mpc_reparse_t *x, mpc_ast_t *parent, int index, mpc_ast_t *t, mpc_state_t *next) {
+
+  int j;
+  mpc_state_t *n;
+
+  for (j = 0; j < t->children_num; j++) {
+    n = j+1 < t->children_num ? &t->children[j+1]->state : next;
+    if (t->children[j]->state.pos < x->pos
+    &&  x->pos + x->removed < (n ? n->pos : x->length - x->delta)) {
+      if (mpc_reparse_node(x, t, j, t->children[j], n)) { return 1; }
+      break;
+    }
+  }
+
+  return mpc_reparse_try(x, parent, index, t, next);
+}
+
+int mpc_ast_reparse(const char *filename, const char *string, long pos, long removed, long added,
+  mpc_ast_t *a, mpc_parser_t *p, mpc_result_t *r, int n, ...) {
+
+  int j, ok;
+  va_list va;
+  mpc_reparse_t x;
+
+  x.filename = filename;
+  x.string = string;
+  x.length = (long)strlen(string);
+  x.pos = pos;
+  x.removed = removed;
+  x.delta = added - removed;
+  x.rules_num = n;
+  x.rules = malloc(sizeof(mpc_parser_t*) * n);
+  x.ctx = mpc_context_new();
+  x.root = a;
+
+  va_start(va, n);
+  for (j = 0; j < n; j++) { x.rules[j] = va_arg(va, mpc_parser_t*); }
+  va_end(va);
+
+  ok = a ? mpc_reparse_node(&x, NULL, 0, a, NULL) : 0;
+
+  if (ok) {
+    r->output = x.root;
+  } else {
+    mpc_ast_delete(a);
+    ok = mpc_context_parse(x.ctx, filename, string, p, r);
   }
+
+  mpc_context_delete(x.ctx);
+  free(x.rules);
+  return ok;
 }
 
-static mpc_val_t *mpcf_re_escape(mpc_val_t *x, void* data) {
+int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+
+  FILE *f = fopen(filename, "rb");
+  int res;
+
+  if (f == NULL) {
+    r->output = NULL;
+    r->error = mpc_err_file(filename, "Unable to open file!");
+    return 0;
+  }
+
+  res = mpc_parse_file(filename, f, p, r);
+  fclose(f);
+  return res;
+}
+
+/*
+** Runs `f` for each of `n` jobs on a pool of
+** threads, handing out the jobs in order. The
+** calling thread works through the jobs too, so if
+** no threads can be started they are all run one
+** after another. Returns 1 if every job returned 1.
+*/
+
+typedef struct {
+  int (*f)(void *data, int k);
+  void *data;
+  int n, next, ok;
+#ifndef MPC_NO_THREADS
+  pthread_mutex_t lock;
+#endif
+} mpc_pool_t;
+
+static int mpc_pool_next(mpc_pool_t *m, int ok) {
+  int k;
+#ifndef MPC_NO_THREADS
+  pthread_mutex_lock(&m->lock);
+#endif
+  m->ok = m->ok && ok;
+  k = m->next < m->n ? m->next++ : -1;
+#ifndef MPC_NO_THREADS
+  pthread_mutex_unlock(&m->lock);
+#endif
+  return k;
+}
+
+static void *mpc_pool_worker(void *data) {
+  mpc_pool_t *m = data;
+  int k = mpc_pool_next(m, 1);
+  while (k >= 0) { k = mpc_pool_next(m, m->f(m->data, k)); }
+  return NULL;
+}
+
+static int mpc_pool_run(int n, int threads, int (*f)(void *data, int k), void *data) {
+
+  mpc_pool_t m;
+#ifndef MPC_NO_THREADS
+  int j, started = 0;
+  pthread_t *ts;
+#endif
+
+  m.f = f;
+  m.data = data;
+  m.n = n;
+  m.next = 0;
+  m.ok = 1;
+
+#ifndef MPC_NO_THREADS
+  if (threads > n) { threads = n; }
+  if (threads < 1) { threads = 1; }
+
+  pthread_mutex_init(&m.lock, NULL);
+  ts = malloc(sizeof(pthread_t) * threads);
+  for (j = 0; j < threads-1; j++) {
+    if (pthread_create(&ts[started], NULL, mpc_pool_worker, &m) == 0) { started++; }
+  }
+
+  mpc_pool_worker(&m);
+
+  for (j = 0; j < started; j++) { pthread_join(ts[j], NULL); }
+  free(ts);
+  pthread_mutex_destroy(&m.lock);
+#else
+  (void)threads;
+  mpc_pool_worker(&m);
+#endif
+
+  return m.ok;
+}
+
+/*
+** `mpc_parse_many` parses each of the files on a
+** pool of threads, putting the results in the same
+** order as the filenames. Returns 1 if every file
+** parsed.
+**
+** Parsers do not change as they parse, so the same
+** parser can be used from many threads at once, as
+** long as it is not being profiled, since the
+** counters are shared.
+*/
+
+typedef struct {
+  const char **filenames;
+  mpc_parser_t *p;
+  mpc_result_t *rs;
+} mpc_many_t;
+
+static int mpc_many_job(void *data, int k) {
+  mpc_many_t *m = data;
+  return mpc_parse_contents(m->filenames[k], m->p, &m->rs[k]);
+}
+
+int mpc_parse_many(const char **filenames, int n, mpc_parser_t *p, mpc_result_t *rs, int threads) {
+  mpc_many_t m;
+  m.filenames = filenames;
+  m.p = p;
+  m.rs = rs;
+  return mpc_pool_run(n, threads, mpc_many_job, &m);
+}
+
+/*
+** `mpc_parse_chunked` parses a large input made up
+** of top level forms, such as a file of Lisp data,
+** on a pool of threads. The parser `p` must have the
+** shape `/^/ <form>* /$/` in the default whitespace
+** mode of `mpca_lang`, and `form` must be the rule
+** it refers to.
+**
+** Where one form ends and the next begins depends
+** on the language, so the input is first given to
+** `split`. It picks at most `n` places between top
+** level forms, each at least `size` bytes after the
+** one before, and writes them in order to `places`.
+** It returns how many it picked, or -1 if the input
+** can not be split, for example if its brackets do
+** not match. The chunks between the places are then
+** parsed as `<form>*` in parallel, and their forms
+** moved into one AST with their states offset to
+** where the chunk began, giving the same AST as `p`
+** does. If the places are out of order or any chunk
+** fails, the whole input is parsed again with `p` so
+** that the error is exactly the one it gives.
+*/
+
+enum {
+  MPC_CHUNK_MIN = 16384,
+  MPC_CHUNK_PER_THREAD = 4
+};
+
+typedef struct {
+  int n;
+  mpc_val_t **xs;
+} mpc_chunk_forms_t;
+
+typedef struct {
+  const char *filename;
+  const char *string;
+  long *starts;
+  mpc_state_t *states;
+  mpc_parser_t *c;
+  mpc_result_t *rs;
+  int *oks;
+} mpc_chunk_t;
+
+/*
+** Turns the places picked by `split` into the start
+** of each chunk and its state. Returns the number of
+** chunks, or zero if the places can not be used. The
+** places must all lie strictly inside the string and
+** increase, which is checked before any are scanned.
+*/
+
+static int mpc_chunk_starts(const char *string, long length, int m, long *starts, mpc_state_t *states) {
+
+  int k;
+  long j = 0, row = 0, line = 0;
+  const char *nl;
+
+  if (m < 0) { return 0; }
+
+  starts[0] = 0;
+  starts[m+1] = length;
+
+  for (k = 1; k <= m + 1; k++) {
+    if (starts[k] <= starts[k-1]) { return 0; }
+  }
+
+  for (k = 0; k <= m + 1; k++) {
+    while ((nl = memchr(string + j, '\n', starts[k] - j)) != NULL) {
+      row++;
+      j = line = (long)(nl - string) + 1;
+    }
+    j = starts[k];
+    states[k] = mpc_state_new();
+    states[k].pos = j;
+    states[k].row = row;
+    states[k].col = j - line;
+  }
+
+  return m + 1;
+}
+
+static mpc_val_t *mpc_chunk_fold(int n, mpc_val_t **xs) {
+  mpc_chunk_forms_t *f = malloc(sizeof(mpc_chunk_forms_t));
+  f->n = n;
+  f->xs = malloc(sizeof(mpc_val_t*) * (n > 0 ? n : 1));
+  memcpy(f->xs, xs, sizeof(mpc_val_t*) * n);
+  return f;
+}
+
+static void mpc_chunk_forms_delete(mpc_chunk_forms_t *f) {
+  int j;
+  for (j = 0; j < f->n; j++) { mpc_ast_delete(f->xs[j]); }
+  free(f->xs);
+  free(f);
+}
+
+static void mpc_chunk_offset(mpc_ast_t *a, mpc_state_t s) {
+  int j;
+  if (a->state.row == 0) { a->state.col += s.col; }
+  a->state.pos += s.pos;
+  a->state.row += s.row;
+  for (j = 0; j < a->children_num; j++) { mpc_chunk_offset(a->children[j], s); }
+}
+
+static int mpc_chunk_job(void *data, int k) {
+  mpc_chunk_t *c = data;
+  c->oks[k] = mpc_nparse(c->filename, c->string + c->starts[k],
+    c->starts[k+1] - c->starts[k], c->c, &c->rs[k]);
+  return c->oks[k];
+}
+
+static mpc_ast_t *mpc_chunk_regex(mpc_state_t s) {
+  return mpc_ast_state(mpc_ast_new("regex", ""), s);
+}
+
+int mpc_parse_chunked(const char *filename, const char *string, mpc_parser_t *p, mpc_parser_t *form,
+  mpc_split_t split, void *data, int threads, mpc_result_t *r) {
+
+  int j, k, n, m = 0, ok;
+  long length = (long)strlen(string);
+  mpc_chunk_t c;
+  mpc_chunk_forms_t *f;
+  mpc_val_t **forms, *xs[3];
+
+  n = threads * MPC_CHUNK_PER_THREAD;
+  if (threads < 2 || length < 2 * MPC_CHUNK_MIN) {
+    return mpc_parse(filename, string, p, r);
+  }
+
+  c.filename = filename;
+  c.string = string;
+  c.starts = malloc(sizeof(long) * (n+1));
+  c.states = malloc(sizeof(mpc_state_t) * (n+1));
+  c.rs = calloc(n, sizeof(mpc_result_t));
+  c.oks = calloc(n, sizeof(int));
+
+  m = split(string, length, length / n > MPC_CHUNK_MIN ? length / n : MPC_CHUNK_MIN,
+    n-1, c.starts + 1, data);
+  n = mpc_chunk_starts(string, length, m < n ? m : -1, c.starts, c.states);
+  m = 0;
+
+  c.c = mpc_and(3, mpcf_snd_free,
+    mpc_whitespaces(),
+    mpc_many(mpc_chunk_fold, form->name
+      ? mpca_state(mpca_root(mpca_add_tag(form, form->name)))
+      : mpca_state(mpca_root(form))),
+    mpc_eoi(),
+    free, (mpc_dtor_t)mpc_chunk_forms_delete);
+
+  ok = n > 0 && mpc_pool_run(n, threads, mpc_chunk_job, &c);
+
+  /* Put the forms together as `<form>*` would */
+  if (ok) {
+    for (k = 0; k < n; k++) { m += ((mpc_chunk_forms_t*)c.rs[k].output)->n; }
+    forms = malloc(sizeof(mpc_val_t*) * (m > 0 ? m : 1));
+    m = 0;
+    for (k = 0; k < n; k++) {
+      f = c.rs[k].output;
+      for (j = 0; j < f->n; j++) {
+        mpc_chunk_offset(f->xs[j], c.states[k]);
+        forms[m++] = f->xs[j];
+      }
+      free(f->xs);
+      free(f);
+    }
+    xs[0] = mpc_chunk_regex(c.states[0]);
+    xs[1] = mpcf_fold_ast(m, forms);
+    xs[2] = mpc_chunk_regex(c.states[n]);
+    r->output = mpcf_fold_ast(3, xs);
+    free(forms);
+  } else {
+    for (k = 0; k < n; k++) {
+      if (c.oks[k]) { mpc_chunk_forms_delete(c.rs[k].output); }
+      else if (c.rs[k].error) { mpc_err_delete(c.rs[k].error); }
+    }
+  }
+
+  mpc_delete(c.c);
+  free(c.starts);
+  free(c.states);
+  free(c.rs);
+  free(c.oks);
+
+  return ok ? 1 : mpc_parse(filename, string, p, r);
+}
+
+/*
+** Building a Parser
+*/
+
+static void mpc_undefine_unretained(mpc_parser_t *p, int force);
+
+static void mpc_undefine_or(mpc_parser_t *p) {
+
+  int i;
+  for (i = 0; i < p->data.or.n; i++) {
+    mpc_undefine_unretained(p->data.or.xs[i], 0);
+  }
+  free(p->data.or.xs);
+  free(p->data.or.first);
+
+}
+
+static void mpc_undefine_and(mpc_parser_t *p) {
+
+  int i;
+  for (i = 0; i < p->data.and.n; i++) {
+    mpc_undefine_unretained(p->data.and.xs[i], 0);
+  }
+  free(p->data.and.xs);
+  free(p->data.and.dxs);
+
+}
+
+static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
+
+  int j;
+
+  if (p->retained && !force) { return; }
+
+  switch (p->type) {
+
+    case MPC_TYPE_FAIL: free(p->data.fail.m); break;
+
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      free(p->data.string.x);
+      free(p->data.string.set);
+      break;
+
+    case MPC_TYPE_CLASS:
+      for (j = 0; j < p->data.cls.n; j++) { free(p->data.cls.ms[j]); }
+      free(p->data.cls.ms);
+      free(p->data.cls.set);
+      break;
+
+    case MPC_TYPE_SPAN:
+      mpc_undefine_unretained(p->data.span.x, 0);
+      free(p->data.span.set);
+      break;
+
+    case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
+    case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
+    case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_FASTFAIL: mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_ARENA:    mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_MEMO:     mpc_undefine_unretained(p->data.memo.x, 0);     break;
+
+    case MPC_TYPE_DFA:
+      mpc_undefine_unretained(p->data.dfa.x, 0);
+      mpc_dfa_delete(p->data.dfa.dfa);
+      break;
+
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:
+      mpc_undefine_unretained(p->data.not.x, 0);
+      break;
+
+    case MPC_TYPE_EXPECT:
+      mpc_undefine_unretained(p->data.expect.x, 0);
+      free(p->data.expect.m);
+      break;
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_undefine_unretained(p->data.repeat.x, 0);
+      break;
+
+    case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
+    case MPC_TYPE_AND: mpc_undefine_and(p); break;
+
+    case MPC_TYPE_CHECK:
+      mpc_undefine_unretained(p->data.check.x, 0);
+      free(p->data.check.e);
+      break;
+
+    case MPC_TYPE_CHECK_WITH:
+      mpc_undefine_unretained(p->data.check_with.x, 0);
+      free(p->data.check_with.e);
+      break;
+
+    default: break;
+  }
+
+  if (!force) {
+    free(p->name);
+    free(p);
+  }
+
+}
+
+void mpc_delete(mpc_parser_t *p) {
+  if (p->retained) {
+
+    if (p->type != MPC_TYPE_UNDEFINED) {
+      mpc_undefine_unretained(p, 0);
+    }
+
+    free(p->profile);
+    free(p->name);
+    free(p);
+
+  } else {
+    mpc_undefine_unretained(p, 0);
+  }
+}
+
+static void mpc_soft_delete(mpc_val_t *x) {
+  mpc_undefine_unretained(x, 0);
+}
+
+static mpc_parser_t *mpc_undefined(void) {
+  mpc_parser_t *p = calloc(1, sizeof(mpc_parser_t));
+  p->retained = 0;
+  p->type = MPC_TYPE_UNDEFINED;
+  p->name = NULL;
+  return p;
+}
+
+mpc_parser_t *mpc_new(const char *name) {
+  mpc_parser_t *p = mpc_undefined();
+  p->retained = 1;
+  p->name = realloc(p->name, strlen(name) + 1);
+  strcpy(p->name, name);
+  return p;
+}
+
+mpc_parser_t *mpc_copy(mpc_parser_t *a) {
+  int i = 0;
+  mpc_parser_t *p;
+
+  if (a->retained) { return a; }
+
+  p = mpc_undefined();
+  p->retained = a->retained;
+  p->type = a->type;
+  p->data = a->data;
+
+  if (a->name) {
+    p->name = malloc(strlen(a->name)+1);
+    strcpy(p->name, a->name);
+  }
+
+  switch (a->type) {
+
+    case MPC_TYPE_FAIL:
+      p->data.fail.m = malloc(strlen(a->data.fail.m)+1);
+      strcpy(p->data.fail.m, a->data.fail.m);
+    break;
+
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      p->data.string.x = malloc(strlen(a->data.string.x)+1);
+      strcpy(p->data.string.x, a->data.string.x);
+      if (a->data.string.set) {
+        p->data.string.set = malloc(MPC_FIRST_BYTES);
+        memcpy(p->data.string.set, a->data.string.set, MPC_FIRST_BYTES);
+      }
+      break;
+
+    case MPC_TYPE_CLASS:
+      p->data.cls.set = malloc(MPC_FIRST_BYTES);
+      memcpy(p->data.cls.set, a->data.cls.set, MPC_FIRST_BYTES);
+      p->data.cls.ms = malloc(sizeof(char*) * a->data.cls.n);
+      for (i = 0; i < a->data.cls.n; i++) {
+        p->data.cls.ms[i] = malloc(strlen(a->data.cls.ms[i])+1);
+        strcpy(p->data.cls.ms[i], a->data.cls.ms[i]);
+      }
+      break;
+
+    case MPC_TYPE_SPAN:
+      p->data.span.x = mpc_copy(a->data.span.x);
+      p->data.span.set = malloc(MPC_FIRST_BYTES);
+      memcpy(p->data.span.set, a->data.span.set, MPC_FIRST_BYTES);
+      break;
+
+    case MPC_TYPE_APPLY:    p->data.apply.x    = mpc_copy(a->data.apply.x);    break;
+    case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_copy(a->data.apply_to.x); break;
+    case MPC_TYPE_PREDICT:  p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
+    case MPC_TYPE_FASTFAIL: p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
+    case MPC_TYPE_ARENA:    p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
+    case MPC_TYPE_MEMO:     p->data.memo.x     = mpc_copy(a->data.memo.x);     break;
+
+    case MPC_TYPE_DFA:
+      p->data.dfa.x = mpc_copy(a->data.dfa.x);
+      p->data.dfa.dfa = mpc_dfa_new(p->data.dfa.x);
+      break;
+
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:
+      p->data.not.x = mpc_copy(a->data.not.x);
+      break;
+
+    case MPC_TYPE_EXPECT:
+      p->data.expect.x = mpc_copy(a->data.expect.x);
+      p->data.expect.m = malloc(strlen(a->data.expect.m)+1);
+      strcpy(p->data.expect.m, a->data.expect.m);
+      break;
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      p->data.repeat.x = mpc_copy(a->data.repeat.x);
+      break;
+
+    case MPC_TYPE_OR:
+      p->data.or.xs = malloc(a->data.or.n * sizeof(mpc_parser_t*));
+      for (i = 0; i < a->data.or.n; i++) {
+        p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
+      }
+      if (a->data.or.first) {
+        p->data.or.first = malloc(a->data.or.n * MPC_FIRST_BYTES);
+        memcpy(p->data.or.first, a->data.or.first, a->data.or.n * MPC_FIRST_BYTES);
+      }
+    break;
+    case MPC_TYPE_AND:
+      p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
+      for (i = 0; i < a->data.and.n; i++) {
+        p->data.and.xs[i] = mpc_copy(a->data.and.xs[i]);
+      }
+      p->data.and.dxs = malloc((a->data.and.n-1) * sizeof(mpc_dtor_t));
+      for (i = 0; i < a->data.and.n-1; i++) {
+        p->data.and.dxs[i] = a->data.and.dxs[i];
+      }
+    break;
+
+    case MPC_TYPE_CHECK:
+      p->data.check.x      = mpc_copy(a->data.check.x);
+      p->data.check.e      = malloc(strlen(a->data.check.e)+1);
+      strcpy(p->data.check.e, a->data.check.e);
+      break;
+    case MPC_TYPE_CHECK_WITH:
+      p->data.check_with.x = mpc_copy(a->data.check_with.x);
+      p->data.check_with.e = malloc(strlen(a->data.check_with.e)+1);
+      strcpy(p->data.check_with.e, a->data.check_with.e);
+      break;
+
+    default: break;
+  }
+
+
+  return p;
+}
+
+mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
+  mpc_undefine_unretained(p, 1);
+  p->type = MPC_TYPE_UNDEFINED;
+  return p;
+}
+
+mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
+
+  if (p->retained) {
+    p->type = a->type;
+    p->data = a->data;
+  } else {
+    mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
+    p->type = a2->type;
+    p->data = a2->data;
+    free(a2);
+  }
+
+  free(a);
+  return p;
+}
+
+void mpc_cleanup(int n, ...) {
+  int i;
+  mpc_parser_t **list = malloc(sizeof(mpc_parser_t*) * n);
+
+  va_list va;
+  va_start(va, n);
+  for (i = 0; i < n; i++) { list[i] = va_arg(va, mpc_parser_t*); }
+  for (i = 0; i < n; i++) { mpc_undefine(list[i]); }
+  for (i = 0; i < n; i++) { mpc_delete(list[i]); }
+  va_end(va);
+
+  free(list);
+}
+
+mpc_parser_t *mpc_pass(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_PASS;
+  return p;
+}
+
+mpc_parser_t *mpc_fail(const char *m) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_FAIL;
+  p->data.fail.m = malloc(strlen(m) + 1);
+  strcpy(p->data.fail.m, m);
+  return p;
+}
+
+/*
+** As `snprintf` is not ANSI standard this
+** function `mpc_failf` should be considered
+** unsafe.
+**
+** You have a few options if this is going to be
+** trouble.
+**
+** - Ensure the format string does not exceed
+**   the buffer length using precision specifiers
+**   such as `%.512s`.
+**
+** - Patch this function in your code base to
+**   use `snprintf` or whatever variant your
+**   system supports.
+**
+** - Avoid it altogether.
+**
+*/
+
+mpc_parser_t *mpc_failf(const char *fmt, ...) {
+
+  va_list va;
+  char *buffer;
+
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_FAIL;
+
+  va_start(va, fmt);
+  buffer = malloc(2048);
+  vsprintf(buffer, fmt, va);
+  va_end(va);
+
+  buffer = realloc(buffer, strlen(buffer) + 1);
+  p->data.fail.m = buffer;
+  return p;
+
+}
+
+mpc_parser_t *mpc_lift_val(mpc_val_t *x) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_LIFT_VAL;
+  p->data.lift.x = x;
+  return p;
+}
+
+mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_LIFT;
+  p->data.lift.lf = lf;
+  return p;
+}
+
+mpc_parser_t *mpc_anchor(int(*f)(char,char)) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_ANCHOR;
+  p->data.anchor.f = f;
+  return mpc_expect(p, "anchor");
+}
+
+mpc_parser_t *mpc_state(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_STATE;
+  return p;
+}
+
+mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_EXPECT;
+  p->data.expect.x = a;
+  p->data.expect.m = malloc(strlen(expected) + 1);
+  strcpy(p->data.expect.m, expected);
+  return p;
+}
+
+/*
+** As `snprintf` is not ANSI standard this
+** function `mpc_expectf` should be considered
+** unsafe.
+**
+** You have a few options if this is going to be
+** trouble.
+**
+** - Ensure the format string does not exceed
+**   the buffer length using precision specifiers
+**   such as `%.512s`.
+**
+** - Patch this function in your code base to
+**   use `snprintf` or whatever variant your
+**   system supports.
+**
+** - Avoid it altogether.
+**
+*/
+
+mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
+  va_list va;
+  char *buffer;
+
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_EXPECT;
+
+  va_start(va, fmt);
+  buffer = malloc(2048);
+  vsprintf(buffer, fmt, va);
+  va_end(va);
+
+  buffer = realloc(buffer, strlen(buffer) + 1);
+  p->data.expect.x = a;
+  p->data.expect.m = buffer;
+  return p;
+}
+
+/*
+** Basic Parsers
+*/
+
+mpc_parser_t *mpc_any(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_ANY;
+  return mpc_expect(p, "any character");
+}
+
+mpc_parser_t *mpc_char(char c) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_SINGLE;
+  p->data.single.x = c;
+  return mpc_expectf(p, "'%c'", c);
+}
+
+mpc_parser_t *mpc_range(char s, char e) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_RANGE;
+  p->data.range.x = s;
+  p->data.range.y = e;
+  return mpc_expectf(p, "character between '%c' and '%c'", s, e);
+}
+
+/* The terminating null counts as part of the string, as with `strchr` */
+static unsigned char *mpc_class_new(const char *s, int invert) {
+  int j;
+  unsigned char *set = calloc(1, MPC_FIRST_BYTES);
+  for (; *s; s++) { mpc_first_add(set, *s); }
+  mpc_first_add(set, '\0');
+  for (j = 0; invert && j < MPC_FIRST_BYTES; j++) { set[j] = (unsigned char)~set[j]; }
+  return set;
+}
+
+mpc_parser_t *mpc_oneof(const char *s) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_ONEOF;
+  p->data.string.x = malloc(strlen(s) + 1);
+  strcpy(p->data.string.x, s);
+  p->data.string.set = mpc_class_new(s, 0);
+  return mpc_expectf(p, "one of '%s'", s);
+}
+
+mpc_parser_t *mpc_noneof(const char *s) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_NONEOF;
+  p->data.string.x = malloc(strlen(s) + 1);
+  strcpy(p->data.string.x, s);
+  p->data.string.set = mpc_class_new(s, 1);
+  return mpc_expectf(p, "none of '%s'", s);
+
+}
+
+mpc_parser_t *mpc_satisfy(int(*f)(char)) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_SATISFY;
+  p->data.satisfy.f = f;
+  return mpc_expectf(p, "character satisfying function %p", f);
+}
+
+mpc_parser_t *mpc_string(const char *s) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_STRING;
+  p->data.string.x = malloc(strlen(s) + 1);
+  strcpy(p->data.string.x, s);
+  return mpc_expectf(p, "\"%s\"", s);
+}
+
+/*
+** Core Parsers
+*/
+
+mpc_parser_t *mpc_apply(mpc_parser_t *a, mpc_apply_t f) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_APPLY;
+  p->data.apply.x = a;
+  p->data.apply.f = f;
+  return p;
+}
+
+mpc_parser_t *mpc_apply_to(mpc_parser_t *a, mpc_apply_to_t f, void *x) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_APPLY_TO;
+  p->data.apply_to.x = a;
+  p->data.apply_to.f = f;
+  p->data.apply_to.d = x;
+  return p;
+}
+
+mpc_parser_t *mpc_check(mpc_parser_t *a, mpc_dtor_t da, mpc_check_t f, const char *e) {
+  mpc_parser_t  *p = mpc_undefined();
+  p->type = MPC_TYPE_CHECK;
+  p->data.check.x = a;
+  p->data.check.dx = da;
+  p->data.check.f = f;
+  p->data.check.e = malloc(strlen(e) + 1);
+  strcpy(p->data.check.e, e);
+  return p;
+}
+
+mpc_parser_t *mpc_check_with(mpc_parser_t *a, mpc_dtor_t da, mpc_check_with_t f, void *x, const char *e) {
+  mpc_parser_t  *p = mpc_undefined();
+  p->type = MPC_TYPE_CHECK_WITH;
+  p->data.check_with.x = a;
+  p->data.check_with.dx = da;
+  p->data.check_with.f = f;
+  p->data.check_with.d = x;
+  p->data.check_with.e = malloc(strlen(e) + 1);
+  strcpy(p->data.check_with.e, e);
+  return p;
+}
+
+mpc_parser_t *mpc_checkf(mpc_parser_t *a, mpc_dtor_t da, mpc_check_t f, const char *fmt, ...) {
+  va_list va;
+  char *buffer;
+  mpc_parser_t *p;
+
+  va_start(va, fmt);
+  buffer = malloc(2048);
+  vsprintf(buffer, fmt, va);
+  va_end(va);
+
+  p = mpc_check(a, da, f, buffer);
+  free(buffer);
+
+  return p;
+}
+
+mpc_parser_t *mpc_check_withf(mpc_parser_t *a, mpc_dtor_t da, mpc_check_with_t f, void *x, const char *fmt, ...) {
+  va_list va;
+  char *buffer;
+  mpc_parser_t *p;
+
+  va_start(va, fmt);
+  buffer = malloc(2048);
+  vsprintf(buffer, fmt, va);
+  va_end(va);
+
+  p = mpc_check_with(a, da, f, x, buffer);
+  free(buffer);
+
+  return p;
+}
+
+mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_PREDICT;
+  p->data.predict.x = a;
+  return p;
+}
+
+mpc_parser_t *mpc_fastfail(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_FASTFAIL;
+  p->data.predict.x = a;
+  return p;
+}
+
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_apply_t cp, mpc_dtor_t da) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MEMO;
+  p->data.memo.x = a;
+  p->data.memo.cp = cp;
+  p->data.memo.dx = da;
+  return p;
+}
+
+mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_NOT;
+  p->data.not.x = a;
+  p->data.not.dx = da;
+  p->data.not.lf = lf;
+  return p;
+}
+
+mpc_parser_t *mpc_not(mpc_parser_t *a, mpc_dtor_t da) {
+  return mpc_not_lift(a, da, mpcf_ctor_null);
+}
+
+mpc_parser_t *mpc_maybe_lift(mpc_parser_t *a, mpc_ctor_t lf) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MAYBE;
+  p->data.not.x = a;
+  p->data.not.lf = lf;
+  return p;
+}
+
+mpc_parser_t *mpc_maybe(mpc_parser_t *a) {
+  return mpc_maybe_lift(a, mpcf_ctor_null);
+}
+
+mpc_parser_t *mpc_many(mpc_fold_t f, mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MANY;
+  p->data.repeat.x = a;
+  p->data.repeat.f = f;
+  return p;
+}
+
+mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MANY1;
+  p->data.repeat.x = a;
+  p->data.repeat.f = f;
+  return p;
+}
+
+mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_COUNT;
+  p->data.repeat.n = n;
+  p->data.repeat.f = f;
+  p->data.repeat.x = a;
+  p->data.repeat.dx = da;
+  return p;
+}
+
+mpc_parser_t *mpc_or(int n, ...) {
+
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+
+  p->type = MPC_TYPE_OR;
+  p->data.or.n = n;
+  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+
+  va_start(va, n);
+  for (i = 0; i < n; i++) {
+    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  va_end(va);
+
+  return p;
+}
+
+mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
+
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+
+  p->type = MPC_TYPE_AND;
+  p->data.and.n = n;
+  p->data.and.f = f;
+  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+
+  va_start(va, f);
+  for (i = 0; i < n; i++) {
+    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  for (i = 0; i < (n-1); i++) {
+    p->data.and.dxs[i] = va_arg(va, mpc_dtor_t);
+  }
+  va_end(va);
+
+  return p;
+}
+
+/*
+** Common Parsers
+*/
+
+mpc_parser_t *mpc_soi(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_SOI;
+  return mpc_expect(p, "start of input");
+}
+
+mpc_parser_t *mpc_eoi(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_EOI;
+  return mpc_expect(p, "end of input");
+}
+
+static int mpc_boundary_anchor(char prev, char next) {
+  const char* word = "abcdefghijklmnopqrstuvwxyz"
+                     "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                     "0123456789_";
+  if ( strchr(word, next) &&  prev == '\0') { return 1; }
+  if ( strchr(word, prev) &&  next == '\0') { return 1; }
+  if ( strchr(word, next) && !strchr(word, prev)) { return 1; }
+  if (!strchr(word, next) &&  strchr(word, prev)) { return 1; }
+  return 0;
+}
+
+static int mpc_boundary_newline_anchor(char prev, char next) {
+  (void)next;
+  return prev == '\n';
+}
+
+mpc_parser_t *mpc_boundary(void) { return mpc_expect(mpc_anchor(mpc_boundary_anchor), "word boundary"); }
+mpc_parser_t *mpc_boundary_newline(void) { return mpc_expect(mpc_anchor(mpc_boundary_newline_anchor), "start of newline"); }
+
+mpc_parser_t *mpc_whitespace(void) { return mpc_expect(mpc_oneof(" \f\n\r\t\v"), "whitespace"); }
+mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_many(mpcf_strfold, mpc_whitespace()), "spaces"); }
+mpc_parser_t *mpc_blank(void) { return mpc_expect(mpc_apply(mpc_whitespaces(), mpcf_free), "whitespace"); }
+
+mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline"); }
+mpc_parser_t *mpc_tab(void) { return mpc_expect(mpc_char('\t'), "tab"); }
+mpc_parser_t *mpc_escape(void) { return mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), free); }
+
+mpc_parser_t *mpc_digit(void) { return mpc_expect(mpc_oneof("0123456789"), "digit"); }
+mpc_parser_t *mpc_hexdigit(void) { return mpc_expect(mpc_oneof("0123456789ABCDEFabcdef"), "hex digit"); }
+mpc_parser_t *mpc_octdigit(void) { return mpc_expect(mpc_oneof("01234567"), "oct digit"); }
+mpc_parser_t *mpc_digits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_digit()), "digits"); }
+mpc_parser_t *mpc_hexdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_hexdigit()), "hex digits"); }
+mpc_parser_t *mpc_octdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_octdigit()), "oct digits"); }
+
+mpc_parser_t *mpc_lower(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyz"), "lowercase letter"); }
+mpc_parser_t *mpc_upper(void) { return mpc_expect(mpc_oneof("ABCDEFGHIJKLMNOPQRSTUVWXYZ"), "uppercase letter"); }
+mpc_parser_t *mpc_alpha(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"), "letter"); }
+mpc_parser_t *mpc_underscore(void) { return mpc_expect(mpc_char('_'), "underscore"); }
+mpc_parser_t *mpc_alphanum(void) { return mpc_expect(mpc_or(3, mpc_alpha(), mpc_digit(), mpc_underscore()), "alphanumeric"); }
+
+mpc_parser_t *mpc_int(void) { return mpc_expect(mpc_apply(mpc_digits(), mpcf_int), "integer"); }
+mpc_parser_t *mpc_hex(void) { return mpc_expect(mpc_apply(mpc_hexdigits(), mpcf_hex), "hexadecimal"); }
+mpc_parser_t *mpc_oct(void) { return mpc_expect(mpc_apply(mpc_octdigits(), mpcf_oct), "octadecimal"); }
+mpc_parser_t *mpc_number(void) { return mpc_expect(mpc_or(3, mpc_int(), mpc_hex(), mpc_oct()), "number"); }
+
+mpc_parser_t *mpc_real(void) {
+
+  /* [+-]?\d+(\.\d+)?([eE][+-]?[0-9]+)? */
+
+  mpc_parser_t *p0, *p1, *p2, *p30, *p31, *p32, *p3;
+
+  p0 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
+  p1 = mpc_digits();
+  p2 = mpc_maybe_lift(mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_digits(), free), mpcf_ctor_str);
+  p30 = mpc_oneof("eE");
+  p31 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
+  p32 = mpc_digits();
+  p3 = mpc_maybe_lift(mpc_and(3, mpcf_strfold, p30, p31, p32, free, free), mpcf_ctor_str);
+
+  return mpc_expect(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, free, free, free), "real");
+
+}
+
+mpc_parser_t *mpc_float(void) {
+  return mpc_expect(mpc_apply(mpc_real(), mpcf_float), "float");
+}
+
+mpc_parser_t *mpc_char_lit(void) {
+  return mpc_expect(mpc_between(mpc_or(2, mpc_escape(), mpc_any()), free, "'", "'"), "char");
+}
+
+mpc_parser_t *mpc_string_lit(void) {
+  mpc_parser_t *strchar = mpc_or(2, mpc_escape(), mpc_noneof("\""));
+  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, strchar), free, "\"", "\""), "string");
+}
+
+mpc_parser_t *mpc_regex_lit(void) {
+  mpc_parser_t *regexchar = mpc_or(2, mpc_escape(), mpc_noneof("/"));
+  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, regexchar), free, "/", "/"), "regex");
+}
+
+mpc_parser_t *mpc_ident(void) {
+  mpc_parser_t *p0, *p1;
+  p0 = mpc_or(2, mpc_alpha(), mpc_underscore());
+  p1 = mpc_many(mpcf_strfold, mpc_alphanum());
+  return mpc_and(2, mpcf_strfold, p0, p1, free);
+}
+
+/*
+** Useful Parsers
+*/
+
+mpc_parser_t *mpc_startwith(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_soi(), a, mpcf_dtor_null); }
+mpc_parser_t *mpc_endwith(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(2, mpcf_fst, a, mpc_eoi(), da); }
+mpc_parser_t *mpc_whole(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(3, mpcf_snd, mpc_soi(), a, mpc_eoi(), mpcf_dtor_null, da); }
+
+mpc_parser_t *mpc_stripl(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_blank(), a, mpcf_dtor_null); }
+mpc_parser_t *mpc_stripr(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
+mpc_parser_t *mpc_strip(mpc_parser_t *a) { return mpc_and(3, mpcf_snd, mpc_blank(), a, mpc_blank(), mpcf_dtor_null, mpcf_dtor_null); }
+mpc_parser_t *mpc_tok(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
+mpc_parser_t *mpc_sym(const char *s) { return mpc_tok(mpc_string(s)); }
+
+mpc_parser_t *mpc_total(mpc_parser_t *a, mpc_dtor_t da) { return mpc_whole(mpc_strip(a), da); }
+
+mpc_parser_t *mpc_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
+  return mpc_and(3, mpcf_snd_free,
+    mpc_string(o), a, mpc_string(c),
+    free, ad);
+}
+
+mpc_parser_t *mpc_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "(", ")"); }
+mpc_parser_t *mpc_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "<", ">"); }
+mpc_parser_t *mpc_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_between(a, ad, "{", "}"); }
+mpc_parser_t *mpc_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_between(a, ad, "[", "]"); }
+
+mpc_parser_t *mpc_tok_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
+  return mpc_and(3, mpcf_snd_free,
+    mpc_sym(o), mpc_tok(a), mpc_sym(c),
+    free, ad);
+}
+
+mpc_parser_t *mpc_tok_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "(", ")"); }
+mpc_parser_t *mpc_tok_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "<", ">"); }
+mpc_parser_t *mpc_tok_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_tok_between(a, ad, "{", "}"); }
+mpc_parser_t *mpc_tok_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_tok_between(a, ad, "[", "]"); }
+
+/*
+** Regular Expression Parsers
+*/
+
+/*
+** So here is a cute bootstrapping.
+**
+** I'm using the previously defined
+** mpc constructs and functions to
+** parse the user regex string and
+** construct a parser from it.
+**
+** As it turns out lots of the standard
+** mpc functions look a lot like `fold`
+** functions and so can be used indirectly
+** by many of the parsing functions to build
+** a parser directly - as we are parsing.
+**
+** This is certainly something that
+** would be less elegant/interesting
+** in a two-phase parser which first
+** builds an AST and then traverses it
+** to generate the object.
+**
+** This whole thing acts as a great
+** case study for how trivial it can be
+** to write a great parser in a few
+** lines of code using mpc.
+*/
+
+/*
+**
+**  ### Regular Expression Grammar
+**
+**      <regex> : <term> | (<term> "|" <regex>)
+**
+**      <term> : <factor>*
+**
+**      <factor> : <base>
+**               | <base> "*"
+**               | <base> "+"
+**               | <base> "?"
+**               | <base> "{" <digits> "}"
+**
+**      <base> : <char>
+**             | "\" <char>
+**             | "(" <regex> ")"
+**             | "[" <range> "]"
+*/
+
+static mpc_val_t *mpcf_re_or(int n, mpc_val_t **xs) {
+  (void) n;
+  if (xs[1] == NULL) { return xs[0]; }
+  else { return mpc_or(2, xs[0], xs[1]); }
+}
+
+static mpc_val_t *mpcf_re_and(int n, mpc_val_t **xs) {
+  int i;
+  mpc_parser_t *p = mpc_lift(mpcf_ctor_str);
+  for (i = 0; i < n; i++) {
+    p = mpc_and(2, mpcf_strfold, p, xs[i], free);
+  }
+  return p;
+}
+
+static mpc_val_t *mpcf_re_repeat(int n, mpc_val_t **xs) {
+  int num;
+  (void) n;
+  if (xs[1] == NULL) { return xs[0]; }
+  switch(((char*)xs[1])[0])
+  {
+    case '*': { free(xs[1]); return mpc_many(mpcf_strfold, xs[0]); }; break;
+    case '+': { free(xs[1]); return mpc_many1(mpcf_strfold, xs[0]); }; break;
+    case '?': { free(xs[1]); return mpc_maybe_lift(xs[0], mpcf_ctor_str); }; break;
+    default:
+      num = *(int*)xs[1];
+      free(xs[1]);
+  }
+
+  return mpc_count(num, mpcf_strfold, xs[0], free);
+}
+
+static mpc_parser_t *mpc_re_escape_char(char c) {
+  switch (c) {
+    case 'a': return mpc_char('\a');
+    case 'f': return mpc_char('\f');
+    case 'n': return mpc_char('\n');
+    case 'r': return mpc_char('\r');
+    case 't': return mpc_char('\t');
+    case 'v': return mpc_char('\v');
+    case 'b': return mpc_and(2, mpcf_snd, mpc_boundary(), mpc_lift(mpcf_ctor_str), free);
+    case 'B': return mpc_not_lift(mpc_boundary(), free, mpcf_ctor_str);
+    case 'A': return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
+    case 'Z': return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free);
+    case 'd': return mpc_digit();
+    case 'D': return mpc_not_lift(mpc_digit(), free, mpcf_ctor_str);
+    case 's': return mpc_whitespace();
+    case 'S': return mpc_not_lift(mpc_whitespace(), free, mpcf_ctor_str);
+    case 'w': return mpc_alphanum();
+    case 'W': return mpc_not_lift(mpc_alphanum(), free, mpcf_ctor_str);
+    default: return NULL;
+  }
+}
+
+static mpc_val_t *mpcf_re_escape(mpc_val_t *x, void* data) {
+
+  int mode = *((int*)data);
+  char *s = x;
+  mpc_parser_t *p;
+
+  /* Any Character */
+  if (s[0] == '.') {
+    free(s);
+    if (mode & MPC_RE_DOTALL) {
+      return mpc_any();
+    } else {
+      return mpc_expect(mpc_noneof("\n"), "any character except a newline");
+    }
+  }
+
+  /* Start of Input */
+  if (s[0] == '^') {
+    free(s);
+    if (mode & MPC_RE_MULTILINE) {
+      return mpc_and(2, mpcf_snd, mpc_or(2, mpc_soi(), mpc_boundary_newline()), mpc_lift(mpcf_ctor_str), free);
+    } else {
+      return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
+    }
+  }
+
+  /* End of Input */
+  if (s[0] == '$') {
+    free(s);
+    if (mode & MPC_RE_MULTILINE) {
+      return mpc_or(2,
+        mpc_newline(),
+        mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free));
+    } else {
+      return mpc_or(2,
+        mpc_and(2, mpcf_fst, mpc_newline(), mpc_eoi(), free),
+        mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free));
+    }
+  }
+
+  /* Regex Escape */
+  if (s[0] == '\\') {
+    p = mpc_re_escape_char(s[1]);
+    p = (p == NULL) ? mpc_char(s[1]) : p;
+    free(s);
+    return p;
+  }
+
+  /* Regex Standard */
+  p = mpc_char(s[0]);
+  free(s);
+  return p;
+}
+
+static const char *mpc_re_range_escape_char(char c) {
+  switch (c) {
+    case '-': return "-";
+    case 'a': return "\a";
+    case 'f': return "\f";
+    case 'n': return "\n";
+    case 'r': return "\r";
+    case 't': return "\t";
+    case 'v': return "\v";
+    case 'b': return "\b";
+    case 'd': return "0123456789";
+    case 's': return " \f\n\r\t\v";
+    case 'w': return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+    default: return NULL;
+  }
+}
+
+static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+
+  mpc_parser_t *out;
+  size_t i, j;
+  size_t start, end;
+  const char *tmp = NULL;
+  const char *s = x;
+  int comp = s[0] == '^' ? 1 : 0;
+  char *range = calloc(1,1);
+
+  if (s[0] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  if (s[0] == '^' &&
+      s[1] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
+
+  for (i = comp; i < strlen(s); i++){
+
+    /* Regex Range Escape */
+    if (s[i] == '\\') {
+      tmp = mpc_re_range_escape_char(s[i+1]);
+      if (tmp != NULL) {
+        range = realloc(range, strlen(range) + strlen(tmp) + 1);
+        strcat(range, tmp);
+      } else {
+        range = realloc(range, strlen(range) + 1 + 1);
+        range[strlen(range) + 1] = '\0';
+        range[strlen(range) + 0] = s[i+1];
+      }
+      i++;
+    }
+
+    /* Regex Range...Range */
+    else if (s[i] == '-') {
+      if (s[i+1] == '\0' || i == 0) {
+          range = realloc(range, strlen(range) + strlen("-") + 1);
+          strcat(range, "-");
+      } else {
+        start = s[i-1]+1;
+        end = s[i+1]-1;
+        for (j = start; j <= end; j++) {
+          range = realloc(range, strlen(range) + 1 + 1 + 1);
+          range[strlen(range) + 1] = '\0';
+          range[strlen(range) + 0] = (char)j;
+        }
+      }
+    }
+
+    /* Regex Range Normal */
+    else {
+      range = realloc(range, strlen(range) + 1 + 1);
+      range[strlen(range) + 1] = '\0';
+      range[strlen(range) + 0] = s[i];
+    }
+
+  }
+
+  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+
+  free(x);
+  free(range);
+
+  return out;
+}
+
+/*
+** Regular expressions that can be matched without
+** backtracking are also compiled into a DFA. This
+** is the case when the Glushkov automaton of the
+** expression is deterministic, no repetition can
+** match the empty string, and only the last of a
+** set of alternatives can. The parser built above
+** then gives exactly the longest match, and so the
+** DFA can scan it in a single loop and allocate
+** the matched string once.
+**
+** The parser is kept for errors. Failed matches
+** run it to get the usual error. Successful ones
+** merge the errors of the attempts to continue the
+** match, which depend only on the state in which
+** the DFA stopped, so these are learnt for every
+** state when the DFA is built. If the parser then
+** disagrees with the DFA no DFA is built, and in
+** states where the errors come from elsewhere the
+** parser is run instead.
+*/
+
+enum {
+  MPC_DFA_POSITIONS = 256,
+  MPC_DFA_SET = MPC_DFA_POSITIONS / 8,
+  MPC_DFA_BUFFER = 64,
+  MPC_DFA_MAX_DEPTH = 64
+};
+
+enum {
+  MPC_DFA_UNKNOWN = 0,
+  MPC_DFA_KNOWN   = 1,
+  MPC_DFA_PARSER  = 2
+};
+
+struct mpc_dfa_t {
+  int states_num;
+  short *trans;
+  char *accept;
+  char *known;
+  mpc_err_t **errs;
+};
+
+typedef struct {
+  int positions_num;
+  unsigned char classes[MPC_DFA_POSITIONS][MPC_FIRST_BYTES];
+  unsigned char follow[MPC_DFA_POSITIONS][MPC_DFA_SET];
+} mpc_glushkov_t;
+
+typedef struct {
+  int nullable;
+  unsigned char first[MPC_DFA_SET];
+  unsigned char last[MPC_DFA_SET];
+} mpc_glushkov_sets_t;
+
+static int mpc_dfa_class(mpc_parser_t *p, unsigned char *cls) {
+
+  int j;
+  char c;
+
+  while (p->type == MPC_TYPE_EXPECT) { p = p->data.expect.x; }
+
+  memset(cls, 0, MPC_FIRST_BYTES);
+
+  /* The end of input is never matched */
+  for (j = 1; j < 256; j++) {
+    c = (char)j;
+    switch (p->type) {
+      case MPC_TYPE_ANY:    break;
+      case MPC_TYPE_SINGLE: if (c != p->data.single.x) { continue; } break;
+      case MPC_TYPE_RANGE:  if (c < p->data.range.x || c > p->data.range.y) { continue; } break;
+      case MPC_TYPE_ONEOF:
+      case MPC_TYPE_NONEOF: if (!mpc_first_has(p->data.string.set, c)) { continue; } break;
+      case MPC_TYPE_CLASS:  if (!mpc_first_has(p->data.cls.set, c)) { continue; } break;
+      default: return 0;
+    }
+    mpc_first_add(cls, c);
+  }
+
+  return 1;
+}
+
+static void mpc_dfa_set_union(unsigned char *x, const unsigned char *y) {
+  int j;
+  for (j = 0; j < MPC_DFA_SET; j++) { x[j] |= y[j]; }
+}
+
+static void mpc_dfa_follow(mpc_glushkov_t *g, const unsigned char *last, const unsigned char *first) {
+  int j;
+  for (j = 0; j < g->positions_num; j++) {
+    if (last[j >> 3] & (1 << (j & 7))) { mpc_dfa_set_union(g->follow[j], first); }
+  }
+}
+
+static int mpc_dfa_walk(mpc_glushkov_t *g, mpc_parser_t *p, mpc_glushkov_sets_t *s, int depth) {
+
+  int j, n;
+  mpc_parser_t *x;
+  mpc_glushkov_sets_t t;
+
+  memset(s, 0, sizeof(mpc_glushkov_sets_t));
+
+  if (depth == MPC_DFA_MAX_DEPTH) { return 0; }
+
+  switch (p->type) {
+
+    case MPC_TYPE_EXPECT:
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_CLASS:
+      if (g->positions_num == MPC_DFA_POSITIONS) { return 0; }
+      if (!mpc_dfa_class(p, g->classes[g->positions_num])) { return 0; }
+      memset(g->follow[g->positions_num], 0, MPC_DFA_SET);
+      s->first[g->positions_num >> 3] |= 1 << (g->positions_num & 7);
+      s->last[g->positions_num >> 3] |= 1 << (g->positions_num & 7);
+      g->positions_num++;
+      return 1;
+
+    case MPC_TYPE_LIFT:
+      s->nullable = 1;
+      return p->data.lift.lf == mpcf_ctor_str;
+
+    case MPC_TYPE_MAYBE:
+      if (p->data.not.lf != mpcf_ctor_str) { return 0; }
+      if (!mpc_dfa_walk(g, p->data.not.x, s, depth+1)) { return 0; }
+      s->nullable = 1;
+      return 1;
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_SPAN:
+      if (p->type == MPC_TYPE_SPAN) {
+        x = p->data.span.x;
+        n = p->data.span.n;
+      } else {
+        if (p->data.repeat.f != mpcf_strfold) { return 0; }
+        x = p->data.repeat.x;
+        n = p->type == MPC_TYPE_MANY1;
+      }
+      if (!mpc_dfa_walk(g, x, s, depth+1)) { return 0; }
+      if (s->nullable) { return 0; }
+      if (n == 0) {
+        mpc_dfa_follow(g, s->last, s->first);
+        s->nullable = 1;
+        return 1;
+      }
+      /* The first repetition fails with a different error so has its own positions */
+      if (!mpc_dfa_walk(g, x, &t, depth+1)) { return 0; }
+      mpc_dfa_follow(g, s->last, t.first);
+      mpc_dfa_follow(g, t.last, t.first);
+      mpc_dfa_set_union(s->last, t.last);
+      return 1;
+
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        if (s->nullable) { return 0; }
+        if (!mpc_dfa_walk(g, p->data.or.xs[j], &t, depth+1)) { return 0; }
+        mpc_dfa_set_union(s->first, t.first);
+        mpc_dfa_set_union(s->last, t.last);
+        s->nullable = t.nullable;
+      }
+      return 1;
+
+    case MPC_TYPE_AND:
+      if (p->data.and.f != mpcf_strfold) { return 0; }
+      n = p->data.and.n;
+      if (n < 1) { return 0; }
+      s->nullable = 1;
+      for (j = 0; j < n; j++) {
+        if (!mpc_dfa_walk(g, p->data.and.xs[j], &t, depth+1)) { return 0; }
+        mpc_dfa_follow(g, s->last, t.first);
+        if (s->nullable) { mpc_dfa_set_union(s->first, t.first); }
+        if (!t.nullable) { memset(s->last, 0, MPC_DFA_SET); }
+        mpc_dfa_set_union(s->last, t.last);
+        s->nullable = s->nullable && t.nullable;
+      }
+      return 1;
+
+    /* A failed count does not give back what it consumed */
+    case MPC_TYPE_COUNT: return 0;
+
+    default: return 0;
+  }
+}
+
+static int mpc_dfa_add_state(mpc_glushkov_t *g, short *trans, const unsigned char *set) {
+
+  int j, c;
+
+  for (j = 0; j < g->positions_num; j++) {
+    if (!(set[j >> 3] & (1 << (j & 7)))) { continue; }
+    for (c = 1; c < 256; c++) {
+      if (!mpc_first_has(g->classes[j], (char)c)) { continue; }
+      /* Two positions reached on the same character */
+      if (trans[c] >= 0) { return 0; }
+      trans[c] = (short)(j+1);
+    }
+  }
+
+  return 1;
+}
+
+static void mpc_dfa_delete(mpc_dfa_t *d) {
+  int j;
+  for (j = 0; j < d->states_num; j++) {
+    if (d->errs[j]) { mpc_err_delete(d->errs[j]); }
+  }
+  free(d->trans);
+  free(d->accept);
+  free(d->known);
+  free(d->errs);
+  free(d);
+}
+
+/*
+** Learns the errors of every state. Each state is
+** reached from the start by the shortest input that
+** passes through an accepting state, found by a
+** breadth first search, and the parser is run on
+** that input. Returns 0 if the parser does not match
+** as much of it as the DFA.
+*/
+
+static int mpc_dfa_learn(mpc_dfa_t *d, mpc_parser_t *p) {
+
+  int j, k, s, t, c, len, acc, x, ok = 1, head = 0, tail = 0;
+  int n = d->states_num * 2;
+  int *from = malloc(sizeof(int) * n);
+  int *queue = malloc(sizeof(int) * n);
+  char *chars = malloc(n);
+  char *path = malloc(n);
+  mpc_input_t *i;
+  mpc_result_t r;
+  mpc_err_t *e;
+
+  /* Search over pairs of a state and whether it has accepted */
+  for (j = 0; j < n; j++) { from[j] = -1; }
+  k = d->accept[0] ? 1 : 0;
+  from[k] = k;
+  queue[tail++] = k;
+
+  while (head < tail && ok) {
+
+    k = queue[head++];
+    s = k / 2;
+
+    for (c = 1; c < 256; c++) {
+      t = d->trans[256 * s + c];
+      if (t < 0) { continue; }
+      j = t * 2 + ((k & 1) || d->accept[t]);
+      if (from[j] >= 0) { continue; }
+      from[j] = k;
+      chars[j] = (char)c;
+      queue[tail++] = j;
+    }
+
+    if (!(k & 1) || d->known[s] != MPC_DFA_UNKNOWN) { continue; }
+
+    len = 0;
+    for (j = k; from[j] != j; j = from[j]) { len++; }
+    for (j = k, t = len; from[j] != j; j = from[j]) { path[--t] = chars[j]; }
+
+    /* Where the DFA last accepted on the way */
+    acc = d->accept[0] ? 0 : -1;
+    for (j = 0, t = 0; j < len; j++) {
+      t = d->trans[256 * t + (unsigned char)path[j]];
+      if (d->accept[t]) { acc = j+1; }
+    }
+
+    i = mpc_input_new_nstring("<dfa>", path, len);
+    e = NULL;
+    x = mpc_parse_run(i, p, &r, &e, 0);
+    ok = x && i->state.pos == acc;
+
+    if (ok && (e == NULL || e->state.pos == len)) {
+      d->known[s] = MPC_DFA_KNOWN;
+      d->errs[s] = e ? mpc_err_export(i, mpc_err_copy(i, e)) : NULL;
+    } else if (ok) {
+      d->known[s] = MPC_DFA_PARSER;
+    }
+
+    if (x) { mpc_free(i, r.output); } else { mpc_err_delete_internal(i, r.error); }
+    mpc_err_delete_internal(i, e);
+    mpc_input_delete(i);
+  }
+
+  free(from);
+  free(queue);
+  free(chars);
+  free(path);
+  return ok;
+}
+
+static mpc_dfa_t *mpc_dfa_new(mpc_parser_t *p) {
+
+  int j, ok;
+  mpc_glushkov_sets_t s;
+  mpc_glushkov_t *g = malloc(sizeof(mpc_glushkov_t));
+  mpc_dfa_t *d;
+
+  g->positions_num = 0;
+  if (!mpc_dfa_walk(g, p, &s, 0)) { free(g); return NULL; }
+
+  d = malloc(sizeof(mpc_dfa_t));
+  d->states_num = g->positions_num + 1;
+  d->trans = malloc(sizeof(short) * 256 * d->states_num);
+  d->accept = calloc(d->states_num, 1);
+  d->known = calloc(d->states_num, 1);
+  d->errs = calloc(d->states_num, sizeof(mpc_err_t*));
+
+  for (j = 0; j < 256 * d->states_num; j++) { d->trans[j] = -1; }
+
+  /* State zero is the start, state `j+1` follows position `j` */
+  ok = mpc_dfa_add_state(g, d->trans, s.first);
+  d->accept[0] = (char)s.nullable;
+  for (j = 0; ok && j < g->positions_num; j++) {
+    ok = mpc_dfa_add_state(g, d->trans + 256 * (j+1), g->follow[j]);
+    d->accept[j+1] = (s.last[j >> 3] & (1 << (j & 7))) != 0;
+  }
+
+  free(g);
+  if (!ok || !mpc_dfa_learn(d, p)) { mpc_dfa_delete(d); return NULL; }
+  return d;
+}
+
+static mpc_parser_t *mpc_re_dfa(mpc_parser_t *a) {
+  mpc_parser_t *p;
+  mpc_dfa_t *d = mpc_dfa_new(a);
+  if (d == NULL) { return a; }
+  p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.x = a;
+  p->data.dfa.dfa = d;
+  return p;
+}
+
+static mpc_err_t *mpc_err_at(mpc_input_t *i, mpc_err_t *x, mpc_state_t s, char c) {
+  mpc_err_t *y = mpc_err_copy(i, x);
+  mpc_free(i, y->filename);
+  y->filename = mpc_malloc(i, strlen(i->filename) + 1);
+  strcpy(y->filename, i->filename);
+  y->state = s;
+  y->received = c;
+  return y;
+}
+
+static int mpc_parse_dfa(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+
+  int t, s = 0;
+  long len = 0, acc = -1, slots = MPC_DFA_BUFFER;
+  char c, acc_last = '\0';
+  char stk[MPC_DFA_BUFFER];
+  char *buf = stk;
+  mpc_state_t acc_state, end_state;
+  mpc_dfa_t *d = p->data.dfa.dfa;
+
+  /* Without backtracking the parser may leave the input elsewhere */
+  if (i->backtrack < 1) {
+    return mpc_parse_run(i, p->data.dfa.x, r, e, 0);
+  }
+
+  mpc_input_mark(i);
+
+  acc_state = i->state;
+  if (d->accept[0]) { acc = 0; acc_last = i->last; }
+
+  while (1) {
+    c = mpc_input_getc(i);
+    t = d->trans[256 * s + (unsigned char)c];
+    if (t < 0) { break; }
+    if (len == slots) {
+      slots *= 2;
+      if (buf == stk) {
+        buf = malloc(slots);
+        memcpy(buf, stk, len);
+      } else {
+        buf = realloc(buf, slots);
+      }
+    }
+    buf[len++] = c;
+    mpc_input_success(i, c, NULL);
+    s = t;
+    if (d->accept[s]) { acc = len; acc_state = i->state; acc_last = i->last; }
+  }
+
+  end_state = i->state;
+
+  /* Without errors to report the match is all that counts */
+  if (acc >= 0 && (i->suppress || d->known[s] == MPC_DFA_KNOWN)) {
+    i->state = acc_state;
+    i->last = acc_last;
+    mpc_input_unmark(i);
+    r->output = mpc_malloc(i, acc + 1);
+    memcpy(r->output, buf, acc);
+    ((char*)r->output)[acc] = '\0';
+    if (buf != stk) { free(buf); }
+    if (!i->suppress && d->errs[s]) {
+      *e = mpc_err_merge(i, *e, mpc_err_at(i, d->errs[s], end_state, c));
+    }
+    return 1;
+  }
+
+  mpc_input_rewind(i);
+  if (buf != stk) { free(buf); }
+
+  if (acc < 0 && i->suppress) {
+    r->error = NULL;
+    return 0;
+  }
+
+  return mpc_parse_run(i, p->data.dfa.x, r, e, 0);
+}
+
+static int mpc_optimise_unretained(mpc_parser_t *p, int force, int backtrack);
+
+mpc_parser_t *mpc_re(const char *re) {
+  return mpc_re_mode(re, MPC_RE_DEFAULT);
+}
+
+mpc_parser_t *mpc_re_mode(const char *re, int mode) {
+
+  char *err_msg;
+  mpc_parser_t *err_out;
+  mpc_result_t r;
+  mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose;
+
+  Regex  = mpc_new("regex");
+  Term   = mpc_new("term");
+  Factor = mpc_new("factor");
+  Base   = mpc_new("base");
+  Range  = mpc_new("range");
+
+  mpc_define(Regex, mpc_and(2, mpcf_re_or,
+    Term,
+    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_char('|'), Regex, free)),
+    (mpc_dtor_t)mpc_delete
+  ));
+
+  mpc_define(Term, mpc_many(mpcf_re_and, Factor));
+
+  mpc_define(Factor, mpc_and(2, mpcf_re_repeat,
+    Base,
+    mpc_or(5,
+      mpc_char('*'), mpc_char('+'), mpc_char('?'),
+      mpc_brackets(mpc_int(), free),
+      mpc_pass()),
+    (mpc_dtor_t)mpc_delete
+  ));
+
+  mpc_define(Base, mpc_or(4,
+    mpc_parens(Regex, (mpc_dtor_t)mpc_delete),
+    mpc_squares(Range, (mpc_dtor_t)mpc_delete),
+    mpc_apply_to(mpc_escape(), mpcf_re_escape, &mode),
+    mpc_apply_to(mpc_noneof(")|"), mpcf_re_escape, &mode)
+  ));
+
+  mpc_define(Range, mpc_apply(
+    mpc_many(mpcf_strfold, mpc_or(2, mpc_escape(), mpc_noneof("]"))),
+    mpcf_re_range
+  ));
+
+  RegexEnclose = mpc_whole(mpc_predictive(Regex), (mpc_dtor_t)mpc_delete);
+
+  /* These only run predictively so are not factored */
+  mpc_optimise_unretained(RegexEnclose, 1, 0);
+  mpc_optimise_unretained(Regex, 1, 0);
+  mpc_optimise_unretained(Term, 1, 0);
+  mpc_optimise_unretained(Factor, 1, 0);
+  mpc_optimise_unretained(Base, 1, 0);
+  mpc_optimise_unretained(Range, 1, 0);
+
+  if(!mpc_parse("<mpc_re_compiler>", re, RegexEnclose, &r)) {
+    err_msg = mpc_err_string(r.error);
+    err_out = mpc_failf("Invalid Regex: %s", err_msg);
+    mpc_err_delete(r.error);
+    free(err_msg);
+    r.output = err_out;
+  }
+
+  mpc_cleanup(6, RegexEnclose, Regex, Term, Factor, Base, Range);
+
+  /*
+  ** Regexes are often used with `mpc_predictive`, or
+  ** in grammars which are, and factoring would then
+  ** change what they match.
+  */
+  mpc_optimise_unretained(r.output, 1, 0);
+
+  return mpc_re_dfa(r.output);
+
+}
+
+/*
+** Common Fold Functions
+*/
+
+void mpcf_dtor_null(mpc_val_t *x) { (void) x; return; }
+
+mpc_val_t *mpcf_ctor_null(void) { return NULL; }
+mpc_val_t *mpcf_ctor_str(void) { return calloc(1, 1); }
+mpc_val_t *mpcf_free(mpc_val_t *x) { free(x); return NULL; }
+
+mpc_val_t *mpcf_int(mpc_val_t *x) {
+  int *y = malloc(sizeof(int));
+  *y = strtol(x, NULL, 10);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_hex(mpc_val_t *x) {
+  int *y = malloc(sizeof(int));
+  *y = strtol(x, NULL, 16);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_oct(mpc_val_t *x) {
+  int *y = malloc(sizeof(int));
+  *y = strtol(x, NULL, 8);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_float(mpc_val_t *x) {
+  float *y = malloc(sizeof(float));
+  *y = strtod(x, NULL);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_strtriml(mpc_val_t *x) {
+  char *s = x;
+  while (isspace((unsigned char)*s)) {
+    memmove(s, s+1, strlen(s));
+  }
+  return s;
+}
+
+mpc_val_t *mpcf_strtrimr(mpc_val_t *x) {
+  char *s = x;
+  size_t l = strlen(s);
+  while (l > 0 && isspace((unsigned char)s[l-1])) {
+    s[l-1] = '\0'; l--;
+  }
+  return s;
+}
+
+mpc_val_t *mpcf_strtrim(mpc_val_t *x) {
+  return mpcf_strtriml(mpcf_strtrimr(x));
+}
+
+static const char mpc_escape_input_c[]  = {
+  '\a', '\b', '\f', '\n', '\r',
+  '\t', '\v', '\\', '\'', '\"', '\0'};
+
+static const char *mpc_escape_output_c[] = {
+  "\\a", "\\b", "\\f", "\\n", "\\r", "\\t",
+  "\\v", "\\\\", "\\'", "\\\"", "\\0", NULL};
+
+static const char mpc_escape_input_raw_re[] = { '/' };
+static const char *mpc_escape_output_raw_re[] = { "\\/", NULL };
+
+static const char mpc_escape_input_raw_cstr[] = { '"' };
+static const char *mpc_escape_output_raw_cstr[] = { "\\\"", NULL };
+
+static const char mpc_escape_input_raw_cchar[] = { '\'' };
+static const char *mpc_escape_output_raw_cchar[] = { "\\'", NULL };
+
+/* Index of the escape for character c, or -1 if it is left as it is */
+static int mpcf_escape_find(char c, const char *input, const char **output) {
+  int i = 0;
+  while (output[i]) {
+    if (c == input[i]) { return i; }
+    i++;
+  }
+  return -1;
+}
+
+static mpc_val_t *mpcf_escape_new(mpc_val_t *x, const char *input, const char **output) {
+
+  int i;
+  size_t l = 0;
+  char *s = x;
+  char *y, *t;
+
+  /* Size the result first so it is allocated once */
+  while (*s) {
+    i = mpcf_escape_find(*s, input, output);
+    l += i == -1 ? 1 : strlen(output[i]);
+    s++;
+  }
+
+  y = malloc(l + 1);
+  t = y;
+
+  for (s = x; *s; s++) {
+    i = mpcf_escape_find(*s, input, output);
+    if (i == -1) {
+      *t++ = *s;
+    } else {
+      l = strlen(output[i]);
+      memcpy(t, output[i], l);
+      t += l;
+    }
+  }
+
+  *t = '\0';
+  return y;
+}
+
+static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, const char *input, const char **output) {
+
+  int i;
+  int found = 0;
+  char *s = x;
+  char *y, *t;
+
+  /* Unescaping never makes a string longer */
+  y = malloc(strlen(s) + 1);
+  t = y;
+
+  while (*s) {
+
+    i = 0;
+    found = 0;
+
+    while (output[i]) {
+      if ((*(s+0)) == output[i][0] &&
+          (*(s+1)) == output[i][1]) {
+        *t++ = input[i];
+        found = 1;
+        s++;
+        break;
+      }
+      i++;
+    }
+
+    if (!found) {
+      *t++ = *s;
+    }
+
+    if (*s == '\0') { break; }
+    else { s++; }
+  }
+
+  *t = '\0';
+  return y;
+
+}
+
+mpc_val_t *mpcf_escape(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_c, mpc_escape_output_c);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_unescape(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_c, mpc_escape_output_c);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_escape_regex(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_unescape_regex(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_escape_string_raw(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_unescape_string_raw(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_escape_char_raw(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_unescape_char_raw(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_null(int n, mpc_val_t** xs) { (void) n; (void) xs; return NULL; }
+mpc_val_t *mpcf_fst(int n, mpc_val_t **xs) { (void) n; return xs[0]; }
+mpc_val_t *mpcf_snd(int n, mpc_val_t **xs) { (void) n; return xs[1]; }
+mpc_val_t *mpcf_trd(int n, mpc_val_t **xs) { (void) n; return xs[2]; }
+
+static mpc_val_t *mpcf_nth_free(int n, mpc_val_t **xs, int x) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (i != x) { free(xs[i]); }
+  }
+  return xs[x];
+}
+
+mpc_val_t *mpcf_fst_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 0); }
+mpc_val_t *mpcf_snd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 1); }
+mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2); }
+mpc_val_t *mpcf_all_free(int n, mpc_val_t** xs) {
+  int i;
+  for (i = 0; i < n; i++) {
+    free(xs[i]);
+  }
+  return NULL;
+}
+
+mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
+  int i;
+  size_t l = 0, k, m;
+
+  if (n == 0) { return calloc(1, 1); }
+
+  for (i = 0; i < n; i++) { l += strlen(xs[i]); }
+
+  m = strlen(xs[0]);
+  xs[0] = realloc(xs[0], l + 1);
+
+  /* Copy each piece to its offset so the result is never rescanned */
+  for (i = 1; i < n; i++) {
+    k = strlen(xs[i]);
+    memcpy((char*)xs[0] + m, xs[i], k);
+    m += k;
+    free(xs[i]);
+  }
+
+  ((char*)xs[0])[m] = '\0';
+
+  return xs[0];
+}
+
+mpc_val_t *mpcf_maths(int n, mpc_val_t **xs) {
+  int **vs = (int**)xs;
+  (void) n;
+
+  switch(((char*)xs[1])[0])
+  {
+    case '*': { *vs[0] *= *vs[2]; }; break;
+    case '/': { *vs[0] /= *vs[2]; }; break;
+    case '%': { *vs[0] %= *vs[2]; }; break;
+    case '+': { *vs[0] += *vs[2]; }; break;
+    case '-': { *vs[0] -= *vs[2]; }; break;
+    default: break;
+  }
+
+  free(xs[1]); free(xs[2]);
+
+  return xs[0];
+}
+
+mpc_val_t *mpcf_tuple(int n, mpc_val_t **xs) {
+  mpc_tuple_t *t = malloc(sizeof(mpc_tuple_t) + sizeof(mpc_val_t*) * n);
+  t->n = n;
+  t->xs = (mpc_val_t**)(t + 1);
+  memcpy(t->xs, xs, sizeof(mpc_val_t*) * n);
+  return t;
+}
+
+/*
+** Printing
+*/
+
+static void mpc_print_unretained(mpc_parser_t *p, int force) {
+
+  /* TODO: Print Everything Escaped */
+
+  int i;
+  char *s, *e;
+  char buff[2];
+
+  if (p->retained && !force) {;
+    if (p->name) { printf("<%s>", p->name); }
+    else { printf("<anon>"); }
+    return;
+  }
+
+  if (p->type == MPC_TYPE_UNDEFINED) { printf("<?>"); }
+  if (p->type == MPC_TYPE_PASS)   { printf("<:>"); }
+  if (p->type == MPC_TYPE_FAIL)   { printf("<!>"); }
+  if (p->type == MPC_TYPE_LIFT)   { printf("<#>"); }
+  if (p->type == MPC_TYPE_STATE)  { printf("<S>"); }
+  if (p->type == MPC_TYPE_ANCHOR) { printf("<@>"); }
+  if (p->type == MPC_TYPE_EXPECT) {
+    printf("%s", p->data.expect.m);
+    /*mpc_print_unretained(p->data.expect.x, 0);*/
+  }
+
+  if (p->type == MPC_TYPE_ANY) { printf("<.>"); }
+  if (p->type == MPC_TYPE_SATISFY) { printf("<f>"); }
+
+  if (p->type == MPC_TYPE_SINGLE) {
+    buff[0] = p->data.single.x; buff[1] = '\0';
+    s = mpcf_escape_new(
+      buff,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("'%s'", s);
+    free(s);
+  }
+
+  if (p->type == MPC_TYPE_RANGE) {
+    buff[0] = p->data.range.x; buff[1] = '\0';
+    s = mpcf_escape_new(
+      buff,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    buff[0] = p->data.range.y; buff[1] = '\0';
+    e = mpcf_escape_new(
+      buff,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("[%s-%s]", s, e);
+    free(s);
+    free(e);
+  }
+
+  if (p->type == MPC_TYPE_ONEOF) {
+    s = mpcf_escape_new(
+      p->data.string.x,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("[%s]", s);
+    free(s);
+  }
+
+  if (p->type == MPC_TYPE_NONEOF) {
+    s = mpcf_escape_new(
+      p->data.string.x,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("[^%s]", s);
+    free(s);
+  }
+
+  if (p->type == MPC_TYPE_CLASS) {
+    e = calloc(1, 256);
+    for (i = 1; i < 256; i++) {
+      if (mpc_first_has(p->data.cls.set, (char)i)) { e[strlen(e)] = (char)i; }
+    }
+    s = mpcf_escape_new(
+      e,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("[%s]", s);
+    free(s);
+    free(e);
+  }
+
+  if (p->type == MPC_TYPE_STRING) {
+    s = mpcf_escape_new(
+      p->data.string.x,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("\"%s\"", s);
+    free(s);
+  }
+
+  if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
+  if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
+  if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_FASTFAIL) { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_ARENA)    { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_print_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { mpc_print_unretained(p->data.dfa.x, 0); }
+
+  if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
+  if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
+
+  if (p->type == MPC_TYPE_MANY)  { mpc_print_unretained(p->data.repeat.x, 0); printf("*"); }
+  if (p->type == MPC_TYPE_MANY1) { mpc_print_unretained(p->data.repeat.x, 0); printf("+"); }
+  if (p->type == MPC_TYPE_COUNT) { mpc_print_unretained(p->data.repeat.x, 0); printf("{%i}", p->data.repeat.n); }
+  if (p->type == MPC_TYPE_SPAN)  { mpc_print_unretained(p->data.span.x, 0); printf(p->data.span.n ? "+" : "*"); }
+
+  if (p->type == MPC_TYPE_OR) {
+    printf("(");
+    for(i = 0; i < p->data.or.n-1; i++) {
+      mpc_print_unretained(p->data.or.xs[i], 0);
+      printf(" | ");
+    }
+    mpc_print_unretained(p->data.or.xs[p->data.or.n-1], 0);
+    printf(")");
+  }
+
+  if (p->type == MPC_TYPE_AND) {
+    printf("(");
+    for(i = 0; i < p->data.and.n-1; i++) {
+      mpc_print_unretained(p->data.and.xs[i], 0);
+      printf(" ");
+    }
+    mpc_print_unretained(p->data.and.xs[p->data.and.n-1], 0);
+    printf(")");
+  }
+
+  if (p->type == MPC_TYPE_CHECK) {
+    mpc_print_unretained(p->data.check.x, 0);
+    printf("->?");
+  }
+  if (p->type == MPC_TYPE_CHECK_WITH) {
+    mpc_print_unretained(p->data.check_with.x, 0);
+    printf("->?");
+  }
+
+}
+
+void mpc_print(mpc_parser_t *p) {
+  mpc_print_unretained(p, 1);
+  printf("\n");
+}
+
+/*
+** Testing
+*/
+
+/*
+** These functions are slightly unwieldy and
+** also the whole of the testing suite for mpc
+** mpc is pretty shaky.
+**
+** It could do with a lot more tests and more
+** precision. Currently I am only really testing
+** changes off of the examples.
+**
+*/
+
+int mpc_test_fail(mpc_parser_t *p, const char *s, const void *d,
+  int(*tester)(const void*, const void*),
+  mpc_dtor_t destructor,
+  void(*printer)(const void*)) {
+  mpc_result_t r;
+  (void) printer;
+  if (mpc_parse("<test>", s, p, &r)) {
+
+    if (tester(r.output, d)) {
+      destructor(r.output);
+      return 0;
+    } else {
+      destructor(r.output);
+      return 1;
+    }
+
+  } else {
+    mpc_err_delete(r.error);
+    return 1;
+  }
+
+}
+
+int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
+  int(*tester)(const void*, const void*),
+  mpc_dtor_t destructor,
+  void(*printer)(const void*)) {
+
+  mpc_result_t r;
+  if (mpc_parse("<test>", s, p, &r)) {
+
+    if (tester(r.output, d)) {
+      destructor(r.output);
+      return 1;
+    } else {
+      printf("Got "); printer(r.output); printf("\n");
+      printf("Expected "); printer(d); printf("\n");
+      destructor(r.output);
+      return 0;
+    }
+
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    return 0;
+
+  }
+
+}
+
+
+/*
+** AST
+*/
+
+void mpc_ast_delete(mpc_ast_t *a) {
+
+  int i;
+
+  if (a == NULL) { return; }
+  if (a->arena) { mpc_ast_arena_release(a); return; }
+
+  for (i = 0; i < a->children_num; i++) {
+    mpc_ast_delete(a->children[i]);
+  }
+
+  free(a->children);
+  free(a->tag);
+  free(a->contents);
+  free(a);
+
+}
+
+static void mpc_ast_delete_no_children(mpc_ast_t *a) {
+  if (a->arena) { return; }
+  free(a->children);
+  free(a->tag);
+  free(a->contents);
+  free(a);
+}
+
+static mpc_ast_t *mpc_ast_new_len(const char *tag, const char *contents, size_t length) {
+
+  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+
+  a->tag = malloc(strlen(tag) + 1);
+  strcpy(a->tag, tag);
+
+  a->contents = malloc(length + 1);
+  memcpy(a->contents, contents, length);
+  a->contents[length] = '\0';
+  a->contents_len = (int)length;
+
+  a->state = mpc_state_new();
+
+  a->children_num = 0;
+  a->children = NULL;
+  a->arena = NULL;
+  return a;
+
+}
+
+mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+  return mpc_ast_new_len(tag, contents, strlen(contents));
+}
+
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+
+  int i;
+  mpc_ast_t *r;
+
+  if (a == NULL) { return a; }
+
+  r = mpc_ast_new_len(a->tag, a->contents, mpc_ast_contents_len(a));
+  r->state = a->state;
+  r->children_num = a->children_num;
+  r->children = a->children_num ? malloc(sizeof(mpc_ast_t*) * a->children_num) : NULL;
+
+  for (i = 0; i < a->children_num; i++) {
+    r->children[i] = mpc_ast_copy(a->children[i]);
+  }
+
+  return r;
+}
+
+mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
+
+  mpc_ast_t *a = mpc_ast_new(tag, "");
+
+  int i;
+  va_list va;
+  va_start(va, tag);
+
+  for (i = 0; i < n; i++) {
+    mpc_ast_add_child(a, va_arg(va, mpc_ast_t*));
+  }
+
+  va_end(va);
+
+  return a;
+
+}
+
+mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
+
+  mpc_ast_t *r;
+
+  if (a == NULL) { return a; }
+  if (a->children_num == 0) { return a; }
+  if (a->children_num == 1) { return a; }
+
+  r = a->arena ? mpc_ast_arena_node(a->arena, ">", "", 0) : mpc_ast_new(">", "");
+  mpc_ast_add_child(r, a);
+  return r;
+}
+
+int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
+
+  int i, n;
+
+  if (strcmp(a->tag, b->tag) != 0) { return 0; }
+  n = mpc_ast_contents_len(a);
+  if (n != mpc_ast_contents_len(b)) { return 0; }
+  if (memcmp(a->contents, b->contents, n) != 0) { return 0; }
+  if (a->children_num != b->children_num) { return 0; }
+
+  for (i = 0; i < a->children_num; i++) {
+    if (!mpc_ast_eq(a->children[i], b->children[i])) { return 0; }
+  }
+
+  return 1;
+}
+
+mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+  if (r->arena) { mpc_ast_arena_add_child(r, a); return r; }
+  r->children_num++;
+  r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
+  r->children[r->children_num-1] = a;
+  return r;
+}
+
+mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
+  if (a == NULL) { return a; }
+  if (a->arena) { mpc_ast_arena_prefix(a, t, strlen(t), 1); return a; }
+  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
+  memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
+  memmove(a->tag, t, strlen(t));
+  memmove(a->tag + strlen(t), "|", 1);
+  return a;
+}
+
+mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
+  if (a == NULL) { return a; }
+  if (a->arena) { mpc_ast_arena_prefix(a, t, strlen(t)-1, 0); return a; }
+  a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
+  memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
+  memmove(a->tag, t, (strlen(t)-1));
+  return a;
+}
+
+mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
+  if (a->arena) { a->tag = mpc_ast_arena_intern(a->arena, t); return a; }
+  a->tag = realloc(a->tag, strlen(t) + 1);
+  strcpy(a->tag, t);
+  return a;
+}
+
+mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
+  if (a == NULL) { return a; }
+  a->state = s;
+  return a;
+}
+
+/*
+** Gives every node of `a` that is a slice of the
+** input its own terminated copy of the contents,
+** so the input can be freed and `contents` used
+** as a normal string again.
+*/
+
+mpc_ast_t *mpc_ast_materialise(mpc_ast_t *a) {
+
+  int i;
+  char *s;
+
+  if (a == NULL) { return a; }
+
+  if (a->arena && mpc_ast_arena_sliced(a->arena, a->contents)) {
+    s = mpc_ast_arena_alloc(a->arena, a->contents_len + 1);
+    memcpy(s, a->contents, a->contents_len);
+    s[a->contents_len] = '\0';
+    a->contents = s;
+  }
+
+  for (i = 0; i < a->children_num; i++) {
+    mpc_ast_materialise(a->children[i]);
+  }
+
+  return a;
+}
+
+static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
+
+  int i, n;
+
+  if (a == NULL) {
+    fprintf(fp, "NULL\n");
+    return;
+  }
+
+  for (i = 0; i < d; i++) { fprintf(fp, "  "); }
+
+  n = mpc_ast_contents_len(a);
+
+  if (n) {
+    fprintf(fp, "%s:%lu:%lu '%.*s'\n", a->tag,
+      (long unsigned int)(a->state.row+1),
+      (long unsigned int)(a->state.col+1),
+      n, a->contents);
+  } else {
+    fprintf(fp, "%s \n", a->tag);
+  }
+
+  for (i = 0; i < a->children_num; i++) {
+    mpc_ast_print_depth(a->children[i], d+1, fp);
+  }
+
+}
+
+void mpc_ast_print(mpc_ast_t *a) {
+  mpc_ast_print_depth(a, 0, stdout);
+}
+
+void mpc_ast_print_to(mpc_ast_t *a, FILE *fp) {
+  mpc_ast_print_depth(a, 0, fp);
+}
+
+int mpc_ast_get_index(mpc_ast_t *ast, const char *tag) {
+  return mpc_ast_get_index_lb(ast, tag, 0);
+}
+
+int mpc_ast_get_index_lb(mpc_ast_t *ast, const char *tag, int lb) {
+  int i;
+
+  for(i=lb; i<ast->children_num; i++) {
+    if(strcmp(ast->children[i]->tag, tag) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+mpc_ast_t *mpc_ast_get_child(mpc_ast_t *ast, const char *tag) {
+  return mpc_ast_get_child_lb(ast, tag, 0);
+}
+
+mpc_ast_t *mpc_ast_get_child_lb(mpc_ast_t *ast, const char *tag, int lb) {
+  int i;
+
+  for(i=lb; i<ast->children_num; i++) {
+    if(strcmp(ast->children[i]->tag, tag) == 0) {
+      return ast->children[i];
+    }
+  }
+
+  return NULL;
+}
+
+mpc_ast_trav_t *mpc_ast_traverse_start(mpc_ast_t *ast,
+                                       mpc_ast_trav_order_t order)
+{
+  mpc_ast_trav_t *trav, *n_trav;
+  mpc_ast_t *cnode = ast;
+
+  /* Create the traversal structure */
+  trav = malloc(sizeof(mpc_ast_trav_t));
+  trav->curr_node = cnode;
+  trav->parent = NULL;
+  trav->curr_child = 0;
+  trav->order = order;
+
+  /* Get start node */
+  switch(order) {
+    case mpc_ast_trav_order_pre:
+      /* Nothing else is needed for pre order start */
+      break;
+
+    case mpc_ast_trav_order_post:
+      while(cnode->children_num > 0) {
+        cnode = cnode->children[0];
+
+        n_trav = malloc(sizeof(mpc_ast_trav_t));
+        n_trav->curr_node = cnode;
+        n_trav->parent = trav;
+        n_trav->curr_child = 0;
+        n_trav->order = order;
+
+        trav = n_trav;
+      }
+
+      break;
+
+    default:
+      /* Unreachable, but compiler complaints */
+      break;
+  }
+
+  return trav;
+}
+
+mpc_ast_t *mpc_ast_traverse_next(mpc_ast_trav_t **trav) {
+  mpc_ast_trav_t *n_trav, *to_free;
+  mpc_ast_t *ret = NULL;
+  int cchild;
+
+  /* The end of traversal was reached */
+  if(*trav == NULL) return NULL;
+
+  switch((*trav)->order) {
+    case mpc_ast_trav_order_pre:
+      ret = (*trav)->curr_node;
+
+      /* If there aren't any more children, go up */
+      while(*trav != NULL &&
+        (*trav)->curr_child >= (*trav)->curr_node->children_num)
+      {
+        to_free = *trav;
+        *trav = (*trav)->parent;
+        free(to_free);
+      }
+
+      /* If trav is NULL, the end was reached */
+      if(*trav == NULL) {
+        break;
+      }
+
+      /* Go to next child */
+      n_trav = malloc(sizeof(mpc_ast_trav_t));
+
+      cchild = (*trav)->curr_child;
+      n_trav->curr_node = (*trav)->curr_node->children[cchild];
+      n_trav->parent = *trav;
+      n_trav->curr_child = 0;
+      n_trav->order = (*trav)->order;
+
+      (*trav)->curr_child++;
+      *trav = n_trav;
+
+      break;
+
+    case mpc_ast_trav_order_post:
+      ret = (*trav)->curr_node;
+
+      /* Move up tree to the parent If the parent doesn't have any more nodes,
+       * then this is the current node. If it does, move down to its left most
+       * child. Also, free the previous traversal node */
+      to_free = *trav;
+      *trav = (*trav)->parent;
+      free(to_free);
+
+      if(*trav == NULL)
+        break;
+
+      /* Next child */
+      (*trav)->curr_child++;
+
+      /* If there aren't any more children, this is the next node */
+      if((*trav)->curr_child >= (*trav)->curr_node->children_num) {
+        break;
+      }
+
+      /* If there are still more children, find the leftmost child from this
+       * node */
+      while((*trav)->curr_node->children_num > 0) {
+        n_trav = malloc(sizeof(mpc_ast_trav_t));
+
+        cchild = (*trav)->curr_child;
+        n_trav->curr_node = (*trav)->curr_node->children[cchild];
+        n_trav->parent = *trav;
+        n_trav->curr_child = 0;
+        n_trav->order = (*trav)->order;
+
+        *trav = n_trav;
+      }
+
+    default:
+      /* Unreachable, but compiler complaints */
+      break;
+  }
+
+  return ret;
+}
+
+void mpc_ast_traverse_free(mpc_ast_trav_t **trav) {
+  mpc_ast_trav_t *n_trav;
+
+  /* Go through parents until all are free */
+  while(*trav != NULL) {
+      n_trav = (*trav)->parent;
+      free(*trav);
+      *trav = n_trav;
+  }
+}
+
+/*
+** The iterator keeps the path from the root in one
+** array of frames, each holding a node and the
+** next of its children to visit, so walking the
+** tree allocates nothing per node. The frames can
+** be given by the caller. If the tree is deeper
+** than that the iterator doubles the array on the
+** heap, which `mpc_ast_iter_free` then releases.
+**
+** A child of -1 marks a node not yet visited.
+*/
+
+enum {
+  MPC_AST_ITER_STACK = 64
+};
+
+void mpc_ast_iter_start(mpc_ast_iter_t *it, mpc_ast_t *ast, mpc_ast_trav_order_t order,
+  mpc_ast_iter_frame_t *frames, int frames_slots) {
+
+  it->order = order;
+  it->depth = 0;
+  it->frames_num = 0;
+  it->frames_slots = frames ? frames_slots : 0;
+  it->frames_owned = 0;
+  it->frames = frames;
+
+  if (ast == NULL) { return; }
+
+  if (it->frames_slots == 0) {
+    it->frames_slots = MPC_AST_ITER_STACK;
+    it->frames = malloc(sizeof(mpc_ast_iter_frame_t) * it->frames_slots);
+    it->frames_owned = 1;
+  }
+
+  it->frames[0].node = ast;
+  it->frames[0].child = -1;
+  it->frames_num = 1;
+}
+
+static void mpc_ast_iter_push(mpc_ast_iter_t *it, mpc_ast_t *a) {
+
+  mpc_ast_iter_frame_t *frames;
+
+  if (it->frames_num == it->frames_slots) {
+    if (it->frames_owned) {
+      frames = realloc(it->frames, sizeof(mpc_ast_iter_frame_t) * it->frames_slots * 2);
+    } else {
+      frames = malloc(sizeof(mpc_ast_iter_frame_t) * it->frames_slots * 2);
+      memcpy(frames, it->frames, sizeof(mpc_ast_iter_frame_t) * it->frames_num);
+    }
+    it->frames = frames;
+    it->frames_slots *= 2;
+    it->frames_owned = 1;
+  }
+
+  it->frames[it->frames_num].node = a;
+  it->frames[it->frames_num].child = -1;
+  it->frames_num++;
+}
+
+mpc_ast_t *mpc_ast_iter_next(mpc_ast_iter_t *it) {
+
+  mpc_ast_iter_frame_t *f;
+  mpc_ast_t *a;
+
+  while (it->frames_num > 0) {
+
+    f = &it->frames[it->frames_num-1];
+
+    if (f->child == -1) {
+      f->child = 0;
+      if (it->order == mpc_ast_trav_order_pre) {
+        it->depth = it->frames_num-1;
+        return f->node;
+      }
+    }
+
+    if (f->child < f->node->children_num) {
+      a = f->node->children[f->child++];
+      if (a) { mpc_ast_iter_push(it, a); }
+      continue;
+    }
+
+    it->frames_num--;
+    if (it->order == mpc_ast_trav_order_post) {
+      it->depth = it->frames_num;
+      return f->node;
+    }
+  }
+
+  return NULL;
+}
+
+void mpc_ast_iter_free(mpc_ast_iter_t *it) {
+  if (it->frames_owned) { free(it->frames); }
+  it->frames = NULL;
+  it->frames_num = 0;
+  it->frames_slots = 0;
+  it->frames_owned = 0;
+}
+
+/*
+** Calls `f` with each node, its depth and `d`. The
+** walk stops at the first call to return non-zero
+** and that value is returned.
+*/
+
+int mpc_ast_visit(mpc_ast_t *ast, mpc_ast_trav_order_t order, mpc_ast_visit_t f, void *d) {
+
+  mpc_ast_iter_frame_t frames[MPC_AST_ITER_STACK];
+  mpc_ast_iter_t it;
+  mpc_ast_t *a;
+  int x = 0;
+
+  mpc_ast_iter_start(&it, ast, order, frames, MPC_AST_ITER_STACK);
+  while (x == 0 && (a = mpc_ast_iter_next(&it))) {
+    x = f(a, it.depth, d);
+  }
+  mpc_ast_iter_free(&it);
+
+  return x;
+}
+
+mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+
+  int i, j;
+  mpc_ast_t** as = (mpc_ast_t**)xs;
+  mpc_ast_t *r;
+
+  if (n == 0) { return NULL; }
+  if (n == 1) { return xs[0]; }
+  if (n == 2 && xs[1] == NULL) { return xs[0]; }
+  if (n == 2 && xs[0] == NULL) { return xs[1]; }
+
+  r = mpc_ast_new(">", "");
+
+  for (i = 0; i < n; i++) {
+
+    if (as[i] == NULL) { continue; }
+
+    if        (as[i] && as[i]->children_num == 0) {
+      mpc_ast_add_child(r, as[i]);
+    } else if (as[i] && as[i]->children_num == 1) {
+      mpc_ast_add_child(r, mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
+      mpc_ast_delete_no_children(as[i]);
+    } else if (as[i] && as[i]->children_num >= 2) {
+      for (j = 0; j < as[i]->children_num; j++) {
+        mpc_ast_add_child(r, as[i]->children[j]);
+      }
+      mpc_ast_delete_no_children(as[i]);
+    }
+
+  }
+
+  if (r->children_num) {
+    r->state = r->children[0]->state;
+  }
+
+  return r;
+}
+
+mpc_val_t *mpcf_fold_ast_tuple(int n, mpc_val_t **xs) {
+  int m;
+  mpc_val_t *stk[MPC_TUPLE_STACK], *r;
+  mpc_val_t **ys = mpc_tuple_splice(n, xs, stk, &m);
+  r = mpcf_fold_ast(m, ys);
+  if (ys != stk) { free(ys); }
+  return r;
+}
+
+mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
+  mpc_ast_t *a = mpc_ast_new("", c);
+  free(c);
+  return a;
+}
+
+mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs) {
+  mpc_state_t *s = ((mpc_state_t**)xs)[0];
+  mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
+  (void)n;
+  a = mpc_ast_state(a, *s);
+  free(s);
+  return a;
+}
+
+mpc_parser_t *mpca_state(mpc_parser_t *a) {
+  return mpc_and(2, mpcf_state_ast, mpc_state(), a, free);
+}
+
+mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t) {
+  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t);
+}
+
+mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
+  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
+}
+
+mpc_parser_t *mpca_root(mpc_parser_t *a) {
+  return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
+}
+
+mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
+mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
+mpc_parser_t *mpca_memo(mpc_parser_t *a) { return mpc_memo(a, (mpc_apply_t)mpc_ast_copy, (mpc_dtor_t)mpc_ast_delete); }
+
+mpc_parser_t *mpca_arena(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_ARENA;
+  p->data.predict.x = a;
+  return p;
+}
+mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
+mpc_parser_t *mpca_many1(mpc_parser_t *a) { return mpc_many1(mpcf_fold_ast, a); }
+mpc_parser_t *mpca_count(int n, mpc_parser_t *a) { return mpc_count(n, mpcf_fold_ast, a, (mpc_dtor_t)mpc_ast_delete); }
+
+mpc_parser_t *mpca_or(int n, ...) {
+
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+
+  p->type = MPC_TYPE_OR;
+  p->data.or.n = n;
+  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+
+  va_start(va, n);
+  for (i = 0; i < n; i++) {
+    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  va_end(va);
+
+  return p;
+
+}
+
+mpc_parser_t *mpca_and(int n, ...) {
+
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+
+  p->type = MPC_TYPE_AND;
+  p->data.and.n = n;
+  p->data.and.f = mpcf_fold_ast;
+  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+
+  va_start(va, n);
+  for (i = 0; i < n; i++) {
+    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  for (i = 0; i < (n-1); i++) {
+    p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete;
+  }
+  va_end(va);
+
+  return p;
+}
+
+mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
+
+/*
+** Grammar Parser
+*/
+
+/*
+** This is another interesting bootstrapping.
+**
+** Having a general purpose AST type allows
+** users to specify the grammar alone and
+** let all fold rules be automatically taken
+** care of by existing functions.
+**
+** You don't get to control the type spat
+** out but this means you can make a nice
+** parser to take in some grammar in nice
+** syntax and spit out a parser that works.
+**
+** The grammar for this looks surprisingly
+** like regex but the main difference is that
+** it is now whitespace insensitive and the
+** base type takes literals of some form.
+*/
+
+/*
+**
+**  ### Grammar Grammar
+**
+**      <grammar> : (<term> "|" <grammar>) | <term>
+**
+**      <term> : <factor>*
+**
+**      <factor> : <base>
+**               | <base> "*"
+**               | <base> "+"
+**               | <base> "?"
+**               | <base> "{" <digits> "}"
+**
+**      <base> : "<" (<digits> | <ident>) ">"
+**             | <string_lit>
+**             | <char_lit>
+**             | <regex_lit> <regex_mode>
+**             | "(" <grammar> ")"
+*/
+
+typedef struct {
+  va_list *va;
+  int parsers_num;
+  mpc_parser_t **parsers;
+  int flags;
+  char **report;
+} mpca_grammar_st_t;
+
+static mpc_val_t *mpcaf_grammar_or(int n, mpc_val_t **xs) {
+  (void) n;
+  if (xs[1] == NULL) { return xs[0]; }
+  else { return mpca_or(2, xs[0], xs[1]); }
+}
+
+static mpc_val_t *mpcaf_grammar_and(int n, mpc_val_t **xs) {
+  int i;
+  mpc_parser_t *p = mpc_pass();
+  for (i = 0; i < n; i++) {
+    if (xs[i] != NULL) { p = mpca_and(2, p, xs[i]); }
+  }
+  return p;
+}
+
+static mpc_val_t *mpcaf_grammar_repeat(int n, mpc_val_t **xs) {
+  int num;
+  (void) n;
+  if (xs[1] == NULL) { return xs[0]; }
+  switch(((char*)xs[1])[0])
+  {
+    case '*': { free(xs[1]); return mpca_many(xs[0]); }; break;
+    case '+': { free(xs[1]); return mpca_many1(xs[0]); }; break;
+    case '?': { free(xs[1]); return mpca_maybe(xs[0]); }; break;
+    case '!': { free(xs[1]); return mpca_not(xs[0]); }; break;
+    default:
+      num = *((int*)xs[1]);
+      free(xs[1]);
+  }
+  return mpca_count(num, xs[0]);
+}
+
+static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
+  mpca_grammar_st_t *st = s;
+  char *y = mpcf_unescape(x);
+  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
+  free(y);
+  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"));
+}
+
+static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
+  mpca_grammar_st_t *st = s;
+  char *y = mpcf_unescape(x);
+  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
+  free(y);
+  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"));
+}
+
+static mpc_val_t *mpcaf_fold_regex(int n, mpc_val_t **xs) {
+  char *y = xs[0];
+  char *m = xs[1];
+  mpca_grammar_st_t *st = xs[2];
+  mpc_parser_t *p;
+  int mode = MPC_RE_DEFAULT;
+
+  (void)n;
+  if (strchr(m, 'm')) { mode |= MPC_RE_MULTILINE; }
+  if (strchr(m, 's')) { mode |= MPC_RE_DOTALL; }
+  y = mpcf_unescape_regex(y);
+  p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re_mode(y, mode) : mpc_tok(mpc_re_mode(y, mode));
+  free(y);
+  free(m);
+
+  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
+}
+
+/* Should this just use `isdigit` instead? */
+static int is_number(const char* s) {
+  size_t i;
+  for (i = 0; i < strlen(s); i++) { if (!strchr("0123456789", s[i])) { return 0; } }
+  return 1;
+}
+
+static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
+
+  int i;
+  mpc_parser_t *p;
+
+  /* Case of Number */
+  if (is_number(x)) {
+
+    i = strtol(x, NULL, 10);
+
+    if (st->va == NULL) {
+      return mpc_failf("No Parser in position %i!", i);
+    }
+
+    while (st->parsers_num <= i) {
+      st->parsers_num++;
+      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
+      st->parsers[st->parsers_num-1] = va_arg(*st->va, mpc_parser_t*);
+      if (st->parsers[st->parsers_num-1] == NULL) {
+        return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
+      }
+    }
+
+    return st->parsers[st->parsers_num-1];
+
+  /* Case of Identifier */
+  } else {
+
+    /* Search Existing Parsers */
+    for (i = 0; i < st->parsers_num; i++) {
+      mpc_parser_t *q = st->parsers[i];
+      if (q == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
+      if (q->name && strcmp(q->name, x) == 0) { return q; }
+    }
+
+    /* Without a list of parsers they are made as needed */
+    if (st->va == NULL) {
+      p = mpc_new(x);
+      st->parsers_num++;
+      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
+      st->parsers[st->parsers_num-1] = p;
+      return p;
+    }
+
+    /* Search New Parsers */
+    while (1) {
+
+      p = va_arg(*st->va, mpc_parser_t*);
+
+      st->parsers_num++;
+      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
+      st->parsers[st->parsers_num-1] = p;
+
+      if (p == NULL || p->name == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
+      if (p->name && strcmp(p->name, x) == 0) { return p; }
+
+    }
+
+  }
+
+}
+
+static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
+
+  mpca_grammar_st_t *st = s;
+  mpc_parser_t *p = mpca_grammar_find_parser(x, st);
+  free(x);
+
+  if (p->name) {
+    return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
+  } else {
+    return mpca_state(mpca_root(p));
+  }
+}
+
+mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
+
+  char *err_msg;
+  mpc_parser_t *err_out;
+  mpc_result_t r;
+  mpc_parser_t *GrammarTotal, *Grammar, *Term, *Factor, *Base;
+
+  GrammarTotal = mpc_new("grammar_total");
+  Grammar = mpc_new("grammar");
+  Term = mpc_new("term");
+  Factor = mpc_new("factor");
+  Base = mpc_new("base");
+
+  mpc_define(GrammarTotal,
+    mpc_predictive(mpc_total(Grammar, mpc_soft_delete))
+  );
+
+  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
+    Term,
+    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
+    mpc_soft_delete
+  ));
+
+  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+
+  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
+    Base,
+      mpc_or(6,
+        mpc_sym("*"),
+        mpc_sym("+"),
+        mpc_sym("?"),
+        mpc_sym("!"),
+        mpc_tok_brackets(mpc_int(), free),
+        mpc_pass()),
+    mpc_soft_delete
+  ));
+
+  mpc_define(Base, mpc_or(5,
+    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
+    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
+    mpc_tok(mpc_and(3, mpcaf_fold_regex, mpc_regex_lit(), mpc_many(mpcf_strfold, mpc_oneof("ms")), mpc_lift_val(st), free, free)),
+    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
+    mpc_tok_parens(Grammar, mpc_soft_delete)
+  ));
+
+  mpc_optimise_unretained(GrammarTotal, 1, 0);
+  mpc_optimise_unretained(Grammar, 1, 0);
+  mpc_optimise_unretained(Factor, 1, 0);
+  mpc_optimise_unretained(Term, 1, 0);
+  mpc_optimise_unretained(Base, 1, 0);
+
+  if(!mpc_parse("<mpc_grammar_compiler>", grammar, GrammarTotal, &r)) {
+    err_msg = mpc_err_string(r.error);
+    err_out = mpc_failf("Invalid Grammar: %s", err_msg);
+    mpc_err_delete(r.error);
+    free(err_msg);
+    r.output = err_out;
+  }
+
+  mpc_cleanup(5, GrammarTotal, Grammar, Term, Factor, Base);
+
+  /* Wrapped first so that it is not factored */
+  if (st->flags & MPCA_LANG_PREDICTIVE) { r.output = mpc_predictive(r.output); }
+
+  mpc_optimise(r.output);
+
+  return r.output;
+
+}
+
+mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...) {
+  mpca_grammar_st_t st;
+  mpc_parser_t *res;
+  va_list va;
+  va_start(va, grammar);
+
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  st.report = NULL;
+
+  res = mpca_grammar_st(grammar, &st);
+  free(st.parsers);
+  va_end(va);
+  return res;
+}
+
+typedef struct {
+  char *ident;
+  char *name;
+  mpc_parser_t *grammar;
+} mpca_stmt_t;
+
+static mpc_val_t *mpca_stmt_afold(int n, mpc_val_t **xs) {
+  mpca_stmt_t *stmt = malloc(sizeof(mpca_stmt_t));
+  stmt->ident = ((char**)xs)[0];
+  stmt->name = ((char**)xs)[1];
+  stmt->grammar = ((mpc_parser_t**)xs)[3];
+  (void) n;
+  free(((char**)xs)[2]);
+  free(((char**)xs)[4]);
+
+  return stmt;
+}
+
+static mpc_val_t *mpca_stmt_fold(int n, mpc_val_t **xs) {
+
+  int i;
+  mpca_stmt_t **stmts = malloc(sizeof(mpca_stmt_t*) * (n+1));
+
+  for (i = 0; i < n; i++) {
+    stmts[i] = xs[i];
+  }
+  stmts[n] = NULL;
+
+  return stmts;
+}
+
+static void mpca_stmt_list_delete(mpc_val_t *x) {
+
+  mpca_stmt_t **stmts = x;
+
+  while(*stmts) {
+    mpca_stmt_t *stmt = *stmts;
+    free(stmt->ident);
+    free(stmt->name);
+    mpc_soft_delete(stmt->grammar);
+    free(stmt);
+    stmts++;
+  }
+  free(x);
+
+}
+
+static char *mpc_ll1_report(mpc_parser_t **rules, int n);
+
+static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
+
+  mpca_grammar_st_t *st = s;
+  mpca_stmt_t *stmt;
+  mpca_stmt_t **stmts = x;
+  mpc_parser_t *left;
+  mpc_parser_t **rules;
+  int n = 0;
+
+  while (stmts[n]) { n++; }
+  rules = malloc(sizeof(mpc_parser_t*) * (n+1));
+  n = 0;
+
+  while(*stmts) {
+    stmt = *stmts;
+    left = mpca_grammar_find_parser(stmt->ident, st);
+    rules[n++] = left;
+    if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
+    if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+    /* Memoised ASTs are cheapest to store and hand out inside an arena */
+    if (st->flags & MPCA_LANG_PACKRAT) { stmt->grammar = mpca_arena(mpca_memo(stmt->grammar)); }
+    mpc_optimise(stmt->grammar);
+    mpc_define(left, stmt->grammar);
+    free(stmt->ident);
+    free(stmt->name);
+    free(stmt);
+    stmts++;
+  }
+
+  /* Rules can only be checked once all are defined */
+  if (st->report) { *st->report = mpc_ll1_report(rules, n); }
+
+  free(rules);
+  free(x);
+
+  return NULL;
+}
+
+static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
+
+  mpc_result_t r;
+  mpc_err_t *e;
+  mpc_parser_t *Lang, *Stmt, *Grammar, *Term, *Factor, *Base;
+
+  Lang    = mpc_new("lang");
+  Stmt    = mpc_new("stmt");
+  Grammar = mpc_new("grammar");
+  Term    = mpc_new("term");
+  Factor  = mpc_new("factor");
+  Base    = mpc_new("base");
+
+  mpc_define(Lang, mpc_apply_to(
+    mpc_total(mpc_predictive(mpc_many(mpca_stmt_fold, Stmt)), mpca_stmt_list_delete),
+    mpca_stmt_list_apply_to, st
+  ));
+
+  mpc_define(Stmt, mpc_and(5, mpca_stmt_afold,
+    mpc_tok(mpc_ident()), mpc_maybe(mpc_tok(mpc_string_lit())), mpc_sym(":"), Grammar, mpc_sym(";"),
+    free, free, free, mpc_soft_delete
+  ));
+
+  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
+      Term,
+      mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
+      mpc_soft_delete
+  ));
+
+  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+
+  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
+    Base,
+      mpc_or(6,
+        mpc_sym("*"),
+        mpc_sym("+"),
+        mpc_sym("?"),
+        mpc_sym("!"),
+        mpc_tok_brackets(mpc_int(), free),
+        mpc_pass()),
+    mpc_soft_delete
+  ));
+
+  mpc_define(Base, mpc_or(5,
+    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
+    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
+    mpc_tok(mpc_and(3, mpcaf_fold_regex, mpc_regex_lit(), mpc_many(mpcf_strfold, mpc_oneof("ms")), mpc_lift_val(st), free, free)),
+    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
+    mpc_tok_parens(Grammar, mpc_soft_delete)
+  ));
+
+  mpc_optimise_unretained(Lang, 1, 0);
+  mpc_optimise_unretained(Stmt, 1, 0);
+  mpc_optimise_unretained(Grammar, 1, 0);
+  mpc_optimise_unretained(Term, 1, 0);
+  mpc_optimise_unretained(Factor, 1, 0);
+  mpc_optimise_unretained(Base, 1, 0);
+
+  if (!mpc_parse_input(i, Lang, &r)) {
+    e = r.error;
+  } else {
+    e = NULL;
+  }
+
+  mpc_cleanup(6, Lang, Stmt, Grammar, Term, Factor, Base);
+
+  return e;
+}
+
+mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
+
+  va_list va;
+  va_start(va, f);
+
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  st.report = NULL;
+
+  i = mpc_input_new_file("<mpca_lang_file>", f);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
+
+  free(st.parsers);
+  va_end(va);
+  return err;
+}
+
+mpc_err_t *mpca_lang_pipe(int flags, FILE *p, ...) {
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
+
+  va_list va;
+  va_start(va, p);
+
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  st.report = NULL;
+
+  i = mpc_input_new_pipe("<mpca_lang_pipe>", p);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
+
+  free(st.parsers);
+  va_end(va);
+  return err;
+}
+
+mpc_err_t *mpca_lang(int flags, const char *language, ...) {
+
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
+
+  va_list va;
+  va_start(va, language);
+
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  st.report = NULL;
+
+  i = mpc_input_new_string("<mpca_lang>", language);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
+
+  free(st.parsers);
+  va_end(va);
+  return err;
+}
+
+mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
+
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
+
+  va_list va;
 
-  int mode = *((int*)data);
-  char *s = x;
-  mpc_parser_t *p;
+  FILE *f = fopen(filename, "rb");
 
-  /* Any Character */
-  if (s[0] == '.') {
-    free(s);
-    if (mode & MPC_RE_DOTALL) {
-      return mpc_any();
-    } else {
-      return mpc_expect(mpc_noneof("\n"), "any character except a newline");
-    }
+  if (f == NULL) {
+    err = mpc_err_file(filename, "Unable to open file!");
+    return err;
   }
 
-  /* Start of Input */
-  if (s[0] == '^') {
-    free(s);
-    if (mode & MPC_RE_MULTILINE) {
-      return mpc_and(2, mpcf_snd, mpc_or(2, mpc_soi(), mpc_boundary_newline()), mpc_lift(mpcf_ctor_str), free);
-    } else {
-      return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
-    }
-  }
+  va_start(va, filename);
 
-  /* End of Input */
-  if (s[0] == '$') {
-    free(s);
-    if (mode & MPC_RE_MULTILINE) {
-      return mpc_or(2,
-        mpc_newline(),
-        mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free));
-    } else {
-      return mpc_or(2,
-        mpc_and(2, mpcf_fst, mpc_newline(), mpc_eoi(), free),
-        mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free));
-    }
-  }
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  st.report = NULL;
 
-  /* Regex Escape */
-  if (s[0] == '\\') {
-    p = mpc_re_escape_char(s[1]);
-    p = (p == NULL) ? mpc_char(s[1]) : p;
-    free(s);
-    return p;
-  }
+  i = mpc_input_new_file(filename, f);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
 
-  /* Regex Standard */
-  p = mpc_char(s[0]);
-  free(s);
-  return p;
-}
+  free(st.parsers);
+  va_end(va);
 
-static const char *mpc_re_range_escape_char(char c) {
-  switch (c) {
-    case '-': return "-";
-    case 'a': return "\a";
-    case 'f': return "\f";
-    case 'n': return "\n";
-    case 'r': return "\r";
-    case 't': return "\t";
-    case 'v': return "\v";
-    case 'b': return "\b";
-    case 'd': return "0123456789";
-    case 's': return " \f\n\r\t\v";
-    case 'w': return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
-    default: return NULL;
-  }
+  fclose(f);
+
+  return err;
 }
 
-static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+/*
+** Code Generation
+*/
 
-  mpc_parser_t *out;
-  size_t i, j;
-  size_t start, end;
-  const char *tmp = NULL;
-  const char *s = x;
-  int comp = s[0] == '^' ? 1 : 0;
-  char *range = calloc(1,1);
+/*
+** `mpca_codegen` turns a grammar into C code that
+** parses it directly. Every node of the optimised
+** parser graph becomes a function which does its
+** work inline and calls its actions by name, so
+** nothing is left to dispatch on parser types. The
+** rule `r` is parsed by `<prefix>_parse_r`, which
+** is called like `mpc_parse` on a string and gives
+** the same output.
+**
+** The generated code never builds errors. When a
+** parse fails the input is parsed again with the
+** grammar built by `mpca_lang` to get the error,
+** much as `mpc_fastfail` does it. This grammar is
+** built by `<prefix>_init`, which must be called
+** once before parsing and before any threads are
+** started, and which returns any error building it.
+**
+** Actions are called by name so only the ones from
+** this library can be used, which covers anything
+** `mpca_lang` builds by itself.
+*/
 
-  if (s[0] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
-  if (s[0] == '^' &&
-      s[1] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
+typedef void (*mpc_codegen_fn_t)(void);
 
-  for (i = comp; i < strlen(s); i++){
+/* What an action is used as, so loaded grammars can only call it that way */
+enum {
+  MPC_ACTION_DTOR,
+  MPC_ACTION_CTOR,
+  MPC_ACTION_APPLY,
+  MPC_ACTION_APPLY_TO,
+  MPC_ACTION_FOLD,
+  MPC_ACTION_CHECK
+};
 
-    /* Regex Range Escape */
-    if (s[i] == '\\') {
-      tmp = mpc_re_range_escape_char(s[i+1]);
-      if (tmp != NULL) {
-        range = realloc(range, strlen(range) + strlen(tmp) + 1);
-        strcat(range, tmp);
-      } else {
-        range = realloc(range, strlen(range) + 1 + 1);
-        range[strlen(range) + 1] = '\0';
-        range[strlen(range) + 0] = s[i+1];
-      }
-      i++;
-    }
+typedef struct {
+  mpc_codegen_fn_t f;
+  const char *name;
+  int kind;
+} mpc_codegen_name_t;
+
+/* Serialised grammars refer to these by index so new ones go at the end */
+static const mpc_codegen_name_t mpc_codegen_names[] = {
+  { (mpc_codegen_fn_t)free,                    "free",                     MPC_ACTION_DTOR },
+  { (mpc_codegen_fn_t)mpcf_dtor_null,          "mpcf_dtor_null",           MPC_ACTION_DTOR },
+  { (mpc_codegen_fn_t)mpcf_ctor_null,          "mpcf_ctor_null",           MPC_ACTION_CTOR },
+  { (mpc_codegen_fn_t)mpcf_ctor_str,           "mpcf_ctor_str",            MPC_ACTION_CTOR },
+  { (mpc_codegen_fn_t)mpcf_free,               "mpcf_free",                MPC_ACTION_APPLY },
+  { (mpc_codegen_fn_t)mpcf_int,                "mpcf_int",                 MPC_ACTION_APPLY },
+  { (mpc_codegen_fn_t)mpcf_hex,                "mpcf_hex",                 MPC_ACTION_APPLY },
+  { (mpc_codegen_fn_t)mpcf_oct,                "mpcf_oct",                 MPC_ACTION_APPLY },
+  { (mpc_codegen_fn_t)mpcf_float,              "mpcf_float",               MPC_ACTION_APPLY },
+  { (mpc_codegen_fn_t)mpcf_strtriml,           "mpcf_strtriml",            MPC_ACTION_APPLY },
+  { (mpc_codegen_fn_t)mpcf_strtrimr,           "mpcf_strtrimr",            MPC_ACTION_APPLY },
+  { (mpc_codegen_fn_t)mpcf_strtrim,            "mpcf_strtrim",             MPC_ACTION_APPLY },
+  { (mpc_codegen_fn_t)mpcf_escape,             "mpcf_escape",              MPC_ACTION_APPLY },
+  { (mpc_codegen_fn_t)mpcf_escape_regex,       "mpcf_escape_regex",        MPC_ACTION_APPLY },
+  { (mpc_codegen_fn_t)mpcf_escape_string_raw,  "mpcf_escape_string_raw",   MPC_ACTION_APPLY },
+  { (mpc_codegen_fn_t)mpcf_escape_char_raw,    "mpcf_escape_char_raw",     MPC_ACTION_APPLY },
+  { (mpc_codegen_fn_t)mpcf_unescape,           "mpcf_unescape",            MPC_ACTION_APPLY },
+  { (mpc_codegen_fn_t)mpcf_unescape_regex,     "mpcf_unescape_regex",      MPC_ACTION_APPLY },
+  { (mpc_codegen_fn_t)mpcf_unescape_string_raw, "mpcf_unescape_string_raw", MPC_ACTION_APPLY },
+  { (mpc_codegen_fn_t)mpcf_unescape_char_raw,  "mpcf_unescape_char_raw",   MPC_ACTION_APPLY },
+  { (mpc_codegen_fn_t)mpcf_null,               "mpcf_null",                MPC_ACTION_FOLD },
+  { (mpc_codegen_fn_t)mpcf_fst,                "mpcf_fst",                 MPC_ACTION_FOLD },
+  { (mpc_codegen_fn_t)mpcf_snd,                "mpcf_snd",                 MPC_ACTION_FOLD },
+  { (mpc_codegen_fn_t)mpcf_trd,                "mpcf_trd",                 MPC_ACTION_FOLD },
+  { (mpc_codegen_fn_t)mpcf_fst_free,           "mpcf_fst_free",            MPC_ACTION_FOLD },
+  { (mpc_codegen_fn_t)mpcf_snd_free,           "mpcf_snd_free",            MPC_ACTION_FOLD },
+  { (mpc_codegen_fn_t)mpcf_trd_free,           "mpcf_trd_free",            MPC_ACTION_FOLD },
+  { (mpc_codegen_fn_t)mpcf_all_free,           "mpcf_all_free",            MPC_ACTION_FOLD },
+  { (mpc_codegen_fn_t)mpcf_strfold,            "mpcf_strfold",             MPC_ACTION_FOLD },
+  { (mpc_codegen_fn_t)mpcf_maths,              "mpcf_maths",               MPC_ACTION_FOLD },
+  { (mpc_codegen_fn_t)mpcf_fold_ast,           "mpcf_fold_ast",            MPC_ACTION_FOLD },
+  { (mpc_codegen_fn_t)mpcf_str_ast,            "mpcf_str_ast",             MPC_ACTION_APPLY },
+  { (mpc_codegen_fn_t)mpcf_state_ast,          "mpcf_state_ast",           MPC_ACTION_FOLD },
+  { (mpc_codegen_fn_t)mpc_ast_tag,             "mpc_ast_tag",              MPC_ACTION_APPLY_TO },
+  { (mpc_codegen_fn_t)mpc_ast_add_tag,         "mpc_ast_add_tag",          MPC_ACTION_APPLY_TO },
+  { (mpc_codegen_fn_t)mpc_ast_add_root,        "mpc_ast_add_root",         MPC_ACTION_APPLY },
+  { (mpc_codegen_fn_t)mpc_ast_delete,          "mpc_ast_delete",           MPC_ACTION_DTOR },
+  { (mpc_codegen_fn_t)mpc_ast_copy,            "mpc_ast_copy",             MPC_ACTION_APPLY },
+  { (mpc_codegen_fn_t)mpcf_tuple,              "mpcf_tuple",               MPC_ACTION_FOLD },
+  { (mpc_codegen_fn_t)mpcf_fold_ast_tuple,     "mpcf_fold_ast_tuple",      MPC_ACTION_FOLD },
+  { NULL, NULL, 0 }
+};
 
-    /* Regex Range...Range */
-    else if (s[i] == '-') {
-      if (s[i+1] == '\0' || i == 0) {
-          range = realloc(range, strlen(range) + strlen("-") + 1);
-          strcat(range, "-");
-      } else {
-        start = s[i-1]+1;
-        end = s[i+1]-1;
-        for (j = start; j <= end; j++) {
-          range = realloc(range, strlen(range) + 1 + 1 + 1);
-          range[strlen(range) + 1] = '\0';
-          range[strlen(range) + 0] = (char)j;
-        }
-      }
-    }
+typedef struct {
+  FILE *f;
+  const char *prefix;
+  mpc_lower_t l;
+  int next, take, rewind, has, string, span, grow, dfa;
+  int boundary, boundary_newline;
+  char err[128];
+} mpc_codegen_t;
+
+static const char *mpc_codegen_name(mpc_codegen_fn_t f) {
+  int j;
+  for (j = 0; mpc_codegen_names[j].f; j++) {
+    if (mpc_codegen_names[j].f == f) { return mpc_codegen_names[j].name; }
+  }
+  return NULL;
+}
 
-    /* Regex Range Normal */
-    else {
-      range = realloc(range, strlen(range) + 1 + 1);
-      range[strlen(range) + 1] = '\0';
-      range[strlen(range) + 0] = s[i];
-    }
+/* Writes a format where every `$` is the prefix */
+static void mpc_codegen_put(mpc_codegen_t *g, const char *fmt, ...) {
+
+  va_list va;
+  const char *c;
+  char *y, *x = malloc(strlen(fmt) * (strlen(g->prefix) + 1) + 1);
 
+  for (c = fmt, y = x; *c; c++) {
+    if (*c == '$') { strcpy(y, g->prefix); y += strlen(g->prefix); }
+    else { *y++ = *c; }
   }
+  *y = '\0';
 
-  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+  va_start(va, fmt);
+  vfprintf(g->f, x, va);
+  va_end(va);
 
   free(x);
-  free(range);
+}
 
-  return out;
+static void mpc_codegen_char(FILE *f, char c) {
+  if (c == '\'' || c == '\\') { fprintf(f, "'\\%c'", c); }
+  else if (isprint((unsigned char)c)) { fprintf(f, "'%c'", c); }
+  else { fprintf(f, "'\\%03o'", (unsigned char)c); }
 }
 
-mpc_parser_t *mpc_re(const char *re) {
-  return mpc_re_mode(re, MPC_RE_DEFAULT);
+static void mpc_codegen_string(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') { fprintf(f, "\\%c", *s); }
+    else if (*s == '\n') { fprintf(f, "\\n\"\n  \""); }
+    else if (isprint((unsigned char)*s) && *s != '?') { fputc(*s, f); }
+    else { fprintf(f, "\\%03o", (unsigned char)*s); }
+  }
+  fputc('"', f);
 }
 
-mpc_parser_t *mpc_re_mode(const char *re, int mode) {
+static void mpc_codegen_set(FILE *f, const unsigned char *set) {
+  int j;
+  fprintf(f, "{");
+  for (j = 0; j < MPC_FIRST_BYTES; j++) {
+    fprintf(f, "%s%i", j ? "," : "", set[j]);
+  }
+  fprintf(f, "}");
+}
 
-  char *err_msg;
-  mpc_parser_t *err_out;
-  mpc_result_t r;
-  mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose;
+static int mpc_codegen_fail(mpc_codegen_t *g, mpc_parser_t *p, const char *what) {
+  if (p->name) {
+    sprintf(g->err, "Can not generate code for %.32s in '%.32s'!", what, p->name);
+  } else {
+    sprintf(g->err, "Can not generate code for %.32s!", what);
+  }
+  return 0;
+}
 
-  Regex  = mpc_new("regex");
-  Term   = mpc_new("term");
-  Factor = mpc_new("factor");
-  Base   = mpc_new("base");
-  Range  = mpc_new("range");
+static int mpc_codegen_known(mpc_codegen_t *g, mpc_parser_t *p, mpc_codegen_fn_t f) {
+  if (f == NULL || mpc_codegen_name(f)) { return 1; }
+  return mpc_codegen_fail(g, p, "an unknown action");
+}
 
-  mpc_define(Regex, mpc_and(2, mpcf_re_or,
-    Term,
-    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_char('|'), Regex, free)),
-    (mpc_dtor_t)mpc_delete
-  ));
+/*
+** Checks a parser can be generated, notes which
+** helpers it needs, and gives an index to each of
+** its children.
+*/
 
-  mpc_define(Term, mpc_many(mpcf_re_and, Factor));
+static int mpc_codegen_lower(mpc_codegen_t *g, mpc_parser_t *p) {
 
-  mpc_define(Factor, mpc_and(2, mpcf_re_repeat,
-    Base,
-    mpc_or(5,
-      mpc_char('*'), mpc_char('+'), mpc_char('?'),
-      mpc_brackets(mpc_int(), free),
-      mpc_pass()),
-    (mpc_dtor_t)mpc_delete
-  ));
+  int j;
+  mpc_lower_t *l = &g->l;
 
-  mpc_define(Base, mpc_or(4,
-    mpc_parens(Regex, (mpc_dtor_t)mpc_delete),
-    mpc_squares(Range, (mpc_dtor_t)mpc_delete),
-    mpc_apply_to(mpc_escape(), mpcf_re_escape, &mode),
-    mpc_apply_to(mpc_noneof(")|"), mpcf_re_escape, &mode)
-  ));
+  switch (p->type) {
 
-  mpc_define(Range, mpc_apply(
-    mpc_many(mpcf_strfold, mpc_or(2, mpc_escape(), mpc_noneof("]"))),
-    mpcf_re_range
-  ));
+    case MPC_TYPE_PASS: case MPC_TYPE_FAIL:
+    case MPC_TYPE_STATE: case MPC_TYPE_SOI: case MPC_TYPE_EOI:
+      return 1;
 
-  RegexEnclose = mpc_whole(mpc_predictive(Regex), (mpc_dtor_t)mpc_delete);
+    case MPC_TYPE_ANY: case MPC_TYPE_SINGLE: case MPC_TYPE_RANGE:
+      g->next = g->take = 1;
+      return 1;
 
-  mpc_optimise(RegexEnclose);
-  mpc_optimise(Regex);
-  mpc_optimise(Term);
-  mpc_optimise(Factor);
-  mpc_optimise(Base);
-  mpc_optimise(Range);
+    case MPC_TYPE_ONEOF: case MPC_TYPE_NONEOF: case MPC_TYPE_CLASS:
+      g->next = g->take = g->has = 1;
+      return 1;
 
-  if(!mpc_parse("<mpc_re_compiler>", re, RegexEnclose, &r)) {
-    err_msg = mpc_err_string(r.error);
-    err_out = mpc_failf("Invalid Regex: %s", err_msg);
-    mpc_err_delete(r.error);
-    free(err_msg);
-    r.output = err_out;
-  }
+    case MPC_TYPE_STRING:
+      g->next = g->rewind = g->string = 1;
+      return 1;
 
-  mpc_cleanup(6, RegexEnclose, Regex, Term, Factor, Base, Range);
+    case MPC_TYPE_SPAN:
+      g->next = g->has = g->span = 1;
+      return 1;
 
-  mpc_optimise(r.output);
+    case MPC_TYPE_ANCHOR:
+      if (p->data.anchor.f == mpc_boundary_anchor) { g->boundary = 1; return 1; }
+      if (p->data.anchor.f == mpc_boundary_newline_anchor) { g->boundary_newline = 1; return 1; }
+      return mpc_codegen_fail(g, p, "an anchor");
 
-  return r.output;
+    case MPC_TYPE_LIFT:
+      return mpc_codegen_known(g, p, (mpc_codegen_fn_t)p->data.lift.lf);
 
-}
+    case MPC_TYPE_LIFT_VAL:
+      if (p->data.lift.x == NULL) { return 1; }
+      return mpc_codegen_fail(g, p, "a lifted value");
 
-/*
-** Common Fold Functions
-*/
+    case MPC_TYPE_EXPECT: mpc_lower_add(l, p->data.expect.x); return 1;
+    case MPC_TYPE_PREDICT:
+    case MPC_TYPE_FASTFAIL:
+    case MPC_TYPE_ARENA:  mpc_lower_add(l, p->data.predict.x); return 1;
+    case MPC_TYPE_MEMO:   mpc_lower_add(l, p->data.memo.x); return 1;
 
-void mpcf_dtor_null(mpc_val_t *x) { (void) x; return; }
+    case MPC_TYPE_APPLY:
+      mpc_lower_add(l, p->data.apply.x);
+      return mpc_codegen_known(g, p, (mpc_codegen_fn_t)p->data.apply.f);
 
-mpc_val_t *mpcf_ctor_null(void) { return NULL; }
-mpc_val_t *mpcf_ctor_str(void) { return calloc(1, 1); }
-mpc_val_t *mpcf_free(mpc_val_t *x) { free(x); return NULL; }
+    case MPC_TYPE_APPLY_TO:
+      mpc_lower_add(l, p->data.apply_to.x);
+      if (p->data.apply_to.d != NULL
+      &&  p->data.apply_to.f != (mpc_apply_to_t)mpc_ast_tag
+      &&  p->data.apply_to.f != (mpc_apply_to_t)mpc_ast_add_tag) {
+        return mpc_codegen_fail(g, p, "an action with data");
+      }
+      return mpc_codegen_known(g, p, (mpc_codegen_fn_t)p->data.apply_to.f);
 
-mpc_val_t *mpcf_int(mpc_val_t *x) {
-  int *y = malloc(sizeof(int));
-  *y = strtol(x, NULL, 10);
-  free(x);
-  return y;
-}
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      g->rewind = g->rewind || p->type == MPC_TYPE_NOT;
+      mpc_lower_add(l, p->data.not.x);
+      return mpc_codegen_known(g, p, (mpc_codegen_fn_t)p->data.not.dx)
+          && mpc_codegen_known(g, p, (mpc_codegen_fn_t)p->data.not.lf);
 
-mpc_val_t *mpcf_hex(mpc_val_t *x) {
-  int *y = malloc(sizeof(int));
-  *y = strtol(x, NULL, 16);
-  free(x);
-  return y;
-}
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      if (p->type == MPC_TYPE_COUNT && p->data.repeat.n < 1) {
+        return mpc_codegen_fail(g, p, "an empty count");
+      }
+      g->grow = g->grow || p->type != MPC_TYPE_COUNT;
+      mpc_lower_add(l, p->data.repeat.x);
+      return mpc_codegen_known(g, p, (mpc_codegen_fn_t)p->data.repeat.f)
+          && mpc_codegen_known(g, p, (mpc_codegen_fn_t)p->data.repeat.dx);
+
+    case MPC_TYPE_OR:
+      g->has = g->has || p->data.or.first;
+      for (j = 0; j < p->data.or.n; j++) { mpc_lower_add(l, p->data.or.xs[j]); }
+      return 1;
+
+    case MPC_TYPE_AND:
+      g->rewind = 1;
+      for (j = 0; j < p->data.and.n; j++) { mpc_lower_add(l, p->data.and.xs[j]); }
+      for (j = 0; j < p->data.and.n-1; j++) {
+        if (!mpc_codegen_known(g, p, (mpc_codegen_fn_t)p->data.and.dxs[j])) { return 0; }
+      }
+      return mpc_codegen_known(g, p, (mpc_codegen_fn_t)p->data.and.f);
+
+    case MPC_TYPE_DFA:
+      g->next = g->dfa = 1;
+      mpc_lower_add(l, p->data.dfa.x);
+      return 1;
 
-mpc_val_t *mpcf_oct(mpc_val_t *x) {
-  int *y = malloc(sizeof(int));
-  *y = strtol(x, NULL, 8);
-  free(x);
-  return y;
-}
+    case MPC_TYPE_UNDEFINED:
+      return mpc_codegen_fail(g, p, "an undefined parser");
 
-mpc_val_t *mpcf_float(mpc_val_t *x) {
-  float *y = malloc(sizeof(float));
-  *y = strtod(x, NULL);
-  free(x);
-  return y;
+    default:
+      return mpc_codegen_fail(g, p, "a custom parser");
+  }
 }
 
-mpc_val_t *mpcf_strtriml(mpc_val_t *x) {
-  char *s = x;
-  while (isspace((unsigned char)*s)) {
-    memmove(s, s+1, strlen(s));
+static void mpc_codegen_helpers(mpc_codegen_t *g) {
+
+  mpc_codegen_put(g,
+    "typedef struct {\n"
+    "  const char *string;\n"
+    "  mpc_state_t state;\n"
+    "  char last;\n"
+    "  int backtrack;\n"
+    "} $_input_t;\n\n");
+
+  if (g->next) {
+    mpc_codegen_put(g,
+      "static void $_next($_input_t *i) {\n"
+      "  char c = i->string[i->state.pos];\n"
+      "  i->last = c;\n"
+      "  i->state.pos++;\n"
+      "  i->state.col++;\n"
+      "  if (c == '\\n') { i->state.col = 0; i->state.row++; }\n"
+      "}\n\n");
   }
-  return s;
-}
 
-mpc_val_t *mpcf_strtrimr(mpc_val_t *x) {
-  char *s = x;
-  size_t l = strlen(s);
-  while (l > 0 && isspace((unsigned char)s[l-1])) {
-    s[l-1] = '\0'; l--;
+  if (g->take) {
+    mpc_codegen_put(g,
+      "static mpc_val_t *$_take($_input_t *i) {\n"
+      "  char *o = malloc(2);\n"
+      "  o[0] = i->string[i->state.pos];\n"
+      "  o[1] = '\\0';\n"
+      "  $_next(i);\n"
+      "  return o;\n"
+      "}\n\n");
   }
-  return s;
-}
 
-mpc_val_t *mpcf_strtrim(mpc_val_t *x) {
-  return mpcf_strtriml(mpcf_strtrimr(x));
-}
+  if (g->rewind) {
+    mpc_codegen_put(g,
+      "static void $_rewind($_input_t *i, mpc_state_t s, char last) {\n"
+      "  if (i->backtrack < 1) { return; }\n"
+      "  i->state = s;\n"
+      "  i->last = last;\n"
+      "}\n\n");
+  }
 
-static const char mpc_escape_input_c[]  = {
-  '\a', '\b', '\f', '\n', '\r',
-  '\t', '\v', '\\', '\'', '\"', '\0'};
+  if (g->has) {
+    mpc_codegen_put(g,
+      "static int $_has(const unsigned char *set, char c) {\n"
+      "  unsigned char x = (unsigned char)c;\n"
+      "  return set[x >> 3] & (1 << (x & 7));\n"
+      "}\n\n");
+  }
 
-static const char *mpc_escape_output_c[] = {
-  "\\a", "\\b", "\\f", "\\n", "\\r", "\\t",
-  "\\v", "\\\\", "\\'", "\\\"", "\\0", NULL};
+  if (g->string) {
+    mpc_codegen_put(g,
+      "static int $_string($_input_t *i, const char *x, mpc_val_t **o) {\n"
+      "  const char *c = x;\n"
+      "  mpc_state_t s = i->state;\n"
+      "  char last = i->last;\n"
+      "  for (; *c; c++) {\n"
+      "    if (i->string[i->state.pos] == '\\0' || i->string[i->state.pos] != *c) {\n"
+      "      $_rewind(i, s, last);\n"
+      "      return 0;\n"
+      "    }\n"
+      "    $_next(i);\n"
+      "  }\n"
+      "  *o = malloc(strlen(x) + 1);\n"
+      "  strcpy(*o, x);\n"
+      "  return 1;\n"
+      "}\n\n");
+  }
 
-static const char mpc_escape_input_raw_re[] = { '/' };
-static const char *mpc_escape_output_raw_re[] = { "\\/", NULL };
+  if (g->span) {
+    mpc_codegen_put(g,
+      "static long $_span($_input_t *i, const unsigned char *set, mpc_val_t **o) {\n"
+      "  const char *s = i->string + i->state.pos;\n"
+      "  long j = 0;\n"
+      "  while (s[j] != '\\0' && $_has(set, s[j])) { $_next(i); j++; }\n"
+      "  *o = malloc(j + 1);\n"
+      "  memcpy(*o, s, j);\n"
+      "  ((char*)*o)[j] = '\\0';\n"
+      "  return j;\n"
+      "}\n\n");
+  }
 
-static const char mpc_escape_input_raw_cstr[] = { '"' };
-static const char *mpc_escape_output_raw_cstr[] = { "\\\"", NULL };
+  if (g->grow) {
+    mpc_codegen_put(g,
+      "static mpc_val_t **$_grow(mpc_val_t **xs, mpc_val_t **stk, int *slots) {\n"
+      "  mpc_val_t **ys = malloc(sizeof(mpc_val_t*) * *slots * 2);\n"
+      "  memcpy(ys, xs, sizeof(mpc_val_t*) * *slots);\n"
+      "  if (xs != stk) { free(xs); }\n"
+      "  *slots *= 2;\n"
+      "  return ys;\n"
+      "}\n\n");
+  }
 
-static const char mpc_escape_input_raw_cchar[] = { '\'' };
-static const char *mpc_escape_output_raw_cchar[] = { "\\'", NULL };
+  if (g->dfa) {
+    mpc_codegen_put(g,
+      "static int $_dfa($_input_t *i, const short (*trans)[256], const char *accept, mpc_val_t **o) {\n"
+      "  const char *s = i->string + i->state.pos;\n"
+      "  long len = 0, acc = accept[0] ? 0 : -1;\n"
+      "  int t, state = 0;\n"
+      "  mpc_state_t start = i->state, acc_state = i->state;\n"
+      "  char start_last = i->last, acc_last = i->last;\n"
+      "  while ((t = trans[state][(unsigned char)s[len]]) >= 0) {\n"
+      "    $_next(i);\n"
+      "    len++;\n"
+      "    state = t;\n"
+      "    if (accept[state]) { acc = len; acc_state = i->state; acc_last = i->last; }\n"
+      "  }\n");
+    mpc_codegen_put(g,
+      "  if (acc < 0) {\n"
+      "    i->state = start;\n"
+      "    i->last = start_last;\n"
+      "    return 0;\n"
+      "  }\n"
+      "  i->state = acc_state;\n"
+      "  i->last = acc_last;\n"
+      "  *o = malloc(acc + 1);\n"
+      "  memcpy(*o, s, acc);\n"
+      "  ((char*)*o)[acc] = '\\0';\n"
+      "  return 1;\n"
+      "}\n\n");
+  }
 
-static mpc_val_t *mpcf_escape_new(mpc_val_t *x, const char *input, const char **output) {
+  if (g->boundary) {
+    mpc_codegen_put(g,
+      "static int $_boundary(char prev, char next) {\n"
+      "  const char* word = \"abcdefghijklmnopqrstuvwxyz\"\n"
+      "                     \"ABCDEFGHIJKLMNOPQRSTUVWXYZ\"\n"
+      "                     \"0123456789_\";\n"
+      "  if ( strchr(word, next) &&  prev == '\\0') { return 1; }\n"
+      "  if ( strchr(word, prev) &&  next == '\\0') { return 1; }\n"
+      "  if ( strchr(word, next) && !strchr(word, prev)) { return 1; }\n"
+      "  if (!strchr(word, next) &&  strchr(word, prev)) { return 1; }\n"
+      "  return 0;\n"
+      "}\n\n");
+  }
 
-  int i;
-  int found;
-  char buff[2];
-  char *s = x;
-  char *y = calloc(1, 1);
+  if (g->boundary_newline) {
+    mpc_codegen_put(g,
+      "static int $_boundary_newline(char prev, char next) {\n"
+      "  (void)next;\n"
+      "  return prev == '\\n';\n"
+      "}\n\n");
+  }
+}
 
-  while (*s) {
+static void mpc_codegen_tables(mpc_codegen_t *g, int k) {
 
-    i = 0;
-    found = 0;
+  int j, c;
+  mpc_parser_t *p = g->l.nodes[k];
+  mpc_dfa_t *d;
 
-    while (output[i]) {
-      if (*s == input[i]) {
-        y = realloc(y, strlen(y) + strlen(output[i]) + 1);
-        strcat(y, output[i]);
-        found = 1;
-        break;
+  switch (p->type) {
+
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      mpc_codegen_put(g, "static const unsigned char $_set_%i[%i] = ", k, MPC_FIRST_BYTES);
+      mpc_codegen_set(g->f, p->data.string.set);
+      fprintf(g->f, ";\n\n");
+      break;
+
+    case MPC_TYPE_CLASS:
+    case MPC_TYPE_SPAN:
+      mpc_codegen_put(g, "static const unsigned char $_set_%i[%i] = ", k, MPC_FIRST_BYTES);
+      mpc_codegen_set(g->f, p->type == MPC_TYPE_CLASS ? p->data.cls.set : p->data.span.set);
+      fprintf(g->f, ";\n\n");
+      break;
+
+    case MPC_TYPE_OR:
+      if (!p->data.or.first) { break; }
+      mpc_codegen_put(g, "static const unsigned char $_first_%i[%i][%i] = {\n",
+        k, p->data.or.n, MPC_FIRST_BYTES);
+      for (j = 0; j < p->data.or.n; j++) {
+        fprintf(g->f, "  ");
+        mpc_codegen_set(g->f, p->data.or.first + j * MPC_FIRST_BYTES);
+        fprintf(g->f, "%s\n", j < p->data.or.n-1 ? "," : "");
       }
-      i++;
-    }
+      fprintf(g->f, "};\n\n");
+      break;
 
-    if (!found) {
-      y = realloc(y, strlen(y) + 2);
-      buff[0] = *s; buff[1] = '\0';
-      strcat(y, buff);
-    }
+    case MPC_TYPE_DFA:
+      d = p->data.dfa.dfa;
+      mpc_codegen_put(g, "static const short $_dfa_%i[%i][256] = {\n", k, d->states_num);
+      for (j = 0; j < d->states_num; j++) {
+        fprintf(g->f, "  {");
+        for (c = 0; c < 256; c++) {
+          fprintf(g->f, "%s%s%i", c ? "," : "", c && c % 32 == 0 ? "\n   " : "", d->trans[256 * j + c]);
+        }
+        fprintf(g->f, "}%s\n", j < d->states_num-1 ? "," : "");
+      }
+      fprintf(g->f, "};\n\n");
+      mpc_codegen_put(g, "static const char $_accept_%i[%i] = {", k, d->states_num);
+      for (j = 0; j < d->states_num; j++) {
+        fprintf(g->f, "%s%i", j ? "," : "", d->accept[j]);
+      }
+      fprintf(g->f, "};\n\n");
+      break;
 
-    s++;
+    default: break;
   }
+}
 
+static void mpc_codegen_call(mpc_codegen_t *g, const char *fmt, mpc_codegen_fn_t f, const char *args) {
+  if (f == NULL || f == (mpc_codegen_fn_t)mpcf_dtor_null) { return; }
+  mpc_codegen_put(g, fmt, mpc_codegen_name(f), args);
+}
 
-  return y;
+static void mpc_codegen_depth(mpc_codegen_t *g) {
+  mpc_codegen_put(g, "  if (depth == %i) { return 0; }\n", MPC_MAX_RECURSION_DEPTH);
 }
 
-static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, const char *input, const char **output) {
+static void mpc_codegen_node(mpc_codegen_t *g, int k) {
 
-  int i;
-  int found = 0;
-  char buff[2];
-  char *s = x;
-  char *y = calloc(1, 1);
+  int j, n, x;
+  mpc_parser_t *p = g->l.nodes[k];
+  mpc_lower_t *l = &g->l;
+  char arg[32];
 
-  while (*s) {
+  mpc_codegen_put(g, "static int $_%i($_input_t *i, mpc_val_t **o, int depth) {\n", k);
 
-    i = 0;
-    found = 0;
+  /* Declarations go first so the depth can be checked before anything runs */
+  switch (p->type) {
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_CLASS:
+      mpc_codegen_put(g, "  char c = i->string[i->state.pos];\n");
+      break;
+    case MPC_TYPE_PREDICT:
+      mpc_codegen_put(g, "  int x;\n");
+      break;
+    case MPC_TYPE_NOT:
+      mpc_codegen_put(g, "  mpc_val_t *x;\n  mpc_state_t s = i->state;\n  char last = i->last;\n");
+      break;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      mpc_codegen_put(g, "  int n = 0, slots = %i;\n  mpc_val_t *stk[%i], **xs = stk;\n",
+        MPC_PARSE_STACK_MIN, MPC_PARSE_STACK_MIN);
+      break;
+    case MPC_TYPE_COUNT:
+      mpc_codegen_put(g, "  int j = 0;\n  mpc_val_t *xs[%i];\n", p->data.repeat.n + 1);
+      if (p->data.repeat.dx && p->data.repeat.dx != mpcf_dtor_null) { mpc_codegen_put(g, "  int k;\n"); }
+      break;
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0 || !p->data.or.first) { break; }
+      mpc_codegen_put(g, "  char c = i->string[i->state.pos];\n  long pos = i->state.pos;\n"
+        "  int skipped = 0, stop = %i;\n", p->data.or.n);
+      break;
+    case MPC_TYPE_AND:
+      if (p->data.and.n == 0) { break; }
+      mpc_codegen_put(g, "  mpc_val_t *xs[%i];\n  mpc_state_t s = i->state;\n  char last = i->last;\n",
+        p->data.and.n);
+      break;
+    default: break;
+  }
 
-    while (output[i]) {
-      if ((*(s+0)) == output[i][0] &&
-          (*(s+1)) == output[i][1]) {
-        y = realloc(y, strlen(y) + 1 + 1);
-        buff[0] = input[i]; buff[1] = '\0';
-        strcat(y, buff);
-        found = 1;
-        s++;
-        break;
-      }
-      i++;
-    }
+  mpc_codegen_depth(g);
 
-    if (!found) {
-      y = realloc(y, strlen(y) + 1 + 1);
-      buff[0] = *s; buff[1] = '\0';
-      strcat(y, buff);
-    }
+  switch (p->type) {
 
-    if (*s == '\0') { break; }
-    else { s++; }
-  }
+    case MPC_TYPE_ANY:
+      mpc_codegen_put(g,
+        "  if (i->string[i->state.pos] == '\\0') { return 0; }\n"
+        "  *o = $_take(i);\n"
+        "  return 1;\n");
+      break;
 
-  return y;
+    case MPC_TYPE_SINGLE:
+      if (p->data.single.x == '\0') { mpc_codegen_put(g, "  (void)i; (void)o;\n  return 0;\n"); break; }
+      mpc_codegen_put(g, "  if (i->string[i->state.pos] != ");
+      mpc_codegen_char(g->f, p->data.single.x);
+      mpc_codegen_put(g, ") { return 0; }\n  *o = $_take(i);\n  return 1;\n");
+      break;
 
-}
+    case MPC_TYPE_RANGE:
+      mpc_codegen_put(g, "  if (c == '\\0' || c < ");
+      mpc_codegen_char(g->f, p->data.range.x);
+      mpc_codegen_put(g, " || c > ");
+      mpc_codegen_char(g->f, p->data.range.y);
+      mpc_codegen_put(g, ") { return 0; }\n  *o = $_take(i);\n  return 1;\n");
+      break;
 
-mpc_val_t *mpcf_escape(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_c, mpc_escape_output_c);
-  free(x);
-  return y;
-}
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_CLASS:
+      mpc_codegen_put(g,
+        "  if (c == '\\0' || !$_has($_set_%i, c)) { return 0; }\n"
+        "  *o = $_take(i);\n"
+        "  return 1;\n", k);
+      break;
 
-mpc_val_t *mpcf_unescape(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_c, mpc_escape_output_c);
-  free(x);
-  return y;
-}
+    case MPC_TYPE_STRING:
+      mpc_codegen_put(g, "  return $_string(i, ");
+      mpc_codegen_string(g->f, p->data.string.x);
+      mpc_codegen_put(g, ", o);\n");
+      break;
 
-mpc_val_t *mpcf_escape_regex(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
-  free(x);
-  return y;
-}
+    case MPC_TYPE_SPAN:
+      mpc_codegen_put(g,
+        "  if ($_span(i, $_set_%i, o) >= %i) { return 1; }\n"
+        "  free(*o);\n"
+        "  return 0;\n", k, p->data.span.n);
+      break;
 
-mpc_val_t *mpcf_unescape_regex(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
-  free(x);
-  return y;
-}
+    case MPC_TYPE_ANCHOR:
+      mpc_codegen_put(g,
+        "  *o = NULL;\n"
+        "  return $_%s(i->last, i->string[i->state.pos]);\n",
+        p->data.anchor.f == mpc_boundary_anchor ? "boundary" : "boundary_newline");
+      break;
 
-mpc_val_t *mpcf_escape_string_raw(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
-  free(x);
-  return y;
-}
+    case MPC_TYPE_SOI:
+      mpc_codegen_put(g, "  *o = NULL;\n  return i->last == '\\0';\n");
+      break;
 
-mpc_val_t *mpcf_unescape_string_raw(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
-  free(x);
-  return y;
-}
+    case MPC_TYPE_EOI:
+      mpc_codegen_put(g,
+        "  *o = NULL;\n"
+        "  if (i->state.term || i->string[i->state.pos] != '\\0') { return 0; }\n"
+        "  i->state.term = 1;\n"
+        "  return 1;\n");
+      break;
 
-mpc_val_t *mpcf_escape_char_raw(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
-  free(x);
-  return y;
-}
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT_VAL:
+      mpc_codegen_put(g, "  (void)i;\n  *o = NULL;\n  return 1;\n");
+      break;
 
-mpc_val_t *mpcf_unescape_char_raw(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
-  free(x);
-  return y;
-}
+    case MPC_TYPE_FAIL:
+      mpc_codegen_put(g, "  (void)i; (void)o;\n  return 0;\n");
+      break;
 
-mpc_val_t *mpcf_null(int n, mpc_val_t** xs) { (void) n; (void) xs; return NULL; }
-mpc_val_t *mpcf_fst(int n, mpc_val_t **xs) { (void) n; return xs[0]; }
-mpc_val_t *mpcf_snd(int n, mpc_val_t **xs) { (void) n; return xs[1]; }
-mpc_val_t *mpcf_trd(int n, mpc_val_t **xs) { (void) n; return xs[2]; }
+    case MPC_TYPE_LIFT:
+      mpc_codegen_put(g, "  (void)i;\n  *o = %s();\n  return 1;\n",
+        mpc_codegen_name((mpc_codegen_fn_t)p->data.lift.lf));
+      break;
 
-static mpc_val_t *mpcf_nth_free(int n, mpc_val_t **xs, int x) {
-  int i;
-  for (i = 0; i < n; i++) {
-    if (i != x) { free(xs[i]); }
-  }
-  return xs[x];
-}
+    case MPC_TYPE_STATE:
+      mpc_codegen_put(g,
+        "  *o = malloc(sizeof(mpc_state_t));\n"
+        "  memcpy(*o, &i->state, sizeof(mpc_state_t));\n"
+        "  return 1;\n");
+      break;
 
-mpc_val_t *mpcf_fst_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 0); }
-mpc_val_t *mpcf_snd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 1); }
-mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2); }
-mpc_val_t *mpcf_all_free(int n, mpc_val_t** xs) {
-  int i;
-  for (i = 0; i < n; i++) {
-    free(xs[i]);
-  }
-  return NULL;
-}
+    case MPC_TYPE_EXPECT:
+    case MPC_TYPE_FASTFAIL:
+    case MPC_TYPE_ARENA:
+    case MPC_TYPE_MEMO:
+      x = mpc_lower_add(l,
+        p->type == MPC_TYPE_EXPECT ? p->data.expect.x :
+        p->type == MPC_TYPE_MEMO ? p->data.memo.x : p->data.predict.x);
+      mpc_codegen_put(g, "  return $_%i(i, o, depth+1);\n", x);
+      break;
 
-mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
-  int i;
-  size_t l = 0;
+    case MPC_TYPE_PREDICT:
+      mpc_codegen_put(g,
+        "  i->backtrack--;\n"
+        "  x = $_%i(i, o, depth+1);\n"
+        "  i->backtrack++;\n"
+        "  return x;\n", mpc_lower_add(l, p->data.predict.x));
+      break;
 
-  if (n == 0) { return calloc(1, 1); }
+    case MPC_TYPE_APPLY:
+      mpc_codegen_put(g,
+        "  if (!$_%i(i, o, depth+1)) { return 0; }\n"
+        "  *o = %s(*o);\n"
+        "  return 1;\n",
+        mpc_lower_add(l, p->data.apply.x),
+        mpc_codegen_name((mpc_codegen_fn_t)p->data.apply.f));
+      break;
 
-  for (i = 0; i < n; i++) { l += strlen(xs[i]); }
+    case MPC_TYPE_APPLY_TO:
+      mpc_codegen_put(g,
+        "  if (!$_%i(i, o, depth+1)) { return 0; }\n"
+        "  *o = %s(*o, ",
+        mpc_lower_add(l, p->data.apply_to.x),
+        mpc_codegen_name((mpc_codegen_fn_t)p->data.apply_to.f));
+      if (p->data.apply_to.d) { mpc_codegen_string(g->f, p->data.apply_to.d); }
+      else { fprintf(g->f, "NULL"); }
+      mpc_codegen_put(g, ");\n  return 1;\n");
+      break;
 
-  xs[0] = realloc(xs[0], l + 1);
+    case MPC_TYPE_NOT:
+      mpc_codegen_put(g,
+        "  if ($_%i(i, &x, depth+1)) {\n"
+        "    $_rewind(i, s, last);\n", mpc_lower_add(l, p->data.not.x));
+      mpc_codegen_call(g, "    %s(%s);\n", (mpc_codegen_fn_t)p->data.not.dx, "x");
+      mpc_codegen_put(g,
+        "    return 0;\n"
+        "  }\n"
+        "  *o = %s();\n"
+        "  return 1;\n", mpc_codegen_name((mpc_codegen_fn_t)p->data.not.lf));
+      break;
 
-  for (i = 1; i < n; i++) {
-    strcat(xs[0], xs[i]); free(xs[i]);
-  }
+    case MPC_TYPE_MAYBE:
+      mpc_codegen_put(g,
+        "  if ($_%i(i, o, depth+1)) { return 1; }\n"
+        "  *o = %s();\n"
+        "  return 1;\n",
+        mpc_lower_add(l, p->data.not.x),
+        mpc_codegen_name((mpc_codegen_fn_t)p->data.not.lf));
+      break;
 
-  return xs[0];
-}
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      mpc_codegen_put(g,
+        "  while ($_%i(i, &xs[n], depth+1)) {\n"
+        "    if (++n == slots) { xs = $_grow(xs, stk, &slots); }\n"
+        "  }\n", mpc_lower_add(l, p->data.repeat.x));
+      if (p->type == MPC_TYPE_MANY1) { mpc_codegen_put(g, "  if (n == 0) { return 0; }\n"); }
+      mpc_codegen_put(g,
+        "  *o = %s(n, xs);\n"
+        "  if (xs != stk) { free(xs); }\n"
+        "  return 1;\n", mpc_codegen_name((mpc_codegen_fn_t)p->data.repeat.f));
+      break;
 
-mpc_val_t *mpcf_maths(int n, mpc_val_t **xs) {
-  int **vs = (int**)xs;
-  (void) n;
+    case MPC_TYPE_COUNT:
+      mpc_codegen_put(g,
+        "  while ($_%i(i, &xs[j], depth+1)) {\n"
+        "    if (++j == %i) { *o = %s(j, xs); return 1; }\n"
+        "  }\n",
+        mpc_lower_add(l, p->data.repeat.x), p->data.repeat.n,
+        mpc_codegen_name((mpc_codegen_fn_t)p->data.repeat.f));
+      if (p->data.repeat.dx && p->data.repeat.dx != mpcf_dtor_null) {
+        mpc_codegen_call(g, "  for (k = 0; k < j; k++) { %s(%s); }\n",
+          (mpc_codegen_fn_t)p->data.repeat.dx, "xs[k]");
+      }
+      mpc_codegen_put(g, "  return 0;\n");
+      break;
+
+    case MPC_TYPE_OR:
+      n = p->data.or.n;
+      if (n == 0) { mpc_codegen_put(g, "  (void)i;\n  *o = NULL;\n  return 1;\n"); break; }
+
+      if (!p->data.or.first) {
+        for (j = 0; j < n; j++) {
+          mpc_codegen_put(g, "  if ($_%i(i, o, depth+1)) { return 1; }\n", mpc_lower_add(l, p->data.or.xs[j]));
+        }
+        mpc_codegen_put(g, "  return 0;\n");
+        break;
+      }
+
+      /* The same search as `mpc_parse_or_first` without the errors */
+      for (j = 0; j < n; j++) {
+        mpc_codegen_put(g,
+          "  if (%i >= stop || $_has($_first_%i[%i], c)) {\n"
+          "    if ($_%i(i, o, depth+1)) { return 1; }\n"
+          "    if (i->state.pos != pos) { stop = %i; }\n"
+          "  } else {\n"
+          "    skipped = 1;\n"
+          "  }\n", j, k, j, mpc_lower_add(l, p->data.or.xs[j]), j+1);
+      }
+      mpc_codegen_put(g, "  if (!skipped || i->state.pos != pos) { return 0; }\n");
+      for (j = 0; j < n; j++) {
+        mpc_codegen_put(g, "  if (!$_has($_first_%i[%i], c) && $_%i(i, o, depth+1)) { return 1; }\n",
+          k, j, mpc_lower_add(l, p->data.or.xs[j]));
+      }
+      mpc_codegen_put(g, "  return 0;\n");
+      break;
+
+    case MPC_TYPE_AND:
+      n = p->data.and.n;
+      if (n == 0) { mpc_codegen_put(g, "  (void)i;\n  *o = NULL;\n  return 1;\n"); break; }
+      for (j = 0; j < n; j++) {
+        mpc_codegen_put(g,
+          "  if (!$_%i(i, &xs[%i], depth+1)) {\n"
+          "    $_rewind(i, s, last);\n", mpc_lower_add(l, p->data.and.xs[j]), j);
+        for (x = 0; x < j; x++) {
+          sprintf(arg, "xs[%i]", x);
+          mpc_codegen_call(g, "    %s(%s);\n", (mpc_codegen_fn_t)p->data.and.dxs[x], arg);
+        }
+        mpc_codegen_put(g, "    return 0;\n  }\n");
+      }
+      mpc_codegen_put(g, "  *o = %s(%i, xs);\n  return 1;\n",
+        mpc_codegen_name((mpc_codegen_fn_t)p->data.and.f), n);
+      break;
+
+    case MPC_TYPE_DFA:
+      x = mpc_lower_add(l, p->data.dfa.x);
+      mpc_codegen_put(g,
+        "  if (i->backtrack < 1) { return $_%i(i, o, 0); }\n"
+        "  return $_dfa(i, $_dfa_%i, $_accept_%i, o);\n", x, k, k);
+      break;
 
-  switch(((char*)xs[1])[0])
-  {
-    case '*': { *vs[0] *= *vs[2]; }; break;
-    case '/': { *vs[0] /= *vs[2]; }; break;
-    case '%': { *vs[0] %= *vs[2]; }; break;
-    case '+': { *vs[0] += *vs[2]; }; break;
-    case '-': { *vs[0] -= *vs[2]; }; break;
     default: break;
   }
 
-  free(xs[1]); free(xs[2]);
-
-  return xs[0];
+  mpc_codegen_put(g, "}\n\n");
 }
 
-/*
-** Printing
-*/
+static void mpc_codegen_source(mpc_codegen_t *g, int flags, const char *language, int n, mpc_parser_t **rules) {
 
-static void mpc_print_unretained(mpc_parser_t *p, int force) {
+  int j, k;
 
-  /* TODO: Print Everything Escaped */
+  mpc_codegen_put(g,
+    "/*\n"
+    "** Generated by mpca_codegen. Do not edit.\n"
+    "*/\n\n"
+    "#include \"mpc.h\"\n\n");
 
-  int i;
-  char *s, *e;
-  char buff[2];
+  mpc_codegen_helpers(g);
 
-  if (p->retained && !force) {;
-    if (p->name) { printf("<%s>", p->name); }
-    else { printf("<anon>"); }
-    return;
+  for (k = 0; k < g->l.nodes_num; k++) {
+    mpc_codegen_put(g, "static int $_%i($_input_t *i, mpc_val_t **o, int depth);\n", k);
   }
+  mpc_codegen_put(g, "\n");
 
-  if (p->type == MPC_TYPE_UNDEFINED) { printf("<?>"); }
-  if (p->type == MPC_TYPE_PASS)   { printf("<:>"); }
-  if (p->type == MPC_TYPE_FAIL)   { printf("<!>"); }
-  if (p->type == MPC_TYPE_LIFT)   { printf("<#>"); }
-  if (p->type == MPC_TYPE_STATE)  { printf("<S>"); }
-  if (p->type == MPC_TYPE_ANCHOR) { printf("<@>"); }
-  if (p->type == MPC_TYPE_EXPECT) {
-    printf("%s", p->data.expect.m);
-    /*mpc_print_unretained(p->data.expect.x, 0);*/
+  for (k = 0; k < g->l.nodes_num; k++) {
+    mpc_codegen_tables(g, k);
+    mpc_codegen_node(g, k);
   }
 
-  if (p->type == MPC_TYPE_ANY) { printf("<.>"); }
-  if (p->type == MPC_TYPE_SATISFY) { printf("<f>"); }
-
-  if (p->type == MPC_TYPE_SINGLE) {
-    buff[0] = p->data.single.x; buff[1] = '\0';
-    s = mpcf_escape_new(
-      buff,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("'%s'", s);
-    free(s);
+  mpc_codegen_put(g, "static const char *$_grammar =\n  ");
+  mpc_codegen_string(g->f, language);
+  mpc_codegen_put(g, ";\n\nstatic mpc_parser_t *$_rules[%i];\n\n", n);
+
+  mpc_codegen_put(g,
+    "mpc_err_t *$_init(void) {\n"
+    "\n"
+    "  int j;\n"
+    "  mpc_err_t *e;\n"
+    "\n"
+    "  if ($_rules[0] != NULL) { return NULL; }\n"
+    "\n");
+  for (j = 0; j < n; j++) {
+    mpc_codegen_put(g, "  $_rules[%i] = mpc_new(", j);
+    mpc_codegen_string(g->f, rules[j]->name);
+    mpc_codegen_put(g, ");\n");
   }
+  mpc_codegen_put(g, "\n  e = mpca_lang(%i, $_grammar", flags);
+  for (j = 0; j < n; j++) { mpc_codegen_put(g, ",\n    $_rules[%i]", j); }
+  mpc_codegen_put(g,
+    ", NULL);\n"
+    "\n"
+    "  if (e) {\n"
+    "    for (j = 0; j < %i; j++) { mpc_delete($_rules[j]); $_rules[j] = NULL; }\n"
+    "  }\n"
+    "\n"
+    "  return e;\n"
+    "}\n\n", n);
+
+  mpc_codegen_put(g,
+    "static int $_run(int (*f)($_input_t*, mpc_val_t**, int), int rule,\n"
+    "  const char *filename, const char *string, mpc_result_t *r) {\n"
+    "\n"
+    "  int x;\n"
+    "  $_input_t i;\n"
+    "  mpc_parser_t *p;\n"
+    "\n"
+    "  i.string = string;\n"
+    "  i.state.pos = 0;\n"
+    "  i.state.row = 0;\n"
+    "  i.state.col = 0;\n"
+    "  i.state.term = 0;\n"
+    "  i.last = '\\0';\n"
+    "  i.backtrack = 1;\n"
+    "\n");
+
+  mpc_codegen_put(g,
+    "  if (f(&i, &r->output, 0)) { return 1; }\n"
+    "\n"
+    "  /* Only failed parses need the grammar, for the error */\n"
+    "  if ($_rules[0] == NULL) {\n"
+    "    p = mpc_fail(\"$_init must be called before parsing\");\n"
+    "    x = mpc_parse(filename, string, p, r);\n"
+    "    mpc_delete(p);\n"
+    "    return x;\n"
+    "  }\n"
+    "\n"
+    "  return mpc_parse(filename, string, $_rules[rule], r);\n"
+    "}\n\n");
 
-  if (p->type == MPC_TYPE_RANGE) {
-    buff[0] = p->data.range.x; buff[1] = '\0';
-    s = mpcf_escape_new(
-      buff,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    buff[0] = p->data.range.y; buff[1] = '\0';
-    e = mpcf_escape_new(
-      buff,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("[%s-%s]", s, e);
-    free(s);
-    free(e);
+  for (j = 0; j < n; j++) {
+    mpc_codegen_put(g,
+      "int $_parse_%s(const char *filename, const char *string, mpc_result_t *r) {\n"
+      "  return $_run($_%i, %i, filename, string, r);\n"
+      "}\n\n", rules[j]->name, j, j);
   }
 
-  if (p->type == MPC_TYPE_ONEOF) {
-    s = mpcf_escape_new(
-      p->data.string.x,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("[%s]", s);
-    free(s);
+  mpc_codegen_put(g,
+    "void $_cleanup(void) {\n"
+    "  int j;\n"
+    "  if ($_rules[0] == NULL) { return; }\n"
+    "  for (j = 0; j < %i; j++) { mpc_undefine($_rules[j]); }\n"
+    "  for (j = 0; j < %i; j++) { mpc_delete($_rules[j]); $_rules[j] = NULL; }\n"
+    "}\n", n, n);
+}
+
+static void mpc_codegen_header(mpc_codegen_t *g, int n, mpc_parser_t **rules) {
+
+  int j;
+
+  mpc_codegen_put(g,
+    "/*\n"
+    "** Generated by mpca_codegen. Do not edit.\n"
+    "*/\n\n"
+    "#ifndef $_h\n"
+    "#define $_h\n\n"
+    "#include \"mpc.h\"\n\n");
+
+  mpc_codegen_put(g, "mpc_err_t *$_init(void);\n");
+
+  for (j = 0; j < n; j++) {
+    mpc_codegen_put(g, "int $_parse_%s(const char *filename, const char *string, mpc_result_t *r);\n", rules[j]->name);
   }
 
-  if (p->type == MPC_TYPE_NONEOF) {
-    s = mpcf_escape_new(
-      p->data.string.x,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("[^%s]", s);
-    free(s);
+  mpc_codegen_put(g, "void $_cleanup(void);\n\n#endif\n");
+}
+
+static int mpc_codegen_ident(const char *s) {
+  if (!isalpha((unsigned char)*s) && *s != '_') { return 0; }
+  for (s++; *s; s++) {
+    if (!isalnum((unsigned char)*s) && *s != '_') { return 0; }
   }
+  return 1;
+}
 
-  if (p->type == MPC_TYPE_STRING) {
-    s = mpcf_escape_new(
-      p->data.string.x,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("\"%s\"", s);
-    free(s);
+mpc_err_t *mpca_codegen(FILE *source, FILE *header, const char *prefix, int flags, const char *language) {
+
+  int j, k;
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
+  mpc_codegen_t g;
+
+  if (!mpc_codegen_ident(prefix)) {
+    return mpc_err_file("<mpca_codegen>", "Prefix must be a C identifier!");
   }
 
-  if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
-  if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
-  if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  st.va = NULL;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  st.report = NULL;
 
-  if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
-  if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
+  i = mpc_input_new_string("<mpca_codegen>", language);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
 
-  if (p->type == MPC_TYPE_MANY)  { mpc_print_unretained(p->data.repeat.x, 0); printf("*"); }
-  if (p->type == MPC_TYPE_MANY1) { mpc_print_unretained(p->data.repeat.x, 0); printf("+"); }
-  if (p->type == MPC_TYPE_COUNT) { mpc_print_unretained(p->data.repeat.x, 0); printf("{%i}", p->data.repeat.n); }
+  if (err == NULL) {
 
-  if (p->type == MPC_TYPE_OR) {
-    printf("(");
-    for(i = 0; i < p->data.or.n-1; i++) {
-      mpc_print_unretained(p->data.or.xs[i], 0);
-      printf(" | ");
+    memset(&g, 0, sizeof(mpc_codegen_t));
+    g.prefix = prefix;
+    mpc_lower_init(&g.l);
+
+    /* Rules come first so rule `j` is function `j` */
+    for (j = 0; j < st.parsers_num; j++) { mpc_lower_add(&g.l, st.parsers[j]); }
+    for (k = 0; err == NULL && k < g.l.nodes_num; k++) {
+      if (!mpc_codegen_lower(&g, g.l.nodes[k])) {
+        err = mpc_err_file("<mpca_codegen>", g.err);
+      }
     }
-    mpc_print_unretained(p->data.or.xs[p->data.or.n-1], 0);
-    printf(")");
-  }
 
-  if (p->type == MPC_TYPE_AND) {
-    printf("(");
-    for(i = 0; i < p->data.and.n-1; i++) {
-      mpc_print_unretained(p->data.and.xs[i], 0);
-      printf(" ");
+    if (err == NULL) {
+      g.f = source;
+      mpc_codegen_source(&g, flags, language, st.parsers_num, st.parsers);
+      if (header) {
+        g.f = header;
+        mpc_codegen_header(&g, st.parsers_num, st.parsers);
+      }
     }
-    mpc_print_unretained(p->data.and.xs[p->data.and.n-1], 0);
-    printf(")");
-  }
 
-  if (p->type == MPC_TYPE_CHECK) {
-    mpc_print_unretained(p->data.check.x, 0);
-    printf("->?");
-  }
-  if (p->type == MPC_TYPE_CHECK_WITH) {
-    mpc_print_unretained(p->data.check_with.x, 0);
-    printf("->?");
+    mpc_lower_free(&g.l);
   }
 
-}
+  for (j = 0; j < st.parsers_num; j++) { mpc_undefine(st.parsers[j]); }
+  for (j = 0; j < st.parsers_num; j++) { mpc_delete(st.parsers[j]); }
+  free(st.parsers);
 
-void mpc_print(mpc_parser_t *p) {
-  mpc_print_unretained(p, 1);
-  printf("\n");
+  return err;
 }
 
 /*
-** Testing
+** Serialisation
 */
 
 /*
-** These functions are slightly unwieldy and
-** also the whole of the testing suite for mpc
-** mpc is pretty shaky.
+** `mpc_serialise` writes out a set of named parsers,
+** and everything they use, so that `mpc_deserialise`
+** can define them again without parsing a grammar,
+** building regular expressions or optimising. The
+** data can be kept in a file or built into a program
+** as an array.
 **
-** It could do with a lot more tests and more
-** precision. Currently I am only really testing
-** changes off of the examples.
+** It starts with a header of the magic `mpcg`, the
+** format version, the number of known actions and a
+** checksum of the rest, all of which are checked on
+** loading. Then come the number of parsers and how
+** many are named, the name of each, and the type and
+** data of each in turn. Parsers refer to each other by their index,
+** and actions by their place in the table used for
+** code generation, so only the actions and anchors
+** of this library can be written. Integers are four
+** bytes, least significant first, apart from the
+** transitions of a DFA which take two.
 **
+** Loading checks that the data is well formed, that
+** each action is of the kind its parser calls and
+** that unnamed parsers each have one owner. It does
+** not check that actions are given the values they
+** expect, so data changed on purpose to pass these
+** checks can still crash a parse. Only load data
+** from somewhere trusted.
 */
 
-int mpc_test_fail(mpc_parser_t *p, const char *s, const void *d,
-  int(*tester)(const void*, const void*),
-  mpc_dtor_t destructor,
-  void(*printer)(const void*)) {
-  mpc_result_t r;
-  (void) printer;
-  if (mpc_parse("<test>", s, p, &r)) {
+enum {
+  MPC_SERIAL_VERSION = 1,
+  MPC_SERIAL_HEADER  = 16
+};
 
-    if (tester(r.output, d)) {
-      destructor(r.output);
-      return 0;
-    } else {
-      destructor(r.output);
-      return 1;
-    }
+enum {
+  MPC_SERIAL_DATA_NONE = 0,
+  MPC_SERIAL_DATA_NAME = 1,
+  MPC_SERIAL_DATA_TAG  = 2
+};
 
-  } else {
-    mpc_err_delete(r.error);
-    return 1;
+static int (*const mpc_serial_anchors[])(char,char) = {
+  mpc_boundary_anchor,
+  mpc_boundary_newline_anchor
+};
+
+static const char *const mpc_serial_tags[] = { "string", "char", "regex" };
+
+typedef struct {
+  unsigned char *data;
+  size_t length, slots;
+  mpc_lower_t l;
+  char err[128];
+} mpc_serial_out_t;
+
+typedef struct {
+  const unsigned char *data;
+  size_t length, pos;
+  int nodes_num;
+  mpc_parser_t **nodes;
+  int *uses;
+  int *owners;
+  int current;
+  int bad;
+} mpc_serial_in_t;
+
+static int mpc_serial_actions_num(void) {
+  int j = 0;
+  while (mpc_codegen_names[j].f) { j++; }
+  return j;
+}
+
+static int mpc_serial_action(mpc_codegen_fn_t f) {
+  int j;
+  for (j = 0; mpc_codegen_names[j].f; j++) {
+    if (mpc_codegen_names[j].f == f) { return j; }
   }
+  return -1;
+}
 
+static unsigned long mpc_serial_checksum(const unsigned char *x, size_t n) {
+  unsigned long h = 2166136261UL;
+  size_t j;
+  for (j = 0; j < n; j++) { h = ((h ^ x[j]) * 16777619UL) & 0xFFFFFFFFUL; }
+  return h;
 }
 
-int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
-  int(*tester)(const void*, const void*),
-  mpc_dtor_t destructor,
-  void(*printer)(const void*)) {
+static void mpc_serial_bytes(mpc_serial_out_t *s, const void *x, size_t n) {
+  if (s->length + n > s->slots) {
+    s->slots = (s->length + n) * 2;
+    s->data = realloc(s->data, s->slots);
+  }
+  memcpy(s->data + s->length, x, n);
+  s->length += n;
+}
 
-  mpc_result_t r;
-  if (mpc_parse("<test>", s, p, &r)) {
+static void mpc_serial_int(mpc_serial_out_t *s, long x) {
+  unsigned char b[4];
+  unsigned long u = (unsigned long)x;
+  b[0] = (unsigned char)(u & 0xFF);
+  b[1] = (unsigned char)((u >> 8) & 0xFF);
+  b[2] = (unsigned char)((u >> 16) & 0xFF);
+  b[3] = (unsigned char)((u >> 24) & 0xFF);
+  mpc_serial_bytes(s, b, 4);
+}
 
-    if (tester(r.output, d)) {
-      destructor(r.output);
-      return 1;
-    } else {
-      printf("Got "); printer(r.output); printf("\n");
-      printf("Expected "); printer(d); printf("\n");
-      destructor(r.output);
-      return 0;
-    }
+static void mpc_serial_short(mpc_serial_out_t *s, int x) {
+  unsigned char b[2];
+  unsigned int u = (unsigned int)x;
+  b[0] = (unsigned char)(u & 0xFF);
+  b[1] = (unsigned char)((u >> 8) & 0xFF);
+  mpc_serial_bytes(s, b, 2);
+}
 
-  } else {
-    mpc_err_print(r.error);
-    mpc_err_delete(r.error);
-    return 0;
+static void mpc_serial_string(mpc_serial_out_t *s, const char *x) {
+  if (x == NULL) { mpc_serial_int(s, -1); return; }
+  mpc_serial_int(s, (long)strlen(x));
+  mpc_serial_bytes(s, x, strlen(x));
+}
+
+static void mpc_serial_set(mpc_serial_out_t *s, const unsigned char *set, int n) {
+  mpc_serial_int(s, set != NULL);
+  if (set) { mpc_serial_bytes(s, set, n); }
+}
+
+/* Transitions are written as runs of characters going to the same state */
+static void mpc_serial_trans(mpc_serial_out_t *s, const short *trans) {
+
+  int c, e, n = 0;
 
+  for (c = 0; c < 256; c = e) {
+    for (e = c+1; e < 256 && trans[e] == trans[c]; e++);
+    if (trans[c] >= 0) { n++; }
   }
 
+  mpc_serial_short(s, n);
+  for (c = 0; c < 256; c = e) {
+    for (e = c+1; e < 256 && trans[e] == trans[c]; e++);
+    if (trans[c] < 0) { continue; }
+    mpc_serial_short(s, c);
+    mpc_serial_short(s, e - c);
+    mpc_serial_short(s, trans[c]);
+  }
+}
+
+static void mpc_serial_node(mpc_serial_out_t *s, mpc_parser_t *p) {
+  mpc_serial_int(s, mpc_lower_add(&s->l, p));
+}
+
+static int mpc_serial_fail(mpc_serial_out_t *s, mpc_parser_t *p, const char *what) {
+  if (p->name) {
+    sprintf(s->err, "Can not serialise %.32s in '%.32s'!", what, p->name);
+  } else {
+    sprintf(s->err, "Can not serialise %.32s!", what);
+  }
+  return 0;
+}
+
+static int mpc_serial_known(mpc_serial_out_t *s, mpc_parser_t *p, mpc_codegen_fn_t f, int kind) {
+  int j = mpc_serial_action(f);
+  if (j >= 0 && mpc_codegen_names[j].kind == kind) { return 1; }
+  return mpc_serial_fail(s, p, "an unknown action");
 }
 
+static int mpc_serial_anchor(int(*f)(char,char)) {
+  if (f == mpc_serial_anchors[0]) { return 0; }
+  if (f == mpc_serial_anchors[1]) { return 1; }
+  return -1;
+}
 
 /*
-** AST
+** The data of `mpc_ast_tag` and `mpc_ast_add_tag` is
+** either the name of a parser, as for the rules of
+** `mpca_lang`, or one of the tags it gives tokens.
 */
 
-void mpc_ast_delete(mpc_ast_t *a) {
+static int mpc_serial_data(mpc_serial_out_t *s, mpc_parser_t *p, int *ref) {
 
-  int i;
+  int k;
+  const char *d = p->data.apply_to.d;
 
-  if (a == NULL) { return; }
+  if (d == NULL) { return MPC_SERIAL_DATA_NONE; }
 
-  for (i = 0; i < a->children_num; i++) {
-    mpc_ast_delete(a->children[i]);
+  if (p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_tag
+  ||  p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_add_tag) {
+    for (k = 0; k < s->l.nodes_num; k++) {
+      if (s->l.nodes[k]->name == d) { *ref = k; return MPC_SERIAL_DATA_NAME; }
+    }
+    for (k = 0; k < (int)(sizeof(mpc_serial_tags) / sizeof(char*)); k++) {
+      if (strcmp(mpc_serial_tags[k], d) == 0) { *ref = k; return MPC_SERIAL_DATA_TAG; }
+    }
   }
 
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
-
+  return -1;
 }
 
-static void mpc_ast_delete_no_children(mpc_ast_t *a) {
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
-}
+/*
+** Checks a parser can be written and gives an index
+** to each of its children.
+*/
+
+static int mpc_serial_lower(mpc_serial_out_t *s, mpc_parser_t *p) {
+
+  int j;
+  mpc_lower_t *l = &s->l;
+
+  switch (p->type) {
+
+    case MPC_TYPE_PASS: case MPC_TYPE_FAIL: case MPC_TYPE_STATE:
+    case MPC_TYPE_SOI: case MPC_TYPE_EOI: case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE: case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF: case MPC_TYPE_NONEOF: case MPC_TYPE_STRING:
+    case MPC_TYPE_CLASS:
+      return 1;
+
+    case MPC_TYPE_ANCHOR:
+      if (mpc_serial_anchor(p->data.anchor.f) >= 0) { return 1; }
+      return mpc_serial_fail(s, p, "an anchor");
+
+    case MPC_TYPE_SATISFY:
+      return mpc_serial_fail(s, p, "a satisfy function");
+
+    case MPC_TYPE_LIFT:
+      return mpc_serial_known(s, p, (mpc_codegen_fn_t)p->data.lift.lf, MPC_ACTION_CTOR);
+
+    case MPC_TYPE_LIFT_VAL:
+      if (p->data.lift.x == NULL) { return 1; }
+      return mpc_serial_fail(s, p, "a lifted value");
+
+    case MPC_TYPE_EXPECT:  mpc_lower_add(l, p->data.expect.x);  return 1;
+    case MPC_TYPE_PREDICT:
+    case MPC_TYPE_FASTFAIL:
+    case MPC_TYPE_ARENA:   mpc_lower_add(l, p->data.predict.x); return 1;
+    case MPC_TYPE_DFA:     mpc_lower_add(l, p->data.dfa.x);     return 1;
+    case MPC_TYPE_SPAN:    mpc_lower_add(l, p->data.span.x);    return 1;
+
+    case MPC_TYPE_MEMO:
+      mpc_lower_add(l, p->data.memo.x);
+      return mpc_serial_known(s, p, (mpc_codegen_fn_t)p->data.memo.cp, MPC_ACTION_APPLY)
+          && mpc_serial_known(s, p, (mpc_codegen_fn_t)p->data.memo.dx, MPC_ACTION_DTOR);
+
+    case MPC_TYPE_APPLY:
+      mpc_lower_add(l, p->data.apply.x);
+      return mpc_serial_known(s, p, (mpc_codegen_fn_t)p->data.apply.f, MPC_ACTION_APPLY);
+
+    case MPC_TYPE_APPLY_TO:
+      mpc_lower_add(l, p->data.apply_to.x);
+      if (mpc_serial_data(s, p, &j) < 0) { return mpc_serial_fail(s, p, "an action with data"); }
+      return mpc_serial_known(s, p, (mpc_codegen_fn_t)p->data.apply_to.f, MPC_ACTION_APPLY_TO);
+
+    case MPC_TYPE_CHECK:
+      mpc_lower_add(l, p->data.check.x);
+      return mpc_serial_known(s, p, (mpc_codegen_fn_t)p->data.check.dx, MPC_ACTION_DTOR)
+          && mpc_serial_known(s, p, (mpc_codegen_fn_t)p->data.check.f, MPC_ACTION_CHECK);
 
-mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+    case MPC_TYPE_CHECK_WITH:
+      return mpc_serial_fail(s, p, "a check with data");
 
-  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      mpc_lower_add(l, p->data.not.x);
+      return (p->type != MPC_TYPE_NOT
+          ||  mpc_serial_known(s, p, (mpc_codegen_fn_t)p->data.not.dx, MPC_ACTION_DTOR))
+          && mpc_serial_known(s, p, (mpc_codegen_fn_t)p->data.not.lf, MPC_ACTION_CTOR);
 
-  a->tag = malloc(strlen(tag) + 1);
-  strcpy(a->tag, tag);
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_lower_add(l, p->data.repeat.x);
+      return mpc_serial_known(s, p, (mpc_codegen_fn_t)p->data.repeat.f, MPC_ACTION_FOLD)
+          && (p->type != MPC_TYPE_COUNT
+          ||  mpc_serial_known(s, p, (mpc_codegen_fn_t)p->data.repeat.dx, MPC_ACTION_DTOR));
 
-  a->contents = malloc(strlen(contents) + 1);
-  strcpy(a->contents, contents);
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) { mpc_lower_add(l, p->data.or.xs[j]); }
+      return 1;
 
-  a->state = mpc_state_new();
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) { mpc_lower_add(l, p->data.and.xs[j]); }
+      for (j = 0; j < p->data.and.n-1; j++) {
+        if (!mpc_serial_known(s, p, (mpc_codegen_fn_t)p->data.and.dxs[j], MPC_ACTION_DTOR)) { return 0; }
+      }
+      return mpc_serial_known(s, p, (mpc_codegen_fn_t)p->data.and.f, MPC_ACTION_FOLD);
 
-  a->children_num = 0;
-  a->children = NULL;
-  return a;
+    case MPC_TYPE_UNDEFINED:
+      return mpc_serial_fail(s, p, "an undefined parser");
 
+    default:
+      return mpc_serial_fail(s, p, "a custom parser");
+  }
 }
 
-mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
+static void mpc_serial_write(mpc_serial_out_t *s, mpc_parser_t *p) {
 
-  mpc_ast_t *a = mpc_ast_new(tag, "");
+  int j, ref = 0;
+  mpc_dfa_t *d;
 
-  int i;
-  va_list va;
-  va_start(va, tag);
+  mpc_serial_int(s, p->type);
 
-  for (i = 0; i < n; i++) {
-    mpc_ast_add_child(a, va_arg(va, mpc_ast_t*));
-  }
+  switch (p->type) {
 
-  va_end(va);
+    case MPC_TYPE_FAIL: mpc_serial_string(s, p->data.fail.m); break;
+    case MPC_TYPE_LIFT: mpc_serial_int(s, mpc_serial_action((mpc_codegen_fn_t)p->data.lift.lf)); break;
+    case MPC_TYPE_ANCHOR: mpc_serial_int(s, mpc_serial_anchor(p->data.anchor.f)); break;
+    case MPC_TYPE_SINGLE: mpc_serial_int(s, (unsigned char)p->data.single.x); break;
 
-  return a;
+    case MPC_TYPE_RANGE:
+      mpc_serial_int(s, (unsigned char)p->data.range.x);
+      mpc_serial_int(s, (unsigned char)p->data.range.y);
+      break;
 
-}
+    case MPC_TYPE_EXPECT:
+      mpc_serial_node(s, p->data.expect.x);
+      mpc_serial_string(s, p->data.expect.m);
+      break;
 
-mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      mpc_serial_string(s, p->data.string.x);
+      mpc_serial_set(s, p->data.string.set, MPC_FIRST_BYTES);
+      break;
 
-  mpc_ast_t *r;
+    case MPC_TYPE_APPLY:
+      mpc_serial_node(s, p->data.apply.x);
+      mpc_serial_int(s, mpc_serial_action((mpc_codegen_fn_t)p->data.apply.f));
+      break;
 
-  if (a == NULL) { return a; }
-  if (a->children_num == 0) { return a; }
-  if (a->children_num == 1) { return a; }
+    case MPC_TYPE_APPLY_TO:
+      mpc_serial_node(s, p->data.apply_to.x);
+      mpc_serial_int(s, mpc_serial_action((mpc_codegen_fn_t)p->data.apply_to.f));
+      mpc_serial_int(s, mpc_serial_data(s, p, &ref));
+      mpc_serial_int(s, ref);
+      break;
 
-  r = mpc_ast_new(">", "");
-  mpc_ast_add_child(r, a);
-  return r;
-}
+    case MPC_TYPE_CHECK:
+      mpc_serial_node(s, p->data.check.x);
+      mpc_serial_int(s, mpc_serial_action((mpc_codegen_fn_t)p->data.check.dx));
+      mpc_serial_int(s, mpc_serial_action((mpc_codegen_fn_t)p->data.check.f));
+      mpc_serial_string(s, p->data.check.e);
+      break;
 
-int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
+    case MPC_TYPE_PREDICT:
+    case MPC_TYPE_FASTFAIL:
+    case MPC_TYPE_ARENA:
+      mpc_serial_node(s, p->data.predict.x);
+      break;
 
-  int i;
 
-  if (strcmp(a->tag, b->tag) != 0) { return 0; }
-  if (strcmp(a->contents, b->contents) != 0) { return 0; }
-  if (a->children_num != b->children_num) { return 0; }
+    case MPC_TYPE_MEMO:
+      mpc_serial_node(s, p->data.memo.x);
+      mpc_serial_int(s, mpc_serial_action((mpc_codegen_fn_t)p->data.memo.cp));
+      mpc_serial_int(s, mpc_serial_action((mpc_codegen_fn_t)p->data.memo.dx));
+      break;
 
-  for (i = 0; i < a->children_num; i++) {
-    if (!mpc_ast_eq(a->children[i], b->children[i])) { return 0; }
-  }
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      mpc_serial_node(s, p->data.not.x);
+      mpc_serial_int(s, p->type == MPC_TYPE_NOT ? mpc_serial_action((mpc_codegen_fn_t)p->data.not.dx) : -1);
+      mpc_serial_int(s, mpc_serial_action((mpc_codegen_fn_t)p->data.not.lf));
+      break;
 
-  return 1;
-}
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_serial_int(s, p->data.repeat.n);
+      mpc_serial_int(s, mpc_serial_action((mpc_codegen_fn_t)p->data.repeat.f));
+      mpc_serial_node(s, p->data.repeat.x);
+      mpc_serial_int(s, p->type == MPC_TYPE_COUNT ? mpc_serial_action((mpc_codegen_fn_t)p->data.repeat.dx) : -1);
+      break;
 
-mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
-  r->children_num++;
-  r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
-  r->children[r->children_num-1] = a;
-  return r;
-}
+    case MPC_TYPE_OR:
+      mpc_serial_int(s, p->data.or.n);
+      for (j = 0; j < p->data.or.n; j++) { mpc_serial_node(s, p->data.or.xs[j]); }
+      mpc_serial_set(s, p->data.or.first, MPC_FIRST_BYTES * p->data.or.n);
+      break;
 
-mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
-  if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
-  memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, strlen(t));
-  memmove(a->tag + strlen(t), "|", 1);
-  return a;
-}
+    case MPC_TYPE_AND:
+      mpc_serial_int(s, p->data.and.n);
+      mpc_serial_int(s, mpc_serial_action((mpc_codegen_fn_t)p->data.and.f));
+      for (j = 0; j < p->data.and.n; j++) { mpc_serial_node(s, p->data.and.xs[j]); }
+      for (j = 0; j < p->data.and.n-1; j++) {
+        mpc_serial_int(s, mpc_serial_action((mpc_codegen_fn_t)p->data.and.dxs[j]));
+      }
+      break;
 
-mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
-  if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
-  memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, (strlen(t)-1));
-  return a;
-}
+    case MPC_TYPE_DFA:
+      d = p->data.dfa.dfa;
+      mpc_serial_node(s, p->data.dfa.x);
+      mpc_serial_int(s, d->states_num);
+      for (j = 0; j < d->states_num; j++) { mpc_serial_trans(s, d->trans + 256 * j); }
+      mpc_serial_bytes(s, d->accept, d->states_num);
+      break;
 
-mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-  a->tag = realloc(a->tag, strlen(t) + 1);
-  strcpy(a->tag, t);
-  return a;
-}
+    case MPC_TYPE_CLASS:
+      mpc_serial_set(s, p->data.cls.set, MPC_FIRST_BYTES);
+      mpc_serial_int(s, p->data.cls.n);
+      for (j = 0; j < p->data.cls.n; j++) { mpc_serial_string(s, p->data.cls.ms[j]); }
+      break;
 
-mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
-  if (a == NULL) { return a; }
-  a->state = s;
-  return a;
+    case MPC_TYPE_SPAN:
+      mpc_serial_int(s, p->data.span.n);
+      mpc_serial_node(s, p->data.span.x);
+      mpc_serial_set(s, p->data.span.set, MPC_FIRST_BYTES);
+      break;
+
+    default: break;
+  }
 }
 
-static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
+static mpc_err_t *mpc_serialise_list(unsigned char **data, size_t *length, int n, mpc_parser_t **ps) {
 
-  int i;
+  int j, k;
+  mpc_serial_out_t s;
+  mpc_err_t *err = NULL;
 
-  if (a == NULL) {
-    fprintf(fp, "NULL\n");
-    return;
-  }
+  memset(&s, 0, sizeof(mpc_serial_out_t));
+  mpc_lower_init(&s.l);
 
-  for (i = 0; i < d; i++) { fprintf(fp, "  "); }
+  /* The named parsers come first and must all be given */
+  for (j = 0; j < n; j++) {
+    if (!ps[j]->retained || ps[j]->name == NULL) {
+      sprintf(s.err, "Only parsers made with mpc_new can be serialised!");
+      break;
+    }
+    if (mpc_lower_add(&s.l, ps[j]) != j) {
+      sprintf(s.err, "Parser '%.32s' is given twice!", ps[j]->name);
+      break;
+    }
+  }
 
-  if (strlen(a->contents)) {
-    fprintf(fp, "%s:%lu:%lu '%s'\n", a->tag,
-      (long unsigned int)(a->state.row+1),
-      (long unsigned int)(a->state.col+1),
-      a->contents);
-  } else {
-    fprintf(fp, "%s \n", a->tag);
+  for (k = 0; s.err[0] == '\0' && k < s.l.nodes_num; k++) {
+    if (k >= n && s.l.nodes[k]->retained) {
+      sprintf(s.err, "Parser '%.32s' is used but not given!", s.l.nodes[k]->name ? s.l.nodes[k]->name : "");
+      break;
+    }
+    mpc_serial_lower(&s, s.l.nodes[k]);
   }
 
-  for (i = 0; i < a->children_num; i++) {
-    mpc_ast_print_depth(a->children[i], d+1, fp);
+  if (s.err[0]) {
+    err = mpc_err_file("<mpc_serialise>", s.err);
+    free(s.data);
+    *data = NULL;
+    *length = 0;
+  } else {
+    mpc_serial_bytes(&s, "mpcg", 4);
+    mpc_serial_int(&s, MPC_SERIAL_VERSION);
+    mpc_serial_int(&s, mpc_serial_actions_num());
+    mpc_serial_int(&s, 0);
+    mpc_serial_int(&s, s.l.nodes_num);
+    mpc_serial_int(&s, n);
+    for (k = 0; k < s.l.nodes_num; k++) { mpc_serial_string(&s, k < n ? s.l.nodes[k]->name : NULL); }
+    for (k = 0; k < s.l.nodes_num; k++) { mpc_serial_write(&s, s.l.nodes[k]); }
+    /* Fill in the checksum now the rest is known */
+    *data = s.data;
+    *length = s.length;
+    s.length = MPC_SERIAL_HEADER - 4;
+    mpc_serial_int(&s, (long)mpc_serial_checksum(*data + MPC_SERIAL_HEADER, *length - MPC_SERIAL_HEADER));
   }
 
+  mpc_lower_free(&s.l);
+  return err;
 }
 
-void mpc_ast_print(mpc_ast_t *a) {
-  mpc_ast_print_depth(a, 0, stdout);
+mpc_err_t *mpc_serialise(unsigned char **data, size_t *length, int n, ...) {
+
+  int j;
+  mpc_err_t *err;
+  mpc_parser_t **ps = malloc(sizeof(mpc_parser_t*) * n);
+  va_list va;
+
+  va_start(va, n);
+  for (j = 0; j < n; j++) { ps[j] = va_arg(va, mpc_parser_t*); }
+  va_end(va);
+
+  err = mpc_serialise_list(data, length, n, ps);
+  free(ps);
+  return err;
 }
 
-void mpc_ast_print_to(mpc_ast_t *a, FILE *fp) {
-  mpc_ast_print_depth(a, 0, fp);
+/*
+** Reading never goes past the end of the data, but
+** marks it as bad and gives back zeros instead.
+*/
+
+static long mpc_serial_get_int(mpc_serial_in_t *s) {
+  unsigned long u;
+  if (s->pos + 4 > s->length) { s->bad = 1; return 0; }
+  u = (unsigned long)s->data[s->pos]
+    | ((unsigned long)s->data[s->pos+1] << 8)
+    | ((unsigned long)s->data[s->pos+2] << 16)
+    | ((unsigned long)s->data[s->pos+3] << 24);
+  s->pos += 4;
+  return u >= 0x80000000UL ? -(long)(0xFFFFFFFFUL - u) - 1 : (long)u;
+}
+
+static int mpc_serial_get_short(mpc_serial_in_t *s) {
+  unsigned int u;
+  if (s->pos + 2 > s->length) { s->bad = 1; return 0; }
+  u = (unsigned int)s->data[s->pos] | ((unsigned int)s->data[s->pos+1] << 8);
+  s->pos += 2;
+  return u >= 0x8000U ? -(int)(0xFFFFU - u) - 1 : (int)u;
+}
+
+static int mpc_serial_get_count(mpc_serial_in_t *s) {
+  long n = mpc_serial_get_int(s);
+  if (n < 0 || (size_t)n > s->length) { s->bad = 1; return 0; }
+  return (int)n;
+}
+
+static void *mpc_serial_get_bytes(mpc_serial_in_t *s, size_t n) {
+  void *x;
+  if (s->bad || s->pos + n > s->length) { s->bad = 1; return calloc(1, n + 1); }
+  x = malloc(n + 1);
+  memcpy(x, s->data + s->pos, n);
+  s->pos += n;
+  return x;
 }
 
-int mpc_ast_get_index(mpc_ast_t *ast, const char *tag) {
-  return mpc_ast_get_index_lb(ast, tag, 0);
+static char *mpc_serial_get_string(mpc_serial_in_t *s) {
+  char *x;
+  long n = mpc_serial_get_int(s);
+  if (n == -1) { return NULL; }
+  if (n < 0 || (size_t)n > s->length) { s->bad = 1; return NULL; }
+  x = mpc_serial_get_bytes(s, n);
+  x[n] = '\0';
+  return x;
 }
 
-int mpc_ast_get_index_lb(mpc_ast_t *ast, const char *tag, int lb) {
-  int i;
+static unsigned char *mpc_serial_get_set(mpc_serial_in_t *s, size_t n) {
+  if (!mpc_serial_get_int(s)) { return NULL; }
+  return mpc_serial_get_bytes(s, n);
+}
 
-  for(i=lb; i<ast->children_num; i++) {
-    if(strcmp(ast->children[i]->tag, tag) == 0) {
-      return i;
-    }
-  }
+static mpc_parser_t *mpc_serial_get_node(mpc_serial_in_t *s) {
+  long k = mpc_serial_get_int(s);
+  if (k < 0 || k >= s->nodes_num) { s->bad = 1; return s->nodes[0]; }
+  s->uses[k]++;
+  s->owners[k] = s->current;
+  return s->nodes[k];
+}
 
-  return -1;
+/* Actions are always called so must be there and of the right kind */
+static mpc_codegen_fn_t mpc_serial_get_action(mpc_serial_in_t *s, int kind) {
+  long k = mpc_serial_get_int(s);
+  if (k < 0 || k >= mpc_serial_actions_num() || mpc_codegen_names[k].kind != kind) { s->bad = 1; return NULL; }
+  return mpc_codegen_names[k].f;
 }
 
-mpc_ast_t *mpc_ast_get_child(mpc_ast_t *ast, const char *tag) {
-  return mpc_ast_get_child_lb(ast, tag, 0);
+static void *mpc_serial_get_data(mpc_serial_in_t *s) {
+  long kind = mpc_serial_get_int(s);
+  long k = mpc_serial_get_int(s);
+  switch (kind) {
+    case MPC_SERIAL_DATA_NONE: return NULL;
+    case MPC_SERIAL_DATA_NAME:
+      if (k >= 0 && k < s->nodes_num && s->nodes[k]->name) { return s->nodes[k]->name; }
+      break;
+    case MPC_SERIAL_DATA_TAG:
+      if (k >= 0 && k < (long)(sizeof(mpc_serial_tags) / sizeof(char*))) { return (void*)mpc_serial_tags[k]; }
+      break;
+  }
+  s->bad = 1;
+  return NULL;
 }
 
-mpc_ast_t *mpc_ast_get_child_lb(mpc_ast_t *ast, const char *tag, int lb) {
-  int i;
+static mpc_dfa_t *mpc_serial_get_dfa(mpc_serial_in_t *s) {
 
-  for(i=lb; i<ast->children_num; i++) {
-    if(strcmp(ast->children[i]->tag, tag) == 0) {
-      return ast->children[i];
+  int j, n, c, e, t;
+  mpc_dfa_t *d = malloc(sizeof(mpc_dfa_t));
+
+  d->states_num = mpc_serial_get_count(s);
+  if (d->states_num < 1 || s->pos + 2 * (size_t)d->states_num > s->length) { s->bad = 1; d->states_num = 0; }
+  d->trans = malloc(sizeof(short) * 256 * (d->states_num + 1));
+  for (j = 0; j < 256 * d->states_num; j++) { d->trans[j] = -1; }
+  for (j = 0; j < d->states_num; j++) {
+    for (n = mpc_serial_get_short(s); n > 0; n--) {
+      c = mpc_serial_get_short(s);
+      e = c + mpc_serial_get_short(s);
+      t = mpc_serial_get_short(s);
+      /* Nothing may move on the null byte that ends the input */
+      if (c < 1 || e > 256 || t < 0 || t >= d->states_num) { s->bad = 1; break; }
+      for (; c < e; c++) { d->trans[256 * j + c] = (short)t; }
     }
   }
-
-  return NULL;
+  d->accept = mpc_serial_get_bytes(s, d->states_num);
+  d->known = calloc(d->states_num + 1, 1);
+  d->errs = calloc(d->states_num + 1, sizeof(mpc_err_t*));
+  return d;
 }
 
-mpc_ast_trav_t *mpc_ast_traverse_start(mpc_ast_t *ast,
-                                       mpc_ast_trav_order_t order)
-{
-  mpc_ast_trav_t *trav, *n_trav;
-  mpc_ast_t *cnode = ast;
+static void mpc_serial_read(mpc_serial_in_t *s, mpc_parser_t *p) {
 
-  /* Create the traversal structure */
-  trav = malloc(sizeof(mpc_ast_trav_t));
-  trav->curr_node = cnode;
-  trav->parent = NULL;
-  trav->curr_child = 0;
-  trav->order = order;
+  int j;
+  long x;
 
-  /* Get start node */
-  switch(order) {
-    case mpc_ast_trav_order_pre:
-      /* Nothing else is needed for pre order start */
+  p->type = (char)mpc_serial_get_int(s);
+
+  switch (p->type) {
+
+    case MPC_TYPE_PASS: case MPC_TYPE_STATE: case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI: case MPC_TYPE_ANY: case MPC_TYPE_LIFT_VAL:
       break;
 
-    case mpc_ast_trav_order_post:
-      while(cnode->children_num > 0) {
-        cnode = cnode->children[0];
+    case MPC_TYPE_FAIL: p->data.fail.m = mpc_serial_get_string(s); break;
+    case MPC_TYPE_LIFT: p->data.lift.lf = (mpc_ctor_t)mpc_serial_get_action(s, MPC_ACTION_CTOR); break;
+    case MPC_TYPE_SINGLE: p->data.single.x = (char)mpc_serial_get_int(s); break;
 
-        n_trav = malloc(sizeof(mpc_ast_trav_t));
-        n_trav->curr_node = cnode;
-        n_trav->parent = trav;
-        n_trav->curr_child = 0;
-        n_trav->order = order;
+    case MPC_TYPE_ANCHOR:
+      x = mpc_serial_get_int(s);
+      if (x != 0 && x != 1) { s->bad = 1; x = 0; }
+      p->data.anchor.f = mpc_serial_anchors[x];
+      break;
 
-        trav = n_trav;
-      }
+    case MPC_TYPE_RANGE:
+      p->data.range.x = (char)mpc_serial_get_int(s);
+      p->data.range.y = (char)mpc_serial_get_int(s);
+      break;
 
+    case MPC_TYPE_EXPECT:
+      p->data.expect.x = mpc_serial_get_node(s);
+      p->data.expect.m = mpc_serial_get_string(s);
       break;
 
-    default:
-      /* Unreachable, but compiler complaints */
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      p->data.string.x = mpc_serial_get_string(s);
+      p->data.string.set = mpc_serial_get_set(s, MPC_FIRST_BYTES);
+      if (p->data.string.x == NULL) { s->bad = 1; }
+      if (p->type != MPC_TYPE_STRING && p->data.string.set == NULL) { s->bad = 1; }
       break;
-  }
 
-  return trav;
-}
+    case MPC_TYPE_APPLY:
+      p->data.apply.x = mpc_serial_get_node(s);
+      p->data.apply.f = (mpc_apply_t)mpc_serial_get_action(s, MPC_ACTION_APPLY);
+      break;
 
-mpc_ast_t *mpc_ast_traverse_next(mpc_ast_trav_t **trav) {
-  mpc_ast_trav_t *n_trav, *to_free;
-  mpc_ast_t *ret = NULL;
-  int cchild;
+    case MPC_TYPE_APPLY_TO:
+      p->data.apply_to.x = mpc_serial_get_node(s);
+      p->data.apply_to.f = (mpc_apply_to_t)mpc_serial_get_action(s, MPC_ACTION_APPLY_TO);
+      p->data.apply_to.d = mpc_serial_get_data(s);
+      break;
 
-  /* The end of traversal was reached */
-  if(*trav == NULL) return NULL;
+    case MPC_TYPE_CHECK:
+      p->data.check.x = mpc_serial_get_node(s);
+      p->data.check.dx = (mpc_dtor_t)mpc_serial_get_action(s, MPC_ACTION_DTOR);
+      p->data.check.f = (mpc_check_t)mpc_serial_get_action(s, MPC_ACTION_CHECK);
+      p->data.check.e = mpc_serial_get_string(s);
+      break;
 
-  switch((*trav)->order) {
-    case mpc_ast_trav_order_pre:
-      ret = (*trav)->curr_node;
+    case MPC_TYPE_PREDICT:
+    case MPC_TYPE_FASTFAIL:
+    case MPC_TYPE_ARENA:
+      p->data.predict.x = mpc_serial_get_node(s);
+      break;
 
-      /* If there aren't any more children, go up */
-      while(*trav != NULL &&
-        (*trav)->curr_child >= (*trav)->curr_node->children_num)
-      {
-        to_free = *trav;
-        *trav = (*trav)->parent;
-        free(to_free);
+    case MPC_TYPE_MEMO:
+      p->data.memo.x = mpc_serial_get_node(s);
+      p->data.memo.cp = (mpc_apply_t)mpc_serial_get_action(s, MPC_ACTION_APPLY);
+      p->data.memo.dx = (mpc_dtor_t)mpc_serial_get_action(s, MPC_ACTION_DTOR);
+      break;
+
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      p->data.not.x = mpc_serial_get_node(s);
+      if (p->type == MPC_TYPE_NOT) {
+        p->data.not.dx = (mpc_dtor_t)mpc_serial_get_action(s, MPC_ACTION_DTOR);
+      } else {
+        /* Only `not` frees what it parsed so `maybe` has no destructor */
+        p->data.not.dx = NULL;
+        if (mpc_serial_get_int(s) != -1) { s->bad = 1; }
       }
+      p->data.not.lf = (mpc_ctor_t)mpc_serial_get_action(s, MPC_ACTION_CTOR);
+      break;
 
-      /* If trav is NULL, the end was reached */
-      if(*trav == NULL) {
-        break;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      p->data.repeat.n = mpc_serial_get_count(s);
+      if (p->type == MPC_TYPE_COUNT && p->data.repeat.n < 1) { s->bad = 1; }
+      p->data.repeat.f = (mpc_fold_t)mpc_serial_get_action(s, MPC_ACTION_FOLD);
+      p->data.repeat.x = mpc_serial_get_node(s);
+      if (p->type == MPC_TYPE_COUNT) {
+        p->data.repeat.dx = (mpc_dtor_t)mpc_serial_get_action(s, MPC_ACTION_DTOR);
+      } else {
+        /* Only counts free what they parsed so the rest have no destructor */
+        p->data.repeat.dx = NULL;
+        if (mpc_serial_get_int(s) != -1) { s->bad = 1; }
       }
+      break;
 
-      /* Go to next child */
-      n_trav = malloc(sizeof(mpc_ast_trav_t));
-
-      cchild = (*trav)->curr_child;
-      n_trav->curr_node = (*trav)->curr_node->children[cchild];
-      n_trav->parent = *trav;
-      n_trav->curr_child = 0;
-      n_trav->order = (*trav)->order;
+    case MPC_TYPE_OR:
+      p->data.or.n = mpc_serial_get_count(s);
+      p->data.or.xs = malloc(sizeof(mpc_parser_t*) * (p->data.or.n + 1));
+      for (j = 0; j < p->data.or.n; j++) { p->data.or.xs[j] = mpc_serial_get_node(s); }
+      p->data.or.first = mpc_serial_get_set(s, MPC_FIRST_BYTES * p->data.or.n);
+      break;
 
-      (*trav)->curr_child++;
-      *trav = n_trav;
+    case MPC_TYPE_AND:
+      p->data.and.n = mpc_serial_get_count(s);
+      p->data.and.f = (mpc_fold_t)mpc_serial_get_action(s, MPC_ACTION_FOLD);
+      p->data.and.xs = malloc(sizeof(mpc_parser_t*) * (p->data.and.n + 1));
+      p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (p->data.and.n + 1));
+      for (j = 0; j < p->data.and.n; j++) { p->data.and.xs[j] = mpc_serial_get_node(s); }
+      for (j = 0; j < p->data.and.n-1; j++) { p->data.and.dxs[j] = (mpc_dtor_t)mpc_serial_get_action(s, MPC_ACTION_DTOR); }
+      break;
 
+    case MPC_TYPE_DFA:
+      p->data.dfa.x = mpc_serial_get_node(s);
+      p->data.dfa.dfa = mpc_serial_get_dfa(s);
       break;
 
-    case mpc_ast_trav_order_post:
-      ret = (*trav)->curr_node;
+    case MPC_TYPE_CLASS:
+      p->data.cls.set = mpc_serial_get_set(s, MPC_FIRST_BYTES);
+      p->data.cls.n = mpc_serial_get_count(s);
+      p->data.cls.ms = malloc(sizeof(char*) * (p->data.cls.n + 1));
+      for (j = 0; j < p->data.cls.n; j++) { p->data.cls.ms[j] = mpc_serial_get_string(s); }
+      if (p->data.cls.set == NULL) { s->bad = 1; }
+      break;
 
-      /* Move up tree to the parent If the parent doesn't have any more nodes,
-       * then this is the current node. If it does, move down to its left most
-       * child. Also, free the previous traversal node */
-      to_free = *trav;
-      *trav = (*trav)->parent;
-      free(to_free);
+    case MPC_TYPE_SPAN:
+      p->data.span.n = mpc_serial_get_count(s);
+      p->data.span.x = mpc_serial_get_node(s);
+      p->data.span.set = mpc_serial_get_set(s, MPC_FIRST_BYTES);
+      if (p->data.span.set == NULL) { s->bad = 1; }
+      break;
 
-      if(*trav == NULL)
-        break;
+    default:
+      s->bad = 1;
+      p->type = MPC_TYPE_UNDEFINED;
+      break;
+  }
+}
 
-      /* Next child */
-      (*trav)->curr_child++;
+static mpc_err_t *mpc_serial_open(mpc_serial_in_t *s, const unsigned char *data, size_t length, int *names_num) {
 
-      /* If there aren't any more children, this is the next node */
-      if((*trav)->curr_child >= (*trav)->curr_node->children_num) {
-        break;
-      }
+  char buffer[128];
+  long version, actions;
+  unsigned long checksum;
 
-      /* If there are still more children, find the leftmost child from this
-       * node */
-      while((*trav)->curr_node->children_num > 0) {
-        n_trav = malloc(sizeof(mpc_ast_trav_t));
+  memset(s, 0, sizeof(mpc_serial_in_t));
+  s->data = data;
+  s->length = length;
 
-        cchild = (*trav)->curr_child;
-        n_trav->curr_node = (*trav)->curr_node->children[cchild];
-        n_trav->parent = *trav;
-        n_trav->curr_child = 0;
-        n_trav->order = (*trav)->order;
+  if (length < MPC_SERIAL_HEADER || memcmp(data, "mpcg", 4) != 0) {
+    return mpc_err_file("<mpc_deserialise>", "Data is not a serialised grammar!");
+  }
 
-        *trav = n_trav;
-      }
+  s->pos = 4;
+  version = mpc_serial_get_int(s);
+  actions = mpc_serial_get_int(s);
+  checksum = (unsigned long)mpc_serial_get_int(s) & 0xFFFFFFFFUL;
 
-    default:
-      /* Unreachable, but compiler complaints */
-      break;
+  if (version != MPC_SERIAL_VERSION) {
+    sprintf(buffer, "Serialised grammar is version %ld but version %d is needed!", version, MPC_SERIAL_VERSION);
+    return mpc_err_file("<mpc_deserialise>", buffer);
   }
 
-  return ret;
-}
+  /* The table of actions only ever grows */
+  if (actions > mpc_serial_actions_num()) {
+    return mpc_err_file("<mpc_deserialise>", "Serialised grammar was written with unknown actions!");
+  }
 
-void mpc_ast_traverse_free(mpc_ast_trav_t **trav) {
-  mpc_ast_trav_t *n_trav;
+  s->nodes_num = mpc_serial_get_count(s);
+  *names_num = mpc_serial_get_count(s);
 
-  /* Go through parents until all are free */
-  while(*trav != NULL) {
-      n_trav = (*trav)->parent;
-      free(*trav);
-      *trav = n_trav;
+  if (checksum != mpc_serial_checksum(data + MPC_SERIAL_HEADER, length - MPC_SERIAL_HEADER)
+  ||  s->bad || s->nodes_num < 1 || *names_num > s->nodes_num) {
+    return mpc_err_file("<mpc_deserialise>", "Serialised grammar is corrupt!");
   }
+
+  return NULL;
 }
 
-mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+/*
+** Named parsers are read into new parsers and only
+** moved into the ones given once everything has been
+** read. If anything goes wrong every parser read is
+** marked as retained so each can be freed on its own.
+*/
 
-  int i, j;
-  mpc_ast_t** as = (mpc_ast_t**)xs;
-  mpc_ast_t *r;
+static mpc_err_t *mpc_serial_load(mpc_serial_in_t *s, int n, mpc_parser_t **ps) {
 
-  if (n == 0) { return NULL; }
-  if (n == 1) { return xs[0]; }
-  if (n == 2 && xs[1] == NULL) { return xs[0]; }
-  if (n == 2 && xs[0] == NULL) { return xs[1]; }
+  int j, k, m;
+  char buffer[128], *name;
+  mpc_err_t *err = NULL;
+  mpc_parser_t **bodies = calloc(s->nodes_num, sizeof(mpc_parser_t*));
 
-  r = mpc_ast_new(">", "");
+  s->nodes = calloc(s->nodes_num, sizeof(mpc_parser_t*));
+  s->uses = calloc(s->nodes_num, sizeof(int));
+  s->owners = calloc(s->nodes_num, sizeof(int));
 
-  for (i = 0; i < n; i++) {
+  for (k = 0; k < s->nodes_num; k++) {
+    bodies[k] = s->nodes[k] = mpc_undefined();
+    name = mpc_serial_get_string(s);
+    if ((name != NULL) != (k < n)) { s->bad = 1; }
+    if (name == NULL) { continue; }
+    for (j = 0; j < n; j++) {
+      if (ps[j]->name && strcmp(ps[j]->name, name) == 0) { s->nodes[k] = ps[j]; break; }
+    }
+    /* Each parser given can only be defined once */
+    for (m = 0; j < n && m < k; m++) {
+      if (s->nodes[m] == ps[j]) { s->bad = 1; }
+    }
+    if (j == n && err == NULL) {
+      sprintf(buffer, "Unknown Parser '%.32s'!", name);
+      err = mpc_err_file("<mpc_deserialise>", buffer);
+    }
+    free(name);
+  }
 
-    if (as[i] == NULL) { continue; }
+  for (k = 0; err == NULL && k < s->nodes_num; k++) {
+    s->current = k;
+    mpc_serial_read(s, bodies[k]);
+  }
 
-    if        (as[i] && as[i]->children_num == 0) {
-      mpc_ast_add_child(r, as[i]);
-    } else if (as[i] && as[i]->children_num == 1) {
-      mpc_ast_add_child(r, mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
-      mpc_ast_delete_no_children(as[i]);
-    } else if (as[i] && as[i]->children_num >= 2) {
-      for (j = 0; j < as[i]->children_num; j++) {
-        mpc_ast_add_child(r, as[i]->children[j]);
-      }
-      mpc_ast_delete_no_children(as[i]);
-    }
+  /*
+  ** Parsers without names are owned by the one parser
+  ** using them, and following owners must lead to a
+  ** named parser rather than round in a loop.
+  */
+  for (k = n; err == NULL && k < s->nodes_num; k++) {
+    if (s->uses[k] != 1) { s->bad = 1; break; }
+  }
 
+  for (k = n; err == NULL && !s->bad && k < s->nodes_num; k++) {
+    for (j = k, m = 0; j >= n && m < s->nodes_num; m++) { j = s->owners[j]; }
+    if (j >= n) { s->bad = 1; }
   }
 
-  if (r->children_num) {
-    r->state = r->children[0]->state;
+  /* Errors are not written out so are learnt again, which also checks the DFA */
+  for (k = 0; err == NULL && !s->bad && k < s->nodes_num; k++) {
+    if (bodies[k]->type != MPC_TYPE_DFA) { continue; }
+    if (!mpc_dfa_learn(bodies[k]->data.dfa.dfa, bodies[k]->data.dfa.x)) { s->bad = 1; }
   }
 
-  return r;
-}
+  if (err == NULL && (s->bad || s->pos != s->length)) {
+    err = mpc_err_file("<mpc_deserialise>", "Serialised grammar is corrupt!");
+  }
 
-mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
-  free(c);
-  return a;
-}
+  if (err) {
+    for (k = 0; k < s->nodes_num; k++) { bodies[k]->retained = 1; }
+    for (k = 0; k < s->nodes_num; k++) {
+      mpc_undefine_unretained(bodies[k], 1);
+    }
+    for (k = 0; k < s->nodes_num; k++) { free(bodies[k]); }
+  } else {
+    for (k = 0; k < s->nodes_num; k++) {
+      if (s->nodes[k] == bodies[k]) { continue; }
+      mpc_undefine(s->nodes[k]);
+      s->nodes[k]->type = bodies[k]->type;
+      s->nodes[k]->data = bodies[k]->data;
+      free(bodies[k]);
+    }
+  }
 
-mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs) {
-  mpc_state_t *s = ((mpc_state_t**)xs)[0];
-  mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
-  (void)n;
-  a = mpc_ast_state(a, *s);
-  free(s);
-  return a;
+  free(bodies);
+  free(s->nodes);
+  free(s->uses);
+  free(s->owners);
+  return err;
 }
 
-mpc_parser_t *mpca_state(mpc_parser_t *a) {
-  return mpc_and(2, mpcf_state_ast, mpc_state(), a, free);
-}
+mpc_err_t *mpc_deserialise(const unsigned char *data, size_t length, ...) {
 
-mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t);
-}
+  int j, n = 0;
+  mpc_serial_in_t s;
+  mpc_parser_t **ps;
+  mpc_err_t *err;
+  va_list va;
 
-mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
-}
+  err = mpc_serial_open(&s, data, length, &n);
+  if (err) { return err; }
 
-mpc_parser_t *mpca_root(mpc_parser_t *a) {
-  return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
-}
+  ps = malloc(sizeof(mpc_parser_t*) * (n + 1));
+  va_start(va, length);
+  for (j = 0; j < n; j++) { ps[j] = va_arg(va, mpc_parser_t*); }
+  va_end(va);
 
-mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
-mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
-mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
-mpc_parser_t *mpca_many1(mpc_parser_t *a) { return mpc_many1(mpcf_fold_ast, a); }
-mpc_parser_t *mpca_count(int n, mpc_parser_t *a) { return mpc_count(n, mpcf_fold_ast, a, (mpc_dtor_t)mpc_ast_delete); }
+  err = mpc_serial_load(&s, n, ps);
+  free(ps);
+  return err;
+}
 
-mpc_parser_t *mpca_or(int n, ...) {
+mpc_err_t *mpca_serialise(unsigned char **data, size_t *length, int flags, const char *language) {
 
-  int i;
-  va_list va;
+  int j;
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
 
-  mpc_parser_t *p = mpc_undefined();
+  st.va = NULL;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  st.report = NULL;
 
-  p->type = MPC_TYPE_OR;
-  p->data.or.n = n;
-  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  i = mpc_input_new_string("<mpca_serialise>", language);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
 
-  va_start(va, n);
-  for (i = 0; i < n; i++) {
-    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+  if (err == NULL) {
+    err = mpc_serialise_list(data, length, st.parsers_num, st.parsers);
+  } else {
+    *data = NULL;
+    *length = 0;
   }
-  va_end(va);
 
-  return p;
+  for (j = 0; j < st.parsers_num; j++) { mpc_undefine(st.parsers[j]); }
+  for (j = 0; j < st.parsers_num; j++) { mpc_delete(st.parsers[j]); }
+  free(st.parsers);
 
+  return err;
 }
 
-mpc_parser_t *mpca_and(int n, ...) {
+static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
 
-  int i;
-  va_list va;
+  int i, total;
 
-  mpc_parser_t *p = mpc_undefined();
+  if (p->retained && !force) { return 0; }
 
-  p->type = MPC_TYPE_AND;
-  p->data.and.n = n;
-  p->data.and.f = mpcf_fold_ast;
-  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
-  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+  if (p->type == MPC_TYPE_EXPECT) { return 1 + mpc_nodecount_unretained(p->data.expect.x, 0); }
 
-  va_start(va, n);
-  for (i = 0; i < n; i++) {
-    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
-  }
-  for (i = 0; i < (n-1); i++) {
-    p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete;
-  }
-  va_end(va);
+  if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
+  if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
+  if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_FASTFAIL) { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_ARENA)    { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { return 1 + mpc_nodecount_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { return 1 + mpc_nodecount_unretained(p->data.dfa.x, 0); }
 
-  return p;
-}
+  if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
+  if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
 
-mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
+  if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
+  if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
 
-/*
-** Grammar Parser
-*/
+  if (p->type == MPC_TYPE_MANY)  { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_MANY1) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_COUNT) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_SPAN)  { return 1 + mpc_nodecount_unretained(p->data.span.x, 0); }
 
-/*
-** This is another interesting bootstrapping.
-**
-** Having a general purpose AST type allows
-** users to specify the grammar alone and
-** let all fold rules be automatically taken
-** care of by existing functions.
-**
-** You don't get to control the type spat
-** out but this means you can make a nice
-** parser to take in some grammar in nice
-** syntax and spit out a parser that works.
-**
-** The grammar for this looks surprisingly
-** like regex but the main difference is that
-** it is now whitespace insensitive and the
-** base type takes literals of some form.
-*/
+  if (p->type == MPC_TYPE_OR) {
+    total = 1;
+    for(i = 0; i < p->data.or.n; i++) {
+      total += mpc_nodecount_unretained(p->data.or.xs[i], 0);
+    }
+    return total;
+  }
 
-/*
-**
-**  ### Grammar Grammar
-**
-**      <grammar> : (<term> "|" <grammar>) | <term>
-**
-**      <term> : <factor>*
-**
-**      <factor> : <base>
-**               | <base> "*"
-**               | <base> "+"
-**               | <base> "?"
-**               | <base> "{" <digits> "}"
-**
-**      <base> : "<" (<digits> | <ident>) ">"
-**             | <string_lit>
-**             | <char_lit>
-**             | <regex_lit> <regex_mode>
-**             | "(" <grammar> ")"
-*/
+  if (p->type == MPC_TYPE_AND) {
+    total = 1;
+    for(i = 0; i < p->data.and.n; i++) {
+      total += mpc_nodecount_unretained(p->data.and.xs[i], 0);
+    }
+    return total;
+  }
 
-typedef struct {
-  va_list *va;
-  int parsers_num;
-  mpc_parser_t **parsers;
-  int flags;
-} mpca_grammar_st_t;
+  return 1;
 
-static mpc_val_t *mpcaf_grammar_or(int n, mpc_val_t **xs) {
-  (void) n;
-  if (xs[1] == NULL) { return xs[0]; }
-  else { return mpca_or(2, xs[0], xs[1]); }
 }
 
-static mpc_val_t *mpcaf_grammar_and(int n, mpc_val_t **xs) {
-  int i;
-  mpc_parser_t *p = mpc_pass();
-  for (i = 0; i < n; i++) {
-    if (xs[i] != NULL) { p = mpca_and(2, p, xs[i]); }
-  }
-  return p;
-}
+/*
+** Profiling
+*/
 
-static mpc_val_t *mpcaf_grammar_repeat(int n, mpc_val_t **xs) {
-  int num;
-  (void) n;
-  if (xs[1] == NULL) { return xs[0]; }
-  switch(((char*)xs[1])[0])
-  {
-    case '*': { free(xs[1]); return mpca_many(xs[0]); }; break;
-    case '+': { free(xs[1]); return mpca_many1(xs[0]); }; break;
-    case '?': { free(xs[1]); return mpca_maybe(xs[0]); }; break;
-    case '!': { free(xs[1]); return mpca_not(xs[0]); }; break;
-    default:
-      num = *((int*)xs[1]);
-      free(xs[1]);
+/*
+** `mpc_profile` turns on counters for every named
+** parser reachable from `p`. These are reported by
+** `mpc_stats`, slowest first. Turning profiling on
+** again resets the counters.
+*/
+
+static int mpc_profile_rules(mpc_parser_t *p, mpc_parser_t ***rules) {
+
+  int k, n = 0;
+  mpc_lower_t l;
+
+  mpc_lower_init(&l);
+  mpc_lower_reach(&l, p);
+
+  *rules = malloc(sizeof(mpc_parser_t*) * l.nodes_num);
+  for (k = 0; k < l.nodes_num; k++) {
+    if (l.nodes[k]->name) { (*rules)[n++] = l.nodes[k]; }
   }
-  return mpca_count(num, xs[0]);
-}
 
-static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
-  mpca_grammar_st_t *st = s;
-  char *y = mpcf_unescape(x);
-  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
-  free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"));
+  mpc_lower_free(&l);
+  return n;
 }
 
-static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
-  mpca_grammar_st_t *st = s;
-  char *y = mpcf_unescape(x);
-  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
-  free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"));
+static int mpc_profile_cmp(const void *a, const void *b) {
+  const mpc_profile_t *x = (*(mpc_parser_t *const*)a)->profile;
+  const mpc_profile_t *y = (*(mpc_parser_t *const*)b)->profile;
+  if (x->time != y->time) { return x->time < y->time ? 1 : -1; }
+  if (x->calls != y->calls) { return x->calls < y->calls ? 1 : -1; }
+  return 0;
 }
 
-static mpc_val_t *mpcaf_fold_regex(int n, mpc_val_t **xs) {
-  char *y = xs[0];
-  char *m = xs[1];
-  mpca_grammar_st_t *st = xs[2];
-  mpc_parser_t *p;
-  int mode = MPC_RE_DEFAULT;
+static int mpc_profile_sorted(mpc_parser_t *p, mpc_parser_t ***rules) {
 
-  (void)n;
-  if (strchr(m, 'm')) { mode |= MPC_RE_MULTILINE; }
-  if (strchr(m, 's')) { mode |= MPC_RE_DOTALL; }
-  y = mpcf_unescape_regex(y);
-  p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re_mode(y, mode) : mpc_tok(mpc_re_mode(y, mode));
-  free(y);
-  free(m);
+  int k, n = mpc_profile_rules(p, rules), m = 0;
 
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
-}
+  for (k = 0; k < n; k++) {
+    if ((*rules)[k]->profile) { (*rules)[m++] = (*rules)[k]; }
+  }
 
-/* Should this just use `isdigit` instead? */
-static int is_number(const char* s) {
-  size_t i;
-  for (i = 0; i < strlen(s); i++) { if (!strchr("0123456789", s[i])) { return 0; } }
-  return 1;
+  qsort(*rules, m, sizeof(mpc_parser_t*), mpc_profile_cmp);
+  return m;
 }
 
-static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
+static double mpc_profile_ms(clock_t t) {
+  return 1000.0 * (double)t / CLOCKS_PER_SEC;
+}
 
-  int i;
-  mpc_parser_t *p;
+void mpc_profile(mpc_parser_t *p, int enable) {
 
-  /* Case of Number */
-  if (is_number(x)) {
+  int k, n;
+  mpc_parser_t **rules;
 
-    i = strtol(x, NULL, 10);
+  n = mpc_profile_rules(p, &rules);
 
-    while (st->parsers_num <= i) {
-      st->parsers_num++;
-      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
-      st->parsers[st->parsers_num-1] = va_arg(*st->va, mpc_parser_t*);
-      if (st->parsers[st->parsers_num-1] == NULL) {
-        return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
-      }
+  for (k = 0; k < n; k++) {
+    if (enable) {
+      if (!rules[k]->profile) { rules[k]->profile = malloc(sizeof(mpc_profile_t)); }
+      memset(rules[k]->profile, 0, sizeof(mpc_profile_t));
+    } else {
+      free(rules[k]->profile);
+      rules[k]->profile = NULL;
     }
+  }
 
-    return st->parsers[st->parsers_num-1];
+  free(rules);
+}
 
-  /* Case of Identifier */
-  } else {
+void mpc_stats_to(mpc_parser_t *p, FILE *f) {
 
-    /* Search Existing Parsers */
-    for (i = 0; i < st->parsers_num; i++) {
-      mpc_parser_t *q = st->parsers[i];
-      if (q == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
-      if (q->name && strcmp(q->name, x) == 0) { return q; }
-    }
+  int k, n;
+  mpc_parser_t **rules;
+  mpc_profile_t *c;
 
-    /* Search New Parsers */
-    while (1) {
+  fprintf(f, "Stats\n");
+  fprintf(f, "=====\n");
+  fprintf(f, "Node Count: %i\n", mpc_nodecount_unretained(p, 1));
 
-      p = va_arg(*st->va, mpc_parser_t*);
+  n = mpc_profile_sorted(p, &rules);
 
-      st->parsers_num++;
-      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
-      st->parsers[st->parsers_num-1] = p;
+  if (n > 0) {
+    fprintf(f, "\n");
+    fprintf(f, "%-20s %10s %10s %10s %10s %10s %10s\n",
+      "Rule", "Calls", "Successes", "Failures", "Backtracks", "Bytes", "Time (ms)");
+    for (k = 0; k < n; k++) {
+      c = rules[k]->profile;
+      fprintf(f, "%-20s %10li %10li %10li %10li %10li %10.3f\n",
+        rules[k]->name, c->calls, c->successes, c->failures,
+        c->backtracks, c->bytes, mpc_profile_ms(c->time));
+    }
+  }
 
-      if (p == NULL || p->name == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
-      if (p->name && strcmp(p->name, x) == 0) { return p; }
+  free(rules);
+}
 
-    }
+void mpc_stats(mpc_parser_t *p) {
+  mpc_stats_to(p, stdout);
+}
 
+static void mpc_stats_json_string(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') { fputc('\\', f); fputc(*s, f); }
+    else if ((unsigned char)*s < 0x20) { fprintf(f, "\\u%04x", (unsigned char)*s); }
+    else { fputc(*s, f); }
   }
-
+  fputc('"', f);
 }
 
-static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
+void mpc_stats_json(mpc_parser_t *p, FILE *f) {
 
-  mpca_grammar_st_t *st = s;
-  mpc_parser_t *p = mpca_grammar_find_parser(x, st);
-  free(x);
+  int k, n;
+  mpc_parser_t **rules;
+  mpc_profile_t *c;
 
-  if (p->name) {
-    return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
-  } else {
-    return mpca_state(mpca_root(p));
+  n = mpc_profile_sorted(p, &rules);
+
+  fprintf(f, "{\"nodes\": %i, \"rules\": [", mpc_nodecount_unretained(p, 1));
+  for (k = 0; k < n; k++) {
+    c = rules[k]->profile;
+    fprintf(f, "%s\n  {\"name\": ", k ? "," : "");
+    mpc_stats_json_string(f, rules[k]->name);
+    fprintf(f, ", \"calls\": %li, \"successes\": %li, \"failures\": %li, "
+      "\"backtracks\": %li, \"bytes\": %li, \"time_ms\": %.3f}",
+      c->calls, c->successes, c->failures, c->backtracks, c->bytes,
+      mpc_profile_ms(c->time));
   }
+  fprintf(f, "%s]}\n", n ? "\n" : "");
+
+  free(rules);
 }
 
-mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
+/*
+** FIRST Sets
+*/
 
-  char *err_msg;
-  mpc_parser_t *err_out;
-  mpc_result_t r;
-  mpc_parser_t *GrammarTotal, *Grammar, *Term, *Factor, *Base;
+/*
+** To avoid trying `or` alternatives which can't
+** possibly match, `mpc_optimise` computes the set
+** of characters each alternative can start with.
+**
+** This is only done where it is statically known.
+** An alternative is always tried if it contains
+** something opaque such as `mpc_satisfy`, an
+** undefined parser, or recursion deeper than the
+** analysis is willing to go, or if it can succeed
+** without consuming any input at all.
+**
+** Parsers referenced by an `or` should be defined
+** before it is optimised. Redefining them later
+** requires calling `mpc_optimise` again.
+*/
 
-  GrammarTotal = mpc_new("grammar_total");
-  Grammar = mpc_new("grammar");
-  Term = mpc_new("term");
-  Factor = mpc_new("factor");
-  Base = mpc_new("base");
+enum {
+  MPC_FIRST_UNKNOWN  = 0,
+  MPC_FIRST_CONSUMES = 1,
+  MPC_FIRST_NULLABLE = 2
+};
 
-  mpc_define(GrammarTotal,
-    mpc_predictive(mpc_total(Grammar, mpc_soft_delete))
-  );
+#define MPC_FIRST_MAX_DEPTH 64
 
-  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
-    Term,
-    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
-    mpc_soft_delete
-  ));
+/*
+** When checking a whole grammar for LL(1) the
+** other rules are not followed. What is known of
+** them so far is kept by rule instead.
+*/
 
-  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+typedef struct {
+  int n;
+  int index;
+  int report;
+  int changed;
+  mpc_parser_t **rules;
+  unsigned char *first;
+  unsigned char *follow;
+  char *nullable;
+  char *unknown;
+  char *partial;
+  char *refs;
+  char *lefts;
+  char *reasons;
+} mpc_ll1_t;
 
-  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
-    Base,
-      mpc_or(6,
-        mpc_sym("*"),
-        mpc_sym("+"),
-        mpc_sym("?"),
-        mpc_sym("!"),
-        mpc_tok_brackets(mpc_int(), free),
-        mpc_pass()),
-    mpc_soft_delete
-  ));
+enum {
+  MPC_LL1_REASON_MAX = 256
+};
 
-  mpc_define(Base, mpc_or(5,
-    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
-    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
-    mpc_tok(mpc_and(3, mpcaf_fold_regex, mpc_regex_lit(), mpc_many(mpcf_strfold, mpc_oneof("ms")), mpc_lift_val(st), free, free)),
-    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
-    mpc_tok_parens(Grammar, mpc_soft_delete)
-  ));
+static int mpc_ll1_find(mpc_ll1_t *g, mpc_parser_t *p) {
+  int k;
+  for (k = 0; k < g->n; k++) {
+    if (g->rules[k] == p) { return k; }
+  }
+  return -1;
+}
 
-  mpc_optimise(GrammarTotal);
-  mpc_optimise(Grammar);
-  mpc_optimise(Factor);
-  mpc_optimise(Term);
-  mpc_optimise(Base);
+static int mpc_ll1_rule_first(mpc_ll1_t *g, mpc_parser_t *p, unsigned char *first) {
 
-  if(!mpc_parse("<mpc_grammar_compiler>", grammar, GrammarTotal, &r)) {
-    err_msg = mpc_err_string(r.error);
-    err_out = mpc_failf("Invalid Grammar: %s", err_msg);
-    mpc_err_delete(r.error);
-    free(err_msg);
-    r.output = err_out;
+  int j, k = mpc_ll1_find(g, p);
+
+  if (k == -1 || g->unknown[k]) { return MPC_FIRST_UNKNOWN; }
+
+  for (j = 0; j < MPC_FIRST_BYTES; j++) {
+    first[j] |= g->first[k * MPC_FIRST_BYTES + j];
   }
 
-  mpc_cleanup(5, GrammarTotal, Grammar, Term, Factor, Base);
+  return g->nullable[k] ? MPC_FIRST_NULLABLE : MPC_FIRST_CONSUMES;
+}
 
-  mpc_optimise(r.output);
+static int mpc_first_set(mpc_parser_t *p, unsigned char *first, int depth, mpc_ll1_t *g) {
 
-  return (st->flags & MPCA_LANG_PREDICTIVE) ? mpc_predictive(r.output) : r.output;
+  int j, x, res;
 
-}
+  if (depth == MPC_FIRST_MAX_DEPTH) { return MPC_FIRST_UNKNOWN; }
+  if (g && p->retained && depth > 0) { return mpc_ll1_rule_first(g, p, first); }
 
-mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...) {
-  mpca_grammar_st_t st;
-  mpc_parser_t *res;
-  va_list va;
-  va_start(va, grammar);
+  switch (p->type) {
 
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+    case MPC_TYPE_FAIL: return MPC_FIRST_CONSUMES;
 
-  res = mpca_grammar_st(grammar, &st);
-  free(st.parsers);
-  va_end(va);
-  return res;
-}
+    case MPC_TYPE_SINGLE:
+      mpc_first_add(first, p->data.single.x);
+      return MPC_FIRST_CONSUMES;
 
-typedef struct {
-  char *ident;
-  char *name;
-  mpc_parser_t *grammar;
-} mpca_stmt_t;
+    case MPC_TYPE_RANGE:
+      for (j = 0; j < 256; j++) {
+        if ((char)j >= p->data.range.x && (char)j <= p->data.range.y) { mpc_first_add(first, (char)j); }
+      }
+      return MPC_FIRST_CONSUMES;
 
-static mpc_val_t *mpca_stmt_afold(int n, mpc_val_t **xs) {
-  mpca_stmt_t *stmt = malloc(sizeof(mpca_stmt_t));
-  stmt->ident = ((char**)xs)[0];
-  stmt->name = ((char**)xs)[1];
-  stmt->grammar = ((mpc_parser_t**)xs)[3];
-  (void) n;
-  free(((char**)xs)[2]);
-  free(((char**)xs)[4]);
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      for (j = 0; j < MPC_FIRST_BYTES; j++) { first[j] |= p->data.string.set[j]; }
+      return MPC_FIRST_CONSUMES;
 
-  return stmt;
-}
+    case MPC_TYPE_CLASS:
+      for (j = 0; j < MPC_FIRST_BYTES; j++) { first[j] |= p->data.cls.set[j]; }
+      return MPC_FIRST_CONSUMES;
 
-static mpc_val_t *mpca_stmt_fold(int n, mpc_val_t **xs) {
+    case MPC_TYPE_ANY:
+      for (j = 1; j < 256; j++) { mpc_first_add(first, (char)j); }
+      return MPC_FIRST_CONSUMES;
 
-  int i;
-  mpca_stmt_t **stmts = malloc(sizeof(mpca_stmt_t*) * (n+1));
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0] == '\0') { return MPC_FIRST_NULLABLE; }
+      mpc_first_add(first, p->data.string.x[0]);
+      return MPC_FIRST_CONSUMES;
+
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+    case MPC_TYPE_NOT:
+      return MPC_FIRST_NULLABLE;
+
+    case MPC_TYPE_EXPECT:     return mpc_first_set(p->data.expect.x, first, depth+1, g);
+    case MPC_TYPE_APPLY:      return mpc_first_set(p->data.apply.x, first, depth+1, g);
+    case MPC_TYPE_APPLY_TO:   return mpc_first_set(p->data.apply_to.x, first, depth+1, g);
+    case MPC_TYPE_CHECK:      return mpc_first_set(p->data.check.x, first, depth+1, g);
+    case MPC_TYPE_CHECK_WITH: return mpc_first_set(p->data.check_with.x, first, depth+1, g);
+    case MPC_TYPE_PREDICT:    return mpc_first_set(p->data.predict.x, first, depth+1, g);
+    case MPC_TYPE_FASTFAIL:   return mpc_first_set(p->data.predict.x, first, depth+1, g);
+    case MPC_TYPE_ARENA:      return mpc_first_set(p->data.predict.x, first, depth+1, g);
+    case MPC_TYPE_MEMO:       return mpc_first_set(p->data.memo.x, first, depth+1, g);
+    case MPC_TYPE_DFA:        return mpc_first_set(p->data.dfa.x, first, depth+1, g);
+    case MPC_TYPE_MANY1:      return mpc_first_set(p->data.repeat.x, first, depth+1, g);
 
-  for (i = 0; i < n; i++) {
-    stmts[i] = xs[i];
-  }
-  stmts[n] = NULL;
+    case MPC_TYPE_MAYBE:
+      x = mpc_first_set(p->data.not.x, first, depth+1, g);
+      return x == MPC_FIRST_UNKNOWN ? MPC_FIRST_UNKNOWN : MPC_FIRST_NULLABLE;
 
-  return stmts;
-}
+    case MPC_TYPE_MANY:
+      x = mpc_first_set(p->data.repeat.x, first, depth+1, g);
+      return x == MPC_FIRST_UNKNOWN ? MPC_FIRST_UNKNOWN : MPC_FIRST_NULLABLE;
 
-static void mpca_stmt_list_delete(mpc_val_t *x) {
+    case MPC_TYPE_SPAN:
+      x = mpc_first_set(p->data.span.x, first, depth+1, g);
+      return p->data.span.n ? x : MPC_FIRST_NULLABLE;
 
-  mpca_stmt_t **stmts = x;
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.n == 0) { return MPC_FIRST_NULLABLE; }
+      return mpc_first_set(p->data.repeat.x, first, depth+1, g);
 
-  while(*stmts) {
-    mpca_stmt_t *stmt = *stmts;
-    free(stmt->ident);
-    free(stmt->name);
-    mpc_soft_delete(stmt->grammar);
-    free(stmt);
-    stmts++;
+    case MPC_TYPE_OR:
+      res = MPC_FIRST_CONSUMES;
+      if (p->data.or.n == 0) { return MPC_FIRST_NULLABLE; }
+      for (j = 0; j < p->data.or.n; j++) {
+        x = mpc_first_set(p->data.or.xs[j], first, depth+1, g);
+        if (x == MPC_FIRST_UNKNOWN) { return MPC_FIRST_UNKNOWN; }
+        if (x == MPC_FIRST_NULLABLE) { res = MPC_FIRST_NULLABLE; }
+      }
+      return res;
+
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) {
+        x = mpc_first_set(p->data.and.xs[j], first, depth+1, g);
+        if (x != MPC_FIRST_NULLABLE) { return x; }
+      }
+      return MPC_FIRST_NULLABLE;
+
+    default: return MPC_FIRST_UNKNOWN;
   }
-  free(x);
 
 }
 
-static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
+static void mpc_optimise_first(mpc_parser_t *p) {
 
-  mpca_grammar_st_t *st = s;
-  mpca_stmt_t *stmt;
-  mpca_stmt_t **stmts = x;
-  mpc_parser_t *left;
+  int j, any = 0;
+  unsigned char *first;
 
-  while(*stmts) {
-    stmt = *stmts;
-    left = mpca_grammar_find_parser(stmt->ident, st);
-    if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
-    if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
-    mpc_optimise(stmt->grammar);
-    mpc_define(left, stmt->grammar);
-    free(stmt->ident);
-    free(stmt->name);
-    free(stmt);
-    stmts++;
+  free(p->data.or.first);
+  p->data.or.first = NULL;
+
+  if (p->data.or.n == 0) { return; }
+
+  first = calloc(p->data.or.n, MPC_FIRST_BYTES);
+
+  for (j = 0; j < p->data.or.n; j++) {
+    if (mpc_first_set(p->data.or.xs[j], first + j * MPC_FIRST_BYTES, 0, NULL) == MPC_FIRST_CONSUMES) {
+      any = 1;
+    } else {
+      memset(first + j * MPC_FIRST_BYTES, 0xFF, MPC_FIRST_BYTES);
+    }
   }
 
-  free(x);
+  /* Nothing to gain if every alternative is always tried */
+  if (!any) { free(first); return; }
 
-  return NULL;
+  p->data.or.first = first;
 }
 
-static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
-
-  mpc_result_t r;
-  mpc_err_t *e;
-  mpc_parser_t *Lang, *Stmt, *Grammar, *Term, *Factor, *Base;
+/*
+** Alternatives of an `or` that each match a single
+** character can be merged into one class. These
+** are the basic parsers and classes, on their own
+** or named by an `expect`.
+*/
 
-  Lang    = mpc_new("lang");
-  Stmt    = mpc_new("stmt");
-  Grammar = mpc_new("grammar");
-  Term    = mpc_new("term");
-  Factor  = mpc_new("factor");
-  Base    = mpc_new("base");
+static mpc_parser_t *mpc_optimise_class_leaf(mpc_parser_t *p) {
 
-  mpc_define(Lang, mpc_apply_to(
-    mpc_total(mpc_predictive(mpc_many(mpca_stmt_fold, Stmt)), mpca_stmt_list_delete),
-    mpca_stmt_list_apply_to, st
-  ));
+  if (p->retained) { return NULL; }
+  while (p->type == MPC_TYPE_EXPECT) {
+    p = p->data.expect.x;
+    if (p->retained) { return NULL; }
+  }
 
-  mpc_define(Stmt, mpc_and(5, mpca_stmt_afold,
-    mpc_tok(mpc_ident()), mpc_maybe(mpc_tok(mpc_string_lit())), mpc_sym(":"), Grammar, mpc_sym(";"),
-    free, free, free, mpc_soft_delete
-  ));
+  switch (p->type) {
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_CLASS:
+      return p;
+    default: return NULL;
+  }
+}
 
-  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
-      Term,
-      mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
-      mpc_soft_delete
-  ));
+static void mpc_optimise_class_set(mpc_parser_t *p, unsigned char *set) {
 
-  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+  int j;
+  mpc_parser_t *x = mpc_optimise_class_leaf(p);
+
+  switch (x->type) {
+    case MPC_TYPE_ANY: memset(set, 0xFF, MPC_FIRST_BYTES); break;
+    case MPC_TYPE_SINGLE: mpc_first_add(set, x->data.single.x); break;
+    case MPC_TYPE_RANGE:
+      for (j = 0; j < 256; j++) {
+        if ((char)j >= x->data.range.x && (char)j <= x->data.range.y) { mpc_first_add(set, (char)j); }
+      }
+      break;
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      for (j = 0; j < MPC_FIRST_BYTES; j++) { set[j] |= x->data.string.set[j]; }
+      break;
+    case MPC_TYPE_CLASS:
+      for (j = 0; j < MPC_FIRST_BYTES; j++) { set[j] |= x->data.cls.set[j]; }
+      break;
+  }
+}
 
-  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
-    Base,
-      mpc_or(6,
-        mpc_sym("*"),
-        mpc_sym("+"),
-        mpc_sym("?"),
-        mpc_sym("!"),
-        mpc_tok_brackets(mpc_int(), free),
-        mpc_pass()),
-    mpc_soft_delete
-  ));
+static void mpc_optimise_class_add(mpc_parser_t *c, mpc_parser_t *p) {
 
-  mpc_define(Base, mpc_or(5,
-    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
-    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
-    mpc_tok(mpc_and(3, mpcaf_fold_regex, mpc_regex_lit(), mpc_many(mpcf_strfold, mpc_oneof("ms")), mpc_lift_val(st), free, free)),
-    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
-    mpc_tok_parens(Grammar, mpc_soft_delete)
-  ));
+  int j, n = 0;
+  char **ms = NULL;
+  mpc_parser_t *x = mpc_optimise_class_leaf(p);
 
-  mpc_optimise(Lang);
-  mpc_optimise(Stmt);
-  mpc_optimise(Grammar);
-  mpc_optimise(Term);
-  mpc_optimise(Factor);
-  mpc_optimise(Base);
+  mpc_optimise_class_set(p, c->data.cls.set);
 
-  if (!mpc_parse_input(i, Lang, &r)) {
-    e = r.error;
-  } else {
-    e = NULL;
+  if (p->type == MPC_TYPE_EXPECT) {
+    n = 1; ms = &p->data.expect.m;
+  } else if (x->type == MPC_TYPE_CLASS) {
+    n = x->data.cls.n; ms = x->data.cls.ms;
   }
 
-  mpc_cleanup(6, Lang, Stmt, Grammar, Term, Factor, Base);
-
-  return e;
+  c->data.cls.ms = realloc(c->data.cls.ms, sizeof(char*) * (c->data.cls.n + n));
+  for (j = 0; j < n; j++) {
+    c->data.cls.ms[c->data.cls.n] = malloc(strlen(ms[j]) + 1);
+    strcpy(c->data.cls.ms[c->data.cls.n], ms[j]);
+    c->data.cls.n++;
+  }
 }
 
-mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
+/*
+** Two parsers are the same if they are the same
+** retained parser, or unretained parsers made in
+** the same way, as then they give the same result
+** wherever they are run.
+*/
 
-  va_list va;
-  va_start(va, f);
+static int mpc_optimise_same(mpc_parser_t *a, mpc_parser_t *b) {
 
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+  int j;
 
-  i = mpc_input_new_file("<mpca_lang_file>", f);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+  if (a == b) { return 1; }
+  if (a->retained || b->retained || a->type != b->type) { return 0; }
+  if (a->profile || b->profile) { return 0; }
 
-  free(st.parsers);
-  va_end(va);
-  return err;
-}
+  switch (a->type) {
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+      return 1;
 
-mpc_err_t *mpca_lang_pipe(int flags, FILE *p, ...) {
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
+    case MPC_TYPE_FAIL:     return strcmp(a->data.fail.m, b->data.fail.m) == 0;
+    case MPC_TYPE_LIFT:     return a->data.lift.lf == b->data.lift.lf;
+    case MPC_TYPE_LIFT_VAL: return a->data.lift.x == b->data.lift.x;
+    case MPC_TYPE_ANCHOR:   return a->data.anchor.f == b->data.anchor.f;
+    case MPC_TYPE_SINGLE:   return a->data.single.x == b->data.single.x;
+    case MPC_TYPE_SATISFY:  return a->data.satisfy.f == b->data.satisfy.f;
+    case MPC_TYPE_RANGE:
+      return a->data.range.x == b->data.range.x
+          && a->data.range.y == b->data.range.y;
 
-  va_list va;
-  va_start(va, p);
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      return strcmp(a->data.string.x, b->data.string.x) == 0;
 
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+    case MPC_TYPE_CLASS:
+      if (a->data.cls.n != b->data.cls.n
+      ||  memcmp(a->data.cls.set, b->data.cls.set, MPC_FIRST_BYTES) != 0) { return 0; }
+      for (j = 0; j < a->data.cls.n; j++) {
+        if (strcmp(a->data.cls.ms[j], b->data.cls.ms[j]) != 0) { return 0; }
+      }
+      return 1;
 
-  i = mpc_input_new_pipe("<mpca_lang_pipe>", p);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+    case MPC_TYPE_SPAN:
+      return a->data.span.n == b->data.span.n
+          && memcmp(a->data.span.set, b->data.span.set, MPC_FIRST_BYTES) == 0
+          && mpc_optimise_same(a->data.span.x, b->data.span.x);
 
-  free(st.parsers);
-  va_end(va);
-  return err;
-}
+    case MPC_TYPE_EXPECT:
+      return strcmp(a->data.expect.m, b->data.expect.m) == 0
+          && mpc_optimise_same(a->data.expect.x, b->data.expect.x);
 
-mpc_err_t *mpca_lang(int flags, const char *language, ...) {
+    case MPC_TYPE_APPLY:
+      return a->data.apply.f == b->data.apply.f
+          && mpc_optimise_same(a->data.apply.x, b->data.apply.x);
 
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
+    case MPC_TYPE_APPLY_TO:
+      return a->data.apply_to.f == b->data.apply_to.f
+          && a->data.apply_to.d == b->data.apply_to.d
+          && mpc_optimise_same(a->data.apply_to.x, b->data.apply_to.x);
 
-  va_list va;
-  va_start(va, language);
+    case MPC_TYPE_CHECK:
+      return a->data.check.f == b->data.check.f
+          && a->data.check.dx == b->data.check.dx
+          && strcmp(a->data.check.e, b->data.check.e) == 0
+          && mpc_optimise_same(a->data.check.x, b->data.check.x);
 
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+    case MPC_TYPE_CHECK_WITH:
+      return a->data.check_with.f == b->data.check_with.f
+          && a->data.check_with.d == b->data.check_with.d
+          && a->data.check_with.dx == b->data.check_with.dx
+          && strcmp(a->data.check_with.e, b->data.check_with.e) == 0
+          && mpc_optimise_same(a->data.check_with.x, b->data.check_with.x);
 
-  i = mpc_input_new_string("<mpca_lang>", language);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+    case MPC_TYPE_PREDICT:
+    case MPC_TYPE_FASTFAIL:
+    case MPC_TYPE_ARENA:
+      return mpc_optimise_same(a->data.predict.x, b->data.predict.x);
 
-  free(st.parsers);
-  va_end(va);
-  return err;
-}
+    case MPC_TYPE_MEMO:
+      return a->data.memo.cp == b->data.memo.cp
+          && a->data.memo.dx == b->data.memo.dx
+          && mpc_optimise_same(a->data.memo.x, b->data.memo.x);
 
-mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
+    case MPC_TYPE_DFA:     return mpc_optimise_same(a->data.dfa.x, b->data.dfa.x);
 
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      return a->data.not.dx == b->data.not.dx
+          && a->data.not.lf == b->data.not.lf
+          && mpc_optimise_same(a->data.not.x, b->data.not.x);
 
-  va_list va;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      return a->data.repeat.n == b->data.repeat.n
+          && a->data.repeat.f == b->data.repeat.f
+          && a->data.repeat.dx == b->data.repeat.dx
+          && mpc_optimise_same(a->data.repeat.x, b->data.repeat.x);
 
-  FILE *f = fopen(filename, "rb");
+    case MPC_TYPE_OR:
+      if (a->data.or.n != b->data.or.n) { return 0; }
+      for (j = 0; j < a->data.or.n; j++) {
+        if (!mpc_optimise_same(a->data.or.xs[j], b->data.or.xs[j])) { return 0; }
+      }
+      return 1;
 
-  if (f == NULL) {
-    err = mpc_err_file(filename, "Unable to open file!");
-    return err;
+    case MPC_TYPE_AND:
+      if (a->data.and.n != b->data.and.n || a->data.and.f != b->data.and.f) { return 0; }
+      for (j = 0; j < a->data.and.n; j++) {
+        if (!mpc_optimise_same(a->data.and.xs[j], b->data.and.xs[j])) { return 0; }
+      }
+      for (j = 0; j < a->data.and.n-1; j++) {
+        if (a->data.and.dxs[j] != b->data.and.dxs[j]) { return 0; }
+      }
+      return 1;
+
+    default: return 0;
   }
 
-  va_start(va, filename);
+}
 
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+/*
+** Neighbouring alternatives of an `or` which start
+** with the same parsers are factored so that those
+** are only parsed once, and `a b | a c | a` becomes
+** `a (b | c | e)` where `e` matches nothing. This
+** is only done for the ast and string folds, which
+** are also what the other alternatives must be part
+** of for a lone `a` to join them. A string fold of
+** string folds gives the same string. That is not
+** true of ast folds, so the rest of each sequence
+** is folded into a tuple, which the outer fold adds
+** back as if the sequence had never been split.
+** Without backtracking a failed alternative is not
+** rewound before the next is tried, so factoring
+** would change the result, and parsers inside of
+** `mpc_predictive` are left alone. A parser must be
+** wrapped in it before being optimised for this to
+** work, and so `mpc_re`, whose result is often
+** wrapped later, does not factor at all.
+*/
 
-  i = mpc_input_new_file(filename, f);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+static mpc_dtor_t mpc_optimise_factor_dtor(mpc_fold_t f) {
+  if (f == mpcf_fold_ast) { return (mpc_dtor_t)mpc_ast_delete; }
+  if (f == mpcf_strfold)  { return free; }
+  return NULL;
+}
 
-  free(st.parsers);
-  va_end(va);
+/* Gets the sequence an alternative is as part of the fold `f` */
+static int mpc_optimise_factor_seq(mpc_parser_t **a, mpc_fold_t f, mpc_parser_t ***xs) {
 
-  fclose(f);
+  int j;
+  mpc_parser_t *p = *a;
 
-  return err;
-}
+  *xs = a;
 
-static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
+  if (p->type != MPC_TYPE_AND || p->retained
+  ||  p->data.and.f != f || p->data.and.n == 0) { return 1; }
 
-  int i, total;
+  for (j = 0; j < p->data.and.n-1; j++) {
+    if (p->data.and.dxs[j] != mpc_optimise_factor_dtor(f)) { return 1; }
+  }
 
-  if (p->retained && !force) { return 0; }
+  *xs = p->data.and.xs;
+  return p->data.and.n;
+}
 
-  if (p->type == MPC_TYPE_EXPECT) { return 1 + mpc_nodecount_unretained(p->data.expect.x, 0); }
+/* Makes a sequence of `xs`, ending with `x` in place of the last if given */
+static mpc_parser_t *mpc_optimise_factor_and(int n, mpc_fold_t f, mpc_dtor_t d, mpc_parser_t **xs, mpc_parser_t *x) {
+  int j;
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_AND;
+  p->data.and.n = n;
+  p->data.and.f = f;
+  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+  for (j = 0; j < n; j++) { p->data.and.xs[j] = j == n-1 && x ? x : xs[j]; }
+  for (j = 0; j < n-1; j++) { p->data.and.dxs[j] = d; }
+  return p;
+}
 
-  if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
-  if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
-  if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+/* Factors the first `l` parsers out of alternatives `k` to `m` */
+static mpc_parser_t *mpc_optimise_factor_run(mpc_parser_t *p, int k, int m, int l, mpc_fold_t f) {
 
-  if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
-  if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
+  int j, h, n;
+  mpc_parser_t **xs, *a, *r, *t = NULL;
+  mpc_dtor_t d = mpc_optimise_factor_dtor(f);
 
-  if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
-  if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
+  r = mpc_undefined();
+  r->type = MPC_TYPE_OR;
+  r->data.or.n = m - k;
+  r->data.or.xs = malloc(sizeof(mpc_parser_t*) * (m - k));
+  r->data.or.first = NULL;
 
-  if (p->type == MPC_TYPE_MANY)  { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_MANY1) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_COUNT) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+  for (j = k; j < m; j++) {
 
-  if (p->type == MPC_TYPE_OR) {
-    total = 1;
-    for(i = 0; i < p->data.or.n; i++) {
-      total += mpc_nodecount_unretained(p->data.or.xs[i], 0);
+    a = p->data.or.xs[j];
+    n = mpc_optimise_factor_seq(&p->data.or.xs[j], f, &xs);
+
+    if (n == l) {
+      r->data.or.xs[j-k] = f == mpcf_strfold ? mpc_lift(mpcf_ctor_str) : mpc_pass();
+    } else if (n == l + 1 && f == mpcf_strfold) {
+      r->data.or.xs[j-k] = xs[l];
+    } else {
+      r->data.or.xs[j-k] = mpc_optimise_factor_and(n - l, f == mpcf_strfold ? mpcf_strfold : mpcf_tuple, d, xs + l, NULL);
     }
-    return total;
-  }
 
-  if (p->type == MPC_TYPE_AND) {
-    total = 1;
-    for(i = 0; i < p->data.and.n; i++) {
-      total += mpc_nodecount_unretained(p->data.and.xs[i], 0);
+    /* The first alternative gives the parsers that are kept */
+    if (j == k) {
+      t = mpc_optimise_factor_and(l + 1, f == mpcf_strfold ? mpcf_strfold : mpcf_fold_ast_tuple, d, xs, r);
+    } else {
+      for (h = 0; h < l; h++) { mpc_soft_delete(xs[h]); }
+    }
+
+    if (xs != &p->data.or.xs[j]) {
+      free(a->data.and.xs); free(a->data.and.dxs); free(a->name); free(a);
     }
-    return total;
   }
 
-  return 1;
+  p->data.or.xs[k] = t;
+  memmove(p->data.or.xs + k + 1, p->data.or.xs + m, (p->data.or.n - m) * sizeof(mpc_parser_t*));
+  p->data.or.n -= m - k - 1;
+
+  return r;
+}
+
+/* Finds alternatives to factor, returning the new `or` or NULL */
+static mpc_parser_t *mpc_optimise_factor(mpc_parser_t *p) {
+
+  int k, m, h, l, n, c, seq;
+  mpc_parser_t **xs, **ys;
+  mpc_fold_t f;
+
+  for (k = 0; k < p->data.or.n-1; k++) {
+    for (h = 0; h < 2; h++) {
+
+      f = h ? mpcf_strfold : mpcf_fold_ast;
+      l = mpc_optimise_factor_seq(&p->data.or.xs[k], f, &xs);
+      seq = xs != &p->data.or.xs[k];
+
+      for (m = k+1; m < p->data.or.n; m++) {
+        n = mpc_optimise_factor_seq(&p->data.or.xs[m], f, &ys);
+        if (!mpc_optimise_same(xs[0], ys[0])) { break; }
+        for (c = 1; c < l && c < n && mpc_optimise_same(xs[c], ys[c]); c++);
+        l = c;
+        seq = seq || ys != &p->data.or.xs[m];
+      }
 
-}
+      /* A lone alternative is only known to fit the fold if a sequence uses it */
+      if (m - k < 2 || !seq) { continue; }
+
+      return mpc_optimise_factor_run(p, k, m, l, f);
+    }
+  }
 
-void mpc_stats(mpc_parser_t* p) {
-  printf("Stats\n");
-  printf("=====\n");
-  printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
+  return NULL;
 }
 
-static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
+static int mpc_optimise_unretained(mpc_parser_t *p, int force, int backtrack) {
 
-  int i, n, m;
+  int i, n, m, k = 0;
   mpc_parser_t *t;
 
-  if (p->retained && !force) { return; }
+  if (p->retained && !force) { return 0; }
 
   /* Optimise Subexpressions */
 
-  if (p->type == MPC_TYPE_EXPECT)     { mpc_optimise_unretained(p->data.expect.x, 0); }
-  if (p->type == MPC_TYPE_APPLY)      { mpc_optimise_unretained(p->data.apply.x, 0); }
-  if (p->type == MPC_TYPE_APPLY_TO)   { mpc_optimise_unretained(p->data.apply_to.x, 0); }
-  if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0); }
-  if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0); }
-  if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0); }
-  if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0); }
-  if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0); }
-  if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_MANY1)      { mpc_optimise_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_COUNT)      { mpc_optimise_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_EXPECT)     { k += mpc_optimise_unretained(p->data.expect.x, 0, backtrack); }
+  if (p->type == MPC_TYPE_APPLY)      { k += mpc_optimise_unretained(p->data.apply.x, 0, backtrack); }
+  if (p->type == MPC_TYPE_APPLY_TO)   { k += mpc_optimise_unretained(p->data.apply_to.x, 0, backtrack); }
+  if (p->type == MPC_TYPE_CHECK)      { k += mpc_optimise_unretained(p->data.check.x, 0, backtrack); }
+  if (p->type == MPC_TYPE_CHECK_WITH) { k += mpc_optimise_unretained(p->data.check_with.x, 0, backtrack); }
+  if (p->type == MPC_TYPE_PREDICT)    { k += mpc_optimise_unretained(p->data.predict.x, 0, 0); }
+  if (p->type == MPC_TYPE_FASTFAIL)   { k += mpc_optimise_unretained(p->data.predict.x, 0, backtrack); }
+  if (p->type == MPC_TYPE_ARENA)      { k += mpc_optimise_unretained(p->data.predict.x, 0, backtrack); }
+  if (p->type == MPC_TYPE_MEMO)       { k += mpc_optimise_unretained(p->data.memo.x, 0, backtrack); }
+  if (p->type == MPC_TYPE_DFA)        { k += mpc_optimise_unretained(p->data.dfa.x, 0, backtrack); }
+  if (p->type == MPC_TYPE_NOT)        { k += mpc_optimise_unretained(p->data.not.x, 0, backtrack); }
+  if (p->type == MPC_TYPE_MAYBE)      { k += mpc_optimise_unretained(p->data.not.x, 0, backtrack); }
+  if (p->type == MPC_TYPE_MANY)       { k += mpc_optimise_unretained(p->data.repeat.x, 0, backtrack); }
+  if (p->type == MPC_TYPE_MANY1)      { k += mpc_optimise_unretained(p->data.repeat.x, 0, backtrack); }
+  if (p->type == MPC_TYPE_COUNT)      { k += mpc_optimise_unretained(p->data.repeat.x, 0, backtrack); }
 
   if (p->type == MPC_TYPE_OR) {
     for(i = 0; i < p->data.or.n; i++) {
-      mpc_optimise_unretained(p->data.or.xs[i], 0);
+      k += mpc_optimise_unretained(p->data.or.xs[i], 0, backtrack);
     }
   }
 
   if (p->type == MPC_TYPE_AND) {
     for(i = 0; i < p->data.and.n; i++) {
-      mpc_optimise_unretained(p->data.and.xs[i], 0);
+      k += mpc_optimise_unretained(p->data.and.xs[i], 0, backtrack);
     }
   }
 
@@ -3938,7 +9262,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.n = n + m - 1;
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(t->data.or.xs); free(t->data.or.first); free(t->name); free(t);
       continue;
     }
 
@@ -3952,7 +9276,54 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
       memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(t->data.or.xs); free(t->data.or.first); free(t->name); free(t);
+      continue;
+    }
+
+    /* Merge `or` character classes */
+    if (p->type == MPC_TYPE_OR) {
+      for (n = 0; n < p->data.or.n-1; n++) {
+        if (mpc_optimise_class_leaf(p->data.or.xs[n])
+        &&  mpc_optimise_class_leaf(p->data.or.xs[n+1])) { break; }
+      }
+      if (n < p->data.or.n-1) {
+        t = mpc_undefined();
+        t->type = MPC_TYPE_CLASS;
+        t->data.cls.set = calloc(1, MPC_FIRST_BYTES);
+        for (m = n; m < p->data.or.n && mpc_optimise_class_leaf(p->data.or.xs[m]); m++) {
+          mpc_optimise_class_add(t, p->data.or.xs[m]);
+          mpc_delete(p->data.or.xs[m]);
+        }
+        p->data.or.xs[n] = t;
+        memmove(p->data.or.xs + n + 1, p->data.or.xs + m, (p->data.or.n - m) * sizeof(mpc_parser_t*));
+        p->data.or.n -= m - n - 1;
+        continue;
+      }
+    }
+
+    /* Remove `or` of a single class */
+    if (p->type == MPC_TYPE_OR
+    &&  p->data.or.n == 1
+    &&  p->data.or.xs[0]->type == MPC_TYPE_CLASS) {
+      t = p->data.or.xs[0];
+      free(p->data.or.xs); free(p->data.or.first);
+      p->type = t->type;
+      p->data = t->data;
+      free(t->name); free(t);
+      continue;
+    }
+
+    /* Fuse string `many` of a class into a span */
+    if ((p->type == MPC_TYPE_MANY || p->type == MPC_TYPE_MANY1)
+    &&  p->data.repeat.f == mpcf_strfold
+    &&  mpc_optimise_class_leaf(p->data.repeat.x)) {
+      t = p->data.repeat.x;
+      n = p->type == MPC_TYPE_MANY1;
+      p->type = MPC_TYPE_SPAN;
+      p->data.span.n = n;
+      p->data.span.x = t;
+      p->data.span.set = calloc(1, MPC_FIRST_BYTES);
+      mpc_optimise_class_set(t, p->data.span.set);
       continue;
     }
 
@@ -4055,13 +9426,617 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       continue;
     }
 
+    /* Factor common start of `or` alternatives */
+    if (p->type == MPC_TYPE_OR && backtrack
+    && (t = mpc_optimise_factor(p))) {
+      k += 1 + mpc_optimise_unretained(t, 0, backtrack);
+      continue;
+    }
+
+    /* Build `or` lookahead */
+    if (p->type == MPC_TYPE_OR) { mpc_optimise_first(p); }
+
+    return k;
+
+  }
+
+}
+
+/*
+** Returns the number of times the alternatives of
+** an `or` were factored.
+*/
+
+int mpc_optimise(mpc_parser_t *p) {
+  return mpc_optimise_unretained(p, 1, 1);
+}
+
+/*
+** A rule is LL(1) when the next character of input
+** is always enough to decide what to do. Then it
+** can be parsed without backtracking and gives the
+** same results as with it. `mpca_report` lists each
+** rule which is not and why, as a check before using
+** `MPCA_LANG_PREDICTIVE` or `mpc_predictive`.
+** Rules are never changed by it, as parsing without
+** backtracking was not found to be any faster.
+**
+** The FIRST set of every rule, the characters it
+** can start with, and its FOLLOW set, those which
+** can come after it, are worked out over the whole
+** grammar by repeating until nothing changes. A
+** rule no other rule uses is followed by the end
+** of input. Every choice is then checked, and a
+** rule is only LL(1) if the rules it uses are too.
+**
+** Unlike `mpc_predictive` the same results are also
+** wanted for input the grammar does not match, so a
+** rule must not be able to skip over what it could
+** not match, as described below. Few rules can be
+** sure of this. Any repetition of a sequence, such
+** as `(',' <item>)*`, fails after consuming input
+** when what follows the first part is missing.
+**
+** A choice which matches a single character once
+** started can never fail part way through, so it
+** is not a conflict even if the character could
+** also be taken by what comes after or by a later
+** alternative. Parsing is greedy either way.
+*/
+
+static void mpc_ll1_conflict(mpc_ll1_t *g, const char *fmt, ...) {
+
+  va_list va;
+  char *reason = g->reasons + g->index * MPC_LL1_REASON_MAX;
+
+  if (!g->report || reason[0] != '\0') { return; }
+
+  va_start(va, fmt);
+  vsprintf(reason, fmt, va);
+  va_end(va);
+}
+
+static int mpc_ll1_common(const unsigned char *a, const unsigned char *b) {
+  int j;
+  for (j = 1; j < 256; j++) {
+    if (mpc_first_has(a, (char)j) && mpc_first_has(b, (char)j)) { return j; }
+  }
+  return -1;
+}
+
+static mpc_parser_t *mpc_ll1_inner(mpc_parser_t *p) {
+  while (!p->retained && (p->type == MPC_TYPE_EXPECT || p->type == MPC_TYPE_APPLY || p->type == MPC_TYPE_APPLY_TO)) {
+    p = p->type == MPC_TYPE_EXPECT ? p->data.expect.x :
+        p->type == MPC_TYPE_APPLY  ? p->data.apply.x : p->data.apply_to.x;
+  }
+  return p;
+}
+
+static int mpc_ll1_single(mpc_parser_t *p) {
+
+  p = mpc_ll1_inner(p);
+  if (p->retained) { return 0; }
+
+  switch (p->type) {
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_CLASS:
+    case MPC_TYPE_ANY: return 1;
+    case MPC_TYPE_STRING: return strlen(p->data.string.x) <= 1;
+    case MPC_TYPE_SPAN: return p->data.span.n <= 1;
+    default: return 0;
+  }
+}
+
+/* Such as the `$` regex, which matches nothing only at the end */
+static int mpc_ll1_end(mpc_parser_t *p) {
+  p = mpc_ll1_inner(p);
+  if (!p->retained && p->type == MPC_TYPE_AND && p->data.and.n > 0) {
+    p = mpc_ll1_inner(p->data.and.xs[0]);
+  }
+  return !p->retained && p->type == MPC_TYPE_EOI;
+}
+
+static int mpc_ll1_consumes(mpc_ll1_t *g, mpc_parser_t *p) {
+  int j;
+  unsigned char first[MPC_FIRST_BYTES];
+  memset(first, 0, MPC_FIRST_BYTES);
+  if (mpc_first_set(p, first, 0, g) == MPC_FIRST_UNKNOWN) { return 1; }
+  for (j = 1; j < 256; j++) {
+    if (mpc_first_has(first, (char)j)) { return 1; }
+  }
+  return 0;
+}
+
+/* Other rules are taken to be able to fail */
+static int mpc_ll1_fails(mpc_parser_t *p, int depth) {
+
+  int j;
+
+  if (p->retained && depth > 0) { return 1; }
+
+  switch (p->type) {
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_MANY: return 0;
+    case MPC_TYPE_SPAN: return p->data.span.n > 0;
+
+    case MPC_TYPE_EXPECT:   return mpc_ll1_fails(p->data.expect.x, depth+1);
+    case MPC_TYPE_APPLY:    return mpc_ll1_fails(p->data.apply.x, depth+1);
+    case MPC_TYPE_APPLY_TO: return mpc_ll1_fails(p->data.apply_to.x, depth+1);
+    case MPC_TYPE_PREDICT:
+    case MPC_TYPE_FASTFAIL:
+    case MPC_TYPE_ARENA:    return mpc_ll1_fails(p->data.predict.x, depth+1);
+    case MPC_TYPE_MEMO:     return mpc_ll1_fails(p->data.memo.x, depth+1);
+
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_ll1_fails(p->data.or.xs[j], depth+1)) { return 0; }
+      }
+      return p->data.or.n > 0;
+
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) {
+        if (mpc_ll1_fails(p->data.and.xs[j], depth+1)) { return 1; }
+      }
+      return 0;
+
+    default: return 1;
+  }
+}
+
+/*
+** Without backtracking a parser which fails after
+** consuming input leaves the input moved. This is
+** only safe when the failure goes on up and out of
+** the rule to a caller which backtracks. Optional
+** and repeated parts, and every alternative but the
+** last, would instead carry on from where it moved
+** to, so they must not be able to fail this way.
+*/
+
+static int mpc_ll1_partial(mpc_ll1_t *g, mpc_parser_t *p, int depth) {
+
+  int j, k, consumed = 0;
+
+  if (p->retained && depth > 0) {
+    k = mpc_ll1_find(g, p);
+    return k == -1 || g->partial[k];
+  }
+
+  switch (p->type) {
+    case MPC_TYPE_FAIL:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_CLASS:
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SPAN:
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI: return 0;
+
+    /* Without backtracking what matched is kept */
+    case MPC_TYPE_STRING: return strlen(p->data.string.x) > 1;
+
+    case MPC_TYPE_EXPECT:   return mpc_ll1_partial(g, p->data.expect.x, depth+1);
+    case MPC_TYPE_APPLY:    return mpc_ll1_partial(g, p->data.apply.x, depth+1);
+    case MPC_TYPE_APPLY_TO: return mpc_ll1_partial(g, p->data.apply_to.x, depth+1);
+    case MPC_TYPE_PREDICT:
+    case MPC_TYPE_FASTFAIL:
+    case MPC_TYPE_ARENA:    return mpc_ll1_partial(g, p->data.predict.x, depth+1);
+    case MPC_TYPE_MEMO:     return mpc_ll1_partial(g, p->data.memo.x, depth+1);
+    case MPC_TYPE_DFA:      return mpc_ll1_partial(g, p->data.dfa.x, depth+1);
+
+    case MPC_TYPE_CHECK:
+      return mpc_ll1_consumes(g, p->data.check.x) || mpc_ll1_partial(g, p->data.check.x, depth+1);
+    case MPC_TYPE_CHECK_WITH:
+      return mpc_ll1_consumes(g, p->data.check_with.x) || mpc_ll1_partial(g, p->data.check_with.x, depth+1);
+
+    case MPC_TYPE_MAYBE: return mpc_ll1_partial(g, p->data.not.x, depth+1);
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1: return mpc_ll1_partial(g, p->data.repeat.x, depth+1);
+    case MPC_TYPE_COUNT:
+      return mpc_ll1_partial(g, p->data.repeat.x, depth+1)
+        || (p->data.repeat.n > 1 && mpc_ll1_consumes(g, p->data.repeat.x));
+
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        if (mpc_ll1_partial(g, p->data.or.xs[j], depth+1)) { return 1; }
+      }
+      return 0;
+
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) {
+        if (mpc_ll1_partial(g, p->data.and.xs[j], depth+1)) { return 1; }
+        if (consumed && mpc_ll1_fails(p->data.and.xs[j], depth+1)) { return 1; }
+        consumed = consumed || mpc_ll1_consumes(g, p->data.and.xs[j]);
+      }
+      return 0;
+
+    default: return 1;
+  }
+}
+
+/* Such as the `\n$` of `$`, which once started can only fail at the end */
+static int mpc_ll1_end_after(mpc_parser_t *p) {
+  int j;
+  p = mpc_ll1_inner(p);
+  if (p->retained || p->type != MPC_TYPE_AND || p->data.and.n < 2) { return 0; }
+  for (j = 0; j < p->data.and.n-1; j++) {
+    if (!mpc_ll1_single(p->data.and.xs[j])) { return 0; }
+  }
+  return mpc_ll1_end(p->data.and.xs[p->data.and.n-1]);
+}
+
+/* Checks an optional or repeated `x` against what follows it */
+static void mpc_ll1_option(mpc_ll1_t *g, mpc_parser_t *x, const unsigned char *follow) {
+
+  int c;
+  char buffer[4];
+  unsigned char first[MPC_FIRST_BYTES];
+
+  if (g->report && mpc_ll1_partial(g, x, 1)) {
+    mpc_ll1_conflict(g, "an optional or repeated part can fail after consuming input");
+  }
+
+  memset(first, 0, MPC_FIRST_BYTES);
+  if (mpc_first_set(x, first, 0, g) == MPC_FIRST_UNKNOWN || mpc_ll1_single(x)) { return; }
+
+  c = mpc_ll1_common(first, follow);
+  if (c != -1) {
+    mpc_ll1_conflict(g, "an optional or repeated part and what follows it can both start with %s",
+      mpc_err_char_unescape((char)c, buffer));
+  }
+}
+
+static void mpc_ll1_walk(mpc_ll1_t *g, mpc_parser_t *p, const unsigned char *follow, int start);
+
+static void mpc_ll1_walk_or(mpc_ll1_t *g, mpc_parser_t *p, const unsigned char *follow, int start) {
+
+  int j, k, c, x, empty = -1;
+  char buffer[4];
+  unsigned char *first = calloc(p->data.or.n, MPC_FIRST_BYTES);
+
+  for (j = 0; j < p->data.or.n; j++) {
+
+    x = mpc_first_set(p->data.or.xs[j], first + j * MPC_FIRST_BYTES, 0, g);
+    if (x == MPC_FIRST_UNKNOWN) { continue; }
+
+    if (x == MPC_FIRST_NULLABLE) {
+      if (empty != -1) {
+        mpc_ll1_conflict(g, "alternatives %i and %i can both match nothing", empty+1, j+1);
+      }
+      empty = j;
+    }
+
+    for (k = 0; k < j; k++) {
+      if (mpc_ll1_single(p->data.or.xs[k])) { continue; }
+      c = mpc_ll1_common(first + k * MPC_FIRST_BYTES, first + j * MPC_FIRST_BYTES);
+      if (c != -1) {
+        mpc_ll1_conflict(g, "alternatives %i and %i can both start with %s", k+1, j+1,
+          mpc_err_char_unescape((char)c, buffer));
+      }
+    }
+  }
+
+  /* Alternatives which only match at the end fail where the end did */
+  k = p->data.or.n;
+  while (k > 0 && mpc_ll1_end(p->data.or.xs[k-1])) { k--; }
+
+  for (j = 0; g->report && j < p->data.or.n-1; j++) {
+    if (j >= k-1 && mpc_ll1_end_after(p->data.or.xs[j])) { continue; }
+    if (mpc_ll1_partial(g, p->data.or.xs[j], 1)) {
+      mpc_ll1_conflict(g, "alternative %i can fail after consuming input", j+1);
+    }
+  }
+
+  /* When an alternative can match nothing the others are options */
+  if (empty != -1 && mpc_ll1_end(p->data.or.xs[empty])) { empty = -1; }
+  for (j = 0; empty != -1 && j < p->data.or.n; j++) {
+    if (j != empty) { mpc_ll1_option(g, p->data.or.xs[j], follow); }
+  }
+
+  for (j = 0; j < p->data.or.n; j++) {
+    mpc_ll1_walk(g, p->data.or.xs[j], follow, start);
+  }
+
+  free(first);
+}
+
+static void mpc_ll1_walk_and(mpc_ll1_t *g, mpc_parser_t *p, const unsigned char *follow, int start) {
+
+  int j, k;
+  char *starts = malloc(p->data.and.n);
+  unsigned char first[MPC_FIRST_BYTES], rest[MPC_FIRST_BYTES];
+
+  /* Each part starts the rule while the parts before can match nothing */
+  for (j = 0; j < p->data.and.n; j++) {
+    starts[j] = (char)start;
+    memset(first, 0, MPC_FIRST_BYTES);
+    if (mpc_first_set(p->data.and.xs[j], first, 0, g) != MPC_FIRST_NULLABLE) { start = 0; }
+  }
+
+  /* Each part is followed by what the parts after can start with */
+  memcpy(rest, follow, MPC_FIRST_BYTES);
+
+  for (j = p->data.and.n-1; j >= 0; j--) {
+    mpc_ll1_walk(g, p->data.and.xs[j], rest, starts[j]);
+    memset(first, 0, MPC_FIRST_BYTES);
+    if (mpc_first_set(p->data.and.xs[j], first, 0, g) != MPC_FIRST_NULLABLE) {
+      memset(rest, 0, MPC_FIRST_BYTES);
+    }
+    for (k = 0; k < MPC_FIRST_BYTES; k++) { rest[k] |= first[k]; }
+  }
+
+  free(starts);
+}
+
+static void mpc_ll1_walk_node(mpc_ll1_t *g, mpc_parser_t *p, const unsigned char *follow, int start);
+
+static void mpc_ll1_walk(mpc_ll1_t *g, mpc_parser_t *p, const unsigned char *follow, int start) {
+
+  int j, k;
+
+  if (!p->retained) {
+    mpc_ll1_walk_node(g, p, follow, start);
+    return;
+  }
+
+  k = mpc_ll1_find(g, p);
+  if (k == -1) {
+    mpc_ll1_conflict(g, "it uses '%s' from outside the grammar", p->name);
     return;
+  }
+
+  for (j = 0; j < MPC_FIRST_BYTES; j++) {
+    if ((g->follow[k * MPC_FIRST_BYTES + j] | follow[j]) == g->follow[k * MPC_FIRST_BYTES + j]) { continue; }
+    g->follow[k * MPC_FIRST_BYTES + j] |= follow[j];
+    g->changed = 1;
+  }
+
+  g->refs[g->index * g->n + k] = 1;
+  if (start) { g->lefts[g->index * g->n + k] = 1; }
+}
+
+static void mpc_ll1_walk_node(mpc_ll1_t *g, mpc_parser_t *p, const unsigned char *follow, int start) {
+
+  unsigned char more[MPC_FIRST_BYTES];
+
+  switch (p->type) {
+
+    case MPC_TYPE_FAIL:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_CLASS:
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_STRING:
+    case MPC_TYPE_SPAN:
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+      return;
+
+    case MPC_TYPE_EXPECT:     mpc_ll1_walk(g, p->data.expect.x, follow, start); return;
+    case MPC_TYPE_APPLY:      mpc_ll1_walk(g, p->data.apply.x, follow, start); return;
+    case MPC_TYPE_APPLY_TO:   mpc_ll1_walk(g, p->data.apply_to.x, follow, start); return;
+    case MPC_TYPE_CHECK:      mpc_ll1_walk(g, p->data.check.x, follow, start); return;
+    case MPC_TYPE_CHECK_WITH: mpc_ll1_walk(g, p->data.check_with.x, follow, start); return;
+    case MPC_TYPE_PREDICT:    mpc_ll1_walk(g, p->data.predict.x, follow, start); return;
+    case MPC_TYPE_FASTFAIL:   mpc_ll1_walk(g, p->data.predict.x, follow, start); return;
+    case MPC_TYPE_ARENA:      mpc_ll1_walk(g, p->data.predict.x, follow, start); return;
+    case MPC_TYPE_MEMO:       mpc_ll1_walk(g, p->data.memo.x, follow, start); return;
+    case MPC_TYPE_DFA:        mpc_ll1_walk(g, p->data.dfa.x, follow, start); return;
 
+    case MPC_TYPE_NOT:
+      mpc_ll1_conflict(g, "it uses a lookahead, which needs backtracking");
+      return;
+
+    case MPC_TYPE_MAYBE:
+      mpc_ll1_option(g, p->data.not.x, follow);
+      mpc_ll1_walk(g, p->data.not.x, follow, start);
+      return;
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      if (p->type != MPC_TYPE_COUNT) { mpc_ll1_option(g, p->data.repeat.x, follow); }
+      memcpy(more, follow, MPC_FIRST_BYTES);
+      mpc_first_set(p->data.repeat.x, more, 0, g);
+      mpc_ll1_walk(g, p->data.repeat.x, more, start);
+      return;
+
+    case MPC_TYPE_OR:  mpc_ll1_walk_or(g, p, follow, start); return;
+    case MPC_TYPE_AND: mpc_ll1_walk_and(g, p, follow, start); return;
+
+    default:
+      mpc_ll1_conflict(g, "it uses a parser which can't be analysed");
+      return;
+  }
+
+}
+
+static int mpc_ll1_left(mpc_ll1_t *g, int k, int m, char *seen) {
+  int j;
+  for (j = 0; j < g->n; j++) {
+    if (!g->lefts[m * g->n + j] || seen[j]) { continue; }
+    if (j == k) { return 1; }
+    seen[j] = 1;
+    if (mpc_ll1_left(g, k, j, seen)) { return 1; }
+  }
+  return 0;
+}
+
+/*
+** Checks the `n` rules of a grammar and returns a
+** line for each which is not LL(1), saying why.
+*/
+
+static char *mpc_ll1_report(mpc_parser_t **rules, int n) {
+
+  int j, k, x;
+  size_t len = 0;
+  char *seen, *safe, *report;
+  unsigned char first[MPC_FIRST_BYTES];
+  mpc_ll1_t g;
+
+  g.n = n;
+  g.rules = rules;
+  g.report = 0;
+  g.first = calloc(n, MPC_FIRST_BYTES);
+  g.follow = calloc(n, MPC_FIRST_BYTES);
+  g.nullable = calloc(n, 1);
+  g.unknown = calloc(n, 1);
+  g.partial = calloc(n, 1);
+  g.refs = calloc(n * n, 1);
+  g.lefts = calloc(n * n, 1);
+  g.reasons = calloc(n, MPC_LL1_REASON_MAX);
+  seen = calloc(n, 1);
+  safe = calloc(n, 1);
+
+  do {
+    g.changed = 0;
+    for (k = 0; k < n; k++) {
+      memcpy(first, g.first + k * MPC_FIRST_BYTES, MPC_FIRST_BYTES);
+      x = mpc_first_set(rules[k], first, 0, &g);
+      if (x == MPC_FIRST_UNKNOWN && !g.unknown[k]) { g.unknown[k] = 1; g.changed = 1; }
+      if (x == MPC_FIRST_NULLABLE && !g.nullable[k]) { g.nullable[k] = 1; g.changed = 1; }
+      if (memcmp(first, g.first + k * MPC_FIRST_BYTES, MPC_FIRST_BYTES) != 0) {
+        memcpy(g.first + k * MPC_FIRST_BYTES, first, MPC_FIRST_BYTES);
+        g.changed = 1;
+      }
+    }
+  } while (g.changed);
+
+  do {
+    g.changed = 0;
+    for (k = 0; k < n; k++) {
+      if (g.partial[k] || !mpc_ll1_partial(&g, rules[k], 0)) { continue; }
+      g.partial[k] = 1;
+      g.changed = 1;
+    }
+  } while (g.changed);
+
+  do {
+    g.changed = 0;
+    for (k = 0; k < n; k++) {
+      g.index = k;
+      mpc_ll1_walk_node(&g, rules[k], g.follow + k * MPC_FIRST_BYTES, 1);
+    }
+  } while (g.changed);
+
+  g.report = 1;
+  for (k = 0; k < n; k++) {
+    g.index = k;
+    memset(seen, 0, n);
+    if (mpc_ll1_left(&g, k, k, seen)) { mpc_ll1_conflict(&g, "it is left recursive"); }
+    if (g.unknown[k]) { mpc_ll1_conflict(&g, "what it starts with can't be analysed"); }
+    mpc_ll1_walk_node(&g, rules[k], g.follow + k * MPC_FIRST_BYTES, 1);
+    safe[k] = g.reasons[k * MPC_LL1_REASON_MAX] == '\0';
   }
 
+  /*
+  ** Without backtracking the rules used are parsed
+  ** the same way. A rule used by one that does still
+  ** backtrack can have its failures caught, and the
+  ** input left where it failed, so it backtracks too.
+  */
+  do {
+    g.changed = 0;
+    for (k = 0; k < n; k++) {
+      for (j = 0; safe[k] && j < n; j++) {
+        if (safe[j]) { continue; }
+        g.index = k;
+        if (g.refs[k * n + j]) {
+          mpc_ll1_conflict(&g, "it uses '%s', which can't be", rules[j]->name);
+        } else if (g.refs[j * n + k]) {
+          mpc_ll1_conflict(&g, "it is used by '%s', which can't be", rules[j]->name);
+        } else {
+          continue;
+        }
+        safe[k] = 0;
+        g.changed = 1;
+      }
+    }
+  } while (g.changed);
+
+  for (k = 0; k < n; k++) {
+    if (!safe[k]) { len += strlen(rules[k]->name) + MPC_LL1_REASON_MAX + 64; }
+  }
+
+  report = malloc(len + 1);
+  report[0] = '\0';
+  for (k = 0, len = 0; k < n; k++) {
+    if (safe[k]) { continue; }
+    len += sprintf(report + len, "rule '%s' can't be parsed predictively as %s\n",
+      rules[k]->name, g.reasons + k * MPC_LL1_REASON_MAX);
+  }
+
+  free(g.first);
+  free(g.follow);
+  free(g.nullable);
+  free(g.unknown);
+  free(g.partial);
+  free(g.refs);
+  free(g.lefts);
+  free(g.reasons);
+  free(seen);
+  free(safe);
+  return report;
 }
 
-void mpc_optimise(mpc_parser_t *p) {
-  mpc_optimise_unretained(p, 1);
+/*
+** `mpca_report` builds the grammar in `language` as
+** `mpca_lang` would and puts the report of its rules
+** in `report`, which is empty if every rule is LL(1)
+** and must be freed. Returns any error building the
+** grammar, in which case `report` is set to NULL.
+*/
+
+mpc_err_t *mpca_report(char **report, int flags, const char *language) {
+
+  int j;
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
+
+  *report = NULL;
+
+  st.va = NULL;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  st.report = report;
+
+  i = mpc_input_new_string("<mpca_report>", language);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
+
+  if (err) {
+    free(*report);
+    *report = NULL;
+  }
+
+  for (j = 0; j < st.parsers_num; j++) { mpc_undefine(st.parsers[j]); }
+  for (j = 0; j < st.parsers_num; j++) { mpc_delete(st.parsers[j]); }
+  free(st.parsers);
+
+  return err;
 }
 
@@ -67,9 +67,26 @@ typedef struct mpc_parser_t mpc_parser_t;
 
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
 int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_slices(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+int mpc_nparse_slices(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_many(const char **filenames, int n, mpc_parser_t *p, mpc_result_t *rs, int threads);
+typedef int(*mpc_split_t)(const char *string, long length, long size, int n, long *places, void *data);
+
+int mpc_parse_chunked(const char *filename, const char *string, mpc_parser_t *p, mpc_parser_t *form,
+  mpc_split_t split, void *data, int threads, mpc_result_t *r);
+
+struct mpc_context_t;
+typedef struct mpc_context_t mpc_context_t;
+
+mpc_context_t *mpc_context_new(void);
+void mpc_context_delete(mpc_context_t *c);
+int mpc_context_parse(mpc_context_t *c, const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+int mpc_context_nparse(mpc_context_t *c, const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
+void mpc_context_memo(mpc_context_t *c, int columns, int entries);
+void mpc_context_stats(mpc_context_t *c, FILE *f);
 
 /*
 ** Function Types
@@ -147,6 +164,8 @@ mpc_parser_t *mpc_or(int n, ...);
 mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_apply_t cp, mpc_dtor_t da);
+mpc_parser_t *mpc_fastfail(mpc_parser_t *a);
 
 /*
 ** Common Parsers
@@ -261,6 +280,7 @@ mpc_val_t *mpcf_all_free(int n, mpc_val_t** xs);
 mpc_val_t *mpcf_freefold(int n, mpc_val_t** xs);
 mpc_val_t *mpcf_strfold(int n, mpc_val_t** xs);
 mpc_val_t *mpcf_maths(int n, mpc_val_t** xs);
+mpc_val_t *mpcf_tuple(int n, mpc_val_t** xs);
 
 /*
 ** Regular Expression Parsers
@@ -281,15 +301,23 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode);
 ** AST
 */
 
+/*
+** Nodes built by hand rather than with `mpc_ast_new`
+** must set `arena` to NULL and `contents_len` to 0.
+*/
+
 typedef struct mpc_ast_t {
   char *tag;
   char *contents;
   mpc_state_t state;
   int children_num;
   struct mpc_ast_t** children;
+  struct mpc_ast_arena_t *arena;
+  int contents_len;
 } mpc_ast_t;
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...);
 mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
@@ -297,6 +325,10 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s);
+mpc_ast_t *mpc_ast_materialise(mpc_ast_t *a);
+
+int mpc_ast_reparse(const char *filename, const char *string, long pos, long removed, long added,
+  mpc_ast_t *a, mpc_parser_t *p, mpc_result_t *r, int n, ...);
 
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
@@ -326,12 +358,36 @@ mpc_ast_t *mpc_ast_traverse_next(mpc_ast_trav_t **trav);
 
 void mpc_ast_traverse_free(mpc_ast_trav_t **trav);
 
+typedef struct {
+  mpc_ast_t *node;
+  int child;
+} mpc_ast_iter_frame_t;
+
+typedef struct {
+  mpc_ast_trav_order_t order;
+  int depth;
+  int frames_num;
+  int frames_slots;
+  int frames_owned;
+  mpc_ast_iter_frame_t *frames;
+} mpc_ast_iter_t;
+
+void mpc_ast_iter_start(mpc_ast_iter_t *it, mpc_ast_t *ast, mpc_ast_trav_order_t order,
+  mpc_ast_iter_frame_t *frames, int frames_slots);
+mpc_ast_t *mpc_ast_iter_next(mpc_ast_iter_t *it);
+void mpc_ast_iter_free(mpc_ast_iter_t *it);
+
+typedef int(*mpc_ast_visit_t)(mpc_ast_t*,int,void*);
+
+int mpc_ast_visit(mpc_ast_t *ast, mpc_ast_trav_order_t order, mpc_ast_visit_t f, void *d);
+
 /*
 ** Warning: This function currently doesn't test for equality of the `state` member!
 */
 int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b);
 
 mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **as);
+mpc_val_t *mpcf_fold_ast_tuple(int n, mpc_val_t **xs);
 mpc_val_t *mpcf_str_ast(mpc_val_t *c);
 mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs);
 
@@ -343,6 +399,8 @@ mpc_parser_t *mpca_total(mpc_parser_t *a);
 
 mpc_parser_t *mpca_not(mpc_parser_t *a);
 mpc_parser_t *mpca_maybe(mpc_parser_t *a);
+mpc_parser_t *mpca_memo(mpc_parser_t *a);
+mpc_parser_t *mpca_arena(mpc_parser_t *a);
 
 mpc_parser_t *mpca_many(mpc_parser_t *a);
 mpc_parser_t *mpca_many1(mpc_parser_t *a);
@@ -354,7 +412,8 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_PACKRAT              = 4
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -364,14 +423,24 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_pipe(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
+mpc_err_t *mpca_codegen(FILE *source, FILE *header, const char *prefix, int flags, const char *language);
+mpc_err_t *mpca_report(char **report, int flags, const char *language);
+
+mpc_err_t *mpc_serialise(unsigned char **data, size_t *length, int n, ...);
+mpc_err_t *mpc_deserialise(const unsigned char *data, size_t length, ...);
+mpc_err_t *mpca_serialise(unsigned char **data, size_t *length, int flags, const char *language);
+
 /*
 ** Misc
 */
 
 
 void mpc_print(mpc_parser_t *p);
-void mpc_optimise(mpc_parser_t *p);
+int mpc_optimise(mpc_parser_t *p);
 void mpc_stats(mpc_parser_t *p);
+void mpc_stats_to(mpc_parser_t *p, FILE *f);
+void mpc_stats_json(mpc_parser_t *p, FILE *f);
+void mpc_profile(mpc_parser_t *p, int enable);
 
 int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
   int(*tester)(const void*, const void*),
@@ -0,0 +1,174 @@
+#include "mpc.h"
+
+/*
+** Generates C code for a grammar written for mpca_lang.
+**
+**   cc -std=c99 -Wall mpcgen.c mpc.c -lm -o mpcgen
+**   ./mpcgen lispy lispy.grammar
+**
+** This writes lispy.c and lispy.h. Each rule such as
+** expr gets a function lispy_parse_expr which is used
+** like mpc_parse, and lispy.c is built along with mpc.c.
+** lispy_init must be called once before parsing. It
+** builds the grammar used to report errors, and gives
+** back any error in doing so.
+**
+**   ./mpcgen -s lispy lispy.grammar
+**
+** This instead writes the serialised grammar as the
+** array lispy_grammar, of lispy_grammar_size bytes,
+** which mpc_deserialise loads into the rules.
+**
+**   ./mpcgen -t lispy lispy.grammar
+**
+** This writes only lispy_grammar.h, which defines the
+** grammar text as the string LISPY_GRAMMAR so that a
+** program can pass it to mpca_lang without reading the
+** file at runtime.
+**
+**   ./mpcgen -r lispy.grammar
+**
+** This writes nothing, and instead prints each rule
+** which is not LL(1) and why, as given by mpca_report.
+*/
+
+static char* read_file(const char* filename) {
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) { return NULL; }
+
+  fseek(f, 0, SEEK_END);
+  long n = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  char* s = malloc(n + 1);
+  n = fread(s, 1, n, f);
+  s[n] = '\0';
+
+  fclose(f);
+  return s;
+}
+
+static FILE* open_output(const char* prefix, const char* ext) {
+  char* filename = malloc(strlen(prefix) + strlen(ext) + 1);
+  strcpy(filename, prefix);
+  strcat(filename, ext);
+  FILE* f = fopen(filename, "wb");
+  if (f == NULL) { fprintf(stderr, "Could not open %s\n", filename); }
+  free(filename);
+  return f;
+}
+
+static mpc_err_t* write_serialised(FILE* source, FILE* header, const char* prefix, const char* grammar) {
+
+  unsigned char* data;
+  size_t length;
+  mpc_err_t* err = mpca_serialise(&data, &length, MPCA_LANG_DEFAULT, grammar);
+  if (err) { return err; }
+
+  fprintf(source, "/*\n** Generated by mpca_serialise. Do not edit.\n*/\n\n");
+  fprintf(source, "#include <stddef.h>\n\n");
+  fprintf(source, "const unsigned char %s_grammar[] = {", prefix);
+  for (size_t i = 0; i < length; i++) {
+    fprintf(source, "%s0x%02x", i % 12 == 0 ? "\n  " : " ", data[i]);
+    if (i + 1 < length) { fputc(',', source); }
+  }
+  fprintf(source, "\n};\n\n");
+  fprintf(source, "const size_t %s_grammar_size = sizeof(%s_grammar);\n", prefix, prefix);
+
+  fprintf(header, "#include <stddef.h>\n\n");
+  fprintf(header, "extern const unsigned char %s_grammar[];\n", prefix);
+  fprintf(header, "extern const size_t %s_grammar_size;\n", prefix);
+
+  free(data);
+  return NULL;
+}
+
+static int write_text(const char* prefix, const char* grammar) {
+
+  FILE* header = open_output(prefix, "_grammar.h");
+  if (header == NULL) { return 1; }
+
+  char* name = malloc(strlen(prefix) + 1);
+  for (size_t i = 0; i <= strlen(prefix); i++) {
+    name[i] = toupper((unsigned char)prefix[i]);
+  }
+
+  fprintf(header, "/*\n** Generated by mpcgen -t. Do not edit.\n*/\n\n");
+  fprintf(header, "#define %s_GRAMMAR \\\n  \"", name);
+  for (const char* c = grammar; *c; c++) {
+    switch (*c) {
+      case '\n': fprintf(header, c[1] ? "\\n\" \\\n  \"" : "\\n"); break;
+      case '\r': break;
+      case '\t':  fprintf(header, "\\t"); break;
+      case '"':  fprintf(header, "\\\""); break;
+      case '\\': fprintf(header, "\\\\"); break;
+      default:   fputc(*c, header); break;
+    }
+  }
+  fprintf(header, "\"\n");
+
+  free(name);
+  fclose(header);
+  return 0;
+}
+
+static int write_report(const char* grammar) {
+
+  char* report;
+  mpc_err_t* err = mpca_report(&report, MPCA_LANG_DEFAULT, grammar);
+  if (err) {
+    mpc_err_print(err);
+    mpc_err_delete(err);
+    return 1;
+  }
+
+  fputs(report, stdout);
+  free(report);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+
+  int serialise = argc == 4 && strcmp(argv[1], "-s") == 0;
+  int text = argc == 4 && strcmp(argv[1], "-t") == 0;
+  int report = argc == 3 && strcmp(argv[1], "-r") == 0;
+
+  if (argc != 3 && !serialise && !text) {
+    fprintf(stderr, "Usage: %s [-s | -t] prefix grammar\n", argv[0]);
+    fprintf(stderr, "       %s -r grammar\n", argv[0]);
+    return 1;
+  }
+
+  const char* prefix = argv[argc-2];
+  char* grammar = read_file(argv[argc-1]);
+  if (grammar == NULL) {
+    fprintf(stderr, "Could not read %s\n", argv[argc-1]);
+    return 1;
+  }
+
+  if (text || report) {
+    int status = text ? write_text(prefix, grammar) : write_report(grammar);
+    free(grammar);
+    return status;
+  }
+
+  FILE* source = open_output(prefix, ".c");
+  FILE* header = open_output(prefix, ".h");
+  if (source == NULL || header == NULL) { return 1; }
+
+  mpc_err_t* err = serialise
+    ? write_serialised(source, header, prefix, grammar)
+    : mpca_codegen(source, header, prefix, MPCA_LANG_DEFAULT, grammar);
+
+  fclose(source);
+  fclose(header);
+  free(grammar);
+
+  if (err) {
+    mpc_err_print(err);
+    mpc_err_delete(err);
+    return 1;
+  }
+
+  return 0;
+}
@@ -1,12 +1,19 @@
 #include "mpc.h"
 
+/* Generated from lispy.grammar with: mpcgen -t lispy lispy.grammar */
+#include "lispy_grammar.h"
+
 #ifdef _WIN32
 
+#include <io.h>
+#define isatty _isatty
+#define STDIN_FILENO 0
+
 static char buffer[2048];
 
 char* readline(char* prompt) {
   fputs(prompt, stdout);
-  fgets(buffer, 2048, stdin);
+  if (fgets(buffer, 2048, stdin) == NULL) { return NULL; }
   char* cpy = malloc(strlen(buffer)+1);
   strcpy(cpy, buffer);
   cpy[strlen(cpy)-1] = '\0';
@@ -16,6 +23,7 @@ char* readline(char* prompt) {
 void add_history(char* unused) {}
 
 #else
+#include <unistd.h>
 #include <editline/readline.h>
 #include <editline/history.h>
 #endif
@@ -550,6 +558,160 @@ lval* lval_read(mpc_ast_t* t) {
   return x;
 }
 
+/* Evaluation */
+
+/* Returns 1 if the line fails to parse or evaluates to an error. Errors are reported at the given row */
+int lval_eval_line(lenv* e, mpc_context_t* ctx, mpc_parser_t* p,
+  const char* filename, long row, const char* line, size_t length) {
+  
+  mpc_result_t r;
+  if (!mpc_context_nparse(ctx, filename, line, length, p, &r)) {
+    r.error->state.row += row;
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    return 1;
+  }
+  
+  lval* x = lval_eval(e, lval_read(r.output));
+  int failed = x->type == LVAL_ERR;
+  lval_println(x);
+  lval_del(x);
+  mpc_ast_delete(r.output);
+  return failed;
+}
+
+/* Batch Mode */
+
+#define BATCH_BLOCK 65536
+
+/* Reads a stream in large blocks and evaluates each non-empty line */
+int lval_eval_stream(lenv* e, mpc_context_t* ctx, mpc_parser_t* p,
+  const char* filename, FILE* f) {
+  
+  size_t slots = BATCH_BLOCK;
+  size_t len = 0;
+  size_t n;
+  char* buf = malloc(slots);
+  int errors = 0;
+  long row = 0;
+  
+  while ((n = fread(buf + len, 1, slots - len, f)) > 0 || len > 0) {
+    
+    len += n;
+    char* start = buf;
+    char* end = buf + len;
+    char* nl;
+    
+    while ((nl = memchr(start, '\n', end - start)) != NULL) {
+      if (nl > start) { errors += lval_eval_line(e, ctx, p, filename, row, start, nl - start); }
+      start = nl + 1;
+      row++;
+    }
+    
+    /* At the end of the input the last line may have no newline */
+    if (n == 0) {
+      errors += lval_eval_line(e, ctx, p, filename, row, start, end - start);
+      break;
+    }
+    
+    /* Keep the unfinished line, growing the buffer if it fills it */
+    len = end - start;
+    memmove(buf, start, len);
+    if (len == slots) {
+      slots *= 2;
+      buf = realloc(buf, slots);
+    }
+  }
+  
+  free(buf);
+  return errors;
+}
+
+/* Loading */
+
+#define LOAD_THREADS 4
+
+/* Picks places between top level forms: whitespace outside any bracket, string or comment */
+int lisp_split(const char* s, long length, long size, int n, long* places, void* data) {
+  
+  (void)data;
+  
+  long depth = 0;
+  long next = size;
+  int k = 0;
+  int quoted = 0;
+  int comment = 0;
+  
+  for (long j = 0; j < length; j++) {
+    
+    if (isspace((unsigned char)s[j])
+    && !quoted && !comment && depth == 0 && j >= next && k < n) {
+      places[k++] = j;
+      next = j + size;
+    }
+    
+    switch (s[j]) {
+      case '\n': comment = 0; break;
+      case '(': case '[': case '{': if (!quoted && !comment) { depth++; } break;
+      case ')': case ']': case '}': if (!quoted && !comment && --depth < 0) { return -1; } break;
+      case '"':  if (!comment) { quoted = !quoted; } break;
+      case '\\': if (quoted) { j++; } break;
+      case ';':  if (!quoted) { comment = 1; } break;
+    }
+  }
+  
+  return depth == 0 && !quoted ? k : -1;
+}
+
+/* Parses a whole file of forms, in parallel when it is large, and evaluates each in turn */
+int lval_eval_file(lenv* e, mpc_parser_t* p, mpc_parser_t* form, const char* filename) {
+  
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "Could not open %s\n", filename);
+    return 1;
+  }
+  
+  size_t slots = BATCH_BLOCK;
+  size_t len = 0;
+  size_t n;
+  char* buf = malloc(slots + 1);
+  
+  while ((n = fread(buf + len, 1, slots - len, f)) > 0) {
+    len += n;
+    if (len == slots) {
+      slots *= 2;
+      buf = realloc(buf, slots + 1);
+    }
+  }
+  
+  buf[len] = '\0';
+  fclose(f);
+  
+  mpc_result_t r;
+  if (!mpc_parse_chunked(filename, buf, p, form, lisp_split, NULL, LOAD_THREADS, &r)) {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    free(buf);
+    return 1;
+  }
+  
+  mpc_ast_t* t = r.output;
+  int errors = 0;
+  
+  for (int i = 0; i < t->children_num; i++) {
+    if (strcmp(t->children[i]->tag, "regex") == 0) { continue; }
+    lval* x = lval_eval(e, lval_read(t->children[i]));
+    errors += x->type == LVAL_ERR;
+    lval_println(x);
+    lval_del(x);
+  }
+  
+  mpc_ast_delete(r.output);
+  free(buf);
+  return errors;
+}
+
 /* Main */
 
 int main(int argc, char** argv) {
@@ -561,46 +723,83 @@ int main(int argc, char** argv) {
   mpc_parser_t* Expr   = mpc_new("expr");
   mpc_parser_t* Lispy  = mpc_new("lispy");
   
-  mpca_lang(MPCA_LANG_DEFAULT,
-    "                                                     \
-      number : /-?[0-9]+/ ;                               \
-      symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;         \
-      sexpr  : '(' <expr>* ')' ;                          \
-      qexpr  : '{' <expr>* '}' ;                          \
-      expr   : <number> | <symbol> | <sexpr> | <qexpr> ;  \
-      lispy  : /^/ <expr>* /$/ ;                          \
-    ",
+  mpc_err_t* err = mpca_lang(MPCA_LANG_DEFAULT, LISPY_GRAMMAR,
     Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
   
-  puts("Lispy Version 0.0.0.0.7");
-  puts("Press Ctrl+c to Exit\n");
+  if (err) {
+    mpc_err_print(err);
+    mpc_err_delete(err);
+    mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+    return 1;
+  }
   
   lenv* e = lenv_new();
   lenv_add_builtins(e);
   
-  while (1) {
+  /* Reused for every line so each parse needs no setup */
+  mpc_context_t* ctx = mpc_context_new();
+  
+  /* Only build error messages for lines that fail, and free each AST at once */
+  mpc_parser_t* Line = mpc_fastfail(mpca_arena(Lispy));
+  
+  /* Run without prompts or history when given expressions, files or piped input */
+  int batch = argc > 1 || !isatty(STDIN_FILENO);
+  int errors = 0;
+  
+  if (batch) { setvbuf(stdout, NULL, _IOFBF, BATCH_BLOCK); }
+  
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-e") == 0 && i+1 < argc) {
+      i++;
+      errors += lval_eval_line(e, ctx, Line, "<command line>", 0, argv[i], strlen(argv[i]));
+    } else if (strcmp(argv[i], "-f") == 0 && i+1 < argc) {
+      i++;
+      FILE* f = fopen(argv[i], "rb");
+      if (f == NULL) {
+        fprintf(stderr, "Could not open %s\n", argv[i]);
+        errors++;
+      } else {
+        errors += lval_eval_stream(e, ctx, Line, argv[i], f);
+        fclose(f);
+      }
+    } else if (strcmp(argv[i], "-l") == 0 && i+1 < argc) {
+      i++;
+      errors += lval_eval_file(e, Lispy, Expr, argv[i]);
+    } else {
+      fprintf(stderr, "Usage: %s [-e expr] [-f file] [-l file] ...\n", argv[0]);
+      errors++;
+      break;
+    }
+  }
+  
+  if (batch && argc == 1) {
+    errors += lval_eval_stream(e, ctx, Line, "<stdin>", stdin);
+  }
   
-    char* input = readline("lispy> ");
-    add_history(input);
+  if (!batch) {
     
-    mpc_result_t r;
-    if (mpc_parse("<stdin>", input, Lispy, &r)) {
-      lval* x = lval_eval(e, lval_read(r.output));
-      lval_println(x);
-      lval_del(x);
-      mpc_ast_delete(r.output);
-    } else {    
-      mpc_err_print(r.error);
-      mpc_err_delete(r.error);
-    }
+    puts("Lispy Version 0.0.0.0.7");
+    puts("Press Ctrl+c or Ctrl+d to Exit\n");
+    
+    while (1) {
     
-    free(input);
+      char* input = readline("lispy> ");
+      if (input == NULL) { putchar('\n'); break; }
+      add_history(input);
+      
+      lval_eval_line(e, ctx, Line, "<stdin>", 0, input, strlen(input));
+      
+      free(input);
+      
+    }
     
   }
   
+  mpc_delete(Line);
+  mpc_context_delete(ctx);
   lenv_del(e);
   
   mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
   
-  return 0;
+  return errors ? 1 : 0;
 }
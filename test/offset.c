@@ -0,0 +1,47 @@
+#include "../src/mpc.h"
+
+/*
+** Parses a file that has already been read from,
+** so the input starts part way through it. Both
+** the result and where the file is left must count
+** from that point.
+**
+**   cc -std=c99 offset.c ../src/mpc.c -lm -lpthread -o offset
+**   ./offset
+*/
+
+int main(void) {
+
+  FILE* f = tmpfile();
+  if (f == NULL) { fprintf(stderr, "Could not open a temporary file\n"); return 1; }
+  fputs("HEADER\n12345 rest", f);
+  rewind(f);
+
+  char line[64];
+  if (fgets(line, sizeof(line), f) == NULL) { return 1; }
+
+  mpc_parser_t* Digits = mpc_many1(mpcf_strfold, mpc_digit());
+
+  mpc_result_t r;
+  int failed = 0;
+
+  if (mpc_parse_file("<offset>", f, Digits, &r)) {
+    failed += strcmp(r.output, "12345") != 0;
+    printf("Parsed: %s\n", (char*)r.output);
+    free(r.output);
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    failed++;
+  }
+
+  long pos = ftell(f);
+  printf("Left at: %li\n", pos);
+  failed += pos != 12;
+
+  mpc_delete(Digits);
+  fclose(f);
+
+  puts(failed ? "failed" : "ok");
+  return failed ? 1 : 0;
+}
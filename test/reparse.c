@@ -0,0 +1,101 @@
+#include "../src/mpc.h"
+#include "../src/lispy_grammar.h"
+
+#include <time.h>
+
+/*
+** Times mpc_ast_reparse against a full parse after
+** one character edits inside the lists of a large
+** Lisp buffer. After the last edit the AST is also
+** checked against a full parse of the edited buffer.
+**
+**   cc -std=c99 -O2 reparse.c ../src/mpc.c -lm -lpthread -o reparse
+**   ./reparse [kilobytes] [edits]
+**
+** The buffer is 1024KB and 100 edits are made by
+** default.
+*/
+
+static double ms(clock_t t) {
+  return 1000.0 * (double)t / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char** argv) {
+
+  long size = (argc > 1 ? atol(argv[1]) : 1024) * 1024;
+  int edits = argc > 2 ? atoi(argv[2]) : 100;
+
+  mpc_parser_t* Number = mpc_new("number");
+  mpc_parser_t* Symbol = mpc_new("symbol");
+  mpc_parser_t* Sexpr  = mpc_new("sexpr");
+  mpc_parser_t* Qexpr  = mpc_new("qexpr");
+  mpc_parser_t* Expr   = mpc_new("expr");
+  mpc_parser_t* Lispy  = mpc_new("lispy");
+
+  mpc_err_t* err = mpca_lang(MPCA_LANG_DEFAULT, LISPY_GRAMMAR,
+    Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  if (err) { mpc_err_print(err); return 1; }
+
+  /* Room for the buffer to grow by one character per edit */
+  char* s = malloc(size + edits + 128);
+  long len = 0;
+  int k = 0;
+  while (len < size) {
+    len += sprintf(s + len, "(def {x%i} (+ %i (* %i %i) (head {a b c})))\n", k, k, k % 7, k % 13);
+    k++;
+  }
+
+  srand(1);
+
+  mpc_result_t r, full;
+  clock_t start = clock();
+  if (!mpc_parse("<bench>", s, Lispy, &r)) {
+    mpc_err_print(r.error);
+    return 1;
+  }
+  clock_t full_time = clock() - start;
+
+  clock_t reparse_time = 0, worst = 0;
+
+  for (int j = 0; j < edits; j++) {
+
+    /* Put a digit after a random digit, which keeps every form valid */
+    long pos = rand() % len;
+    while (s[pos] < '0' || s[pos] > '9') { pos = (pos + 1) % len; }
+    pos++;
+    memmove(s + pos + 1, s + pos, len - pos + 1);
+    s[pos] = '7';
+    len++;
+
+    start = clock();
+    int ok = mpc_ast_reparse("<bench>", s, pos, 0, 1, r.output, Lispy, &r, 2, Sexpr, Qexpr);
+    clock_t t = clock() - start;
+    reparse_time += t;
+    if (t > worst) { worst = t; }
+
+    if (!ok) {
+      mpc_err_print(r.error);
+      return 1;
+    }
+  }
+
+  if (!mpc_parse("<bench>", s, Lispy, &full)) {
+    mpc_err_print(full.error);
+    return 1;
+  }
+  int same = mpc_ast_eq(r.output, full.output);
+  mpc_ast_delete(full.output);
+
+  printf("Buffer: %li bytes\n", len);
+  printf("Full parse: %.1f ms\n", ms(full_time));
+  printf("Reparse: %.2f ms average, %.2f ms worst, over %i edits\n",
+    ms(reparse_time) / edits, ms(worst), edits);
+  printf("Same as full parse: %s\n", same ? "yes" : "no");
+
+  mpc_ast_delete(r.output);
+  free(s);
+
+  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+
+  return same ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+#include "../src/mpc.h"
+#include "../src/lispy_grammar.h"
+
+#include <pthread.h>
+
+/*
+** Parses Lisp files and one large string with the
+** same parser from several threads at once, through
+** mpc_parse_many and mpc_parse_chunked.
+**
+**   cc -std=c99 -g -fsanitize=thread threads.c ../src/mpc.c -lm -lpthread -o threads
+**   ./threads
+**
+** ThreadSanitizer reports any data race, and the
+** program exits with 1 if any parse fails.
+*/
+
+#define CALLERS 4
+#define FILES 8
+#define FORMS 1200
+
+static mpc_parser_t* Expr;
+static mpc_parser_t* Lispy;
+static const char* filenames[FILES];
+static char* chunk;
+
+static int split(const char* s, long length, long size, int n, long* places, void* data) {
+  int k = 0;
+  long depth = 0, next = size;
+  for (long j = 0; j < length; j++) {
+    if (s[j] == '(') { depth++; }
+    if (s[j] == ')') { depth--; }
+    if (s[j] == '\n' && depth == 0 && j >= next && k < n) {
+      places[k++] = j;
+      next = j + size;
+    }
+  }
+  return k;
+}
+
+static void* caller(void* data) {
+
+  mpc_result_t rs[FILES];
+  int ok = mpc_parse_many(filenames, FILES, Lispy, rs, 4);
+  for (int k = 0; k < FILES; k++) {
+    if (ok) { mpc_ast_delete(rs[k].output); }
+    else if (rs[k].error) { mpc_err_print(rs[k].error); mpc_err_delete(rs[k].error); }
+  }
+
+  mpc_result_t r;
+  if (mpc_parse_chunked("<chunk>", chunk, Lispy, Expr, split, NULL, 4, &r)) {
+    mpc_ast_delete(r.output);
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    ok = 0;
+  }
+
+  *(int*)data = ok;
+  return NULL;
+}
+
+int main(void) {
+
+  mpc_parser_t* Number = mpc_new("number");
+  mpc_parser_t* Symbol = mpc_new("symbol");
+  mpc_parser_t* Sexpr  = mpc_new("sexpr");
+  mpc_parser_t* Qexpr  = mpc_new("qexpr");
+  Expr  = mpc_new("expr");
+  Lispy = mpc_new("lispy");
+
+  mpc_err_t* err = mpca_lang(MPCA_LANG_DEFAULT, LISPY_GRAMMAR,
+    Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  if (err) { mpc_err_print(err); return 1; }
+
+  const char* form = "(+ 1 (* 2 3) {head (list 4 5)})\n";
+  size_t len = strlen(form);
+
+  chunk = malloc(len * FORMS + 1);
+  for (int k = 0; k < FORMS; k++) { memcpy(chunk + k * len, form, len); }
+  chunk[len * FORMS] = '\0';
+
+  for (int k = 0; k < FILES; k++) {
+    char* name = malloc(32);
+    sprintf(name, "threads_%i.lsp", k);
+    FILE* f = fopen(name, "wb");
+    if (f == NULL) { fprintf(stderr, "Could not open %s\n", name); return 1; }
+    fwrite(chunk, 1, len * (k + 1) * 25, f);
+    fclose(f);
+    filenames[k] = name;
+  }
+
+  pthread_t ts[CALLERS];
+  int oks[CALLERS];
+  for (int k = 0; k < CALLERS; k++) { pthread_create(&ts[k], NULL, caller, &oks[k]); }
+  for (int k = 0; k < CALLERS; k++) { pthread_join(ts[k], NULL); }
+
+  int failed = 0;
+  for (int k = 0; k < CALLERS; k++) { failed += !oks[k]; }
+
+  for (int k = 0; k < FILES; k++) {
+    remove(filenames[k]);
+    free((char*)filenames[k]);
+  }
+  free(chunk);
+
+  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+
+  puts(failed ? "failed" : "ok");
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,94 @@
+#include "../src/mpc.h"
+
+#include <time.h>
+
+/*
+** Times walking trees of a million AST nodes with
+** mpc_ast_traverse_next, mpc_ast_iter_next and
+** mpc_ast_visit, in pre and post order, for a few
+** fanouts. Every walk must see every node.
+**
+**   cc -std=c99 -O2 traverse.c ../src/mpc.c -lm -lpthread -o traverse
+**   ./traverse [nodes] [walks]
+**
+** Times are in ms per walk, averaged over 10 walks
+** by default.
+*/
+
+static long visited;
+
+static int count(mpc_ast_t* a, int depth, void* d) {
+  visited++;
+  return 0;
+}
+
+/* Builds a tree of `n` nodes level by level, each with up to `fanout` children */
+static mpc_ast_t* build(long n, int fanout) {
+
+  mpc_ast_t** nodes = malloc(sizeof(mpc_ast_t*) * n);
+  for (long k = 0; k < n; k++) { nodes[k] = mpc_ast_new("node", "x"); }
+  for (long k = 1; k < n; k++) { mpc_ast_add_child(nodes[(k - 1) / fanout], nodes[k]); }
+
+  mpc_ast_t* root = nodes[0];
+  free(nodes);
+  return root;
+}
+
+static double walk(mpc_ast_t* a, int how, mpc_ast_trav_order_t order, int walks) {
+
+  clock_t start = clock();
+
+  for (int j = 0; j < walks; j++) {
+
+    if (how == 0) {
+      mpc_ast_trav_t* trav = mpc_ast_traverse_start(a, order);
+      while (mpc_ast_traverse_next(&trav)) { visited++; }
+      mpc_ast_traverse_free(&trav);
+    }
+
+    if (how == 1) {
+      mpc_ast_iter_t it;
+      mpc_ast_iter_frame_t frames[64];
+      mpc_ast_iter_start(&it, a, order, frames, 64);
+      while (mpc_ast_iter_next(&it)) { visited++; }
+      mpc_ast_iter_free(&it);
+    }
+
+    if (how == 2) { mpc_ast_visit(a, order, count, NULL); }
+  }
+
+  return 1000.0 * (double)(clock() - start) / CLOCKS_PER_SEC / walks;
+}
+
+int main(int argc, char** argv) {
+
+  long n = argc > 1 ? atol(argv[1]) : 1000000;
+  int walks = argc > 2 ? atoi(argv[2]) : 10;
+  int fanouts[] = { 2, 4, 16 };
+  const char* orders[] = { "pre", "post" };
+  int failed = 0;
+
+  puts("ms per walk (traverse / iter / visit)");
+
+  for (int f = 0; f < 3; f++) {
+
+    mpc_ast_t* a = build(n, fanouts[f]);
+    printf("fanout %2i:", fanouts[f]);
+
+    for (int o = 0; o < 2; o++) {
+      double t[3];
+      for (int how = 0; how < 3; how++) {
+        visited = 0;
+        t[how] = walk(a, how, o == 0 ? mpc_ast_trav_order_pre : mpc_ast_trav_order_post, walks);
+        failed += visited != n * walks;
+      }
+      printf("  %s %.1f / %.1f / %.1f", orders[o], t[0], t[1], t[2]);
+    }
+
+    putchar('\n');
+    mpc_ast_delete(a);
+  }
+
+  if (failed) { puts("Some walks missed nodes"); }
+  return failed ? 1 : 0;
+}